@@ -0,0 +1,411 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+
+/* Micro-benchmark for the FETCH response parser. It parses the responses
+ * of a synthetic mailbox load, once with the FETCH parser, fed in socket-sized
+ * chunks, and once with a reference which builds a list tree first, the way
+ * the IMAP driver used to. The results need to match:
+ *
+ *   make bench_imap_fetch && ./bench_imap_fetch [messages]
+ */
+
+#include "imap_fetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+int DFlags;
+const char *Home;
+
+#define CHUNK 65536
+
+typedef struct {
+	int uid, flags, status, size;
+	time_t date;
+	int body_len;
+	unsigned body_sum;
+	char got_tuid;
+	char tuid[TUIDL];
+} result_t;
+
+static char *data, *work;
+static int len, nrsps;
+static result_t *res_new, *res_ref;
+
+static void
+synthesize( int nmsgs )
+{
+	static const char *flags[] = { "\\Seen", "\\Seen \\Flagged", "", "\\Answered \\Seen", "\\Recent" };
+	int i, j, l, a = 0, bl;
+
+	srand( 1 );
+	for (i = 1; i <= nmsgs; i++) {
+		if (len + 70000 > a)
+			data = nfrealloc( data, a = a * 2 + 1000000 );
+		if (i % 50) {
+			/* The bulk of a full load. */
+			len += sprintf( data + len,
+			                "* %d FETCH (UID %d FLAGS (%s) RFC822.SIZE %d INTERNALDATE \"%02d-Mar-2015 12:%02d:%02d +0100\""
+			                " BODY[HEADER.FIELDS (X-TUID)] ",
+			                i, i + 1000, flags[i % 5], 1000 + rand() % 100000, 1 + i % 28, i % 60, (i / 60) % 60 );
+			if (i % 3)
+				len += sprintf( data + len, "{24}\r\nX-TUID: %06dabcdef\r\n\r\n)\r\n", i % 1000000 );
+			else
+				len += sprintf( data + len, "{2}\r\n\r\n)\r\n" );
+		} else {
+			/* A fetched message. */
+			bl = 500 + rand() % 60000;
+			len += sprintf( data + len, "* %d FETCH (UID %d FLAGS (\\Seen) MODSEQ (%d) BODY[] {%d}\r\n",
+			                i, i + 1000, i * 7, bl );
+			for (j = 0; j < bl; j += l) {
+				l = bl - j < 76 ? bl - j : 76;
+				memset( data + len + j, 'a' + i % 26, l );
+				if (l > 2) {
+					data[len + j + l - 2] = '\r';
+					data[len + j + l - 1] = '\n';
+				}
+			}
+			len += bl;
+			len += sprintf( data + len, ")\r\n" );
+		}
+	}
+	work = nfmalloc( len + 1 );
+	res_new = nfcalloc( nmsgs * sizeof(result_t) );
+	res_ref = nfcalloc( nmsgs * sizeof(result_t) );
+}
+
+static unsigned
+checksum( unsigned sum, const char *buf, int l )
+{
+	int i;
+
+	for (i = 0; i < l; i++)
+		sum = (sum ^ (unsigned char)buf[i]) * 16777619;
+	return sum;
+}
+
+/* The FETCH parser, reading from a "socket" which fills up in chunks. */
+
+static int pos, avail;
+static result_t *cur_res;
+
+static char *
+in_read_line( void *aux ATTR_UNUSED )
+{
+	char *s = work + pos, *p;
+
+	if (!(p = memchr( s, '\n', avail - pos )))
+		return 0;
+	pos = p + 1 - work;
+	if (p != s && p[-1] == '\r')
+		p--;
+	*p = 0;
+	return s;
+}
+
+static int
+in_read_direct( void *aux ATTR_UNUSED, char **buf, int l )
+{
+	int n = avail - pos;
+
+	if (n > l)
+		n = l;
+	*buf = work + pos;
+	pos += n;
+	return n;
+}
+
+static void
+sink_write( msg_sink_t *sink ATTR_UNUSED, const char *buf, int l )
+{
+	cur_res->body_sum = checksum( cur_res->body_sum, buf, l );
+}
+
+static msg_sink_t sink = { sink_write };
+
+static msg_sink_t *
+in_body_sink( void *aux ATTR_UNUSED, int uid ATTR_UNUSED, int l ATTR_UNUSED )
+{
+	return &sink;
+}
+
+static int
+parse_new( result_t *res )
+{
+	fetch_parser_t fp;
+	char *s;
+	int n = 0, r;
+
+	memcpy( work, data, len );
+	pos = 0;
+	avail = 0;
+	fp.read_line = in_read_line;
+	fp.read_direct = in_read_direct;
+	fp.body_sink = in_body_sink;
+	fp.aux = 0;
+	for (;;) {
+		while (!(s = in_read_line( 0 ))) {
+			if (avail == len)
+				return n;
+			avail = len - avail < CHUNK ? len : avail + CHUNK;
+		}
+		if (!(s = strstr( s, " FETCH " )))
+			return -1;
+		cur_res = &res[n];
+		cur_res->body_sum = 2166136261U;
+		fetch_parser_init( &fp );
+		r = fetch_parse( &fp, s + 7 );
+		while (r == FETCH_PARTIAL) {
+			if (avail == len)
+				return -1;
+			avail = len - avail < CHUNK ? len : avail + CHUNK;
+			r = fetch_parse( &fp, 0 );
+		}
+		if (r != FETCH_OK)
+			return -1;
+		cur_res->uid = fp.uid;
+		cur_res->flags = fp.flags;
+		cur_res->status = fp.status;
+		cur_res->size = fp.size;
+		cur_res->date = fp.date;
+		if (fp.got_body) {
+			cur_res->body_len = fp.body_len;
+		} else {
+			cur_res->body_len = -1;
+			cur_res->body_sum = 0;
+		}
+		if ((cur_res->got_tuid = fp.got_tuid))
+			memcpy( cur_res->tuid, fp.tuid, TUIDL );
+		n++;
+	}
+}
+
+/* The reference: build a list tree, then interpret it. */
+
+#define NIL	(void*)0x1
+#define LIST	(void*)0x2
+
+typedef struct _list {
+	struct _list *next, *child;
+	char *val;
+	int len;
+} list_t;
+
+static void
+free_list( list_t *list )
+{
+	list_t *tmp;
+
+	for (; list; list = tmp) {
+		tmp = list->next;
+		if (list->val == LIST)
+			free_list( list->child );
+		else if (list->val != NIL)
+			free( list->val );
+		free( list );
+	}
+}
+
+static int
+is_atom( list_t *list )
+{
+	return list && list->val && list->val != NIL && list->val != LIST;
+}
+
+/* Parse the elements of a list up to the closing parenthesis. */
+static list_t *
+parse_list( char **sp, int *bad )
+{
+	list_t *head = 0, **curp = &head, *cur;
+	char *s = *sp, *p, *d;
+	char c;
+
+	for (;;) {
+		while (*s == ' ')
+			s++;
+		if (*s == ')') {
+			*sp = s + 1;
+			return head;
+		}
+		if (!*s || *s == '\r') {
+			*bad = 1;
+			return head;
+		}
+		*curp = cur = nfcalloc( sizeof(*cur) );
+		curp = &cur->next;
+		if (*s == '(') {
+			s++;
+			cur->val = LIST;
+			cur->child = parse_list( &s, bad );
+			if (*bad)
+				return head;
+		} else if (*s == '{') {
+			cur->len = strtol( s + 1, &s, 10 );
+			s += 3;
+			cur->val = nfmalloc( cur->len + 1 );
+			memcpy( cur->val, s, cur->len );
+			cur->val[cur->len] = 0;
+			s += cur->len;
+		} else if (*s == '"') {
+			p = d = ++s;
+			while ((c = *s++) != '"') {
+				if (c == '\\')
+					c = *s++;
+				*d++ = c;
+			}
+			cur->len = d - p;
+			cur->val = nfmalloc( cur->len + 1 );
+			memcpy( cur->val, p, cur->len );
+			cur->val[cur->len] = 0;
+		} else {
+			for (p = s; *s && *s != ' ' && *s != ')' && *s != '\r'; s++) {}
+			cur->len = s - p;
+			if (cur->len == 3 && !memcmp( p, "NIL", 3 )) {
+				cur->val = NIL;
+			} else {
+				cur->val = nfmalloc( cur->len + 1 );
+				memcpy( cur->val, p, cur->len );
+				cur->val[cur->len] = 0;
+			}
+		}
+	}
+}
+
+static void
+interpret( list_t *list, result_t *res )
+{
+	list_t *tmp, *flags;
+	int i;
+
+	memset( res, 0, sizeof(*res) );
+	res->body_len = -1;
+	for (tmp = list; tmp; tmp = tmp->next) {
+		if (!is_atom( tmp ))
+			continue;
+		if (!strcmp( "UID", tmp->val )) {
+			if (is_atom( tmp = tmp->next ))
+				res->uid = atoi( tmp->val );
+		} else if (!strcmp( "FLAGS", tmp->val )) {
+			tmp = tmp->next;
+			for (flags = tmp->child; flags; flags = flags->next) {
+				if (!strcmp( "\\Recent", flags->val ))
+					res->status |= M_RECENT;
+				for (i = 0; i < NUM_FLAGS; i++)
+					if (flags->val[0] == '\\' && !strcmp( ImapFlags[i], flags->val + 1 ))
+						res->flags |= 1 << i;
+			}
+			res->status |= M_FLAGS;
+		} else if (!strcmp( "INTERNALDATE", tmp->val )) {
+			if (is_atom( tmp = tmp->next ))
+				res->date = parse_imap_date( tmp->val );
+		} else if (!strcmp( "RFC822.SIZE", tmp->val )) {
+			if (is_atom( tmp = tmp->next ))
+				res->size = atoi( tmp->val );
+		} else if (!strcmp( "BODY[]", tmp->val )) {
+			if (is_atom( tmp = tmp->next )) {
+				res->body_len = tmp->len;
+				res->body_sum = checksum( 2166136261U, tmp->val, tmp->len );
+			}
+		} else if (!strcmp( "BODY[HEADER.FIELDS", tmp->val )) {
+			tmp = tmp->next->next->next;
+			if (starts_with( tmp->val, tmp->len, "X-TUID: ", 8 )) {
+				res->got_tuid = 1;
+				memcpy( res->tuid, tmp->val + 8, TUIDL );
+			}
+		}
+	}
+}
+
+static int
+parse_ref( result_t *res )
+{
+	list_t *list;
+	char *s = work, *e = work + len;
+	int n = 0, bad = 0;
+
+	memcpy( work, data, len );
+	work[len] = 0;
+	while (s < e) {
+		if (!(s = strstr( s, " FETCH (" )))
+			return -1;
+		s += 8;
+		list = parse_list( &s, &bad );
+		if (bad)
+			return -1;
+		interpret( list, &res[n++] );
+		free_list( list );
+		s += 2;
+	}
+	return n;
+}
+
+static double
+now( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double
+measure( int (*parse)( result_t *res ), result_t *res )
+{
+	double st, t;
+	int rounds = 0;
+
+	st = now();
+	do {
+		if (parse( res ) != nrsps) {
+			fprintf( stderr, "Parsing failed.\n" );
+			exit( 1 );
+		}
+		rounds++;
+	} while ((t = now() - st) < 1);
+	return t / rounds;
+}
+
+int
+main( int argc, char **argv )
+{
+	double nt, rt;
+	int i, bad = 0;
+
+	nrsps = argc > 1 ? atoi( argv[1] ) : 100000;
+	synthesize( nrsps );
+	printf( "%d responses, %d bytes\n", nrsps, len );
+
+	rt = measure( parse_ref, res_ref );
+	nt = measure( parse_new, res_new );
+	for (i = 0; i < nrsps; i++) {
+		if (memcmp( &res_new[i], &res_ref[i], sizeof(result_t) )) {
+			if (bad++ < 5)
+				fprintf( stderr, "mismatch on response %d\n", i );
+		}
+	}
+	printf( "reference %9.0f responses/s %7.1f MB/s\n", nrsps / rt, len / rt / 1e6 );
+	printf( "parser    %9.0f responses/s %7.1f MB/s   %s\n", nrsps / nt, len / nt / 1e6,
+	        bad ? "MISMATCH" : "ok" );
+	return bad ? 1 : 0;
+}
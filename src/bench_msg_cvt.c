@@ -0,0 +1,312 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+
+/* Micro-benchmark for the message converter. Run it on some real-world
+ * messages (files or maildir folders) to check that the output matches the
+ * straightforward byte-at-a-time conversion, and to see how fast it is:
+ *
+ *   make bench_msg_cvt && ./bench_msg_cvt ~/Maildir/INBOX/cur
+ *
+ * Without arguments, a synthetic corpus is used. */
+
+#include "msg_cvt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+int DFlags;
+const char *Home;
+
+#define CHUNK 65536
+
+typedef struct {
+	char *data;
+	int len;
+} msg_t;
+
+static msg_t *msgs;
+static int nmsgs, amsgs;
+static long total;
+
+static void
+add_msg( char *data, int len )
+{
+	if (nmsgs == amsgs)
+		msgs = nfrealloc( msgs, (amsgs = amsgs * 2 + 64) * sizeof(*msgs) );
+	msgs[nmsgs].data = data;
+	msgs[nmsgs].len = len;
+	nmsgs++;
+	total += len;
+}
+
+static void
+load( const char *path, int depth )
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char *data;
+	int fd;
+	char buf[_POSIX_PATH_MAX];
+
+	if (stat( path, &st )) {
+		sys_error( "Cannot stat %s", path );
+		return;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (depth > 2 || !(dir = opendir( path )))
+			return;
+		while ((de = readdir( dir ))) {
+			if (de->d_name[0] == '.')
+				continue;
+			nfsnprintf( buf, sizeof(buf), "%s/%s", path, de->d_name );
+			load( buf, depth + 1 );
+		}
+		closedir( dir );
+	} else if (S_ISREG(st.st_mode) && st.st_size) {
+		if ((fd = open( path, O_RDONLY )) < 0) {
+			sys_error( "Cannot open %s", path );
+			return;
+		}
+		data = nfmalloc( st.st_size );
+		if (read( fd, data, st.st_size ) != st.st_size) {
+			sys_error( "Cannot read %s", path );
+			free( data );
+		} else {
+			add_msg( data, st.st_size );
+		}
+		close( fd );
+	}
+}
+
+static void
+synthesize( void )
+{
+	int i, j, l, sz;
+	char *data;
+
+	srand( 1 );
+	for (i = 0; i < 2000; i++) {
+		sz = 4096 + (i % 17 ? rand() % 16384 : rand() % 1048576);
+		data = nfmalloc( sz + 1024 );
+		l = sprintf( data,
+		             "Return-Path: <someone@example.com>\n"
+		             "Received: from mail.example.com (mail.example.com [192.0.2.1])\n"
+		             "\tby mx.example.org with ESMTP id %d; Mon, 1 Jan 2001 00:00:00 +0000\n"
+		             "From: Someone <someone@example.com>\n"
+		             "To: Someone Else <else@example.org>\n"
+		             "Subject: Message number %d\n"
+		             "Message-ID: <%d@example.com>\n"
+		             "%s"
+		             "\n", i, i, i, i % 3 ? "" : "X-TUID: 0123456789ab\n" );
+		while (l < sz) {
+			/* Alternate between text-like lines and long base64-like lines. */
+			for (j = (i & 1) ? 76 : rand() % 80; j && l < sz; j--)
+				data[l++] = 'A' + rand() % 26;
+			data[l++] = '\n';
+		}
+		add_msg( data, l );
+	}
+}
+
+/* The obvious byte-at-a-time implementation, for reference. */
+
+static char *rbuf;
+static int rlen, rsize;
+
+static void
+rput( char c )
+{
+	if (rlen == rsize)
+		rbuf = nfrealloc( rbuf, rsize = rsize * 2 + 4096 );
+	rbuf[rlen++] = c;
+}
+
+static void
+rconv( char c, int scr, int tcr )
+{
+	if (scr != tcr) {
+		if (c == '\r')
+			return;
+		if (c == '\n' && tcr)
+			rput( '\r' );
+	}
+	rput( c );
+}
+
+static void
+rtuid( const char *tuid, int scr, int tcr, int hcrs )
+{
+	const char *s;
+	int i;
+
+	for (s = "X-TUID: "; *s; s++)
+		rput( *s );
+	for (i = 0; i < TUIDL; i++)
+		rput( tuid[i] );
+	if (tcr && (!scr || hcrs))
+		rput( '\r' );
+	rput( '\n' );
+}
+
+static int
+reference( const char *buf, int len, int scr, int tcr, const char *tuid )
+{
+	int i = 0, j, ls, lcrs, hcrs = 0;
+
+	rlen = 0;
+	if (tuid) {
+		for (;;) {
+			for (ls = i, lcrs = 0; i < len && buf[i] != '\n'; i++)
+				if (buf[i] == '\r')
+					lcrs++;
+			if (i == len)
+				return -1;
+			i++;
+			if (i - ls >= 8 && !memcmp( buf + ls, "X-TUID: ", 8 )) {
+				rtuid( tuid, scr, tcr, hcrs );
+				break;
+			}
+			hcrs += lcrs;
+			if (i - ls - lcrs == 1) {
+				rtuid( tuid, scr, tcr, hcrs );
+				for (j = ls; j < i; j++)
+					rconv( buf[j], scr, tcr );
+				break;
+			}
+			for (j = ls; j < i; j++)
+				rconv( buf[j], scr, tcr );
+		}
+	}
+	for (; i < len; i++)
+		rconv( buf[i], scr, tcr );
+	return 0;
+}
+
+static long outlen;
+
+static void
+count_out( void *aux, const char *buf, int len )
+{
+	(void)aux;
+	(void)buf;
+	outlen += len;
+}
+
+static void
+cvt_chunked( msg_cvt_t *cvt, const msg_t *msg, int scr, int tcr, const char *tuid )
+{
+	int off, l;
+
+	msg_cvt_init( cvt, scr, tcr, tuid, count_out, 0 );
+	for (off = 0; off < msg->len; off += l) {
+		l = msg->len - off < CHUNK ? msg->len - off : CHUNK;
+		msg_cvt_feed( cvt, msg->data + off, l );
+	}
+	msg_cvt_done( cvt );
+}
+
+static double
+now( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+run( const char *name, msg_t *corp, int scr, int tcr, const char *tuid )
+{
+	msg_cvt_t *cvt;
+	char *out;
+	double st, ot, nt;
+	int i, rr, cr, outl, bad = 0, rounds;
+
+	for (i = 0; i < nmsgs; i++) {
+		rr = reference( corp[i].data, corp[i].len, scr, tcr, tuid );
+		cr = msg_cvt_buffer( corp[i].data, corp[i].len, scr, tcr, tuid, &out, &outl );
+		if (rr != cr || (!rr && (rlen != outl || memcmp( rbuf, out, outl )))) {
+			if (bad++ < 5)
+				fprintf( stderr, "%s: mismatch on message %d\n", name, i );
+		}
+		if (!cr)
+			free( out );
+	}
+
+	cvt = nfmalloc( sizeof(*cvt) );
+	rounds = 0;
+	st = now();
+	do {
+		for (i = 0; i < nmsgs; i++)
+			reference( corp[i].data, corp[i].len, scr, tcr, tuid );
+		rounds++;
+	} while ((ot = now() - st) < .5);
+	ot /= rounds;
+	rounds = 0;
+	st = now();
+	do {
+		for (i = 0; i < nmsgs; i++)
+			cvt_chunked( cvt, &corp[i], scr, tcr, tuid );
+		rounds++;
+	} while ((nt = now() - st) < .5);
+	nt /= rounds;
+	free( cvt );
+
+	printf( "%-12s reference %8.1f MB/s   msg_cvt %8.1f MB/s   %s\n", name,
+	        total / ot / 1e6, total / nt / 1e6, bad ? "MISMATCH" : "ok" );
+	return bad;
+}
+
+int
+main( int argc, char **argv )
+{
+	msg_t *crlf;
+	int i, bad = 0;
+	const char *tuid = "0123456789ab";
+
+	for (i = 1; i < argc; i++)
+		load( argv[i], 0 );
+	if (!nmsgs)
+		synthesize();
+	printf( "%d messages, %ld bytes\n", nmsgs, total );
+
+	crlf = nfmalloc( nmsgs * sizeof(*crlf) );
+	for (i = 0; i < nmsgs; i++) {
+		reference( msgs[i].data, msgs[i].len, 0, 1, 0 );
+		crlf[i].data = nfmalloc( rlen );
+		memcpy( crlf[i].data, rbuf, rlen );
+		crlf[i].len = rlen;
+	}
+
+	bad |= run( "LF->CRLF", msgs, 0, 1, tuid );
+	bad |= run( "CRLF->LF", crlf, 1, 0, tuid );
+	bad |= run( "TUID only", msgs, 0, 0, tuid );
+	bad |= run( "CRLF+TUID", crlf, 1, 1, tuid );
+	return bad ? 1 : 0;
+}
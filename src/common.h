@@ -26,6 +26,7 @@
 #include <autodefs.h>
 
 #include <sys/types.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -65,6 +66,9 @@
 
 extern int DFlags;
 extern int UseFSync;
+extern int DetectMoves;
+extern int MaxParallel;
+extern int DaemonInterval;
 extern char FieldDelimiter;
 
 extern int Pid;
@@ -98,6 +102,11 @@ void *memrchr( const void *s, int c, size_t n );
 int starts_with( const char *str, int strl, const char *cmp, int cmpl );
 int equals( const char *str, int strl, const char *cmp, int cmpl );
 
+/* Longest Message-ID (including the angle brackets and the NUL) we care about. */
+#define MSGIDL 256
+
+int find_msgid( const char *hdr, int len, char *buf );
+
 #ifndef HAVE_TIMEGM
 # include <time.h>
 time_t timegm( struct tm *tm );
@@ -114,6 +123,19 @@ void ATTR_NORETURN oob( void );
 
 char *expand_strdup( const char *s );
 
+/* A pool hands out memory for objects which are released all at once. */
+typedef struct pool_chunk pool_chunk_t;
+
+typedef struct {
+	pool_chunk_t *chunks; /* most recent first */
+	char *ptr; /* free space in the first chunk ... */
+	size_t left; /* ... of this size */
+	size_t size; /* size of the first chunk */
+} pool_t;
+
+void *pool_alloc( pool_t *pool, size_t sz ); /* zero-initialize pool_t before */
+void pool_free( pool_t *pool );
+
 int map_name( const char *arg, char **result, int reserve, const char *in, const char *out );
 
 void sort_ints( int *arr, int len );
@@ -135,6 +157,51 @@ void add_fd( int fd, void (*cb)( int events, void *aux ), void *aux );
 void conf_fd( int fd, int and_events, int or_events );
 void fake_fd( int fd, int events );
 void del_fd( int fd );
+
+typedef struct list_head {
+	struct list_head *next, *prev;
+} list_head_t;
+
+typedef struct {
+	list_head_t links; /* must be first */
+	void (*cb)( void *aux );
+	void *aux;
+	uint64_t expiry;
+} wakeup_t;
+
+uint64_t get_usecs( void ); /* monotonic clock */
+
+void init_wakeup( wakeup_t *tmr, void (*cb)( void *aux ), void *aux );
+void conf_wakeup( wakeup_t *tmr, int timeout ); /* milliseconds; negative disarms */
+void wipe_wakeup( wakeup_t *tmr );
+static INLINE int pending_wakeup( wakeup_t *tmr ) { return tmr->links.next != 0; }
+
 void main_loop( void );
 
+/* stats.c */
+
+/* Activity of a store, as counted by its driver. The counters only grow;
+ * the set-up times are those of a fresh connection, and are cleared once
+ * they have been reported. */
+typedef struct {
+	uint64_t bytes_in, bytes_out;
+	int commands, round_trips;
+	int fsyncs, renames;
+	uint64_t connect_us, tls_us, auth_us;
+} io_stats_t;
+
+void io_stats_diff( io_stats_t *res, const io_stats_t *now, const io_stats_t *then );
+
+extern FILE *StatsFile; /* null if no statistics are wanted */
+
+int stats_open( const char *path );
+void stats_open_rec( const char *type );
+void stats_close_rec( void );
+void stats_open_obj( const char *key );
+void stats_close_obj( void );
+void stats_str( const char *key, const char *val );
+void stats_int( const char *key, uint64_t val );
+void stats_usecs( const char *key, uint64_t usecs );
+void stats_io( const char *key, const io_stats_t *io );
+
 #endif
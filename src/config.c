@@ -226,8 +226,14 @@ getopt_helper( conffile_t *cfile, int *cops, channel_conf_t *conf )
 		conf->use_internal_date = parse_bool( cfile );
 	else if (!strcasecmp( "MaxMessages", cfile->cmd ))
 		conf->max_messages = parse_int( cfile );
+	else if (!strcasecmp( "MaxAge", cfile->cmd ))
+		conf->max_age = parse_int( cfile );
+	else if (!strcasecmp( "PruneAged", cfile->cmd ))
+		conf->prune_aged = parse_bool( cfile );
 	else if (!strcasecmp( "ExpireUnread", cfile->cmd ))
 		conf->expire_unread = parse_bool( cfile );
+	else if (!strcasecmp( "Placeholders", cfile->cmd ))
+		conf->placeholders = parse_bool( cfile );
 	else
 		return 0;
 	return 1;
@@ -364,8 +370,11 @@ load_config( const char *where, int pseudo )
 			channel = nfcalloc( sizeof(*channel) );
 			channel->name = nfstrdup( cfile.val );
 			channel->max_messages = global_conf.max_messages;
+			channel->max_age = global_conf.max_age;
+			channel->prune_aged = global_conf.prune_aged;
 			channel->expire_unread = global_conf.expire_unread;
 			channel->use_internal_date = global_conf.use_internal_date;
+			channel->placeholders = global_conf.placeholders;
 			cops = 0;
 			max_size = -1;
 			while (getcline( &cfile ) && cfile.cmd) {
@@ -467,6 +476,42 @@ load_config( const char *where, int pseudo )
 		{
 			UseFSync = parse_bool( &cfile );
 		}
+		else if (!strcasecmp( "DetectMoves", cfile.cmd ))
+		{
+			DetectMoves = parse_bool( &cfile );
+		}
+		else if (!strcasecmp( "MaxParallel", cfile.cmd ))
+		{
+			if ((MaxParallel = parse_int( &cfile )) < 1) {
+				error( "%s:%d: MaxParallel must be at least 1\n", cfile.file, cfile.line );
+				cfile.err = 1;
+			}
+		}
+		else if (!strcasecmp( "SyncStateFormat", cfile.cmd ))
+		{
+			if (!strcasecmp( "Text", cfile.val ))
+				SyncStateFormat = SYNCSTATE_TEXT;
+			else if (!strcasecmp( "Binary", cfile.val ))
+				SyncStateFormat = SYNCSTATE_BINARY;
+			else {
+				error( "%s:%d: invalid SyncStateFormat '%s'\n", cfile.file, cfile.line, cfile.val );
+				cfile.err = 1;
+			}
+		}
+		else if (!strcasecmp( "JournalFlush", cfile.cmd ))
+		{
+			if ((JournalFlush = parse_int( &cfile )) < 0) {
+				error( "%s:%d: JournalFlush must not be negative\n", cfile.file, cfile.line );
+				cfile.err = 1;
+			}
+		}
+		else if (!strcasecmp( "DaemonInterval", cfile.cmd ))
+		{
+			if ((DaemonInterval = parse_int( &cfile )) < 0) {
+				error( "%s:%d: DaemonInterval must not be negative\n", cfile.file, cfile.line );
+				cfile.err = 1;
+			}
+		}
 		else if (!strcasecmp( "FieldDelimiter", cfile.cmd ))
 		{
 			if (strlen( cfile.val ) != 1) {
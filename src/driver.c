@@ -24,17 +24,23 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 driver_t *drivers[N_DRIVERS] = { &maildir_driver, &imap_driver };
 
 void
-free_generic_messages( message_t *msgs )
+free_generic_messages( store_t *ctx )
 {
-	message_t *tmsg;
+	pool_free( &ctx->msg_pool );
+	ctx->msgs = 0;
+}
 
-	for (; msgs; msgs = tmsg) {
-		tmsg = msgs->next;
-		free( msgs );
+void
+free_msg_map( msg_map_t *map )
+{
+	if (map) {
+		munmap( map->base, map->size );
+		free( map );
 	}
 }
 
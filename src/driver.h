@@ -64,8 +64,15 @@ typedef struct message {
 	int uid;
 	unsigned char flags, status;
 	char tuid[TUIDL];
+	char *msgid; /* if OPEN_MSGID; allocated from the store's msg_pool */
 } message_t;
 
+/* Message state as recorded by a previous sync; see load(). */
+typedef struct {
+	int uid;
+	unsigned char flags;
+} known_msg_t;
+
 /* For opts, both in store and driver_t->select() */
 #define OPEN_OLD        (1<<0)
 #define OPEN_NEW        (1<<1)
@@ -75,25 +82,40 @@ typedef struct message {
 #define OPEN_SETFLAGS   (1<<6)
 #define OPEN_APPEND     (1<<7)
 #define OPEN_FIND       (1<<8)
+#define OPEN_MSGID      (1<<9)
+#define OPEN_STASH      (1<<10) /* keep expunged messages for adopt_msg() */
 
 typedef struct store {
 	struct store *next;
 	store_conf_t *conf; /* foreign */
 	string_list_t *boxes; /* _list results - own */
-	char listed; /* was _list already run? */
+	int listed; /* serial of the last _list run; zero if none */
 
 	void (*bad_callback)( void *aux );
 	void *bad_callback_aux;
 
 	/* currently open mailbox */
 	char *path; /* own */
-	message_t *msgs; /* own */
+	message_t *msgs; /* own; allocated from msg_pool */
+	pool_t msg_pool;
 	int uidvalidity;
 	int uidnext; /* from SELECT responses */
+	uint64_t highestmodseq; /* ditto; zero if mod-sequences are not supported */
 	unsigned opts; /* maybe preset? */
+	io_stats_t stats;
 	/* note that the following do _not_ reflect stats from msgs, but mailbox totals */
 	int count; /* # of messages */
 	int recent; /* # of recent messages - don't trust this beyond the initial read */
+
+	/* set up by the user before load() */
+	uint64_t changedsince;
+	known_msg_t *known; /* own */
+	int nknown;
+	int minnewuid; /* with OPEN_MSGID, Message-IDs are needed only from this UID on */
+	time_t since; /* if set, only messages which arrived since then are wanted; see load() */
+
+	/* set up by the driver's load() if since is set */
+	int sinceuid; /* the lowest UID of the wanted messages, or INT_MAX if there are none */
 } store_t;
 
 /* When the callback is invoked (at most once per store), the store is fubar;
@@ -105,11 +127,30 @@ set_bad_callback( store_t *ctx, void (*cb)( void *aux ), void *aux )
 	ctx->bad_callback_aux = aux;
 }
 
+/* Receiver of message contents which are passed in pieces as they become available. */
+typedef struct msg_sink {
+	void (*write)( struct msg_sink *sink, const char *buf, int len );
+} msg_sink_t;
+
+/* A read-only mapping of a message file. The message contents start at off;
+ * their bare LFs are to be stored as CRLFs. */
+typedef struct {
+	char *base;
+	int size, off;
+} msg_map_t;
+
+void free_msg_map( msg_map_t *map );
+
 typedef struct {
 	char *data;
 	int len;
+	msg_map_t *map; /* store_msg(): the contents continue here, see DRV_MAPPED */
 	time_t date;
 	unsigned char flags;
+	char placeholder; /* fetch_msg(): get a placeholder instead of the contents, see DRV_PLACEHOLDER */
+	message_t *replace; /* store_msg()/close_msg(): overwrite this message, see DRV_REPLACE */
+	msg_sink_t *sink; /* if set, the contents go there rather than to data */
+	char map_ok; /* fetch_msg(): the contents may be returned in map instead of data */
 } msg_data_t;
 
 #define DRV_OK          0
@@ -132,6 +173,22 @@ typedef struct {
    This flag says that the driver will act upon (DFlags & VERBOSE).
 */
 #define DRV_VERBOSE     2
+/*
+   This flag says that fetch_msg() can make up a placeholder for a message
+   which is too big: a small message with the original header which
+   describes the MIME structure of the body.
+*/
+#define DRV_PLACEHOLDER 4
+/*
+   This flag says that store_msg() and close_msg() can replace the contents
+   of an existing message, keeping its UID and flags.
+*/
+#define DRV_REPLACE     8
+/*
+   This flag says that store_msg() can take contents which continue in
+   a file mapping, so they need not be converted into one buffer.
+*/
+#define DRV_MAPPED      16
 
 #define LIST_PATH       1
 #define LIST_INBOX      2
@@ -161,6 +218,14 @@ struct driver {
 	void (*list)( store_t *ctx, int flags,
 	              void (*cb)( int sts, void *aux ), void *aux );
 
+	/* Determine a cheap fingerprint of the mailbox name without selecting it.
+	 * It must change whenever messages are added or removed, or their flags
+	 * change. The callback gets a null fingerprint if none can be determined,
+	 * e.g., because the mailbox does not exist. Drivers which cannot do this
+	 * leave this null. */
+	void (*box_fingerprint)( store_t *ctx, const char *name,
+	                         void (*cb)( int sts, const char *fp, void *aux ), void *aux );
+
 	/* Invoked before select(), this informs the driver which operations (OP_*)
 	 * will be performed on the mailbox. The driver may extend the set by implicitly
 	 * needed or available operations. */
@@ -171,23 +236,71 @@ struct driver {
 	void (*select)( store_t *ctx, const char *name, int create,
 	               void (*cb)( int sts, void *aux ), void *aux );
 
+	/* Determine the lowest UID of the messages which arrived in the current mailbox
+	 * not earlier than the given time, or INT_MAX if there are none. The result
+	 * may be too low, but never too high. Optional; called before load().
+	 * Drivers which leave this null must honor since in load() instead. */
+	void (*find_since)( store_t *ctx, time_t since,
+	                    void (*cb)( int sts, int uid, void *aux ), void *aux );
+
 	/* Load the message attributes needed to perform the requested operations.
 	 * Consider only messages with UIDs between minuid and maxuid (inclusive)
 	 * and those named in the excs array (smaller than minuid).
 	 * The driver takes ownership of the excs array. Messages below newuid do not need
-	 * to have the TUID populated even if OPEN_FIND is set. */
+	 * to have the TUID populated even if OPEN_FIND is set.
+	 * For stores which report a highestmodseq, changedsince may be set as well. Then
+	 * the known array (sorted by UID) holds the state of all messages the previous sync
+	 * saw up to its last entry, and changedsince is the highestmodseq of that time.
+	 * The driver may then fetch only the messages which were modified or expunged
+	 * since, and recreate the others from the array. Messages from the excs array
+	 * (which may overlap the range in this case) must be always fetched in full.
+	 * The driver takes ownership of the known array.
+	 * If since is set, the driver determines sinceuid the way find_since() does,
+	 * and skips all messages below it, including the excs. */
 	void (*load)( store_t *ctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
 	              void (*cb)( int sts, void *aux ), void *aux );
 
-	/* Fetch the contents and flags of the given message from the current mailbox. */
+	/* Fetch the contents and flags of the given message from the current mailbox.
+	 * If data->sink is set, the contents are written to it (possibly before the
+	 * callback is invoked with an error status) instead of being stored in data. */
 	void (*fetch_msg)( store_t *ctx, message_t *msg, msg_data_t *data,
 	                   void (*cb)( int sts, void *aux ), void *aux );
 
+	/* Announce that count messages are about to be stored in the current mailbox,
+	 * so their UIDs can be reserved at once. Unused UIDs are lost, which is
+	 * harmless. Drivers which do not assign UIDs themselves leave this null. */
+	int (*reserve_uids)( store_t *ctx, int count );
+
 	/* Store the given message to either the current mailbox or the trash folder.
-	 * If the new copy's UID can be immediately determined, return it, otherwise -2. */
+	 * If the new copy's UID can be immediately determined, return it, otherwise -2.
+	 * The operation may be delayed until commit() is called. */
 	void (*store_msg)( store_t *ctx, msg_data_t *data, int to_trash,
 	                   void (*cb)( int sts, int uid, void *aux ), void *aux );
 
+	/* Streaming alternative to store_msg(): create a message the contents of which
+	 * are subsequently written to the returned sink. Write errors are reported only
+	 * by close_msg(). Drivers which need to know the size of a message in advance
+	 * leave this null. */
+	int (*open_msg)( store_t *ctx, int to_trash, msg_sink_t **sink );
+
+	/* Finish a message created with open_msg(). The flags and the date are taken from
+	 * data; the callback is invoked like that of store_msg(). If data is null, the
+	 * message is discarded instead; no callback is invoked then, and this is permitted
+	 * even after the store was canceled. */
+	void (*close_msg)( store_t *ctx, msg_sink_t *sink, msg_data_t *data,
+	                   void (*cb)( int sts, int uid, void *aux ), void *aux );
+
+	/* Store a message which was expunged from another mailbox during this run
+	 * (see DetectMoves) by moving it into the current mailbox, provided one with
+	 * the given Message-ID and size is at hand. The size is that with CRLF line
+	 * endings and without an X-TUID header. Returns DRV_MSG_BAD if the message
+	 * needs to be copied after all; otherwise, the UID is stored in *uid.
+	 * Drivers which cannot do this leave this null. */
+	int (*adopt_msg)( store_t *ctx, const char *msgid, int size, int flags, int *uid );
+
+	/* Dispose of the expunged messages which nobody adopted. */
+	void (*drop_moved)( void );
+
 	/* Index the messages which have newly appeared in the mailbox, including their
 	 * temporary UID headers. This is needed if store_msg() does not guarantee returning
 	 * a UID; otherwise the driver needs to implement only the OPEN_FIND flag. */
@@ -218,11 +331,19 @@ struct driver {
 	void (*cancel)( store_t *ctx,
 	                void (*cb)( void *aux ), void *aux );
 
-	/* Commit any pending set_flags() commands. */
+	/* Commit any pending set_flags() and store_msg() commands. */
 	void (*commit)( store_t *ctx );
+
+	/* Wait for changes to the selected mailbox. Once the server reports some,
+	 * the callback is invoked with DRV_OK. Otherwise, the wait lasts until
+	 * cancel() is called, after which the callback gets DRV_CANCELED.
+	 * DRV_BOX_BAD means that the mailbox cannot be watched.
+	 * Drivers which cannot watch leave this null. */
+	void (*idle)( store_t *ctx,
+	              void (*cb)( int sts, void *aux ), void *aux );
 };
 
-void free_generic_messages( message_t * );
+void free_generic_messages( store_t * );
 
 void parse_generic_store( store_conf_t *store, conffile_t *cfg );
 
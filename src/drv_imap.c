@@ -24,6 +24,7 @@
 #include "driver.h"
 
 #include "socket.h"
+#include "imap_fetch.h"
 
 #include <assert.h>
 #include <unistd.h>
@@ -57,6 +58,9 @@ typedef struct imap_server_conf {
 #ifdef HAVE_LIBSSL
 	char ssl_type;
 #endif
+#ifdef HAVE_LIBZ
+	char compress;
+#endif
 } imap_server_conf_t;
 
 typedef struct imap_store_conf {
@@ -83,6 +87,8 @@ typedef struct _list {
 #define MAX_LIST_DEPTH 5
 
 struct imap_store;
+struct imap_cmd;
+struct imap_cmd_multiappend;
 
 typedef struct parse_list_state {
 	list_t *head, **stack[MAX_LIST_DEPTH];
@@ -90,8 +96,6 @@ typedef struct parse_list_state {
 	int level, need_bytes;
 } parse_list_state_t;
 
-struct imap_cmd;
-
 typedef struct imap_store {
 	store_t gen;
 	const char *label; /* foreign */
@@ -101,16 +105,32 @@ typedef struct imap_store {
 	/* trash folder's existence is not confirmed yet */
 	enum { TrashUnknown, TrashChecking, TrashKnown } trashnc;
 	unsigned got_namespace:1;
+	unsigned qresync:1; /* QRESYNC was ENABLEd */
 	char *delimiter; /* hierarchy delimiter */
+	string_list_t *box_status; /* STATUS results: mailbox name, NUL, fingerprint */
+	char *status_box; /* mailbox of the STATUS response being parsed */
 	list_t *ns_personal, *ns_other, *ns_shared; /* NAMESPACE info */
 	message_t **msgapp; /* FETCH results */
+	int msgs_maxuid; /* highest UID in the FETCH results so far */
+	char msgs_unsorted; /* the FETCH results came in out of order */
+	int *vanished, nvanished, avanished; /* UID ranges from VANISHED responses */
+	int changed_minuid, changed_maxuid; /* CHANGEDSINCE FETCH of the current load */
+	int search_min; /* lowest UID from SEARCH results */
 	unsigned caps; /* CAPABILITY results */
 	string_list_t *auth_mechs;
 	parse_list_state_t parse_list_sts;
+	fetch_parser_t fetch_sts;
+	struct imap_cmd *fetch_stream; /* FETCH whose BODY[] goes directly to the command's sink */
 	/* command queue */
 	int nexttag, num_in_progress;
 	struct imap_cmd *pending, **pending_append;
 	struct imap_cmd *in_progress, **in_progress_append;
+	struct imap_cmd **tag_hash, **uid_hash; /* in_progress by tag and by param.uid */
+	int hash_size, num_uid_cmds;
+	uint64_t setup_mark, tls_mark; /* for the connection set-up statistics */
+	struct imap_cmd_multiappend *append_batch; /* APPENDs waiting for imap_commit() */
+	struct flag_update *flag_updates; /* STOREs waiting for imap_commit() */
+	int nflag_updates, aflag_updates;
 
 	/* Used during sequential operations like connect */
 	enum { GreetingPending = 0, GreetingBad, GreetingOk, GreetingPreauth } greeting;
@@ -120,6 +140,15 @@ typedef struct imap_store {
 		void (*imap_cancel)( void *aux );
 	} callbacks;
 	void *callback_aux;
+	/* incremental imap_load() */
+	void (*load_callback)( int sts, void *aux );
+	void *load_callback_aux;
+	/* imap_idle() */
+	struct imap_cmd_simple *idle_cmd;
+	enum { IdleNone, IdleStarting, IdleRunning, IdleEnding } idling;
+	char idle_changed; /* the server reported changes which imap_idle() did not deliver yet */
+	char idle_renew; /* IDLE is ended only to be restarted */
+	wakeup_t idle_timer;
 #ifdef HAVE_LIBSASL
 	sasl_conn_t *sasl;
 	int sasl_cont;
@@ -130,6 +159,8 @@ typedef struct imap_store {
 
 struct imap_cmd {
 	struct imap_cmd *next;
+	struct imap_cmd **pprev; /* while in progress: the pointer pointing to this command */
+	struct imap_cmd *tag_next, *uid_next; /* chains in tag_hash and uid_hash */
 	char *cmd;
 	int tag;
 
@@ -138,13 +169,19 @@ struct imap_cmd {
 		 * Needs to invoke bad_callback and return -1 on error, otherwise return 0. */
 		int (*cont)( imap_store_t *ctx, struct imap_cmd *cmd, const char *prompt );
 		void (*done)( imap_store_t *ctx, struct imap_cmd *cmd, int response );
+		/* If set, data is not consumed when it is sent; instead, this is called
+		 * afterwards to send the rest of the command, which may set data again. */
+		int (*lit_sent)( imap_store_t *ctx, struct imap_cmd *cmd );
 		char *data;
 		int data_len;
+		msg_map_t *map; /* the literal continues here, see DRV_MAPPED */
+		int map_len; /* ... amounting to so many bytes on the wire */
 		int uid; /* to identify fetch responses */
 		char high_prio; /* if command is queued, put it at the front of the queue. */
 		char to_trash; /* we are storing to trash, not current. */
 		char create; /* create the mailbox if we get an error ... */
 		char trycreate; /* ... but only if this is true or the server says so. */
+		char idle; /* this is an IDLE, which blocks everything behind it. */
 	} param;
 };
 
@@ -154,6 +191,13 @@ struct imap_cmd_simple {
 	void *callback_aux;
 };
 
+struct imap_cmd_fingerprint {
+	struct imap_cmd gen;
+	void (*callback)( int sts, const char *fp, void *aux );
+	void *callback_aux;
+	char *box;
+};
+
 struct imap_cmd_fetch_msg {
 	struct imap_cmd_simple gen;
 	msg_data_t *msg_data;
@@ -166,6 +210,32 @@ struct imap_cmd_out_uid {
 	int out_uid;
 };
 
+typedef struct {
+	char *data;
+	int len;
+	msg_map_t *map;
+	int map_len;
+	int flags;
+	time_t date;
+	int uid;
+	void (*callback)( int sts, int uid, void *aux );
+	void *callback_aux;
+} imap_append_t;
+
+struct imap_cmd_multiappend {
+	struct imap_cmd gen;
+	imap_append_t *msgs;
+	int nmsgs, amsgs, size;
+	int cur; /* message the literal of which is being sent */
+};
+
+typedef struct flag_update {
+	int uid;
+	int flags;
+	char what; /* + or - */
+	struct imap_cmd_refcounted_state *sts;
+} flag_update_t;
+
 struct imap_cmd_refcounted_state {
 	void (*callback)( int sts, void *aux );
 	void *callback_aux;
@@ -178,6 +248,12 @@ struct imap_cmd_refcounted {
 	struct imap_cmd_refcounted_state *state;
 };
 
+struct imap_cmd_set_flags {
+	struct imap_cmd gen;
+	struct imap_cmd_refcounted_state **states;
+	int nstates;
+};
+
 #define CAP(cap) (ctx->caps & (1 << (cap)))
 
 enum CAPABILITY {
@@ -190,8 +266,17 @@ enum CAPABILITY {
 #endif
 	UIDPLUS,
 	LITERALPLUS,
+	MULTIAPPEND,
 	MOVE,
-	NAMESPACE
+	NAMESPACE,
+	QRESYNC,
+	CONDSTORE,
+	LIST_STATUS,
+	ESEARCH,
+#ifdef HAVE_LIBZ
+	COMPRESS_DEFLATE,
+#endif
+	IDLE
 };
 
 static const char *cap_list[] = {
@@ -204,27 +289,31 @@ static const char *cap_list[] = {
 #endif
 	"UIDPLUS",
 	"LITERAL+",
+	"MULTIAPPEND",
 	"MOVE",
-	"NAMESPACE"
+	"NAMESPACE",
+	"QRESYNC",
+	"CONDSTORE",
+	"LIST-STATUS",
+	"ESEARCH",
+#ifdef HAVE_LIBZ
+	"COMPRESS=DEFLATE",
+#endif
+	"IDLE"
 };
 
 #define RESP_OK       0
 #define RESP_NO       1
 #define RESP_CANCEL   2
 
+/* RFC 2177 asks clients to re-issue the IDLE at least every 29 minutes. */
+#define IDLE_RENEW (25 * 60)
+
 static INLINE void imap_ref( imap_store_t *ctx ) { ++ctx->ref_count; }
 static int imap_deref( imap_store_t *ctx );
 
 static void imap_invoke_bad_callback( imap_store_t *ctx );
 
-static const char *Flags[] = {
-	"Draft",
-	"Flagged",
-	"Answered",
-	"Seen",
-	"Deleted",
-};
-
 static struct imap_cmd *
 new_imap_cmd( int size )
 {
@@ -248,10 +337,129 @@ done_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd, int response )
 {
 	cmd->param.done( ctx, cmd, response );
 	free( cmd->param.data );
+	free_msg_map( cmd->param.map );
 	free( cmd->cmd );
 	free( cmd );
 }
 
+/* Commands in progress are hashed by tag and by the UID they fetch, so
+ * responses can be matched in constant time even with a deep pipeline. */
+
+static INLINE unsigned
+hash_uid( int uid )
+{
+	return (unsigned)uid * 1103515245U;
+}
+
+static void
+hash_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
+{
+	struct imap_cmd **cmdp;
+
+	cmdp = &ctx->tag_hash[cmd->tag & (ctx->hash_size - 1)];
+	cmd->tag_next = *cmdp;
+	*cmdp = cmd;
+	if (cmd->param.uid) {
+		/* Append, so the oldest command wins if a UID is fetched twice. */
+		for (cmdp = &ctx->uid_hash[hash_uid( cmd->param.uid ) & (ctx->hash_size - 1)];
+		     *cmdp; cmdp = &(*cmdp)->uid_next) {}
+		cmd->uid_next = 0;
+		*cmdp = cmd;
+		ctx->num_uid_cmds++;
+	}
+}
+
+static void
+unhash_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
+{
+	struct imap_cmd **cmdp;
+
+	for (cmdp = &ctx->tag_hash[cmd->tag & (ctx->hash_size - 1)]; *cmdp != cmd; cmdp = &(*cmdp)->tag_next) {}
+	*cmdp = cmd->tag_next;
+	if (cmd->param.uid) {
+		for (cmdp = &ctx->uid_hash[hash_uid( cmd->param.uid ) & (ctx->hash_size - 1)];
+		     *cmdp != cmd; cmdp = &(*cmdp)->uid_next) {}
+		*cmdp = cmd->uid_next;
+		ctx->num_uid_cmds--;
+	}
+}
+
+static void
+grow_cmd_hash( imap_store_t *ctx )
+{
+	struct imap_cmd *cmd;
+
+	free( ctx->tag_hash );
+	free( ctx->uid_hash );
+	ctx->hash_size = ctx->hash_size ? ctx->hash_size * 2 : 16;
+	ctx->tag_hash = nfcalloc( ctx->hash_size * sizeof(*ctx->tag_hash) );
+	ctx->uid_hash = nfcalloc( ctx->hash_size * sizeof(*ctx->uid_hash) );
+	ctx->num_uid_cmds = 0;
+	for (cmd = ctx->in_progress; cmd; cmd = cmd->next)
+		hash_imap_cmd( ctx, cmd );
+}
+
+static struct imap_cmd *
+find_tagged_cmd( imap_store_t *ctx, int tag )
+{
+	struct imap_cmd *cmd;
+
+	for (cmd = ctx->tag_hash[tag & (ctx->hash_size - 1)]; cmd; cmd = cmd->tag_next)
+		if (cmd->tag == tag)
+			break;
+	return cmd;
+}
+
+/* Find the fetch_msg() command a BODY[] belongs to - either by its UID,
+ * or because there is only one candidate. */
+static struct imap_cmd *
+find_fetch_cmd( imap_store_t *ctx, int uid )
+{
+	struct imap_cmd *cmd;
+
+	if (!ctx->in_progress)
+		return 0;
+	if (uid) {
+		for (cmd = ctx->uid_hash[hash_uid( uid ) & (ctx->hash_size - 1)]; cmd; cmd = cmd->uid_next)
+			if (cmd->param.uid == uid)
+				return cmd;
+	} else if (ctx->num_uid_cmds == 1) {
+		for (cmd = ctx->in_progress; cmd; cmd = cmd->next)
+			if (cmd->param.uid)
+				return cmd;
+	}
+	return 0;
+}
+
+/* The mapped tail of a literal is queued without copying it; the mapping
+ * is owned by the command, so it outlives the queue. */
+static int
+send_imap_map( imap_store_t *ctx, msg_map_t *map )
+{
+	if (!map)
+		return 0;
+	return socket_write_crlf( &ctx->conn, map->base + map->off, map->size - map->off );
+}
+
+static int
+send_imap_lit( imap_store_t *ctx, struct imap_cmd *cmd )
+{
+	char *p = cmd->param.data;
+
+	cmd->param.data = 0;
+	if (cmd->param.lit_sent) {
+		if (socket_write( &ctx->conn, p, cmd->param.data_len, KeepOwn ) < 0 ||
+		    send_imap_map( ctx, cmd->param.map ) < 0)
+			return -1;
+		return cmd->param.lit_sent( ctx, cmd );
+	}
+	if (socket_write( &ctx->conn, p, cmd->param.data_len, GiveOwn ) < 0 ||
+	    send_imap_map( ctx, cmd->param.map ) < 0 ||
+	    socket_write( &ctx->conn, "\r\n", 2, KeepOwn ) < 0)
+		return -1;
+	return 0;
+}
+
 static int
 send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 {
@@ -271,7 +479,7 @@ send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 		litplus = 1;
 	}
 	bufl = nfsnprintf( buf, sizeof(buf), buffmt,
-	                   cmd->tag, cmd->cmd, cmd->param.data_len );
+	                   cmd->tag, cmd->cmd, cmd->param.data_len + cmd->param.map_len );
 	if (DFlags & VERBOSE) {
 		if (ctx->num_in_progress)
 			printf( "(%d in progress) ", ctx->num_in_progress );
@@ -283,19 +491,22 @@ send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	}
 	if (socket_write( &ctx->conn, buf, bufl, KeepOwn ) < 0)
 		goto bail;
-	if (litplus) {
-		char *p = cmd->param.data;
-		cmd->param.data = 0;
-		if (socket_write( &ctx->conn, p, cmd->param.data_len, GiveOwn ) < 0 ||
-		    socket_write( &ctx->conn, "\r\n", 2, KeepOwn ) < 0)
-			goto bail;
-	}
+	ctx->gen.stats.commands++;
+	if (!ctx->num_in_progress)
+		ctx->gen.stats.round_trips++;
+	if (litplus && send_imap_lit( ctx, cmd ) < 0)
+		goto bail;
 	if (cmd->param.to_trash && ctx->trashnc == TrashUnknown)
 		ctx->trashnc = TrashChecking;
+	if (ctx->num_in_progress >= ctx->hash_size)
+		grow_cmd_hash( ctx );
+	hash_imap_cmd( ctx, cmd );
 	cmd->next = 0;
+	cmd->pprev = ctx->in_progress_append;
 	*ctx->in_progress_append = cmd;
 	ctx->in_progress_append = &cmd->next;
 	ctx->num_in_progress++;
+	socket_expect_read( &ctx->conn, 1 );
 	return 0;
 
   bail:
@@ -308,11 +519,11 @@ cmd_submittable( imap_store_t *ctx, struct imap_cmd *cmd )
 {
 	struct imap_cmd *cmdp;
 
-	return !ctx->conn.write_buf &&
+	return !socket_congested( &ctx->conn ) &&
 	       !(ctx->in_progress &&
 	         (cmdp = (struct imap_cmd *)((char *)ctx->in_progress_append -
 	                                     offsetof(struct imap_cmd, next)), 1) &&
-	         (cmdp->param.cont || cmdp->param.data)) &&
+	         (cmdp->param.cont || cmdp->param.data || cmdp->param.idle)) &&
 	       !(cmd->param.to_trash && ctx->trashnc == TrashChecking) &&
 	       ctx->num_in_progress < ((imap_store_conf_t *)ctx->gen.conf)->server->max_in_progress;
 }
@@ -355,6 +566,8 @@ cancel_submitted_imap_cmds( imap_store_t *ctx )
 	}
 }
 
+static void imap_end_idle( imap_store_t *ctx );
+
 static int
 submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 {
@@ -363,6 +576,8 @@ submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	assert( cmd );
 	assert( cmd->param.done );
 
+	if (ctx->idle_cmd && cmd != &ctx->idle_cmd->gen)
+		imap_end_idle( ctx );
 	if ((ctx->pending && !cmd->param.high_prio) || !cmd_submittable( ctx, cmd )) {
 		if (ctx->pending && cmd->param.high_prio) {
 			cmd->next = ctx->pending;
@@ -844,153 +1059,225 @@ parse_namespace_rsp_p3( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 	return LIST_OK;
 }
 
-static time_t
-parse_date( const char *str )
+static char *
+fetch_read_line( void *aux )
 {
-	char *end;
-	time_t date;
-	int hours, mins;
-	struct tm datetime;
+	imap_store_t *ctx = (imap_store_t *)aux;
+	char *s;
 
-	memset( &datetime, 0, sizeof(datetime) );
-	if (!(end = strptime( str, "%d-%b-%Y %H:%M:%S ", &datetime )))
-		return -1;
-	if ((date = timegm( &datetime )) == -1)
-		return -1;
-	if (sscanf( end, "%3d%2d", &hours, &mins ) != 2)
-		return -1;
-	return date - (hours * 60 + mins) * 60;
+	if ((s = socket_read_line( &ctx->conn )) && (DFlags & VERBOSE)) {
+		printf( "%s%s\n", ctx->label, s );
+		fflush( stdout );
+	}
+	return s;
 }
 
 static int
-parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
+fetch_read_direct( void *aux, char **buf, int len )
 {
-	list_t *tmp, *flags;
-	char *body = 0, *tuid = 0;
-	imap_message_t *cur;
-	msg_data_t *msgdata;
+	imap_store_t *ctx = (imap_store_t *)aux;
+	int n;
+
+	if ((n = socket_read_direct( &ctx->conn, buf, len )) && (DFlags & XVERBOSE))
+		fwrite( *buf, n, 1, stdout );
+	return n;
+}
+
+/* Let the BODY[] go directly to the sink of its command if possible. */
+static msg_sink_t *
+fetch_body_sink( void *aux, int uid, int len ATTR_UNUSED )
+{
+	imap_store_t *ctx = (imap_store_t *)aux;
 	struct imap_cmd *cmdp;
-	int uid = 0, mask = 0, status = 0, size = 0;
-	unsigned i;
-	time_t date = 0;
+	msg_sink_t *sink;
 
-	if (!is_list( list )) {
-		error( "IMAP error: bogus FETCH response\n" );
-		free_list( list );
-		return LIST_BAD;
-	}
+	if (!(cmdp = find_fetch_cmd( ctx, uid )) ||
+	    ((struct imap_cmd_fetch_msg *)cmdp)->msg_data->placeholder ||
+	    !(sink = ((struct imap_cmd_fetch_msg *)cmdp)->msg_data->sink))
+		return 0;
+	ctx->fetch_stream = cmdp;
+	return sink;
+}
 
-	for (tmp = list->child; tmp; tmp = tmp->next) {
-		if (is_atom( tmp )) {
-			if (!strcmp( "UID", tmp->val )) {
-				tmp = tmp->next;
-				if (is_atom( tmp ))
-					uid = atoi( tmp->val );
-				else
-					error( "IMAP error: unable to parse UID\n" );
-			} else if (!strcmp( "FLAGS", tmp->val )) {
-				tmp = tmp->next;
-				if (is_list( tmp )) {
-					for (flags = tmp->child; flags; flags = flags->next) {
-						if (is_atom( flags )) {
-							if (flags->val[0] == '\\') { /* ignore user-defined flags for now */
-								if (!strcmp( "Recent", flags->val + 1)) {
-									status |= M_RECENT;
-									goto flagok;
-								}
-								for (i = 0; i < as(Flags); i++)
-									if (!strcmp( Flags[i], flags->val + 1 )) {
-										mask |= 1 << i;
-										goto flagok;
-									}
-								if (flags->val[1] == 'X' && flags->val[2] == '-')
-									goto flagok; /* ignore system flag extensions */
-								error( "IMAP warning: unknown system flag %s\n", flags->val );
-							}
-						  flagok: ;
-						} else
-							error( "IMAP error: unable to parse FLAGS list\n" );
-					}
-					status |= M_FLAGS;
-				} else
-					error( "IMAP error: unable to parse FLAGS\n" );
-			} else if (!strcmp( "INTERNALDATE", tmp->val )) {
-				tmp = tmp->next;
-				if (is_atom( tmp )) {
-					if ((date = parse_date( tmp->val )) == -1)
-						error( "IMAP error: unable to parse INTERNALDATE format\n" );
-				} else
-					error( "IMAP error: unable to parse INTERNALDATE\n" );
-			} else if (!strcmp( "RFC822.SIZE", tmp->val )) {
-				tmp = tmp->next;
-				if (is_atom( tmp ))
-					size = atoi( tmp->val );
-				else
-					error( "IMAP error: unable to parse RFC822.SIZE\n" );
-			} else if (!strcmp( "BODY[]", tmp->val )) {
-				tmp = tmp->next;
-				if (is_atom( tmp )) {
-					body = tmp->val;
-					tmp->val = 0;       /* don't free together with list */
-					size = tmp->len;
-				} else
-					error( "IMAP error: unable to parse BODY[]\n" );
-			} else if (!strcmp( "BODY[HEADER.FIELDS", tmp->val )) {
-				tmp = tmp->next;
-				if (is_list( tmp )) {
-					tmp = tmp->next;
-					if (!is_atom( tmp ) || strcmp( tmp->val, "]" ))
-						goto bfail;
-					tmp = tmp->next;
-					if (!is_atom( tmp ))
-						goto bfail;
-					if (starts_with( tmp->val, tmp->len, "X-TUID: ", 8 ))
-						tuid = tmp->val + 8;
-				} else {
-				  bfail:
-					error( "IMAP error: unable to parse BODY[HEADER.FIELDS ...]\n" );
-				}
-			}
+static int
+parse_fetch_rsp( imap_store_t *ctx )
+{
+	fetch_parser_t *fp = &ctx->fetch_sts;
+	imap_message_t *cur;
+	msg_data_t *msgdata;
+	struct imap_cmd *cmdp;
+	char *p;
+
+	if (ctx->idle_cmd) {
+		/* There is no load to attach the data to. */
+		free( fp->body );
+		fp->body = 0;
+		return LIST_OK;
+	}
+	if (fp->got_body) {
+		if (!(cmdp = find_fetch_cmd( ctx, fp->uid ))) {
+			error( "IMAP error: unexpected FETCH response (UID %d)\n", fp->uid );
+			free( fp->body );
+			fp->body = 0;
+			return LIST_BAD;
 		}
-	}
-
-	if (body) {
-		for (cmdp = ctx->in_progress; cmdp; cmdp = cmdp->next)
-			if (cmdp->param.uid == uid)
-				goto gotuid;
-		error( "IMAP error: unexpected FETCH response (UID %d)\n", uid );
-		free_list( list );
-		return LIST_BAD;
-	  gotuid:
 		msgdata = ((struct imap_cmd_fetch_msg *)cmdp)->msg_data;
-		msgdata->data = body;
-		msgdata->len = size;
-		msgdata->date = date;
-		if (status & M_FLAGS)
-			msgdata->flags = mask;
-	} else if (uid) { /* ignore async flag updates for now */
-		/* XXX this will need sorting for out-of-order (multiple queries) */
-		cur = nfcalloc( sizeof(*cur) );
+		if (msgdata->placeholder) {
+			/* The "body" is just the header. */
+			p = make_placeholder( fp->body, fp->body_len, fp->bstruct, fp->size, &fp->body_len );
+			free( fp->body );
+			fp->body = p;
+		}
+		if (ctx->fetch_stream) {
+			free( fp->body );
+			if (ctx->fetch_stream != cmdp) {
+				error( "IMAP error: streamed FETCH response has wrong UID %d\n", fp->uid );
+				fp->body = 0;
+				return LIST_BAD;
+			}
+		} else if (msgdata->sink) {
+			msgdata->sink->write( msgdata->sink, fp->body, fp->body_len );
+			free( fp->body );
+		} else {
+			msgdata->data = fp->body;
+		}
+		fp->body = 0;
+		msgdata->len = fp->body_len;
+		msgdata->date = fp->date;
+		if (fp->status & M_FLAGS)
+			msgdata->flags = fp->flags;
+	} else if (fp->uid) { /* ignore async flag updates for now */
+		/* Responses to multiple queries may be interleaved; imap_load_p2() sorts them. */
+		if (fp->uid <= ctx->msgs_maxuid)
+			ctx->msgs_unsorted = 1;
+		else
+			ctx->msgs_maxuid = fp->uid;
+		cur = pool_alloc( &ctx->gen.msg_pool, sizeof(*cur) );
+		memset( cur, 0, sizeof(*cur) );
 		*ctx->msgapp = &cur->gen;
 		ctx->msgapp = &cur->gen.next;
 		cur->gen.next = 0;
-		cur->gen.uid = uid;
-		cur->gen.flags = mask;
-		cur->gen.status = status;
-		cur->gen.size = size;
+		cur->gen.uid = fp->uid;
+		cur->gen.flags = fp->flags;
+		cur->gen.status = fp->status;
+		cur->gen.size = fp->size;
 		cur->gen.srec = 0;
-		if (tuid)
-			strncpy( cur->gen.tuid, tuid, TUIDL );
+		if (fp->got_tuid)
+			memcpy( cur->gen.tuid, fp->tuid, TUIDL );
 		else
 			cur->gen.tuid[0] = 0;
-		if (ctx->gen.uidnext <= uid) /* in case the server sends no UIDNEXT */
-			ctx->gen.uidnext = uid + 1;
+		if (fp->got_msgid) {
+			cur->gen.msgid = pool_alloc( &ctx->gen.msg_pool, strlen( fp->msgid ) + 1 );
+			strcpy( cur->gen.msgid, fp->msgid );
+		}
+		if (ctx->gen.uidnext <= fp->uid) /* in case the server sends no UIDNEXT */
+			ctx->gen.uidnext = fp->uid + 1;
 	}
-
-	free_list( list );
 	return LIST_OK;
 }
 
+static int
+parse_fetch_continue( imap_store_t *ctx, char *s )
+{
+	int ret;
+
+	switch (fetch_parse( &ctx->fetch_sts, s )) {
+	case FETCH_PARTIAL:
+		return LIST_PARTIAL;
+	case FETCH_BAD:
+		return LIST_BAD;
+	}
+	ret = parse_fetch_rsp( ctx );
+	free( ctx->fetch_sts.bstruct );
+	ctx->fetch_sts.bstruct = 0;
+	return ret;
+}
+
+static int
+parse_fetch( imap_store_t *ctx, char *s )
+{
+	fetch_parser_t *fp = &ctx->fetch_sts;
+
+	if (!s) {
+		error( "IMAP error: bogus FETCH response\n" );
+		return LIST_BAD;
+	}
+	fetch_parser_init( fp );
+	fp->read_line = fetch_read_line;
+	fp->read_direct = fetch_read_direct;
+	fp->body_sink = fetch_body_sink;
+	fp->aux = ctx;
+	ctx->fetch_stream = 0;
+	return parse_fetch_continue( ctx, s );
+}
+
+static int
+parse_vanished_rsp( imap_store_t *ctx, char *s )
+{
+	char *arg;
+	int lo, hi, tmp;
+
+	if ((arg = next_arg( &s )) && !strcmp( "(EARLIER)", arg ))
+		arg = next_arg( &s );
+	if (!arg)
+		goto bad;
+	if (!ctx->changed_maxuid)
+		return 0; /* we don't track expunges otherwise */
+	for (;;) {
+		if ((lo = strtol( arg, &arg, 10 )) <= 0)
+			goto bad;
+		hi = lo;
+		if (*arg == ':') {
+			if ((hi = strtol( arg + 1, &arg, 10 )) <= 0)
+				goto bad;
+			if (hi < lo) {
+				tmp = hi;
+				hi = lo;
+				lo = tmp;
+			}
+		}
+		if (ctx->nvanished == ctx->avanished) {
+			ctx->avanished = ctx->avanished * 2 + 50;
+			ctx->vanished = nfrealloc( ctx->vanished, ctx->avanished * 2 * sizeof(int) );
+		}
+		ctx->vanished[ctx->nvanished * 2] = lo;
+		ctx->vanished[ctx->nvanished * 2 + 1] = hi;
+		ctx->nvanished++;
+		if (!*arg)
+			return 0;
+		if (*arg++ != ',')
+			goto bad;
+	}
+
+  bad:
+	error( "IMAP error: malformed VANISHED response\n" );
+	return -1;
+}
+
+static void
+parse_search_rsp( imap_store_t *ctx, char *s )
+{
+	char *arg;
+	int uid;
+
+	while ((arg = next_arg( &s )))
+		if ((uid = atoi( arg )) > 0 && uid < ctx->search_min)
+			ctx->search_min = uid;
+}
+
+static void
+parse_esearch_rsp( imap_store_t *ctx, char *s )
+{
+	char *arg;
+	int uid;
+
+	/* We ask only for the MIN, so the tag correlator and UID marker can be skipped. */
+	while ((arg = next_arg( &s )))
+		if (!strcmp( "MIN", arg ) && (arg = next_arg( &s )) &&
+		    (uid = atoi( arg )) > 0 && uid < ctx->search_min)
+			ctx->search_min = uid;
+}
+
 static void
 parse_capability( imap_store_t *ctx, char *cmd )
 {
@@ -1013,6 +1300,34 @@ parse_capability( imap_store_t *ctx, char *cmd )
 		add_string_list( &ctx->auth_mechs, "LOGIN" );
 }
 
+static void imap_multiappend_p2( imap_store_t *, struct imap_cmd *, int );
+
+/* Distribute the UIDs from a MULTIAPPEND's APPENDUID response code,
+ * which come in the order of the messages. */
+static int
+parse_append_uids( struct imap_cmd_multiappend *cmd, char *s )
+{
+	int i, uid, last;
+
+	for (i = 0; ; s++) {
+		if (!(uid = strtol( s, &s, 10 )))
+			return -1;
+		last = uid;
+		if (*s == ':' && !(last = strtol( s + 1, &s, 10 )))
+			return -1;
+		if (last < uid)
+			return -1;
+		for (; uid <= last; uid++) {
+			if (i == cmd->nmsgs)
+				return -1;
+			cmd->msgs[i++].uid = uid;
+		}
+		if (*s != ',')
+			break;
+	}
+	return (*s || i != cmd->nmsgs) ? -1 : 0;
+}
+
 static int
 parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 {
@@ -1041,6 +1356,15 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 			error( "IMAP error: malformed NEXTUID status\n" );
 			return RESP_CANCEL;
 		}
+	} else if (!strcmp( "HIGHESTMODSEQ", arg )) {
+		if (!(arg = next_arg( &s )) ||
+		    (ctx->gen.highestmodseq = strtoull( arg, &earg, 10 ), *earg))
+		{
+			error( "IMAP error: malformed HIGHESTMODSEQ status\n" );
+			return RESP_CANCEL;
+		}
+	} else if (!strcmp( "NOMODSEQ", arg )) {
+		ctx->gen.highestmodseq = 0;
 	} else if (!strcmp( "CAPABILITY", arg )) {
 		parse_capability( ctx, s );
 	} else if (!strcmp( "ALERT", arg )) {
@@ -1053,7 +1377,9 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 		if (!(arg = next_arg( &s )) ||
 		    (ctx->gen.uidvalidity = strtoll( arg, &earg, 10 ), *earg) ||
 		    !(arg = next_arg( &s )) ||
-		    !(((struct imap_cmd_out_uid *)cmd)->out_uid = atoi( arg )))
+		    (cmd->param.done == imap_multiappend_p2 ?
+		         parse_append_uids( (struct imap_cmd_multiappend *)cmd, arg ) < 0 :
+		         !(((struct imap_cmd_out_uid *)cmd)->out_uid = atoi( arg ))))
 		{
 			error( "IMAP error: malformed APPENDUID status\n" );
 			return RESP_CANCEL;
@@ -1142,6 +1468,91 @@ parse_list_rsp_p2( imap_store_t *ctx, list_t *list, char *cmd ATTR_UNUSED )
 	return LIST_OK;
 }
 
+static void
+set_box_status( imap_store_t *ctx, const char *name, const char *fp )
+{
+	string_list_t *ent, **entp;
+	int nl = strlen( name ), fl = strlen( fp );
+
+	for (entp = &ctx->box_status; (ent = *entp); entp = &ent->next)
+		if (!strcmp( ent->string, name )) {
+			*entp = ent->next;
+			free( ent );
+			break;
+		}
+	ent = nfmalloc( sizeof(*ent) + nl + 1 + fl );
+	memcpy( ent->string, name, nl + 1 );
+	memcpy( ent->string + nl + 1, fp, fl + 1 );
+	ent->next = ctx->box_status;
+	ctx->box_status = ent;
+}
+
+/* Each result is used only once, as it becomes stale. */
+static char *
+take_box_status( imap_store_t *ctx, const char *name )
+{
+	string_list_t *ent, **entp;
+	char *fp;
+
+	for (entp = &ctx->box_status; (ent = *entp); entp = &ent->next)
+		if (!strcmp( ent->string, name )) {
+			*entp = ent->next;
+			fp = nfstrdup( ent->string + strlen( ent->string ) + 1 );
+			free( ent );
+			return fp;
+		}
+	return 0;
+}
+
+static int
+parse_status_rsp_p2( imap_store_t *ctx, list_t *list, char *cmd ATTR_UNUSED )
+{
+	list_t *tmp;
+	char *fp;
+	int uidvalidity = 0, uidnext = 0, messages = -1;
+	uint64_t modseq = 0;
+
+	if (!is_list( list )) {
+		error( "IMAP error: malformed STATUS response\n" );
+		free_list( list );
+		return LIST_BAD;
+	}
+	for (tmp = list->child; tmp && tmp->next; tmp = tmp->next->next) {
+		if (!is_atom( tmp ) || !is_atom( tmp->next ))
+			continue;
+		if (!strcasecmp( tmp->val, "UIDVALIDITY" ))
+			uidvalidity = atoi( tmp->next->val );
+		else if (!strcasecmp( tmp->val, "UIDNEXT" ))
+			uidnext = atoi( tmp->next->val );
+		else if (!strcasecmp( tmp->val, "MESSAGES" ))
+			messages = atoi( tmp->next->val );
+		else if (!strcasecmp( tmp->val, "HIGHESTMODSEQ" ))
+			modseq = strtoull( tmp->next->val, 0, 10 );
+	}
+	free_list( list );
+	/* A zero HIGHESTMODSEQ means that the mailbox has no persistent mod-sequences. */
+	if (uidvalidity && uidnext && messages >= 0 && modseq) {
+		nfasprintf( &fp, "%d %d %d %" PRIu64, uidvalidity, uidnext, messages, modseq );
+		set_box_status( ctx, ctx->status_box, fp );
+		free( fp );
+	}
+	return LIST_OK;
+}
+
+static int
+parse_status_rsp( imap_store_t *ctx, list_t *list, char *cmd )
+{
+	if (!is_atom( list )) {
+		error( "IMAP error: malformed STATUS response\n" );
+		free_list( list );
+		return LIST_BAD;
+	}
+	free( ctx->status_box );
+	ctx->status_box = nfstrdup( list->val );
+	free_list( list );
+	return parse_list( ctx, cmd, parse_status_rsp_p2 );
+}
+
 static int
 prepare_name( char **buf, const imap_store_t *ctx, const char *prefix, const char *name )
 {
@@ -1182,17 +1593,36 @@ struct imap_cmd_trycreate {
 
 static void imap_open_store_greeted( imap_store_t * );
 static void get_cmd_result_p2( imap_store_t *, struct imap_cmd *, int );
+static int imap_send_done( imap_store_t * );
+static void imap_idle_renew( void * );
 
 static void
 imap_socket_read( void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)aux;
-	struct imap_cmd *cmdp, **pcmdp;
+	struct imap_cmd *cmdp;
 	char *cmd, *arg, *arg1, *p;
 	int resp, resp2, tag, greeted;
 
 	greeted = ctx->greeting;
 	for (;;) {
+		if (ctx->idle_changed) {
+			ctx->idle_changed = 0;
+			if (ctx->idle_cmd && ctx->idle_cmd->callback) {
+				void (*cb)( int sts, void *aux ) = ctx->idle_cmd->callback;
+				void *cb_aux = ctx->idle_cmd->callback_aux;
+
+				ctx->idle_cmd->callback = 0;
+				imap_ref( ctx );
+				cb( DRV_OK, cb_aux );
+				if (imap_deref( ctx ))
+					return;
+			}
+		}
+		if (ctx->fetch_sts.level) {
+			resp = parse_fetch_continue( ctx, 0 );
+			goto listret;
+		}
 		if (ctx->parse_list_sts.level) {
 			resp = parse_list_continue( ctx, 0 );
 		  listret:
@@ -1238,13 +1668,36 @@ imap_socket_read( void *aux )
 			} else if (!strcmp( "LIST", arg )) {
 				resp = parse_list( ctx, cmd, parse_list_rsp );
 				goto listret;
+			} else if (!strcmp( "STATUS", arg )) {
+				resp = parse_list( ctx, cmd, parse_status_rsp );
+				goto listret;
+			} else if (!strcmp( "ENABLED", arg )) {
+				while ((arg = next_arg( &cmd )))
+					if (!strcmp( "QRESYNC", arg ))
+						ctx->qresync = 1;
+			} else if (!strcmp( "SEARCH", arg )) {
+				parse_search_rsp( ctx, cmd );
+			} else if (!strcmp( "ESEARCH", arg )) {
+				parse_esearch_rsp( ctx, cmd );
+			} else if (!strcmp( "VANISHED", arg )) {
+				if (ctx->idle_cmd)
+					ctx->idle_changed = 1;
+				else if (parse_vanished_rsp( ctx, cmd ) < 0)
+					break;
 			} else if ((arg1 = next_arg( &cmd ))) {
-				if (!strcmp( "EXISTS", arg1 ))
+				if (!strcmp( "EXISTS", arg1 )) {
+					if (ctx->idle_cmd && atoi( arg ) != ctx->gen.count)
+						ctx->idle_changed = 1;
 					ctx->gen.count = atoi( arg );
-				else if (!strcmp( "RECENT", arg1 ))
+				} else if (!strcmp( "RECENT", arg1 )) {
 					ctx->gen.recent = atoi( arg );
-				else if(!strcmp ( "FETCH", arg1 )) {
-					resp = parse_list( ctx, cmd, parse_fetch_rsp );
+				} else if (!strcmp( "EXPUNGE", arg1 )) {
+					if (ctx->idle_cmd)
+						ctx->idle_changed = 1;
+				} else if(!strcmp ( "FETCH", arg1 )) {
+					if (ctx->idle_cmd)
+						ctx->idle_changed = 1;
+					resp = parse_fetch( ctx, cmd );
 					goto listret;
 				}
 			} else {
@@ -1252,6 +1705,7 @@ imap_socket_read( void *aux )
 				break; /* this may mean anything, so prefer not to spam the log */
 			}
 			if (greeted == GreetingPending) {
+				socket_expect_read( &ctx->conn, 0 );
 				imap_ref( ctx );
 				imap_open_store_greeted( ctx );
 				if (imap_deref( ctx ))
@@ -1264,34 +1718,45 @@ imap_socket_read( void *aux )
 		} else if (*arg == '+') {
 			/* This can happen only with the last command underway, as
 			   it enforces a round-trip. */
-			cmdp = ctx->in_progress;
-			if (cmdp->param.data) {
+			cmdp = (struct imap_cmd *)((char *)ctx->in_progress_append -
+			                           offsetof(struct imap_cmd, next));
+			if (cmdp->param.idle) {
+				if (ctx->idling == IdleEnding) {
+					/* Somebody wanted the connection back before the IDLE even started. */
+					if (imap_send_done( ctx ) < 0)
+						return;
+				} else {
+					ctx->idling = IdleRunning;
+					socket_expect_read( &ctx->conn, 0 );
+					conf_wakeup( &ctx->idle_timer, IDLE_RENEW * 1000 );
+				}
+			} else if (cmdp->param.data) {
 				if (cmdp->param.to_trash)
 					ctx->trashnc = TrashKnown; /* Can't get NO [TRYCREATE] any more. */
-				p = cmdp->param.data;
-				cmdp->param.data = 0;
-				if (socket_write( &ctx->conn, p, cmdp->param.data_len, GiveOwn ) < 0)
+				if (send_imap_lit( ctx, cmdp ) < 0)
 					return;
 			} else if (cmdp->param.cont) {
 				if (cmdp->param.cont( ctx, cmdp, cmd ))
 					return;
+				if (socket_write( &ctx->conn, "\r\n", 2, KeepOwn ) < 0)
+					return;
 			} else {
 				error( "IMAP error: unexpected command continuation request\n" );
 				break;
 			}
-			if (socket_write( &ctx->conn, "\r\n", 2, KeepOwn ) < 0)
-				return;
 		} else {
 			tag = atoi( arg );
-			for (pcmdp = &ctx->in_progress; (cmdp = *pcmdp); pcmdp = &cmdp->next)
-				if (cmdp->tag == tag)
-					goto gottag;
-			error( "IMAP error: unexpected tag %s\n", arg );
-			break;
-		  gottag:
-			if (!(*pcmdp = cmdp->next))
-				ctx->in_progress_append = pcmdp;
-			ctx->num_in_progress--;
+			if (!(cmdp = find_tagged_cmd( ctx, tag ))) {
+				error( "IMAP error: unexpected tag %s\n", arg );
+				break;
+			}
+			unhash_imap_cmd( ctx, cmdp );
+			if (!(*cmdp->pprev = cmdp->next))
+				ctx->in_progress_append = cmdp->pprev;
+			else
+				cmdp->next->pprev = cmdp->pprev;
+			if (!--ctx->num_in_progress)
+				socket_expect_read( &ctx->conn, 0 );
 			arg = next_arg( &cmd );
 			if (!arg) {
 				error( "IMAP error: malformed tagged response\n" );
@@ -1364,6 +1829,9 @@ get_cmd_result_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
 
 /******************* imap_cancel_store *******************/
 
+static void imap_cancel_flags( imap_store_t *ctx );
+static void imap_cancel_appends( imap_store_t *ctx );
+
 static void
 imap_cancel_store( store_t *gctx )
 {
@@ -1373,10 +1841,19 @@ imap_cancel_store( store_t *gctx )
 	sasl_dispose( &ctx->sasl );
 #endif
 	socket_close( &ctx->conn );
+	wipe_wakeup( &ctx->idle_timer );
 	cancel_submitted_imap_cmds( ctx );
+	imap_cancel_flags( ctx );
+	imap_cancel_appends( ctx );
 	cancel_pending_imap_cmds( ctx );
-	free_generic_messages( ctx->gen.msgs );
+	free_generic_messages( &ctx->gen );
 	free_string_list( ctx->gen.boxes );
+	free_string_list( ctx->box_status );
+	free( ctx->status_box );
+	free( ctx->fetch_sts.body );
+	free( ctx->fetch_sts.bstruct );
+	free( ctx->tag_hash );
+	free( ctx->uid_hash );
 	free_list( ctx->ns_personal );
 	free_list( ctx->ns_other );
 	free_list( ctx->ns_shared );
@@ -1421,8 +1898,7 @@ imap_cancel_unowned( void *gctx )
 static void
 imap_disown_store( store_t *gctx )
 {
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
+	free_generic_messages( gctx );
 	set_bad_callback( gctx, imap_cancel_unowned, gctx );
 	gctx->next = unowned;
 	unowned = gctx;
@@ -1467,6 +1943,12 @@ static void imap_open_store_authenticate_p3( imap_store_t *, struct imap_cmd *,
 #endif
 static void imap_open_store_authenticate2( imap_store_t * );
 static void imap_open_store_authenticate2_p2( imap_store_t *, struct imap_cmd *, int );
+static void imap_open_store_compress( imap_store_t * );
+#ifdef HAVE_LIBZ
+static void imap_open_store_compress_p2( imap_store_t *, struct imap_cmd *, int );
+#endif
+static void imap_open_store_enable( imap_store_t * );
+static void imap_open_store_enable_p2( imap_store_t *, struct imap_cmd *, int );
 static void imap_open_store_namespace( imap_store_t * );
 static void imap_open_store_namespace_p2( imap_store_t *, struct imap_cmd *, int );
 static void imap_open_store_namespace2( imap_store_t * );
@@ -1501,6 +1983,8 @@ imap_open_store( store_conf_t *conf, const char *label,
 			free_string_list( ctx->gen.boxes );
 			ctx->gen.boxes = 0;
 			ctx->gen.listed = 0;
+			free_string_list( ctx->box_status );
+			ctx->box_status = 0;
 			ctx->gen.conf = conf;
 			free( ctx->delimiter );
 			ctx->delimiter = 0;
@@ -1520,10 +2004,13 @@ imap_open_store( store_conf_t *conf, const char *label,
 	set_bad_callback( &ctx->gen, (void (*)(void *))imap_open_store_bail, ctx );
 	ctx->in_progress_append = &ctx->in_progress;
 	ctx->pending_append = &ctx->pending;
+	init_wakeup( &ctx->idle_timer, imap_idle_renew, ctx );
 
 	socket_init( &ctx->conn, &srvc->sconf,
 	             (void (*)( void * ))imap_invoke_bad_callback,
 	             imap_socket_read, (int (*)(void *))flush_imap_cmds, ctx );
+	ctx->conn.stats = &ctx->gen.stats;
+	ctx->setup_mark = get_usecs();
 	socket_connect( &ctx->conn, imap_open_store_connected );
 }
 
@@ -1535,12 +2022,21 @@ imap_open_store_connected( int ok, void *aux )
 	imap_store_conf_t *cfg = (imap_store_conf_t *)ctx->gen.conf;
 	imap_server_conf_t *srvc = cfg->server;
 #endif
+	uint64_t now;
 
-	if (!ok)
+	if (!ok) {
 		imap_open_store_bail( ctx );
+		return;
+	}
+	now = get_usecs();
+	ctx->gen.stats.connect_us = now - ctx->setup_mark;
+	ctx->setup_mark = now;
+	socket_expect_read( &ctx->conn, 1 ); /* the greeting */
 #ifdef HAVE_LIBSSL
-	else if (srvc->ssl_type == SSL_IMAPS)
+	if (srvc->ssl_type == SSL_IMAPS) {
+		ctx->tls_mark = now;
 		socket_start_tls( &ctx->conn, imap_open_store_tlsstarted1 );
+	}
 #endif
 }
 
@@ -1552,6 +2048,8 @@ imap_open_store_tlsstarted1( int ok, void *aux )
 
 	if (!ok)
 		imap_open_store_ssl_bail( ctx );
+	else
+		ctx->gen.stats.tls_us += get_usecs() - ctx->tls_mark;
 }
 #endif
 
@@ -1609,7 +2107,7 @@ imap_open_store_authenticate( imap_store_t *ctx )
 			return;
 		}
 #endif
-		imap_open_store_namespace( ctx );
+		imap_open_store_compress( ctx );
 	}
 }
 
@@ -1619,8 +2117,10 @@ imap_open_store_authenticate_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UN
 {
 	if (response == RESP_NO)
 		imap_open_store_bail( ctx );
-	else if (response == RESP_OK)
+	else if (response == RESP_OK) {
+		ctx->tls_mark = get_usecs();
 		socket_start_tls( &ctx->conn, imap_open_store_tlsstarted2 );
+	}
 }
 
 static void
@@ -1628,10 +2128,12 @@ imap_open_store_tlsstarted2( int ok, void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)aux;
 
-	if (!ok)
+	if (!ok) {
 		imap_open_store_ssl_bail( ctx );
-	else
+	} else {
+		ctx->gen.stats.tls_us += get_usecs() - ctx->tls_mark;
 		imap_exec( ctx, 0, imap_open_store_authenticate_p3, "CAPABILITY" );
+	}
 }
 
 static void
@@ -1970,7 +2472,55 @@ imap_open_store_authenticate2_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_U
 	if (response == RESP_NO)
 		imap_open_store_bail( ctx );
 	else if (response == RESP_OK)
-		imap_open_store_namespace( ctx );
+		imap_open_store_compress( ctx );
+}
+
+static void
+imap_open_store_compress( imap_store_t *ctx )
+{
+#ifdef HAVE_LIBZ
+	imap_store_conf_t *cfg = (imap_store_conf_t *)ctx->gen.conf;
+
+	/* Nothing else may be in flight, as the response switches the stream. */
+	if (cfg->server->compress && CAP(COMPRESS_DEFLATE)) {
+		imap_exec( ctx, 0, imap_open_store_compress_p2, "COMPRESS DEFLATE" );
+		return;
+	}
+#endif
+	imap_open_store_enable( ctx );
+}
+
+#ifdef HAVE_LIBZ
+static void
+imap_open_store_compress_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
+{
+	if (response == RESP_NO) {
+		/* We just go on uncompressed. */
+		imap_open_store_enable( ctx );
+	} else if (response == RESP_OK) {
+		if (socket_start_deflate( &ctx->conn ) < 0)
+			imap_open_store_bail( ctx );
+		else
+			imap_open_store_enable( ctx );
+	}
+}
+#endif
+
+static void
+imap_open_store_enable( imap_store_t *ctx )
+{
+	if (CAP(QRESYNC))
+		imap_exec( ctx, 0, imap_open_store_enable_p2, "ENABLE QRESYNC" );
+	else
+		imap_open_store_namespace( ctx );
+}
+
+static void
+imap_open_store_enable_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
+{
+	/* Failure is not fatal - we just won't sync incrementally. */
+	if (response != RESP_CANCEL)
+		imap_open_store_namespace( ctx );
 }
 
 static void
@@ -2028,6 +2578,11 @@ static void
 imap_open_store_finalize( imap_store_t *ctx )
 {
 	set_bad_callback( &ctx->gen, 0, 0 );
+	if (ctx->setup_mark) {
+		/* The remainder of the set-up is the greeting and the login. */
+		ctx->gen.stats.auth_us = get_usecs() - ctx->setup_mark - ctx->gen.stats.tls_us;
+		ctx->setup_mark = 0;
+	}
 	if (!ctx->prefix)
 		ctx->prefix = "";
 	ctx->trashnc = TrashUnknown;
@@ -2053,6 +2608,55 @@ imap_open_store_bail( imap_store_t *ctx )
 	cb( 0, aux );
 }
 
+/******************* imap_box_fingerprint *******************/
+
+static void imap_box_fingerprint_p2( imap_store_t *, struct imap_cmd *, int );
+
+static void
+imap_box_fingerprint( store_t *gctx, const char *name,
+                      void (*cb)( int sts, const char *fp, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_fingerprint *cmd;
+	char *buf, *fp;
+
+	/* Without mod-sequences, flag changes would go unnoticed. */
+	if (!CAP(CONDSTORE) && !CAP(QRESYNC)) {
+		cb( DRV_OK, 0, aux );
+		return;
+	}
+	ctx->name = name;
+	if (prepare_box( &buf, ctx ) < 0) {
+		cb( DRV_OK, 0, aux );
+		return;
+	}
+	if ((fp = take_box_status( ctx, buf ))) {
+		/* From a LIST-STATUS. */
+		free( buf );
+		cb( DRV_OK, fp, aux );
+		free( fp );
+		return;
+	}
+	INIT_IMAP_CMD(imap_cmd_fingerprint, cmd, cb, aux)
+	cmd->box = buf;
+	imap_exec( ctx, &cmd->gen, imap_box_fingerprint_p2,
+	           "STATUS \"%\\s\" (UIDVALIDITY UIDNEXT MESSAGES HIGHESTMODSEQ)", buf );
+}
+
+static void
+imap_box_fingerprint_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_fingerprint *cmd = (struct imap_cmd_fingerprint *)gcmd;
+	char *fp;
+
+	fp = take_box_status( ctx, cmd->box );
+	free( cmd->box );
+	/* A missing mailbox is not an error here. */
+	cmd->callback( response == RESP_CANCEL ? DRV_CANCELED : DRV_OK,
+	               response == RESP_OK ? fp : 0, cmd->callback_aux );
+	free( fp );
+}
+
 /******************* imap_prepare_opts *******************/
 
 static void
@@ -2071,9 +2675,10 @@ imap_select( store_t *gctx, const char *name, int create,
 	struct imap_cmd_simple *cmd;
 	char *buf;
 
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
+	free_generic_messages( gctx );
 	ctx->msgapp = &gctx->msgs;
+	ctx->msgs_maxuid = 0;
+	ctx->msgs_unsorted = 0;
 
 	ctx->name = name;
 	if (prepare_box( &buf, ctx ) < 0) {
@@ -2082,6 +2687,7 @@ imap_select( store_t *gctx, const char *name, int create,
 	}
 
 	ctx->gen.uidnext = 0;
+	ctx->gen.highestmodseq = 0;
 
 	INIT_IMAP_CMD(imap_cmd_simple, cmd, cb, aux)
 	cmd->gen.param.create = create;
@@ -2091,23 +2697,82 @@ imap_select( store_t *gctx, const char *name, int create,
 	free( buf );
 }
 
+/******************* imap_find_since *******************/
+
+static size_t
+my_strftime( char *s, size_t max, const char *fmt, const struct tm *tm )
+{
+    return strftime( s, max, fmt, tm );
+}
+
+static void imap_find_since_p2( imap_store_t *, struct imap_cmd *, int );
+
+static void
+imap_find_since( store_t *gctx, time_t since,
+                 void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_out_uid *cmd;
+	char buf[16];
+
+	/* SINCE has only a granularity of days, and is evaluated in the server's
+	 * time zone, so go back one more day to be on the safe side. */
+	since -= 24 * 60 * 60;
+	my_strftime( buf, sizeof(buf), "%d-%b-%Y", gmtime( &since ) );
+	ctx->search_min = INT_MAX;
+	INIT_IMAP_CMD(imap_cmd_out_uid, cmd, cb, aux)
+	imap_exec( ctx, &cmd->gen, imap_find_since_p2,
+	           CAP(ESEARCH) ? "UID SEARCH RETURN (MIN) SINCE %s" : "UID SEARCH SINCE %s", buf );
+}
+
+static void
+imap_find_since_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_out_uid *cmd = (struct imap_cmd_out_uid *)gcmd;
+
+	transform_box_response( &response );
+	cmd->callback( response, ctx->search_min, cmd->callback_aux );
+}
+
 /******************* imap_load *******************/
 
-static int imap_submit_load( imap_store_t *, const char *, int, struct imap_cmd_refcounted_state * );
+static int imap_submit_load( imap_store_t *, const char *, int, const char *, struct imap_cmd_refcounted_state * );
+static void imap_load_p2( int sts, void *aux );
 
 static void
 imap_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
            void (*cb)( int sts, void *aux ), void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
-	int i, j, bl;
-	char buf[1000];
+	int i, j, bl, cmaxuid, hdruid;
+	char buf[1000], mbuf[64];
 
 	if (!ctx->gen.count) {
 		free( excs );
+		free( ctx->gen.known );
+		ctx->gen.known = 0;
 		cb( DRV_OK, aux );
 	} else {
-		struct imap_cmd_refcounted_state *sts = imap_refcounted_new_state( cb, aux );
+		struct imap_cmd_refcounted_state *sts = imap_refcounted_new_state( imap_load_p2, ctx );
+
+		ctx->load_callback = cb;
+		ctx->load_callback_aux = aux;
+		cmaxuid = 0;
+		if (ctx->gen.changedsince && ctx->qresync && ctx->gen.nknown) {
+			cmaxuid = ctx->gen.known[ctx->gen.nknown - 1].uid;
+			if (cmaxuid > maxuid)
+				cmaxuid = maxuid;
+			if ((ctx->gen.opts & OPEN_FIND) && cmaxuid >= newuid)
+				cmaxuid = newuid - 1;
+			if (cmaxuid >= minuid) {
+				ctx->changed_minuid = minuid;
+				ctx->changed_maxuid = cmaxuid;
+			}
+		}
+		if (!ctx->changed_maxuid) {
+			free( ctx->gen.known );
+			ctx->gen.known = 0;
+		}
 
 		sort_ints( excs, nexcs );
 		for (i = 0; i < nexcs; ) {
@@ -2120,23 +2785,36 @@ imap_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nex
 				if (i != j)
 					bl += sprintf( buf + bl, ":%d", excs[i] );
 			}
-			if (imap_submit_load( ctx, buf, 0, sts ) < 0)
+			if (imap_submit_load( ctx, buf, 0, "", sts ) < 0)
 				goto done;
 		}
+		if (ctx->changed_maxuid) {
+			sprintf( buf, "%d:%d", minuid, cmaxuid );
+			sprintf( mbuf, " (CHANGEDSINCE %" PRIu64 " VANISHED)", ctx->gen.changedsince );
+			if (imap_submit_load( ctx, buf, 0, mbuf, sts ) < 0)
+				goto done;
+			minuid = cmaxuid + 1;
+		}
 		if (maxuid == INT_MAX)
 			maxuid = ctx->gen.uidnext ? ctx->gen.uidnext - 1 : 1000000000;
 		if (maxuid >= minuid) {
-			if ((ctx->gen.opts & OPEN_FIND) && minuid < newuid) {
-				sprintf( buf, "%d:%d", minuid, newuid - 1 );
-				if (imap_submit_load( ctx, buf, 0, sts ) < 0)
+			/* The header fields are fetched only for the messages which need them. */
+			hdruid = INT_MAX;
+			if (ctx->gen.opts & OPEN_FIND)
+				hdruid = newuid;
+			if ((ctx->gen.opts & OPEN_MSGID) && ctx->gen.minnewuid < hdruid)
+				hdruid = ctx->gen.minnewuid;
+			if (hdruid != INT_MAX && minuid < hdruid) {
+				sprintf( buf, "%d:%d", minuid, hdruid - 1 );
+				if (imap_submit_load( ctx, buf, 0, "", sts ) < 0)
 					goto done;
-				if (newuid > maxuid)
+				if (hdruid > maxuid)
 					goto done;
-				sprintf( buf, "%d:%d", newuid, maxuid );
+				sprintf( buf, "%d:%d", hdruid, maxuid );
 			} else {
 				sprintf( buf, "%d:%d", minuid, maxuid );
 			}
-			imap_submit_load( ctx, buf, (ctx->gen.opts & OPEN_FIND), sts );
+			imap_submit_load( ctx, buf, hdruid != INT_MAX, "", sts );
 		}
 	  done:
 		free( excs );
@@ -2145,13 +2823,142 @@ imap_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nex
 }
 
 static int
-imap_submit_load( imap_store_t *ctx, const char *buf, int tuids, struct imap_cmd_refcounted_state *sts )
+imap_submit_load( imap_store_t *ctx, const char *buf, int hdrs, const char *mods, struct imap_cmd_refcounted_state *sts )
 {
+	/* The X-TUID is needed along with the Message-ID to tell the size of the message without it. */
 	return imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
-	                  "UID FETCH %s (UID%s%s%s)", buf,
+	                  "UID FETCH %s (UID%s%s%s)%s", buf,
 	                  (ctx->gen.opts & OPEN_FLAGS) ? " FLAGS" : "",
 	                  (ctx->gen.opts & OPEN_SIZE) ? " RFC822.SIZE" : "",
-	                  tuids ? " BODY.PEEK[HEADER.FIELDS (X-TUID)]" : "");
+	                  !hdrs ? "" :
+	                  (ctx->gen.opts & OPEN_MSGID) ? " BODY.PEEK[HEADER.FIELDS (X-TUID MESSAGE-ID)]" :
+	                                                 " BODY.PEEK[HEADER.FIELDS (X-TUID)]",
+	                  mods );
+}
+
+static int
+uid_compare( const void *a, const void *b )
+{
+	return (*(const message_t **)a)->uid - (*(const message_t **)b)->uid;
+}
+
+static int
+range_compare( const void *a, const void *b )
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Merge the CHANGEDSINCE results with the messages we were told about,
+ * yielding the same message list a full load would have produced. */
+static void
+imap_merge_known( imap_store_t *ctx )
+{
+	message_t **fetched, *msg, *pmsg, **msgapp;
+	known_msg_t *known = ctx->gen.known;
+	int *vanished = ctx->vanished;
+	int i, j, v, nfetched, nknown = ctx->gen.nknown, nvanished = ctx->nvanished;
+
+	for (nfetched = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		nfetched++;
+	fetched = nfmalloc( (nfetched + 1) * sizeof(*fetched) );
+	for (i = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		fetched[i++] = msg;
+	qsort( fetched, nfetched, sizeof(*fetched), uid_compare );
+	qsort( vanished, nvanished, 2 * sizeof(int), range_compare );
+	debug( "merging %d changed and %d known messages, %d UID ranges vanished\n",
+	       nfetched, nknown, nvanished );
+
+	msgapp = &ctx->gen.msgs;
+	pmsg = 0;
+	for (i = j = v = 0; ; ) {
+		if (i < nfetched && (j == nknown || fetched[i]->uid <= known[j].uid)) {
+			msg = fetched[i++];
+			if (pmsg && pmsg->uid == msg->uid) {
+				/* Exceptions are fetched separately, so they may come in twice.
+				 * The pool reclaims the duplicate along with the others. */
+				continue;
+			}
+			if (j < nknown && known[j].uid == msg->uid)
+				j++;
+		} else if (j < nknown) {
+			if (known[j].uid < ctx->changed_minuid || known[j].uid > ctx->changed_maxuid) {
+				j++;
+				continue;
+			}
+			while (v < nvanished && vanished[v * 2 + 1] < known[j].uid)
+				v++;
+			if (v < nvanished && vanished[v * 2] <= known[j].uid) {
+				j++;
+				continue;
+			}
+			msg = pool_alloc( &ctx->gen.msg_pool, sizeof(imap_message_t) );
+			memset( msg, 0, sizeof(imap_message_t) );
+			msg->uid = known[j].uid;
+			if (ctx->gen.opts & OPEN_FLAGS) {
+				msg->flags = known[j].flags;
+				msg->status = M_FLAGS;
+			}
+			j++;
+		} else {
+			break;
+		}
+		*msgapp = pmsg = msg;
+		msgapp = &msg->next;
+	}
+	*msgapp = 0;
+	ctx->msgapp = msgapp;
+	ctx->msgs_maxuid = pmsg ? pmsg->uid : 0;
+	ctx->msgs_unsorted = 0;
+	free( fetched );
+}
+
+/* Bring the results of interleaved FETCH responses into UID order. */
+static void
+imap_sort_msgs( imap_store_t *ctx )
+{
+	message_t **fetched, *msg, *pmsg, **msgapp;
+	int i, nfetched;
+
+	for (nfetched = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		nfetched++;
+	fetched = nfmalloc( nfetched * sizeof(*fetched) );
+	for (i = 0, msg = ctx->gen.msgs; msg; msg = msg->next)
+		fetched[i++] = msg;
+	qsort( fetched, nfetched, sizeof(*fetched), uid_compare );
+
+	msgapp = &ctx->gen.msgs;
+	pmsg = 0;
+	for (i = 0; i < nfetched; i++) {
+		msg = fetched[i];
+		if (pmsg && pmsg->uid == msg->uid)
+			continue; /* the pool reclaims duplicates along with the others */
+		*msgapp = pmsg = msg;
+		msgapp = &msg->next;
+	}
+	*msgapp = 0;
+	ctx->msgapp = msgapp;
+	ctx->msgs_unsorted = 0;
+	free( fetched );
+}
+
+static void
+imap_load_p2( int sts, void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)aux;
+
+	if (sts == DRV_OK) {
+		if (ctx->changed_maxuid)
+			imap_merge_known( ctx );
+		else if (ctx->msgs_unsorted)
+			imap_sort_msgs( ctx );
+	}
+	free( ctx->gen.known );
+	ctx->gen.known = 0;
+	free( ctx->vanished );
+	ctx->vanished = 0;
+	ctx->nvanished = ctx->avanished = 0;
+	ctx->changed_maxuid = 0;
+	ctx->load_callback( sts, ctx->load_callback_aux );
 }
 
 /******************* imap_fetch_msg *******************/
@@ -2168,10 +2975,12 @@ imap_fetch_msg( store_t *ctx, message_t *msg, msg_data_t *data,
 	cmd->gen.gen.param.uid = msg->uid;
 	cmd->msg_data = data;
 	data->data = 0;
+	data->len = -1;
 	imap_exec( (imap_store_t *)ctx, &cmd->gen.gen, imap_fetch_msg_p2,
-	           "UID FETCH %d (%s%sBODY.PEEK[])", msg->uid,
+	           "UID FETCH %d (%s%s%s)", msg->uid,
 	           !(msg->status & M_FLAGS) ? "FLAGS " : "",
-	           (data->date== -1) ? "INTERNALDATE " : "" );
+	           (data->date== -1) ? "INTERNALDATE " : "",
+	           data->placeholder ? "RFC822.SIZE BODY.PEEK[HEADER] BODYSTRUCTURE" : "BODY.PEEK[]" );
 }
 
 static void
@@ -2179,7 +2988,7 @@ imap_fetch_msg_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
 {
 	struct imap_cmd_fetch_msg *cmd = (struct imap_cmd_fetch_msg *)gcmd;
 
-	if (response == RESP_OK && !cmd->msg_data->data) {
+	if (response == RESP_OK && cmd->msg_data->len < 0) {
 		/* The FETCH succeeded, but there is no message with this UID. */
 		response = RESP_NO;
 	}
@@ -2196,11 +3005,11 @@ imap_make_flags( int flags, char *buf )
 	const char *s;
 	unsigned i, d;
 
-	for (i = d = 0; i < as(Flags); i++)
+	for (i = d = 0; i < as(ImapFlags); i++)
 		if (flags & (1 << i)) {
 			buf[d++] = ' ';
 			buf[d++] = '\\';
-			for (s = Flags[i]; *s; s++)
+			for (s = ImapFlags[i]; *s; s++)
 				buf[d++] = *s;
 		}
 	buf[0] = '(';
@@ -2208,15 +3017,21 @@ imap_make_flags( int flags, char *buf )
 	return d;
 }
 
-static int
-imap_flags_helper( imap_store_t *ctx, int uid, char what, int flags,
+static void
+queue_flag_update( imap_store_t *ctx, int uid, char what, int flags,
                    struct imap_cmd_refcounted_state *sts )
 {
-	char buf[256];
+	flag_update_t *fu;
 
-	buf[imap_make_flags( flags, buf )] = 0;
-	return imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_set_flags_p2,
-	                  "UID STORE %d %cFLAGS.SILENT %s", uid, what, buf );
+	if (ctx->nflag_updates == ctx->aflag_updates)
+		ctx->flag_updates = nfrealloc( ctx->flag_updates,
+		                               (ctx->aflag_updates = ctx->aflag_updates * 2 + 64) * sizeof(*fu) );
+	fu = &ctx->flag_updates[ctx->nflag_updates++];
+	fu->uid = uid;
+	fu->what = what;
+	fu->flags = flags;
+	fu->sts = sts;
+	sts->ref_count++;
 }
 
 static void
@@ -2234,28 +3049,110 @@ imap_set_flags( store_t *gctx, message_t *msg, int uid, int add, int del,
 	}
 	if (add || del) {
 		struct imap_cmd_refcounted_state *sts = imap_refcounted_new_state( cb, aux );
-		if ((add && imap_flags_helper( ctx, uid, '+', add, sts ) < 0) ||
-		    (del && imap_flags_helper( ctx, uid, '-', del, sts ) < 0)) {}
+		if (add)
+			queue_flag_update( ctx, uid, '+', add, sts );
+		if (del)
+			queue_flag_update( ctx, uid, '-', del, sts );
 		imap_refcounted_done( sts );
 	} else {
 		cb( DRV_OK, aux );
 	}
 }
 
+static int
+compare_flag_updates( const void *a, const void *b )
+{
+	const flag_update_t *fa = (const flag_update_t *)a, *fb = (const flag_update_t *)b;
+
+	if (fa->what != fb->what)
+		return fa->what - fb->what;
+	if (fa->flags != fb->flags)
+		return fa->flags - fb->flags;
+	return fa->uid - fb->uid;
+}
+
+/* Send the queued flag updates, with one command per set of flags and UID range
+ * list (which is limited in length, as some servers cannot handle long lines). */
+static void
+imap_flush_flags( imap_store_t *ctx )
+{
+	flag_update_t *fus = ctx->flag_updates;
+	int nfus = ctx->nflag_updates;
+	struct imap_cmd_set_flags *cmd;
+	int i, j, k, bl;
+	char buf[1000], fbuf[256];
+
+	if (!nfus)
+		return;
+	ctx->flag_updates = 0;
+	ctx->nflag_updates = ctx->aflag_updates = 0;
+	qsort( fus, nfus, sizeof(*fus), compare_flag_updates );
+	for (i = 0; i < nfus; i = j) {
+#define SAME_GROUP(a, b) (fus[a].what == fus[b].what && fus[a].flags == fus[b].flags)
+		for (bl = 0, j = i; j < nfus && SAME_GROUP(i, j) && bl < 960; j++) {
+			if (bl)
+				buf[bl++] = ',';
+			bl += sprintf( buf + bl, "%d", fus[j].uid );
+			k = j;
+			for (; j + 1 < nfus && SAME_GROUP(i, j + 1) && fus[j + 1].uid <= fus[j].uid + 1; j++) {}
+			if (fus[j].uid != fus[k].uid)
+				bl += sprintf( buf + bl, ":%d", fus[j].uid );
+		}
+#undef SAME_GROUP
+		cmd = (struct imap_cmd_set_flags *)new_imap_cmd( sizeof(*cmd) );
+		cmd->nstates = j - i;
+		cmd->states = nfmalloc( cmd->nstates * sizeof(*cmd->states) );
+		for (k = i; k < j; k++)
+			cmd->states[k - i] = fus[k].sts;
+		fbuf[imap_make_flags( fus[i].flags, fbuf )] = 0;
+		if (imap_exec( ctx, &cmd->gen, imap_set_flags_p2,
+		               "UID STORE %s %cFLAGS.SILENT %s", buf, fus[i].what, fbuf ) < 0) {
+			for (k = j; k < nfus; k++) {
+				fus[k].sts->ret_val = DRV_CANCELED;
+				imap_refcounted_done( fus[k].sts );
+			}
+			break;
+		}
+	}
+	free( fus );
+}
+
 static void
 imap_set_flags_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int response )
 {
-	struct imap_cmd_refcounted_state *sts = ((struct imap_cmd_refcounted *)cmd)->state;
-	switch (response) {
-	case RESP_CANCEL:
-		sts->ret_val = DRV_CANCELED;
-		break;
-	case RESP_NO:
-		if (sts->ret_val == DRV_OK) /* Don't override cancelation. */
-			sts->ret_val = DRV_MSG_BAD;
-		break;
+	struct imap_cmd_set_flags *cmdp = (struct imap_cmd_set_flags *)cmd;
+	struct imap_cmd_refcounted_state *sts;
+	int i;
+
+	for (i = 0; i < cmdp->nstates; i++) {
+		sts = cmdp->states[i];
+		switch (response) {
+		case RESP_CANCEL:
+			sts->ret_val = DRV_CANCELED;
+			break;
+		case RESP_NO:
+			if (sts->ret_val == DRV_OK) /* Don't override cancelation. */
+				sts->ret_val = DRV_MSG_BAD;
+			break;
+		}
+		imap_refcounted_done( sts );
 	}
-	imap_refcounted_done( sts );
+	free( cmdp->states );
+}
+
+static void
+imap_cancel_flags( imap_store_t *ctx )
+{
+	flag_update_t *fus = ctx->flag_updates;
+	int i, nfus = ctx->nflag_updates;
+
+	ctx->flag_updates = 0;
+	ctx->nflag_updates = ctx->aflag_updates = 0;
+	for (i = 0; i < nfus; i++) {
+		fus[i].sts->ret_val = DRV_CANCELED;
+		imap_refcounted_done( fus[i].sts );
+	}
+	free( fus );
 }
 
 /******************* imap_close *******************/
@@ -2324,34 +3221,53 @@ imap_trash_msg( store_t *gctx, message_t *msg,
 
 /******************* imap_store_msg *******************/
 
+/* Limits for the messages which are sent in one MULTIAPPEND command. */
+#define APPEND_BATCH_MSGS 100
+#define APPEND_BATCH_SIZE (4 * 1024 * 1024)
+
 static void imap_store_msg_p2( imap_store_t *, struct imap_cmd *, int );
 
-static size_t
-my_strftime( char *s, size_t max, const char *fmt, const struct tm *tm )
+/* Format the flags and the date of a message to be appended, each followed by a space. */
+static int
+imap_make_append_opts( char *buf, int flags, time_t date )
 {
-    return strftime( s, max, fmt, tm );
+	int d = 0;
+
+	if (flags) {
+		d = imap_make_flags( flags, buf );
+		buf[d++] = ' ';
+	}
+	if (date) {
+		buf[d++] = '"';
+		/* configure ensures that %z actually works. */
+		d += my_strftime( buf + d, 64, "%d-%b-%Y %H:%M:%S %z", localtime( &date ) );
+		buf[d++] = '"';
+		buf[d++] = ' ';
+	}
+	buf[d] = 0;
+	return d;
+}
+
+/* The size of a mapped message tail as it is sent. */
+static int
+map_lit_len( msg_map_t *map )
+{
+	return map ? crlf_len( map->base + map->off, map->size - map->off ) : 0;
 }
 
 static void
-imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
-                void (*cb)( int sts, int uid, void *aux ), void *aux )
+imap_append_msg( imap_store_t *ctx, char *data, int len, msg_map_t *map, int flags, time_t date,
+                 int to_trash, void (*cb)( int sts, int uid, void *aux ), void *aux )
 {
-	imap_store_t *ctx = (imap_store_t *)gctx;
 	struct imap_cmd_out_uid *cmd;
 	char *buf;
-	int d;
-	char flagstr[128], datestr[64];
-
-	d = 0;
-	if (data->flags) {
-		d = imap_make_flags( data->flags, flagstr );
-		flagstr[d++] = ' ';
-	}
-	flagstr[d] = 0;
+	char opts[128];
 
 	INIT_IMAP_CMD(imap_cmd_out_uid, cmd, cb, aux)
-	cmd->gen.param.data_len = data->len;
-	cmd->gen.param.data = data->data;
+	cmd->gen.param.data_len = len;
+	cmd->gen.param.data = data;
+	cmd->gen.param.map = map;
+	cmd->gen.param.map_len = map_lit_len( map );
 	cmd->out_uid = -2;
 
 	if (to_trash) {
@@ -2367,18 +3283,49 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 			return;
 		}
 	}
-	if (data->date) {
-		/* configure ensures that %z actually works. */
-		my_strftime( datestr, sizeof(datestr), "%d-%b-%Y %H:%M:%S %z", localtime( &data->date ) );
-		imap_exec( ctx, &cmd->gen, imap_store_msg_p2,
-		           "APPEND \"%\\s\" %s\"%\\s\" ", buf, flagstr, datestr );
-	} else {
-		imap_exec( ctx, &cmd->gen, imap_store_msg_p2,
-		           "APPEND \"%\\s\" %s", buf, flagstr );
-	}
+	imap_make_append_opts( opts, flags, date );
+	imap_exec( ctx, &cmd->gen, imap_store_msg_p2, "APPEND \"%\\s\" %s", buf, opts );
 	free( buf );
 }
 
+static void imap_flush_appends( imap_store_t *ctx );
+
+static void
+imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
+                void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_multiappend *cmd;
+	imap_append_t *am;
+
+	if (to_trash || !CAP(MULTIAPPEND)) {
+		imap_append_msg( ctx, data->data, data->len, data->map, data->flags, data->date, to_trash, cb, aux );
+		return;
+	}
+	if (!(cmd = ctx->append_batch)) {
+		cmd = ctx->append_batch = (struct imap_cmd_multiappend *)new_imap_cmd( sizeof(*cmd) );
+		cmd->gen.cmd = 0;
+		cmd->gen.param.done = imap_multiappend_p2;
+		cmd->msgs = 0;
+		cmd->nmsgs = cmd->amsgs = cmd->size = 0;
+	}
+	if (cmd->nmsgs == cmd->amsgs)
+		cmd->msgs = nfrealloc( cmd->msgs, (cmd->amsgs = cmd->amsgs * 2 + 16) * sizeof(*cmd->msgs) );
+	am = &cmd->msgs[cmd->nmsgs++];
+	am->data = data->data;
+	am->len = data->len;
+	am->map = data->map;
+	am->map_len = map_lit_len( data->map );
+	am->flags = data->flags;
+	am->date = data->date;
+	am->uid = -2;
+	am->callback = cb;
+	am->callback_aux = aux;
+	cmd->size += am->len + am->map_len;
+	if (cmd->nmsgs >= APPEND_BATCH_MSGS || cmd->size >= APPEND_BATCH_SIZE)
+		imap_flush_appends( ctx );
+}
+
 static void
 imap_store_msg_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int response )
 {
@@ -2388,6 +3335,123 @@ imap_store_msg_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int resp
 	cmdp->callback( response, cmdp->out_uid, cmdp->callback_aux );
 }
 
+static int imap_multiappend_next( imap_store_t *, struct imap_cmd * );
+
+/* Send the queued messages in one MULTIAPPEND command (RFC 3502). */
+static void
+imap_flush_appends( imap_store_t *ctx )
+{
+	struct imap_cmd_multiappend *cmd;
+	imap_append_t *am;
+	char *buf;
+	int i;
+	char opts[128];
+
+	if (!(cmd = ctx->append_batch))
+		return;
+	ctx->append_batch = 0;
+	am = cmd->msgs;
+	if (cmd->nmsgs == 1) {
+		imap_append_msg( ctx, am->data, am->len, am->map, am->flags, am->date, 0, am->callback, am->callback_aux );
+		free( cmd->msgs );
+		free( cmd );
+		return;
+	}
+	if (prepare_box( &buf, ctx ) < 0) {
+		for (i = 0; i < cmd->nmsgs; i++) {
+			free( am[i].data );
+			free_msg_map( am[i].map );
+			am[i].callback( DRV_BOX_BAD, -1, am[i].callback_aux );
+		}
+		free( cmd->msgs );
+		free( cmd );
+		return;
+	}
+	cmd->cur = 0;
+	cmd->gen.param.data = am->data;
+	cmd->gen.param.data_len = am->len;
+	cmd->gen.param.map = am->map;
+	cmd->gen.param.map_len = am->map_len;
+	cmd->gen.param.lit_sent = imap_multiappend_next;
+	imap_make_append_opts( opts, am->flags, am->date );
+	imap_exec( ctx, &cmd->gen, imap_multiappend_p2, "APPEND \"%\\s\" %s", buf, opts );
+	free( buf );
+}
+
+static int
+imap_multiappend_next( imap_store_t *ctx, struct imap_cmd *gcmd )
+{
+	struct imap_cmd_multiappend *cmd = (struct imap_cmd_multiappend *)gcmd;
+	imap_append_t *am;
+	int bufl, litplus = CAP(LITERALPLUS);
+	char buf[200];
+
+	while (++cmd->cur < cmd->nmsgs) {
+		am = &cmd->msgs[cmd->cur];
+		buf[0] = ' ';
+		bufl = 1 + imap_make_append_opts( buf + 1, am->flags, am->date );
+		bufl += nfsnprintf( buf + bufl, sizeof(buf) - bufl, litplus ? "{%d+}\r\n" : "{%d}\r\n",
+		                    am->len + am->map_len );
+		if (DFlags & VERBOSE) {
+			printf( "%s>>> %s", ctx->label, buf + 1 );
+			fflush( stdout );
+		}
+		if (socket_write( &ctx->conn, buf, bufl, KeepOwn ) < 0)
+			return -1;
+		if (!litplus) {
+			/* Wait for the continuation request. */
+			cmd->gen.param.data = am->data;
+			cmd->gen.param.data_len = am->len;
+			cmd->gen.param.map = am->map;
+			cmd->gen.param.map_len = am->map_len;
+			return 0;
+		}
+		if (socket_write( &ctx->conn, am->data, am->len, KeepOwn ) < 0 ||
+		    send_imap_map( ctx, am->map ) < 0)
+			return -1;
+	}
+	return socket_write( &ctx->conn, "\r\n", 2, KeepOwn ) < 0 ? -1 : 0;
+}
+
+static void
+imap_multiappend_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_multiappend *cmd = (struct imap_cmd_multiappend *)gcmd;
+	imap_append_t *am;
+	int i;
+
+	cmd->gen.param.data = 0; /* points into msgs */
+	cmd->gen.param.map = 0;
+	if (response == RESP_NO && !ctx->canceling) {
+		/* The command is atomic, so a single bad message fails all of them.
+		 * Retry individually to find out which one it was. */
+		for (i = 0; i < cmd->nmsgs; i++) {
+			am = &cmd->msgs[i];
+			imap_append_msg( ctx, am->data, am->len, am->map, am->flags, am->date, 0, am->callback, am->callback_aux );
+		}
+	} else {
+		transform_msg_response( &response );
+		for (i = 0; i < cmd->nmsgs; i++) {
+			am = &cmd->msgs[i];
+			free( am->data );
+			free_msg_map( am->map );
+			am->callback( response, am->uid, am->callback_aux );
+		}
+	}
+	free( cmd->msgs );
+}
+
+static void
+imap_cancel_appends( imap_store_t *ctx )
+{
+	struct imap_cmd_multiappend *cmd;
+
+	if ((cmd = ctx->append_batch)) {
+		ctx->append_batch = 0;
+		done_imap_cmd( ctx, &cmd->gen, RESP_CANCEL );
+	}
+}
+
 /******************* imap_find_new_msgs *******************/
 
 static void imap_find_new_msgs_p2( imap_store_t *, struct imap_cmd *, int );
@@ -2425,17 +3489,100 @@ imap_list( store_t *gctx, int flags,
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 	struct imap_cmd_refcounted_state *sts = imap_refcounted_new_state( cb, aux );
+	const char *ret = "";
 
+	/* Collect the fingerprints of all boxes in one go. */
+	if (CAP(LIST_STATUS) && (CAP(CONDSTORE) || CAP(QRESYNC))) {
+		free_string_list( ctx->box_status );
+		ctx->box_status = 0;
+		ret = " RETURN (STATUS (UIDVALIDITY UIDNEXT MESSAGES HIGHESTMODSEQ))";
+	}
 	if (((flags & LIST_PATH) &&
 	     imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
-	                "LIST \"\" \"%\\s*\"", ctx->prefix ) < 0) ||
+	                "LIST \"\" \"%\\s*\"%s", ctx->prefix, ret ) < 0) ||
 	    ((flags & LIST_INBOX) && (!(flags & LIST_PATH) || *ctx->prefix) &&
 	     imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
-	                "LIST \"\" INBOX*" ) < 0))
+	                "LIST \"\" INBOX*%s", ret ) < 0))
 		{}
 	imap_refcounted_done( sts );
 }
 
+/******************* imap_idle *******************/
+
+static void imap_idle_p2( imap_store_t *, struct imap_cmd *, int );
+
+static void
+imap_idle( store_t *gctx,
+           void (*cb)( int sts, void *aux ), void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	struct imap_cmd_simple *cmd;
+
+	if (!CAP(IDLE)) {
+		cb( DRV_BOX_BAD, aux );
+		return;
+	}
+	INIT_IMAP_CMD(imap_cmd_simple, cmd, cb, aux)
+	cmd->gen.param.idle = 1;
+	ctx->idle_cmd = cmd;
+	ctx->idling = IdleStarting;
+	ctx->idle_changed = 0;
+	imap_exec( ctx, &cmd->gen, imap_idle_p2, "IDLE" );
+}
+
+static int
+imap_send_done( imap_store_t *ctx )
+{
+	if (DFlags & VERBOSE) {
+		printf( "%s>>> DONE\n", ctx->label );
+		fflush( stdout );
+	}
+	socket_expect_read( &ctx->conn, 1 );
+	return socket_write( &ctx->conn, "DONE\r\n", 6, KeepOwn );
+}
+
+static void
+imap_end_idle( imap_store_t *ctx )
+{
+	int was_running = (ctx->idling == IdleRunning);
+
+	wipe_wakeup( &ctx->idle_timer );
+	ctx->idling = IdleEnding;
+	if (was_running)
+		imap_send_done( ctx );
+}
+
+static void
+imap_idle_renew( void *aux )
+{
+	imap_store_t *ctx = (imap_store_t *)aux;
+
+	ctx->idle_renew = 1;
+	imap_end_idle( ctx );
+}
+
+static void
+imap_idle_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	struct imap_cmd_simple *cmdp = (struct imap_cmd_simple *)cmd;
+	int renew = ctx->idle_renew;
+
+	wipe_wakeup( &ctx->idle_timer );
+	ctx->idle_cmd = 0;
+	ctx->idling = IdleNone;
+	ctx->idle_renew = 0;
+	if (!cmdp->callback)
+		return; /* the change was already reported */
+	if (ctx->idle_changed) {
+		ctx->idle_changed = 0;
+		cmdp->callback( DRV_OK, cmdp->callback_aux );
+	} else if (renew && response == RESP_OK) {
+		imap_idle( &ctx->gen, cmdp->callback, cmdp->callback_aux );
+	} else {
+		cmdp->callback( response == RESP_NO ? DRV_BOX_BAD : DRV_CANCELED, cmdp->callback_aux );
+	}
+}
+
 /******************* imap_cancel *******************/
 
 static void
@@ -2444,7 +3591,11 @@ imap_cancel( store_t *gctx,
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
+	imap_cancel_flags( ctx );
+	imap_cancel_appends( ctx );
 	cancel_pending_imap_cmds( ctx );
+	if (ctx->idle_cmd)
+		imap_end_idle( ctx );
 	if (ctx->in_progress) {
 		ctx->canceling = 1;
 		ctx->callbacks.imap_cancel = cb;
@@ -2459,7 +3610,10 @@ imap_cancel( store_t *gctx,
 static void
 imap_commit( store_t *gctx )
 {
-	(void)gctx;
+	imap_store_t *ctx = (imap_store_t *)gctx;
+
+	imap_flush_flags( ctx );
+	imap_flush_appends( ctx );
 }
 
 /******************* imap_parse_store *******************/
@@ -2504,6 +3658,10 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 	server->sconf.system_certs = 1;
 #endif
 	server->max_in_progress = INT_MAX;
+	server->sconf.timeout = 20;
+#ifdef HAVE_LIBZ
+	server->compress = 1;
+#endif
 
 	while (getcline( cfg ) && cfg->cmd) {
 		if (!strcasecmp( "Host", cfg->cmd )) {
@@ -2533,12 +3691,18 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 			server->pass_cmd = nfstrdup( cfg->val );
 		else if (!strcasecmp( "Port", cfg->cmd ))
 			server->sconf.port = parse_int( cfg );
+		else if (!strcasecmp( "Timeout", cfg->cmd ))
+			server->sconf.timeout = parse_int( cfg );
 		else if (!strcasecmp( "PipelineDepth", cfg->cmd )) {
 			if ((server->max_in_progress = parse_int( cfg )) < 1) {
 				error( "%s:%d: PipelineDepth must be at least 1\n", cfg->file, cfg->line );
 				cfg->err = 1;
 			}
 		}
+#ifdef HAVE_LIBZ
+		else if (!strcasecmp( "Compression", cfg->cmd ))
+			server->compress = parse_bool( cfg );
+#endif
 #ifdef HAVE_LIBSSL
 		else if (!strcasecmp( "CertificateFile", cfg->cmd )) {
 			server->sconf.cert_file = expand_strdup( cfg->val );
@@ -2547,6 +3711,8 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 				           cfg->file, cfg->line, server->sconf.cert_file );
 				cfg->err = 1;
 			}
+		} else if (!strcasecmp( "SSLSessionFile", cfg->cmd )) {
+			server->sconf.session_file = expand_strdup( cfg->val );
 		} else if (!strcasecmp( "SystemCertificates", cfg->cmd )) {
 			server->sconf.system_certs = parse_bool( cfg );
 		} else if (!strcasecmp( "SSLType", cfg->cmd )) {
@@ -2717,22 +3883,30 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 }
 
 struct driver imap_driver = {
-	DRV_CRLF | DRV_VERBOSE,
+	DRV_CRLF | DRV_VERBOSE | DRV_PLACEHOLDER | DRV_MAPPED,
 	imap_parse_store,
 	imap_cleanup,
 	imap_open_store,
 	imap_disown_store,
 	imap_cancel_store,
 	imap_list,
+	imap_box_fingerprint,
 	imap_prepare_opts,
 	imap_select,
+	imap_find_since,
 	imap_load,
 	imap_fetch_msg,
+	0, /* reserve_uids: the server assigns the UIDs */
 	imap_store_msg,
+	0, /* open_msg: APPEND needs the size in advance */
+	0,
+	0, /* adopt_msg: the messages would have to be located on the server first */
+	0,
 	imap_find_new_msgs,
 	imap_set_flags,
 	imap_trash_msg,
 	imap_close,
 	imap_cancel,
 	imap_commit,
+	imap_idle,
 };
@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <time.h>
 #include <utime.h>
@@ -58,6 +59,7 @@ typedef struct maildir_store_conf {
 	int alt_map;
 #endif /* USE_DB */
 	char info_delimiter;
+	char scan_index;
 	char *info_prefix, *info_stop; /* precalculated from info_delimiter */
 } maildir_store_conf_t;
 
@@ -66,13 +68,21 @@ typedef struct maildir_message {
 	char *base;
 } maildir_message_t;
 
+struct scan_index;
+struct maildir_sink;
+
 typedef struct maildir_store {
 	store_t gen;
 	int uvfd, uvok, nuid, fresh;
+	int rsvuid, nrsv; /* block of UIDs taken in advance */
 	int minuid, maxuid, newuid, nexcs, *excs;
 	char *trash;
+	struct scan_index *index; /* result of the previous scan */
+	struct maildir_sink *pending, **pending_append; /* stored messages awaiting group commit */
+	int npending;
 #ifdef USE_DB
 	DB *db;
+	int dbdirty; /* mappings of reserved UIDs not flushed yet */
 #endif /* USE_DB */
 } maildir_store_t;
 
@@ -85,6 +95,22 @@ static int MaildirCount;
 
 static const char Flags[] = { 'D', 'F', 'R', 'S', 'T' };
 
+/* These count the operations for the statistics. */
+
+static int
+md_rename( maildir_store_t *ctx, const char *from, const char *to )
+{
+	ctx->gen.stats.renames++;
+	return rename( from, to );
+}
+
+static int
+md_fdatasync( maildir_store_t *ctx, int fd )
+{
+	ctx->gen.stats.fsyncs++;
+	return fdatasync( fd );
+}
+
 static unsigned char
 maildir_parse_flags( const char *info_prefix, const char *base )
 {
@@ -148,6 +174,7 @@ maildir_open_store( store_conf_t *conf, const char *label ATTR_UNUSED,
 	ctx = nfcalloc( sizeof(*ctx) );
 	ctx->gen.conf = conf;
 	ctx->uvfd = -1;
+	ctx->pending_append = &ctx->pending;
 	if (conf->trash) {
 		if (maildir_validate_path( conf ) < 0) {
 			free( ctx );
@@ -160,29 +187,34 @@ maildir_open_store( store_conf_t *conf, const char *label ATTR_UNUSED,
 }
 
 static void
-free_maildir_messages( message_t *msg )
+free_maildir_messages( store_t *gctx )
 {
-	message_t *tmsg;
+	message_t *msg;
 
-	for (; (tmsg = msg); msg = tmsg) {
-		tmsg = msg->next;
+	for (msg = gctx->msgs; msg; msg = msg->next)
 		free( ((maildir_message_t *)msg)->base );
-		free( msg );
-	}
+	free_generic_messages( gctx );
 }
 
+static void free_scan_index( struct scan_index *ix );
+static void maildir_flush_stores( maildir_store_t *ctx );
+static void maildir_discard_stores( maildir_store_t *ctx );
+static void maildir_drop_moved( void );
+
 static void
 maildir_cleanup( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 
-	free_maildir_messages( gctx->msgs );
+	maildir_discard_stores( ctx );
+	free_maildir_messages( gctx );
 #ifdef USE_DB
 	if (ctx->db)
 		ctx->db->close( ctx->db, 0 );
 #endif /* USE_DB */
 	free( gctx->path );
 	free( ctx->excs );
+	free_scan_index( ctx->index );
 	if (ctx->uvfd >= 0)
 		close( ctx->uvfd );
 }
@@ -199,6 +231,7 @@ maildir_disown_store( store_t *gctx )
 static void
 maildir_cleanup_drv( void )
 {
+	maildir_drop_moved();
 }
 
 static void
@@ -313,6 +346,7 @@ typedef struct {
 	char *base;
 	int size;
 	unsigned uid:31, recent:1;
+	int ix; /* entry in the new scan index, or -1 */
 	char tuid[TUIDL];
 } msg_t;
 
@@ -333,6 +367,189 @@ maildir_free_scan( msglist_t *msglist )
 	}
 }
 
+/* The scan index caches the listings of cur/ and new/ along with the directories'
+ * modification times, and the size and TUID of each message. An unchanged directory
+ * does not need to be listed, and known messages need not be looked at. The entries
+ * are identified by the file names without the UID and the flags, as is done in the
+ * AltMap database. */
+
+#define INDEX_NAME ".mbsyncindex"
+#define INDEX_MAGIC "MBSYNC-INDEX 1"
+
+enum { TUID_UNKNOWN, TUID_NONE, TUID_KNOWN };
+
+typedef struct {
+	char *base;
+	int size; /* -1 if unknown */
+	char recent; /* in new/ */
+	char tuid_state;
+	char tuid[TUIDL];
+} index_ent_t;
+
+typedef struct scan_index {
+	index_ent_t *ents;
+	int nents, nalloc;
+	int *hash, hsize; /* entry numbers + 1, built on demand */
+	time_t stamps[2];
+} scan_index_t;
+
+static void
+free_scan_index( scan_index_t *ix )
+{
+	int i;
+
+	if (ix) {
+		for (i = 0; i < ix->nents; i++)
+			free( ix->ents[i].base );
+		free( ix->ents );
+		free( ix->hash );
+		free( ix );
+	}
+}
+
+static index_ent_t *
+index_add( scan_index_t *ix, const char *base, int recent )
+{
+	index_ent_t *ie;
+
+	if (ix->nents == ix->nalloc)
+		ix->ents = nfrealloc( ix->ents, (ix->nalloc = ix->nalloc * 2 + 100) * sizeof(*ie) );
+	ie = &ix->ents[ix->nents++];
+	ie->base = nfstrdup( base );
+	ie->recent = recent;
+	ie->size = -1;
+	ie->tuid_state = TUID_UNKNOWN;
+	return ie;
+}
+
+static unsigned
+index_hash( const char *str, int len )
+{
+	unsigned h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+static index_ent_t *
+index_find( scan_index_t *ix, const char *info_stop, const char *base )
+{
+	index_ent_t *ie;
+	unsigned h;
+	int i, kl;
+
+	if (!ix->hash) {
+		for (ix->hsize = 64; ix->hsize < ix->nents * 2; ix->hsize *= 2) {}
+		ix->hash = nfcalloc( ix->hsize * sizeof(int) );
+		for (i = 0; i < ix->nents; i++) {
+			ie = &ix->ents[i];
+			for (h = index_hash( ie->base, strcspn( ie->base, info_stop ) ); ix->hash[h & (ix->hsize - 1)]; h++) {}
+			ix->hash[h & (ix->hsize - 1)] = i + 1;
+		}
+	}
+	kl = strcspn( base, info_stop );
+	for (h = index_hash( base, kl ); (i = ix->hash[h & (ix->hsize - 1)]); h++) {
+		ie = &ix->ents[i - 1];
+		if (!strncmp( ie->base, base, kl ) && strcspn( ie->base, info_stop ) == (size_t)kl)
+			return ie;
+	}
+	return 0;
+}
+
+static scan_index_t *
+maildir_read_index( maildir_store_t *ctx )
+{
+	scan_index_t *ix;
+	index_ent_t *ie;
+	FILE *f;
+	char *p, *e;
+	long stamps[2];
+	int recent, size, l;
+	char buf[_POSIX_PATH_MAX + 100];
+
+	nfsnprintf( buf, sizeof(buf), "%s/" INDEX_NAME, ctx->gen.path );
+	if (!(f = fopen( buf, "r" ))) {
+		if (errno != ENOENT)
+			sys_error( "Maildir warning: cannot read scan index %s", buf );
+		return 0;
+	}
+	ix = nfcalloc( sizeof(*ix) );
+	if (!fgets( buf, sizeof(buf), f ) ||
+	    sscanf( buf, INDEX_MAGIC " %ld %ld\n", &stamps[0], &stamps[1] ) != 2)
+		goto bad;
+	ix->stamps[0] = stamps[0];
+	ix->stamps[1] = stamps[1];
+	while (fgets( buf, sizeof(buf), f )) {
+		if (!(l = strlen( buf )) || buf[l - 1] != '\n')
+			goto bad;
+		buf[l - 1] = 0;
+		recent = strtol( buf, &p, 10 );
+		if (*p != ' ' || (recent != 0 && recent != 1))
+			goto bad;
+		size = strtol( p + 1, &p, 10 );
+		if (*p++ != ' ' || !(e = strchr( p, ' ' )))
+			goto bad;
+		if (*p == '+' && e - p != TUIDL + 1)
+			goto bad;
+		if (*p != '+' && (e - p != 1 || (*p != '-' && *p != '?')))
+			goto bad;
+		ie = index_add( ix, e + 1, recent );
+		ie->size = size;
+		if (*p == '+') {
+			ie->tuid_state = TUID_KNOWN;
+			memcpy( ie->tuid, p + 1, TUIDL );
+		} else if (*p == '-') {
+			ie->tuid_state = TUID_NONE;
+		}
+	}
+	fclose( f );
+	return ix;
+
+  bad:
+	warn( "Maildir warning: ignoring corrupted scan index in %s\n", ctx->gen.path );
+	fclose( f );
+	free_scan_index( ix );
+	return 0;
+}
+
+static void
+maildir_write_index( maildir_store_t *ctx, scan_index_t *ix )
+{
+	index_ent_t *ie;
+	FILE *f;
+	int i;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+
+	/* This is only a cache, so there is no need to fsync it. A torn file is
+	 * detected by means of the missing terminating newline. */
+	nfsnprintf( buf, sizeof(buf), "%s/" INDEX_NAME, ctx->gen.path );
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/" INDEX_NAME ".new", ctx->gen.path );
+	if (!(f = fopen( nbuf, "w" ))) {
+		sys_error( "Maildir warning: cannot write scan index %s", nbuf );
+		return;
+	}
+	fprintf( f, INDEX_MAGIC " %ld %ld\n", (long)ix->stamps[0], (long)ix->stamps[1] );
+	for (i = 0; i < ix->nents; i++) {
+		ie = &ix->ents[i];
+		if (strchr( ie->base, '\n' ))
+			continue;
+		fprintf( f, "%d %d ", ie->recent, ie->size );
+		if (ie->tuid_state == TUID_KNOWN)
+			fprintf( f, "+%.*s", TUIDL, ie->tuid );
+		else
+			putc( ie->tuid_state == TUID_NONE ? '-' : '?', f );
+		fprintf( f, " %s\n", ie->base );
+	}
+	if (ferror( f ) | fclose( f )) {
+		sys_error( "Maildir warning: cannot write scan index %s", nbuf );
+		unlink( nbuf );
+		return;
+	}
+	if (md_rename( ctx, nbuf, buf ))
+		sys_error( "Maildir warning: cannot commit scan index %s", buf );
+}
+
 #define _24_HOURS (3600 * 24)
 
 static int
@@ -423,23 +640,45 @@ make_key( const char *info_stop, DBT *tkey, char *name )
 }
 
 static int
-maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid )
+maildir_sync_db( maildir_store_t *ctx )
 {
-	int ret, uv[2];
-
-	if (uid)
-		*uid = ++ctx->nuid;
-	key.data = (void *)"UIDVALIDITY";
-	key.size = 11;
-	uv[0] = ctx->gen.uidvalidity;
-	uv[1] = ctx->nuid;
-	value.data = uv;
-	value.size = sizeof(uv);
-	if ((ret = ctx->db->put( ctx->db, 0, &key, &value, 0 ))) {
-	  tbork:
-		ctx->db->err( ctx->db, ret, "Maildir error: db->put()" );
+	int ret;
+
+	ctx->dbdirty = 0;
+	if ((ret = ctx->db->sync( ctx->db, 0 ))) {
+		ctx->db->err( ctx->db, ret, "Maildir error: db->sync()" );
 		return DRV_BOX_BAD;
 	}
+	return DRV_OK;
+}
+
+static int
+maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid )
+{
+	int ret, reserved, uv[2];
+
+	reserved = 0;
+	if (uid && ctx->nrsv) {
+		/* The stored UIDVALIDITY record covers the reservation already,
+		 * and the new mapping is flushed together with the others. */
+		*uid = ctx->rsvuid++;
+		ctx->nrsv--;
+		ctx->dbdirty = reserved = 1;
+	} else {
+		if (uid)
+			*uid = ++ctx->nuid;
+		key.data = (void *)"UIDVALIDITY";
+		key.size = 11;
+		uv[0] = ctx->gen.uidvalidity;
+		uv[1] = ctx->nuid;
+		value.data = uv;
+		value.size = sizeof(uv);
+		if ((ret = ctx->db->put( ctx->db, 0, &key, &value, 0 ))) {
+		  tbork:
+			ctx->db->err( ctx->db, ret, "Maildir error: db->put()" );
+			return DRV_BOX_BAD;
+		}
+	}
 	if (uid) {
 		make_key( ((maildir_store_conf_t *)ctx->gen.conf)->info_stop, &key, (char *)name );
 		value.data = uid;
@@ -447,11 +686,9 @@ maildir_set_uid( maildir_store_t *ctx, const char *name, int *uid )
 		if ((ret = ctx->db->put( ctx->db, 0, &key, &value, 0 )))
 			goto tbork;
 	}
-	if ((ret = ctx->db->sync( ctx->db, 0 ))) {
-		ctx->db->err( ctx->db, ret, "Maildir error: db->sync()" );
-		return DRV_BOX_BAD;
-	}
-	return DRV_OK;
+	if (reserved)
+		return DRV_OK;
+	return maildir_sync_db( ctx );
 }
 #endif /* USE_DB */
 
@@ -463,7 +700,7 @@ maildir_store_uid( maildir_store_t *ctx )
 
 	n = sprintf( buf, "%d\n%d\n", ctx->gen.uidvalidity, ctx->nuid );
 	lseek( ctx->uvfd, 0, SEEK_SET );
-	if (write( ctx->uvfd, buf, n ) != n || ftruncate( ctx->uvfd, n ) || (UseFSync && fdatasync( ctx->uvfd ))) {
+	if (write( ctx->uvfd, buf, n ) != n || ftruncate( ctx->uvfd, n ) || (UseFSync && md_fdatasync( ctx, ctx->uvfd ))) {
 		error( "Maildir error: cannot write UIDVALIDITY.\n" );
 		return DRV_BOX_BAD;
 	}
@@ -475,6 +712,7 @@ maildir_init_uid( maildir_store_t *ctx )
 {
 	ctx->gen.uidvalidity = time( 0 );
 	ctx->nuid = 0;
+	ctx->nrsv = 0;
 	ctx->uvok = 0;
 #ifdef USE_DB
 	if (ctx->db) {
@@ -548,10 +786,36 @@ maildir_uidval_unlock( maildir_store_t *ctx )
 static int
 maildir_obtain_uid( maildir_store_t *ctx, int *uid )
 {
+	if (ctx->nrsv) {
+		*uid = ctx->rsvuid++;
+		ctx->nrsv--;
+		return DRV_OK;
+	}
 	*uid = ++ctx->nuid;
 	return maildir_store_uid( ctx );
 }
 
+/* Take count UIDs with a single update of the UID storage. The caller must
+ * hold the lock. If a previous reservation is too small, it is abandoned. */
+static int
+maildir_bump_uids( maildir_store_t *ctx, int count )
+{
+	int ret;
+
+	if (ctx->nrsv >= count)
+		return DRV_OK;
+	ctx->rsvuid = ctx->nuid + 1;
+	ctx->nuid += count;
+#ifdef USE_DB
+	if (ctx->db)
+		ret = maildir_set_uid( ctx, 0, 0 );
+	else
+#endif /* USE_DB */
+		ret = maildir_store_uid( ctx );
+	ctx->nrsv = (ret == DRV_OK) ? count : 0;
+	return ret;
+}
+
 static int
 maildir_compare( const void *l, const void *r )
 {
@@ -614,8 +878,23 @@ maildir_compare( const void *l, const void *r )
 	return strcmp( lm->base, rm->base );
 }
 
+/* For MaxAge, the messages are not stat()ed; the time of delivery which leads
+ * their file names is good enough. Files whose names do not start with a time
+ * stamp count as recent. */
 static int
-maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
+maildir_arrived_since( const char *base, time_t since )
+{
+	char *end;
+	long stamp;
+
+	stamp = strtol( base, &end, 10 );
+	return end == base || *end != '.' || stamp >= since;
+}
+
+/* With since, only the messages from the lowest UID of the ones which arrived
+ * not earlier than that on are listed, and that UID goes to sinceuid. */
+static int
+maildir_scan( maildir_store_t *ctx, msglist_t *msglist, time_t since )
 {
 	maildir_store_conf_t *conf = (maildir_store_conf_t *)ctx->gen.conf;
 	DIR *d;
@@ -627,7 +906,10 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 	DBC *dbc;
 #endif /* USE_DB */
 	msg_t *entry;
-	int i, j, uid, bl, fnl, ret;
+	scan_index_t *nix;
+	index_ent_t *ie, *oie;
+	const char *name;
+	int i, j, k, uid, sinceuid, bl, fnl, ret, ixdirty;
 	time_t now, stamps[2];
 	struct stat st;
 	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
@@ -638,10 +920,16 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 		if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
 			return ret;
 
+	if (conf->scan_index && !ctx->index)
+		ctx->index = maildir_read_index( ctx );
+	nix = 0;
   again:
 	msglist->ents = 0;
 	msglist->nents = msglist->nalloc = 0;
 	ctx->gen.count = ctx->gen.recent = 0;
+	free_scan_index( nix );
+	nix = 0;
+	sinceuid = INT_MAX;
 	if (ctx->uvok || ctx->maxuid == INT_MAX) {
 #ifdef USE_DB
 		if (ctx->db) {
@@ -657,6 +945,9 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 			}
 		}
 #endif /* USE_DB */
+		if (conf->scan_index)
+			nix = nfcalloc( sizeof(*nix) );
+		ixdirty = 0;
 		bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->gen.path );
 	  restat:
 		now = time( 0 );
@@ -676,10 +967,15 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				goto restat;
 			}
 			stamps[i] = st.st_mtime;
+			if (nix) /* A modification during this second might still follow. */
+				nix->stamps[i] = (stamps[i] < now) ? stamps[i] : 0;
 		}
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
-			if (!(d = opendir( buf ))) {
+			if (ctx->index && ctx->index->stamps[i] == stamps[i]) {
+				/* Unchanged since the last scan, so use the listing from the index. */
+				d = 0;
+			} else if (!(d = opendir( buf ))) {
 				sys_error( "Maildir error: cannot list %s", buf );
 			  rfail:
 				maildir_free_scan( msglist );
@@ -688,22 +984,45 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				if (ctx->db)
 					tdb->close( tdb, 0 );
 #endif /* USE_DB */
+				free_scan_index( nix );
 				return DRV_BOX_BAD;
+			} else {
+				ixdirty = 1;
 			}
-			while ((e = readdir( d ))) {
-				if (*e->d_name == '.')
-					continue;
+			for (k = 0; ; ) {
+				if (d) {
+					if (!(e = readdir( d )))
+						break;
+					name = e->d_name;
+					if (*name == '.')
+						continue;
+				} else {
+					for (; k < ctx->index->nents && ctx->index->ents[k].recent != i; k++) {}
+					if (k == ctx->index->nents)
+						break;
+					name = ctx->index->ents[k++].base;
+				}
 				ctx->gen.count++;
 				ctx->gen.recent += i;
+				if (nix) {
+					ie = index_add( nix, name, i );
+					if (ctx->index && (oie = index_find( ctx->index, conf->info_stop, name ))) {
+						ie->size = oie->size;
+						ie->tuid_state = oie->tuid_state;
+						memcpy( ie->tuid, oie->tuid, TUIDL );
+					}
+				}
 #ifdef USE_DB
 				if (ctx->db) {
-					make_key( conf->info_stop, &key, e->d_name );
+					make_key( conf->info_stop, &key, (char *)name );
 					if ((ret = ctx->db->get( ctx->db, 0, &key, &value, 0 ))) {
 						if (ret != DB_NOTFOUND) {
 							ctx->db->err( ctx->db, ret, "Maildir error: db->get()" );
 						  mbork:
 							maildir_free_scan( msglist );
-							closedir( d );
+							if (d)
+								closedir( d );
+							free_scan_index( nix );
 							goto bork;
 						}
 						uid = INT_MAX;
@@ -718,10 +1037,12 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				} else
 #endif /* USE_DB */
 				{
-					uid = (ctx->uvok && (u = strstr( e->d_name, ",U=" ))) ? atoi( u + 3 ) : 0;
+					uid = (ctx->uvok && (u = strstr( name, ",U=" ))) ? atoi( u + 3 ) : 0;
 					if (!uid)
 						uid = INT_MAX;
 				}
+				if (since && uid < sinceuid && maildir_arrived_since( name, since ))
+					sinceuid = uid;
 				if (uid <= ctx->maxuid) {
 					if (uid < ctx->minuid) {
 						for (j = 0; j < ctx->nexcs; j++)
@@ -735,14 +1056,16 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 						msglist->ents = nfrealloc( msglist->ents, msglist->nalloc * sizeof(msg_t) );
 					}
 					entry = &msglist->ents[msglist->nents++];
-					entry->base = nfstrdup( e->d_name );
+					entry->base = nfstrdup( name );
 					entry->uid = uid;
 					entry->recent = i;
+					entry->ix = nix ? nix->nents - 1 : -1;
 					entry->size = 0;
 					entry->tuid[0] = 0;
 				}
 			}
-			closedir( d );
+			if (d)
+				closedir( d );
 		}
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
@@ -788,7 +1111,24 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 			tdb->close( tdb, 0 );
 		}
 #endif /* USE_DB */
+		if (since) {
+			/* The messages without UID will be numbered above all others. */
+			for (i = j = 0; i < msglist->nents; i++) {
+				if (msglist->ents[i].uid < sinceuid)
+					free( msglist->ents[i].base );
+				else
+					msglist->ents[j++] = msglist->ents[i];
+			}
+			msglist->nents = j;
+		}
 		qsort( msglist->ents, msglist->nents, sizeof(msg_t), maildir_compare );
+		/* The messages without UID sort last; number them in one go. */
+		for (j = msglist->nents; j > 0 && msglist->ents[j - 1].uid == INT_MAX; j--) {}
+		if (msglist->nents - j > 1 && (ret = maildir_bump_uids( ctx, msglist->nents - j )) != DRV_OK) {
+			maildir_free_scan( msglist );
+			free_scan_index( nix );
+			return ret;
+		}
 		for (uid = i = 0; i < msglist->nents; i++) {
 			entry = &msglist->ents[i];
 			if (entry->uid != INT_MAX) {
@@ -797,6 +1137,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					/* See comment in maildir_uidval_lock() why this is fatal. */
 					error( "Maildir error: duplicate UID %d.\n", uid );
 					maildir_free_scan( msglist );
+					free_scan_index( nix );
 					return DRV_BOX_BAD;
 #else
 					info( "Maildir notice: duplicate UID; changing UIDVALIDITY.\n");
@@ -814,6 +1155,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					 * situation might indicate some serious trouble, so let's not make it worse. */
 					error( "Maildir error: UID %d is beyond highest assigned UID %d.\n", uid, ctx->nuid );
 					maildir_free_scan( msglist );
+					free_scan_index( nix );
 					return DRV_BOX_BAD;
 				}
 				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid))
@@ -822,6 +1164,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 			} else if (ctx->db) {
 				if ((ret = maildir_set_uid( ctx, entry->base, &uid )) != DRV_OK) {
 					maildir_free_scan( msglist );
+					free_scan_index( nix );
 					return ret;
 				}
 				entry->uid = uid;
@@ -831,6 +1174,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 			} else {
 				if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
 					maildir_free_scan( msglist );
+					free_scan_index( nix );
 					return ret;
 				}
 				entry->uid = uid;
@@ -844,11 +1188,12 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					+ 1 - 4;
 				memcpy( nbuf, buf, bl + 4 );
 				nfsnprintf( nbuf + bl + 4, sizeof(nbuf) - bl - 4, "%s", entry->base );
-				if (rename( nbuf, buf )) {
+				if (md_rename( ctx, nbuf, buf )) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot rename %s to %s", nbuf, buf );
 					  fail:
 						maildir_free_scan( msglist );
+						free_scan_index( nix );
 						return DRV_BOX_BAD;
 					}
 				  retry:
@@ -858,18 +1203,47 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				free( entry->base );
 				entry->base = nfmalloc( fnl );
 				memcpy( entry->base, buf + bl + 4, fnl );
+				if (nix) {
+					ie = &nix->ents[entry->ix];
+					free( ie->base );
+					ie->base = nfstrdup( entry->base );
+					ixdirty = 1;
+				}
 			}
+			if (since && sinceuid == INT_MAX) {
+				/* Just numbered, and no recent message precedes it. */
+				if (!maildir_arrived_since( entry->base, since )) {
+					free( entry->base );
+					entry->base = 0;
+					continue;
+				}
+				sinceuid = uid;
+			}
+			ie = nix ? &nix->ents[entry->ix] : 0;
 			if (ctx->gen.opts & OPEN_SIZE) {
-				if (stat( buf, &st )) {
-					if (errno != ENOENT) {
-						sys_error( "Maildir error: cannot stat %s", buf );
-						goto fail;
+				if (ie && ie->size >= 0) {
+					entry->size = ie->size;
+				} else {
+					if (stat( buf, &st )) {
+						if (errno != ENOENT) {
+							sys_error( "Maildir error: cannot stat %s", buf );
+							goto fail;
+						}
+						goto retry;
+					}
+					entry->size = st.st_size;
+					if (ie) {
+						ie->size = entry->size;
+						ixdirty = 1;
 					}
-					goto retry;
 				}
-				entry->size = st.st_size;
 			}
 			if ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid) {
+				if (ie && ie->tuid_state != TUID_UNKNOWN) {
+					if (ie->tuid_state == TUID_KNOWN)
+						memcpy( entry->tuid, ie->tuid, TUIDL );
+					continue;
+				}
 				if (!(f = fopen( buf, "r" ))) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot open %s", buf );
@@ -886,9 +1260,34 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					}
 				}
 				fclose( f );
+				if (ie) {
+					ie->tuid_state = entry->tuid[0] ? TUID_KNOWN : TUID_NONE;
+					memcpy( ie->tuid, entry->tuid, TUIDL );
+					ixdirty = 1;
+				}
 			}
 		}
+		if (since) {
+			for (i = j = 0; i < msglist->nents; i++)
+				if (msglist->ents[i].base)
+					msglist->ents[j++] = msglist->ents[i];
+			msglist->nents = j;
+			ctx->gen.sinceuid = sinceuid;
+		}
+#ifdef USE_DB
+		if (ctx->dbdirty && (ret = maildir_sync_db( ctx )) != DRV_OK) {
+			maildir_free_scan( msglist );
+			free_scan_index( nix );
+			return ret;
+		}
+#endif /* USE_DB */
 		ctx->uvok = 1;
+		if (nix) {
+			if (ixdirty)
+				maildir_write_index( ctx, nix );
+			free_scan_index( ctx->index );
+			ctx->index = nix;
+		}
 	}
 #ifdef USE_DB
 	if (!ctx->db)
@@ -904,6 +1303,7 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 	entry->base = 0; /* prevent deletion */
 	msg->gen.size = entry->size;
 	msg->gen.srec = 0;
+	msg->gen.msgid = 0;
 	strncpy( msg->gen.tuid, entry->tuid, TUIDL );
 	if (entry->recent)
 		msg->gen.status |= M_RECENT;
@@ -917,7 +1317,7 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 static void
 maildir_app_msg( maildir_store_t *ctx, message_t ***msgapp, msg_t *entry )
 {
-	maildir_message_t *msg = nfmalloc( sizeof(*msg) );
+	maildir_message_t *msg = pool_alloc( &ctx->gen.msg_pool, sizeof(*msg) );
 	msg->gen.next = **msgapp;
 	**msgapp = &msg->gen;
 	*msgapp = &msg->gen.next;
@@ -937,12 +1337,16 @@ maildir_select( store_t *gctx, const char *name, int create,
 #endif /* USE_DB */
 	char uvpath[_POSIX_PATH_MAX];
 
+	maildir_flush_stores( ctx );
 	maildir_cleanup( gctx );
 	gctx->msgs = 0;
 	ctx->excs = 0;
+	ctx->index = 0;
 	ctx->uvfd = -1;
+	ctx->nrsv = 0;
 #ifdef USE_DB
 	ctx->db = 0;
+	ctx->dbdirty = 0;
 #endif /* USE_DB */
 	if (starts_with( name, -1, "INBOX", 5 ) && (!name[5] || name[5] == '/')) {
 		gctx->path = maildir_join_path( ((maildir_store_conf_t *)gctx->conf)->inbox, name + 5 );
@@ -1040,6 +1444,43 @@ maildir_select( store_t *gctx, const char *name, int create,
 	cb( DRV_OK, aux );
 }
 
+/* The directories' modification times change whenever messages are added,
+ * removed, or renamed to change their flags. */
+static void
+maildir_box_fingerprint( store_t *gctx, const char *name,
+                         void (*cb)( int sts, const char *fp, void *aux ), void *aux )
+{
+	const char *prefix;
+	char *path;
+	time_t now, stamps[3];
+	struct stat st;
+	int i, pl;
+	char buf[_POSIX_PATH_MAX], fp[80];
+
+	if (starts_with( name, -1, "INBOX", 5 ) && (!name[5] || name[5] == '/')) {
+		prefix = ((maildir_store_conf_t *)gctx->conf)->inbox;
+		name += 5;
+	} else if (!(prefix = gctx->conf->path)) {
+		cb( DRV_OK, 0, aux );
+		return;
+	}
+	path = maildir_join_path( prefix, name );
+	pl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", path );
+	free( path );
+	now = time( 0 );
+	for (i = 0; i < 3; i++) {
+		strcpy( buf + pl, i ? subdirs[i - 1] : "" );
+		/* Later modifications during the same second would go unnoticed. */
+		if (stat( buf, &st ) || st.st_mtime >= now) {
+			cb( DRV_OK, 0, aux );
+			return;
+		}
+		stamps[i] = st.st_mtime;
+	}
+	nfsnprintf( fp, sizeof(fp), "%ld %ld %ld", (long)stamps[0], (long)stamps[1], (long)stamps[2] );
+	cb( DRV_OK, fp, aux );
+}
+
 static void
 maildir_prepare_opts( store_t *gctx, int opts )
 {
@@ -1064,16 +1505,22 @@ maildir_load( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int
 	ctx->newuid = newuid;
 	ctx->excs = nfrealloc( excs, nexcs * sizeof(int) );
 	ctx->nexcs = nexcs;
+	gctx->sinceuid = INT_MAX;
 
 	if (ctx->fresh) {
 		ctx->gen.count = ctx->gen.recent = 0;
 		goto dontscan;
 	}
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK) {
+	if (maildir_scan( ctx, &msglist, gctx->since ) != DRV_OK) {
 		cb( DRV_BOX_BAD, aux );
 		return;
 	}
+	if (gctx->since && ctx->minuid < gctx->sinceuid) {
+		/* Keep rescans in line with what was loaded. */
+		ctx->minuid = gctx->sinceuid;
+		ctx->nexcs = 0;
+	}
 	msgapp = &ctx->gen.msgs;
 	for (i = 0; i < msglist.nents; i++)
 		maildir_app_msg( ctx, &msgapp, msglist.ents + i );
@@ -1091,7 +1538,7 @@ maildir_rescan( maildir_store_t *ctx )
 	msglist_t msglist;
 	int i;
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK)
+	if (maildir_scan( ctx, &msglist, 0 ) != DRV_OK)
 		return DRV_BOX_BAD;
 	for (msgapp = &ctx->gen.msgs, i = 0;
 	     (msg = (maildir_message_t *)*msgapp) || i < msglist.nents; )
@@ -1148,14 +1595,22 @@ maildir_again( maildir_store_t *ctx, maildir_message_t *msg,
 	return (msg->gen.status & M_DEAD) ? DRV_MSG_BAD : DRV_OK;
 }
 
+#define READ_CHUNK 65536
+/* Messages with a bigger header are not identified for DetectMoves. */
+#define MAX_IDENT_HDR (16 * READ_CHUNK)
+/* Smaller messages are cheaper to read than to map. */
+#define MAP_MIN_SIZE 65536
+
 static void
 maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
                    void (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
-	int fd, ret;
+	int fd, ret, left, n;
 	struct stat st;
+	char *chunk;
+	void *base;
 	char buf[_POSIX_PATH_MAX];
 
 	for (;;) {
@@ -1171,12 +1626,34 @@ maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
 	data->len = st.st_size;
 	if (data->date == -1)
 		data->date = st.st_mtime;
-	data->data = nfmalloc( data->len );
-	if (read( fd, data->data, data->len ) != data->len) {
-		sys_error( "Maildir error: cannot read %s", buf );
-		close( fd );
-		cb( DRV_MSG_BAD, aux );
-		return;
+	if (data->sink) {
+		chunk = nfmalloc( READ_CHUNK );
+		for (left = data->len; left > 0; left -= n) {
+			if ((n = read( fd, chunk, left < READ_CHUNK ? left : READ_CHUNK )) <= 0) {
+				sys_error( "Maildir error: cannot read %s", buf );
+				free( chunk );
+				close( fd );
+				cb( DRV_MSG_BAD, aux );
+				return;
+			}
+			data->sink->write( data->sink, chunk, n );
+		}
+		free( chunk );
+	} else if (data->map_ok && data->len >= MAP_MIN_SIZE &&
+	           (base = mmap( 0, data->len, PROT_READ, MAP_PRIVATE, fd, 0 )) != MAP_FAILED) {
+		data->map = nfmalloc( sizeof(*data->map) );
+		data->map->base = base;
+		data->map->size = data->len;
+		data->map->off = 0;
+		data->len = 0;
+	} else {
+		data->data = nfmalloc( data->len );
+		if (read( fd, data->data, data->len ) != data->len) {
+			sys_error( "Maildir error: cannot read %s", buf );
+			close( fd );
+			cb( DRV_MSG_BAD, aux );
+			return;
+		}
 	}
 	close( fd );
 	if (!(gmsg->status & M_FLAGS))
@@ -1199,99 +1676,331 @@ maildir_make_flags( char info_delimiter, int flags, char *buf )
 	return d;
 }
 
+typedef struct maildir_sink {
+	msg_sink_t gen;
+	struct maildir_sink *next;
+	const char *box;
+	int fd, uid, failed;
+	/* for the group commit */
+	int subdir;
+	maildir_message_t *replace; /* the message whose file is to be overwritten */
+	void (*cb)( int sts, int uid, void *aux );
+	void *aux;
+	char base[128];
+	char fbuf[NUM_FLAGS + 3];
+	char tmp[_POSIX_PATH_MAX];
+} maildir_sink_t;
+
+/* Maximal number of messages (and thus open files) awaiting a group commit. */
+#define MAX_PENDING_STORES 100
+
 static void
-maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
-                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+maildir_write_msg( msg_sink_t *gsink, const char *buf, int len )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	const char *box;
-	int ret, fd, bl, uid;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+	maildir_sink_t *sink = (maildir_sink_t *)gsink;
+	int ret;
 
-	bl = nfsnprintf( base, sizeof(base), "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
-	if (!to_trash) {
+	if (sink->failed)
+		return;
+	if ((ret = write( sink->fd, buf, len )) != len) {
+		if (ret < 0)
+			sys_error( "Maildir error: cannot write %s", sink->tmp );
+		else
+			error( "Maildir error: cannot write %s. Disk full?\n", sink->tmp );
+		sink->failed = 1;
+	}
+}
+
+/* Make up the file name of a new message and assign it a UID, unless it goes to the trash. */
+static int
+maildir_new_base( maildir_store_t *ctx, int to_trash, char *base, int bsz, int *uid )
+{
+	int ret, bl;
+
+	*uid = 0;
+	bl = nfsnprintf( base, bsz, "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	if (to_trash)
+		return DRV_OK;
 #ifdef USE_DB
-		if (ctx->db) {
-			if ((ret = maildir_set_uid( ctx, base, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
-		} else
+	if (ctx->db)
+		return maildir_set_uid( ctx, base, uid );
 #endif /* USE_DB */
-		{
-			if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
-			    (ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
-			maildir_uidval_unlock( ctx );
-			nfsnprintf( base + bl, sizeof(base) - bl, ",U=%d", uid );
-		}
-		box = gctx->path;
+	if (ctx->nrsv) {
+		maildir_obtain_uid( ctx, uid );
+	} else if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
+	           (ret = maildir_obtain_uid( ctx, uid )) != DRV_OK) {
+		return ret;
 	} else {
-		box = ctx->trash;
+		maildir_uidval_unlock( ctx );
 	}
+	nfsnprintf( base + bl, bsz - bl, ",U=%d", *uid );
+	return DRV_OK;
+}
+
+static int
+maildir_open_msg( store_t *gctx, int to_trash, msg_sink_t **sinkp )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_sink_t *sink;
+	const char *box;
+	int ret;
 
-	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, data->flags, fbuf );
-	nfsnprintf( buf, sizeof(buf), "%s/tmp/%s%s", box, base, fbuf );
-	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+	sink = nfmalloc( sizeof(*sink) );
+	if ((ret = maildir_new_base( ctx, to_trash, sink->base, sizeof(sink->base), &sink->uid )) != DRV_OK) {
+		free( sink );
+		return ret;
+	}
+	box = to_trash ? ctx->trash : gctx->path;
+
+	nfsnprintf( sink->tmp, sizeof(sink->tmp), "%s/tmp/%s", box, sink->base );
+	if ((sink->fd = open( sink->tmp, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
 		if (errno != ENOENT || !to_trash) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+			sys_error( "Maildir error: cannot create %s", sink->tmp );
+			free( sink );
+			return DRV_BOX_BAD;
 		}
 		if ((ret = maildir_validate( box, 1, ctx )) != DRV_OK) {
-			free( data->data );
-			cb( ret, 0, aux );
-			return;
+			free( sink );
+			return ret;
 		}
-		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+		if ((sink->fd = open( sink->tmp, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+			sys_error( "Maildir error: cannot create %s", sink->tmp );
+			free( sink );
+			return DRV_BOX_BAD;
 		}
 	}
-	ret = write( fd, data->data, data->len );
-	free( data->data );
-	if (ret != data->len || (UseFSync && (ret = fsync( fd )))) {
-		if (ret < 0)
-			sys_error( "Maildir error: cannot write %s", buf );
-		else
-			error( "Maildir error: cannot write %s. Disk full?\n", buf );
-		close( fd );
-		cb( DRV_BOX_BAD, 0, aux );
+	sink->gen.write = maildir_write_msg;
+	sink->box = box;
+	sink->replace = 0;
+	sink->failed = 0;
+	*sinkp = &sink->gen;
+	return DRV_OK;
+}
+
+/* The final name of a message. Any replaced message's name is looked up only
+ * now, as a flag change might have renamed it in the meantime. */
+static void
+maildir_sink_name( maildir_sink_t *sink, char *buf, int bsz )
+{
+	if (sink->replace)
+		nfsnprintf( buf, bsz, "%s/%s/%s", sink->box,
+		            subdirs[sink->replace->gen.status & M_RECENT], sink->replace->base );
+	else
+		nfsnprintf( buf, bsz, "%s/%s/%s%s", sink->box, subdirs[sink->subdir], sink->base, sink->fbuf );
+}
+
+static int
+maildir_sync_dir( maildir_store_t *ctx, const char *box, int subdir )
+{
+	int fd, ret;
+	char buf[_POSIX_PATH_MAX];
+
+	nfsnprintf( buf, sizeof(buf), "%s/%s", box, subdirs[subdir] );
+	if ((fd = open( buf, O_RDONLY )) < 0) {
+		sys_error( "Maildir error: cannot open directory %s", buf );
+		return -1;
+	}
+	ctx->gen.stats.fsyncs++;
+	if ((ret = fsync( fd )))
+		sys_error( "Maildir error: cannot fsync directory %s", buf );
+	close( fd );
+	return ret;
+}
+
+/* Make the pending messages durable and move them into place. The data of all
+ * messages is flushed first (with a single syncfs() if possible), then they are
+ * renamed, and finally the directories are flushed. Only then are the callbacks
+ * invoked, so the journal never refers to a message which might get lost. */
+static void
+maildir_flush_stores( maildir_store_t *ctx )
+{
+	maildir_sink_t *sink, *pending;
+	int i, j, nd, synced;
+	const char *dbox[4];
+	int dsub[4], dbad[4];
+	char nbuf[_POSIX_PATH_MAX];
+
+	if (!(pending = ctx->pending))
 		return;
+	ctx->pending = 0;
+	ctx->pending_append = &ctx->pending;
+	ctx->npending = 0;
+
+	synced = 0;
+#ifdef HAVE_SYNCFS
+	/* This reports only write-back errors which have not been reported yet,
+	 * but a failing close() or the per-file fallback will catch the others. */
+	ctx->gen.stats.fsyncs++;
+	if (!syncfs( pending->fd ))
+		synced = 1;
+#endif
+	nd = 0;
+	for (sink = pending; sink; sink = sink->next) {
+		if (!synced && md_fdatasync( ctx, sink->fd )) {
+			sys_error( "Maildir error: cannot write %s", sink->tmp );
+			close( sink->fd );
+			goto bad;
+		}
+		if (close( sink->fd ) < 0) {
+			/* Quota exceeded may cause this. */
+			sys_error( "Maildir error: cannot write %s", sink->tmp );
+			goto bad;
+		}
+		maildir_sink_name( sink, nbuf, sizeof(nbuf) );
+		if (md_rename( ctx, sink->tmp, nbuf )) {
+			sys_error( "Maildir error: cannot rename %s to %s", sink->tmp, nbuf );
+			sink->failed = 1;
+			continue;
+		}
+		for (i = 0; i < nd; i++)
+			if (dbox[i] == sink->box && dsub[i] == sink->subdir)
+				break;
+		if (i == nd) {
+			dbox[nd] = sink->box;
+			dsub[nd++] = sink->subdir;
+		}
+		continue;
+	  bad:
+		unlink( sink->tmp );
+		sink->failed = 1;
 	}
-	if (close( fd ) < 0) {
-		/* Quota exceeded may cause this. */
-		sys_error( "Maildir error: cannot write %s", buf );
-		cb( DRV_BOX_BAD, 0, aux );
+	for (i = 0; i < nd; i++)
+		dbad[i] = maildir_sync_dir( ctx, dbox[i], dsub[i] );
+#ifdef USE_DB
+	if (ctx->dbdirty && maildir_sync_db( ctx ) != DRV_OK)
+		for (sink = pending; sink; sink = sink->next)
+			sink->failed = 1;
+#endif /* USE_DB */
+
+	while ((sink = pending)) {
+		pending = sink->next;
+		if (!sink->failed)
+			for (j = 0; j < nd; j++)
+				if (dbox[j] == sink->box && dsub[j] == sink->subdir && dbad[j])
+					sink->failed = 1;
+		if (sink->failed)
+			sink->cb( DRV_BOX_BAD, 0, sink->aux );
+		else
+			sink->cb( DRV_OK, sink->uid, sink->aux );
+		free( sink );
+	}
+}
+
+static void
+maildir_discard_stores( maildir_store_t *ctx )
+{
+	maildir_sink_t *sink;
+
+	while ((sink = ctx->pending)) {
+		ctx->pending = sink->next;
+		close( sink->fd );
+		unlink( sink->tmp );
+		free( sink );
+	}
+	ctx->pending_append = &ctx->pending;
+	ctx->npending = 0;
+}
+
+#ifdef USE_DB
+static int maildir_purge_msg( maildir_store_t *ctx, const char *name );
+#endif /* USE_DB */
+
+static void
+maildir_close_msg( store_t *gctx, msg_sink_t *gsink, msg_data_t *data,
+                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_sink_t *sink = (maildir_sink_t *)gsink;
+	int uid;
+	char nbuf[_POSIX_PATH_MAX];
+
+	if (!data) {
+		close( sink->fd );
+		unlink( sink->tmp );
+		free( sink );
 		return;
 	}
+	if (sink->failed) {
+		close( sink->fd );
+		goto bail;
+	}
 
 	if (data->date) {
 		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
 		struct utimbuf utimebuf;
 		utimebuf.actime = utimebuf.modtime = data->date;
-		if (utime( buf, &utimebuf ) < 0) {
-			sys_error( "Maildir error: cannot set times for %s", buf );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+		if (utime( sink->tmp, &utimebuf ) < 0) {
+			sys_error( "Maildir error: cannot set times for %s", sink->tmp );
+			close( sink->fd );
+			goto bail;
 		}
 	}
 
-	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
-	nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s%s", box, subdirs[!(data->flags & F_SEEN)], base, fbuf );
-	if (rename( buf, nbuf )) {
-		sys_error( "Maildir error: cannot rename %s to %s", buf, nbuf );
-		cb( DRV_BOX_BAD, 0, aux );
+	if (data->replace) {
+		/* The file takes over the name of the message, and thus its UID and flags. */
+#ifdef USE_DB
+		if (ctx->db && maildir_purge_msg( ctx, sink->base ) != DRV_OK) {
+			close( sink->fd );
+			goto bail;
+		}
+#endif /* USE_DB */
+		sink->replace = (maildir_message_t *)data->replace;
+		sink->subdir = data->replace->status & M_RECENT;
+		sink->uid = data->replace->uid;
+	} else {
+		/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
+		maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, data->flags, sink->fbuf );
+		sink->subdir = !(data->flags & F_SEEN);
+	}
+
+	if (UseFSync) {
+		/* Defer the flushing, so it can be done for many messages at once. */
+		sink->cb = cb;
+		sink->aux = aux;
+		sink->next = 0;
+		*ctx->pending_append = sink;
+		ctx->pending_append = &sink->next;
+		if (++ctx->npending >= MAX_PENDING_STORES)
+			maildir_flush_stores( ctx );
 		return;
 	}
+
+	if (close( sink->fd ) < 0) {
+		/* Quota exceeded may cause this. */
+		sys_error( "Maildir error: cannot write %s", sink->tmp );
+		goto bail;
+	}
+	maildir_sink_name( sink, nbuf, sizeof(nbuf) );
+	if (md_rename( ctx, sink->tmp, nbuf )) {
+		sys_error( "Maildir error: cannot rename %s to %s", sink->tmp, nbuf );
+		goto bail;
+	}
+	uid = sink->uid;
+	free( sink );
 	cb( DRV_OK, uid, aux );
+	return;
+
+  bail:
+	unlink( sink->tmp );
+	free( sink );
+	cb( DRV_BOX_BAD, 0, aux );
+}
+
+static void
+maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
+                   void (*cb)( int sts, int uid, void *aux ), void *aux )
+{
+	msg_sink_t *sink;
+	int ret;
+
+	if ((ret = maildir_open_msg( gctx, to_trash, &sink )) != DRV_OK) {
+		free( data->data );
+		cb( ret, 0, aux );
+		return;
+	}
+	sink->write( sink, data->data, data->len );
+	free( data->data );
+	maildir_close_msg( gctx, sink, data, cb, aux );
 }
 
 static void
@@ -1343,7 +2052,7 @@ maildir_set_flags( store_t *gctx, message_t *gmsg, int uid ATTR_UNUSED, int add,
 		} else {
 			tl = ol + maildir_make_flags( conf->info_delimiter, msg->gen.flags, nbuf + bl + ol );
 		}
-		if (!rename( buf, nbuf ))
+		if (!md_rename( ctx, buf, nbuf ))
 			break;
 		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot rename %s to %s", buf, nbuf )) != DRV_OK) {
 			cb( ret, aux );
@@ -1391,14 +2100,14 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 		s = strstr( msg->base, ((maildir_store_conf_t *)gctx->conf)->info_prefix );
 		nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%ld.%d_%d.%s%s", ctx->trash,
 		            subdirs[gmsg->status & M_RECENT], (long)time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
-		if (!rename( buf, nbuf ))
+		if (!md_rename( ctx, buf, nbuf ))
 			break;
 		if (!stat( buf, &st )) {
 			if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK) {
 				cb( ret, aux );
 				return;
 			}
-			if (!rename( buf, nbuf ))
+			if (!md_rename( ctx, buf, nbuf ))
 				break;
 			if (errno != ENOENT) {
 				sys_error( "Maildir error: cannot move %s to %s", buf, nbuf );
@@ -1423,13 +2132,173 @@ maildir_trash_msg( store_t *gctx, message_t *gmsg,
 	cb( DRV_OK, aux );
 }
 
+/* With OPEN_STASH, expunged messages are set aside in the tmp/ directory
+ * of their mailbox until the end of the run, in case they reappear in
+ * another mailbox, i.e., they were actually moved on the other side. */
+typedef struct moved_msg {
+	struct moved_msg *next;
+	char *path;
+	int size; /* as passed to adopt_msg() */
+	char msgid[1];
+} moved_msg_t;
+
+#define MOVED_BUCKETS 256
+
+static moved_msg_t *MovedMsgs[MOVED_BUCKETS];
+
+/* Determine the Message-ID of a message file, and the size which the message
+ * would have in a store with CRLF line endings, not counting the X-TUID.
+ * Only the header is kept in memory; the body is just scanned for LFs. */
+static int
+maildir_ident_msg( const char *path, char *msgid, int *sizep )
+{
+	int fd, n, hl, ls, size, cr, inhdr, ret = -1;
+	struct stat st;
+	char *hdr = 0, *buf, *b, *s, *p, *e, lc;
+
+	if ((fd = open( path, O_RDONLY )) < 0)
+		return -1;
+	if (fstat( fd, &st ) || st.st_size >= INT_MAX / 2) {
+		close( fd );
+		return -1;
+	}
+	buf = nfmalloc( READ_CHUNK );
+	size = hl = ls = 0;
+	inhdr = 1;
+	lc = '\n';
+	while ((n = read( fd, buf, READ_CHUNK ))) {
+		if (n < 0)
+			goto bail;
+		size += n;
+		s = buf;
+		e = buf + n;
+		if (inhdr) {
+			if (hl + n > MAX_IDENT_HDR)
+				goto bail;
+			hdr = nfrealloc( hdr, hl + n );
+			memcpy( hdr + hl, buf, n );
+			hl += n;
+			for (s = hdr + ls, e = hdr + hl; (p = memchr( s, '\n', e - s )); s = p + 1) {
+				cr = (p > s && p[-1] == '\r');
+				if (!cr)
+					size++;
+				if (p - s == cr) {
+					inhdr = 0;
+					s = p + 1;
+					break;
+				}
+				if (starts_with( s, p - s, "X-TUID: ", 8 ))
+					size -= p - s + 1 + !cr;
+			}
+			ls = s - hdr;
+			if (inhdr)
+				continue;
+			if (!find_msgid( hdr, ls, msgid ))
+				goto bail;
+			/* The rest of the buffered data belongs to the body. */
+		}
+		for (b = s; (p = memchr( s, '\n', e - s )); s = p + 1)
+			if ((p > b ? p[-1] : lc) != '\r')
+				size++;
+		lc = e[-1];
+	}
+	if (!inhdr || find_msgid( hdr, hl, msgid )) {
+		*sizep = size;
+		ret = 0;
+	}
+  bail:
+	free( hdr );
+	free( buf );
+	close( fd );
+	return ret;
+}
+
+static int
+maildir_stash_msg( maildir_store_t *ctx, const char *path, const char *base )
+{
+	moved_msg_t *mm, **mmp;
+	int size, ml;
+	char msgid[MSGIDL], nbuf[_POSIX_PATH_MAX];
+
+	if (maildir_ident_msg( path, msgid, &size ) < 0)
+		return -1;
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/tmp/%s", ctx->gen.path, base );
+	if (md_rename( ctx, path, nbuf ))
+		return -1;
+	ml = strlen( msgid );
+	mm = nfmalloc( sizeof(*mm) + ml );
+	mm->path = nfstrdup( nbuf );
+	mm->size = size;
+	memcpy( mm->msgid, msgid, ml + 1 );
+	mmp = &MovedMsgs[index_hash( msgid, ml ) % MOVED_BUCKETS];
+	mm->next = *mmp;
+	*mmp = mm;
+	debug( "setting aside %s for adoption\n", nbuf );
+	return 0;
+}
+
+static int
+maildir_adopt_msg( store_t *gctx, const char *msgid, int size, int flags, int *uid )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	moved_msg_t *mm, **mmp;
+	int ret, subdir;
+	char base[128], fbuf[NUM_FLAGS + 3], nbuf[_POSIX_PATH_MAX];
+
+	for (mmp = &MovedMsgs[index_hash( msgid, strlen( msgid ) ) % MOVED_BUCKETS]; (mm = *mmp); mmp = &mm->next)
+		if (mm->size == size && !strcmp( mm->msgid, msgid ))
+			goto found;
+	return DRV_MSG_BAD;
+  found:
+	*mmp = mm->next;
+	if ((ret = maildir_new_base( ctx, 0, base, sizeof(base), uid )) != DRV_OK) {
+		unlink( mm->path );
+		goto out;
+	}
+	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, flags, fbuf );
+	subdir = !(flags & F_SEEN);
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s%s", gctx->path, subdirs[subdir], base, fbuf );
+	if (md_rename( ctx, mm->path, nbuf )) {
+		/* Most likely, the mailboxes are on different file systems. */
+		debug( "cannot adopt %s: %s\n", mm->path, strerror( errno ) );
+		unlink( mm->path );
+		ret = DRV_MSG_BAD;
+		goto out;
+	}
+	debug( "adopted %s as %s\n", mm->path, nbuf );
+#ifdef USE_DB
+	if (ctx->dbdirty && (ret = maildir_sync_db( ctx )) != DRV_OK)
+		goto out;
+#endif /* USE_DB */
+	if (UseFSync && maildir_sync_dir( ctx, gctx->path, subdir ))
+		ret = DRV_BOX_BAD;
+  out:
+	free( mm->path );
+	free( mm );
+	return ret;
+}
+
+static void
+maildir_drop_moved( void )
+{
+	moved_msg_t *mm;
+	int i;
+
+	for (i = 0; i < MOVED_BUCKETS; i++) {
+		while ((mm = MovedMsgs[i])) {
+			MovedMsgs[i] = mm->next;
+			unlink( mm->path );
+			free( mm->path );
+			free( mm );
+		}
+	}
+}
+
 static void
 maildir_close( store_t *gctx,
                void (*cb)( int sts, void *aux ), void *aux )
 {
-#ifdef USE_DB
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-#endif /* USE_DB */
 	message_t *msg;
 	int basel, retry, ret;
 	char buf[_POSIX_PATH_MAX];
@@ -1440,7 +2309,7 @@ maildir_close( store_t *gctx,
 		for (msg = gctx->msgs; msg; msg = msg->next)
 			if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
 				nfsnprintf( buf + basel, sizeof(buf) - basel, "%s/%s", subdirs[msg->status & M_RECENT], ((maildir_message_t *)msg)->base );
-				if (unlink( buf )) {
+				if ((!(gctx->opts & OPEN_STASH) || maildir_stash_msg( ctx, buf, ((maildir_message_t *)msg)->base )) && unlink( buf )) {
 					if (errno == ENOENT)
 						retry = 1;
 					else
@@ -1468,16 +2337,51 @@ maildir_close( store_t *gctx,
 }
 
 static void
-maildir_cancel( store_t *gctx ATTR_UNUSED,
+maildir_cancel( store_t *gctx,
                 void (*cb)( void *aux ), void *aux )
 {
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_sink_t *sink;
+
+	while ((sink = ctx->pending)) {
+		ctx->pending = sink->next;
+		close( sink->fd );
+		unlink( sink->tmp );
+		sink->cb( DRV_CANCELED, 0, sink->aux );
+		free( sink );
+	}
+	ctx->pending_append = &ctx->pending;
+	ctx->npending = 0;
 	cb( aux );
 }
 
+static int
+maildir_reserve_uids( store_t *gctx, int count )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	int ret;
+
+#ifdef USE_DB
+	if (ctx->db)
+		return maildir_bump_uids( ctx, count );
+#endif /* USE_DB */
+	if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
+		return ret;
+	ret = maildir_bump_uids( ctx, count );
+	maildir_uidval_unlock( ctx );
+	return ret;
+}
+
 static void
 maildir_commit( store_t *gctx )
 {
-	(void) gctx;
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+
+	maildir_flush_stores( ctx );
+#ifdef USE_DB
+	if (ctx->dbdirty)
+		maildir_sync_db( ctx );
+#endif /* USE_DB */
 }
 
 static int
@@ -1501,6 +2405,8 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep )
 		else if (!strcasecmp( "AltMap", cfg->cmd ))
 			store->alt_map = parse_bool( cfg );
 #endif /* USE_DB */
+		else if (!strcasecmp( "ScanIndex", cfg->cmd ))
+			store->scan_index = parse_bool( cfg );
 		else if (!strcasecmp( "InfoDelimiter", cfg->cmd )) {
 			if (strlen( cfg->val ) != 1) {
 				error( "%s:%d: Info delimiter must be exactly one character long\n", cfg->file, cfg->line );
@@ -1524,22 +2430,30 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep )
 }
 
 struct driver maildir_driver = {
-	0, /* XXX DRV_CRLF? */
+	DRV_REPLACE, /* XXX DRV_CRLF? */
 	maildir_parse_store,
 	maildir_cleanup_drv,
 	maildir_open_store,
 	maildir_disown_store,
 	maildir_disown_store, /* _cancel_, but it's the same */
 	maildir_list,
+	maildir_box_fingerprint,
 	maildir_prepare_opts,
 	maildir_select,
+	0, /* find_since: load() does it while scanning anyway */
 	maildir_load,
 	maildir_fetch_msg,
+	maildir_reserve_uids,
 	maildir_store_msg,
+	maildir_open_msg,
+	maildir_close_msg,
+	maildir_adopt_msg,
+	maildir_drop_moved,
 	maildir_find_new_msgs,
 	maildir_set_flags,
 	maildir_trash_msg,
 	maildir_close,
 	maildir_cancel,
 	maildir_commit,
+	0, /* idle: new messages are found by the next scan */
 };
@@ -0,0 +1,596 @@
+#! /usr/bin/perl -w
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# A minimal IMAP server for benchmarking mbsync. The mailboxes live in
+# memory for the server's lifetime, so consecutive sessions see each
+# other's changes. Each session starts out pre-authenticated.
+#
+# A "round trip" is counted whenever the server has answered everything
+# it was sent and needs to wait for the client. The latency is applied
+# once per round trip, i.e., to every flight of commands.
+
+use strict;
+use Compress::Raw::Zlib;
+use Getopt::Long;
+use IO::Socket::INET;
+use POSIX qw(strftime);
+use Time::HiRes qw(sleep);
+
+my %opt = (caps => "IMAP4rev1 UIDPLUS LITERAL+ MULTIAPPEND", latency => 0, bandwidth => 0);
+
+sub usage()
+{
+	print STDERR <<EOF;
+Usage: $0 [options]
+  --port N          listen on 127.0.0.1:N and serve sessions one after
+                    another until killed; with 0, a free port is chosen
+                    and printed. Without this, a single session is served
+                    on stdin/stdout, which is suitable for Tunnel.
+  --import DIR      serve the maildirs in DIR; the one named INBOX
+                    becomes the INBOX
+  --caps LIST       capabilities to announce (default: $opt{caps})
+                    CONDSTORE adds mod-sequences,
+                    COMPRESS=DEFLATE enables compression
+  --latency MS      round trip time to simulate
+  --bandwidth KB    limit the transfers to KB kilobytes per second in
+                    each direction
+  --stats FILE      append each session's counters to FILE
+  --script FILE     run the Perl code in FILE at start-up; it may define
+                    on_command(\$tag, \$cmd, \$args), which returns the
+                    tagged response to send instead of handling the
+                    command, or undef to proceed normally
+EOF
+	exit 1;
+}
+
+GetOptions(\%opt, "port=i", "import=s", "caps=s", "latency=f", "bandwidth=f",
+                  "stats=s", "script=s") or usage();
+@ARGV and usage();
+
+# name => { uidvalidity, uidnext, modseq, msgs => [ { uid, flags => {}, date, data } ] }
+our %boxes;
+our ($in, $out, %cnt);
+my ($ibuf, $obuf, $sent, $sel, $inflater, $deflater);
+
+sub has_cap($)
+{
+	my ($cap) = @_;
+	return grep { $_ eq $cap } split(/ /, $opt{caps});
+}
+
+sub new_box()
+{
+	return { uidvalidity => time() % 1000000 + 1, uidnext => 1, modseq => 1, msgs => [] };
+}
+
+sub imap_date($)
+{
+	return strftime("%d-%b-%Y %H:%M:%S +0000", gmtime(shift));
+}
+
+my %mdflags = (D => "\\Draft", F => "\\Flagged", R => "\\Answered", S => "\\Seen", T => "\\Deleted");
+
+sub import_box($$)
+{
+	my ($name, $path) = @_;
+	my $box = $boxes{$name} = new_box();
+	my @msgs = ();
+
+	for my $sd ("new", "cur") {
+		opendir(DIR, $path."/".$sd) or next;
+		for my $ent (readdir(DIR)) {
+			next if ($ent =~ /^\./);
+			my $fn = $path."/".$sd."/".$ent;
+			open(FILE, "<", $fn) or die "Cannot read $fn.\n";
+			local $/;
+			my $data = <FILE>;
+			close FILE;
+			$data =~ s/\r?\n/\r\n/g;
+			my %flags = ();
+			if ($ent =~ /:2,(\w*)$/) {
+				$flags{$mdflags{$_}} = 1 for (grep { $mdflags{$_} } split(//, $1));
+			}
+			push @msgs, { flags => \%flags, date => (stat($fn))[9], data => $data };
+		}
+		closedir DIR;
+	}
+	for my $msg (sort { $a->{date} <=> $b->{date} } @msgs) {
+		$msg->{uid} = $box->{uidnext}++;
+		push @{$box->{msgs}}, $msg;
+	}
+}
+
+sub import_tree($$);
+sub import_tree($$)
+{
+	my ($dir, $pfx) = @_;
+
+	opendir(my $dh, $dir) or die "Cannot list $dir.\n";
+	for my $ent (sort readdir($dh)) {
+		# Like in mbsync, boxes nested into other boxes start with a dot.
+		my $name = $ent;
+		next if ($pfx eq "" ? $name =~ /^\./ : $name !~ s/^\.// || $name =~ /^\.?$/);
+		next if (!-d $dir."/".$ent);
+		if (-d $dir."/".$ent."/cur") {
+			import_box($pfx.$name, $dir."/".$ent);
+		}
+		import_tree($dir."/".$ent, $pfx.$name."/");
+	}
+	closedir $dh;
+}
+
+$boxes{INBOX} = new_box();
+import_tree($opt{import}, "") if (defined($opt{import}));
+if (defined($opt{script})) {
+	-r $opt{script} or die "Cannot read $opt{script}.\n";
+	do $opt{script};
+	die "Cannot run $opt{script}: $@" if ($@);
+}
+$SIG{PIPE} = "IGNORE";
+
+################################################################################
+
+sub flush_out()
+{
+	if ($deflater && length($obuf)) {
+		my $z = "";
+		$deflater->deflate($obuf, $z) == Z_OK && $deflater->flush($z, Z_SYNC_FLUSH) == Z_OK
+			or die "Compression error.\n";
+		$obuf = $z;
+	}
+	while (length($obuf)) {
+		my $n = syswrite($out, $obuf, 65536);
+		defined($n) or die "Write error: $!\n";
+		$cnt{bytes_out} += $n;
+		substr($obuf, 0, $n, "");
+		sleep($n / ($opt{bandwidth} * 1024)) if ($opt{bandwidth});
+		$sent = 1;
+	}
+}
+
+sub send_out($)
+{
+	$obuf .= shift;
+	flush_out() if (length($obuf) >= 65536);
+}
+
+sub fill_in()
+{
+	my $flight = 0;
+
+	flush_out();
+	if ($sent) {
+		$cnt{roundtrips}++;
+		$sent = 0;
+		$flight = 1;
+	}
+	my $buf;
+	my $n = sysread($in, $buf, 65536);
+	return 0 if (!$n);
+	$cnt{bytes_in} += $n;
+	inflate_in($buf);
+	sleep($opt{latency} / 1000) if ($flight && $opt{latency});
+	sleep($n / ($opt{bandwidth} * 1024)) if ($opt{bandwidth});
+	return 1;
+}
+
+sub inflate_in($)
+{
+	my ($buf) = @_;
+	if (!$inflater) {
+		$ibuf .= $buf;
+		return;
+	}
+	my $st = $inflater->inflate($buf, $ibuf);
+	$st == Z_OK || $st == Z_BUF_ERROR or die "Decompression error: $st\n";
+}
+
+sub start_compress()
+{
+	flush_out();
+	($deflater) = Compress::Raw::Zlib::Deflate->new(-WindowBits => -MAX_WBITS(), -AppendOutput => 1);
+	($inflater) = Compress::Raw::Zlib::Inflate->new(-WindowBits => -MAX_WBITS(), -AppendOutput => 1);
+	# Whatever follows the command is compressed already.
+	my $rest = $ibuf;
+	$ibuf = "";
+	inflate_in($rest) if (length($rest));
+}
+
+sub read_line()
+{
+	my $i;
+	while (($i = index($ibuf, "\n")) < 0) {
+		fill_in() or return undef;
+	}
+	my $line = substr($ibuf, 0, $i + 1, "");
+	$line =~ s/\r?\n$//;
+	return $line;
+}
+
+sub read_bytes($)
+{
+	my ($len) = @_;
+	while (length($ibuf) < $len) {
+		fill_in() or return undef;
+	}
+	return substr($ibuf, 0, $len, "");
+}
+
+# Returns the command as a list of alternating text and literals.
+sub read_command()
+{
+	my @parts = ();
+	for (;;) {
+		my $line = read_line();
+		defined($line) or return undef;
+		if ($line =~ /^(.*)\{(\d+)(\+?)\}$/s) {
+			push @parts, $1;
+			send_out("+ go ahead\r\n") if (!$3);
+			my $lit = read_bytes($2);
+			defined($lit) or return undef;
+			push @parts, $lit;
+		} else {
+			push @parts, $line;
+			return @parts;
+		}
+	}
+}
+
+################################################################################
+
+sub unquote($)
+{
+	my ($s) = @_;
+	if ($s =~ /^"((?:[^"\\]|\\.)*)"$/) {
+		$s = $1;
+		$s =~ s/\\(.)/$1/g;
+	}
+	return $s;
+}
+
+sub quote($)
+{
+	my ($s) = @_;
+	$s =~ s/([\\"])/\\$1/g;
+	return '"'.$s.'"';
+}
+
+# Split off the leading string (quoted or atom) of $args.
+sub get_string(\$)
+{
+	my ($args) = @_;
+	$$args =~ s/^\s*("(?:[^"\\]|\\.)*"|[^\s()]+)\s*// or return undef;
+	return unquote($1);
+}
+
+# Return the indices of the messages in the UID set, in ascending order.
+# The messages are sorted by UID, so each range is found by bisection.
+sub find_set($$)
+{
+	my ($box, $set) = @_;
+	my $msgs = $box->{msgs};
+	my $max = @$msgs ? $msgs->[-1]{uid} : 1;
+	my %idx = ();
+	for my $item (split(/,/, $set)) {
+		my ($from, $to) = split(/:/, $item);
+		$to = $from if (!defined($to));
+		$from = $max if ($from eq "*");
+		$to = $max if ($to eq "*");
+		($from, $to) = ($to, $from) if ($from > $to);
+		my ($lo, $hi) = (0, scalar(@$msgs));
+		while ($lo < $hi) {
+			my $mid = int(($lo + $hi) / 2);
+			if ($msgs->[$mid]{uid} < $from) {
+				$lo = $mid + 1;
+			} else {
+				$hi = $mid;
+			}
+		}
+		for (; $lo < @$msgs && $msgs->[$lo]{uid} <= $to; $lo++) {
+			$idx{$lo} = 1;
+		}
+	}
+	return sort { $a <=> $b } keys %idx;
+}
+
+sub flag_list($)
+{
+	my ($msg) = @_;
+	return "(".join(" ", sort keys %{$msg->{flags}}).")";
+}
+
+sub box_status($$)
+{
+	my ($name, $items) = @_;
+	my $box = $boxes{$name};
+	my @r = ();
+	for my $item (split(/ /, uc($items))) {
+		if ($item eq "MESSAGES") {
+			push @r, "MESSAGES ".scalar(@{$box->{msgs}});
+		} elsif ($item eq "UIDNEXT") {
+			push @r, "UIDNEXT ".$box->{uidnext};
+		} elsif ($item eq "UIDVALIDITY") {
+			push @r, "UIDVALIDITY ".$box->{uidvalidity};
+		} elsif ($item eq "UNSEEN") {
+			push @r, "UNSEEN ".scalar(grep { !$_->{flags}{"\\Seen"} } @{$box->{msgs}});
+		} elsif ($item eq "RECENT") {
+			push @r, "RECENT 0";
+		} elsif ($item eq "HIGHESTMODSEQ" && has_cap("CONDSTORE")) {
+			push @r, "HIGHESTMODSEQ ".$box->{modseq};
+		}
+	}
+	send_out("* STATUS ".quote($name)." (".join(" ", @r).")\r\n");
+}
+
+sub list_match($$)
+{
+	my ($name, $pat) = @_;
+	$pat = quotemeta($pat);
+	$pat =~ s/\\\*/.*/g;
+	$pat =~ s/\\%/[^\/]*/g;
+	return $name =~ /^$pat$/;
+}
+
+sub expunge($$$)
+{
+	my ($box, $set, $quiet) = @_;
+	my %match = map { ($_, 1) } defined($set) ? find_set($box, $set) : (0..$#{$box->{msgs}});
+	my @keep = ();
+	my ($i, $seq) = (0, 1);
+	for my $msg (@{$box->{msgs}}) {
+		if ($msg->{flags}{"\\Deleted"} && $match{$i++}) {
+			send_out("* $seq EXPUNGE\r\n") if (!$quiet);
+		} else {
+			push @keep, $msg;
+			$seq++;
+		}
+	}
+	$box->{modseq}++ if (@keep != @{$box->{msgs}});
+	$box->{msgs} = \@keep;
+}
+
+sub append_msgs($@)
+{
+	my ($box, @parts) = @_;
+	my @uids = ();
+
+	while (@parts > 1) {
+		my ($opts, $data) = (shift @parts, shift @parts);
+		my %flags = ();
+		if ($opts =~ s/\(([^)]*)\)//) {
+			$flags{$_} = 1 for (grep { $_ ne "\\Recent" } split(/ /, $1));
+		}
+		my $date = time();
+		if ($opts =~ /"(\d+)-(\w+)-(\d+) (\d+):(\d+):(\d+) ([-+]\d+)"/) {
+			my %m = (Jan => 0, Feb => 1, Mar => 2, Apr => 3, May => 4, Jun => 5,
+			         Jul => 6, Aug => 7, Sep => 8, Oct => 9, Nov => 10, Dec => 11);
+			require Time::Local;
+			$date = Time::Local::timegm($6, $5, $4, $1, $m{$2}, $3);
+		}
+		push @uids, $box->{uidnext};
+		push @{$box->{msgs}}, { uid => $box->{uidnext}++, flags => \%flags, date => $date, data => $data };
+	}
+	$box->{modseq}++;
+	return @uids;
+}
+
+sub fetch($$$)
+{
+	my ($box, $set, $items) = @_;
+	for my $i (find_set($box, $set)) {
+		my $msg = $box->{msgs}[$i];
+		my $r = "* ".($i + 1)." FETCH (UID ".$msg->{uid};
+		$r .= " FLAGS ".flag_list($msg) if ($items =~ /\bFLAGS\b/);
+		$r .= " INTERNALDATE \"".imap_date($msg->{date})."\"" if ($items =~ /\bINTERNALDATE\b/);
+		$r .= " RFC822.SIZE ".length($msg->{data}) if ($items =~ /\bRFC822\.SIZE\b/);
+		if ($items =~ /BODY\.PEEK\[HEADER\.FIELDS \(([^)]*)\)\]/) {
+			my @want = map { lc } split(/ /, $1);
+			my ($hdrs) = split(/\r\n\r\n/, $msg->{data}, 2);
+			my $h = "";
+			for my $line (split(/\r\n(?![ \t])/, $hdrs)) {
+				my ($field) = $line =~ /^([^:]+):/;
+				$h .= $line."\r\n" if (defined($field) && grep { $_ eq lc($field) } @want);
+			}
+			$h .= "\r\n";
+			$r .= " BODY[HEADER.FIELDS (".uc($1).")] {".length($h)."}\r\n".$h;
+		}
+		if ($items =~ /BODY\.PEEK\[HEADER\]/) {
+			my ($hdrs) = split(/\r\n\r\n/, $msg->{data}, 2);
+			$r .= " BODY[HEADER] {".(length($hdrs) + 4)."}\r\n".$hdrs."\r\n\r\n";
+		}
+		if ($items =~ /\bBODYSTRUCTURE\b/) {
+			# The generated messages are all plain text.
+			my (undef, $body) = split(/\r\n\r\n/, $msg->{data}, 2);
+			$body = "" if (!defined($body));
+			$r .= " BODYSTRUCTURE (\"TEXT\" \"PLAIN\" (\"CHARSET\" \"us-ascii\") NIL NIL \"7BIT\" ".
+			      length($body)." ".(() = $body =~ /\n/g).")";
+		}
+		$r .= " BODY[] {".length($msg->{data})."}\r\n".$msg->{data} if ($items =~ /BODY\.PEEK\[\]/);
+		send_out($r.")\r\n");
+	}
+}
+
+sub store($$$$)
+{
+	my ($box, $set, $op, $flags) = @_;
+	my @flags = split(/ /, $flags);
+	for my $i (find_set($box, $set)) {
+		my $msg = $box->{msgs}[$i];
+		if ($op =~ /^\+/) {
+			$msg->{flags}{$_} = 1 for (@flags);
+		} elsif ($op =~ /^-/) {
+			delete $msg->{flags}{$_} for (@flags);
+		} else {
+			$msg->{flags} = { map { ($_, 1) } @flags };
+		}
+		send_out("* ".($i + 1)." FETCH (UID ".$msg->{uid}." FLAGS ".flag_list($msg).")\r\n")
+			if ($op !~ /\.SILENT$/i);
+	}
+	$box->{modseq}++;
+}
+
+sub handle($$$@)
+{
+	my ($tag, $cmd, $args, @parts) = @_;
+
+	if (defined(&on_command)) {
+		my $r = on_command($tag, $cmd, $args);
+		return $r if (defined($r));
+	}
+	if ($cmd eq "CAPABILITY") {
+		send_out("* CAPABILITY ".$opt{caps}."\r\n");
+	} elsif ($cmd eq "COMPRESS") {
+		return "BAD not supported" if (!has_cap("COMPRESS=DEFLATE") || uc($args) ne "DEFLATE");
+		return "NO [COMPRESSIONACTIVE] already compressing" if ($deflater);
+	} elsif ($cmd eq "NOOP" || $cmd eq "CHECK" || $cmd eq "LOGIN" || $cmd eq "ENABLE") {
+	} elsif ($cmd eq "LOGOUT") {
+		send_out("* BYE see you\r\n");
+	} elsif ($cmd eq "NAMESPACE") {
+		send_out("* NAMESPACE ((\"\" \"/\")) NIL NIL\r\n");
+	} elsif ($cmd eq "LIST") {
+		my $ref = get_string($args);
+		my $pat = get_string($args);
+		my $ret = $args =~ /RETURN \(STATUS \(([^)]*)\)\)/i ? $1 : undef;
+		for my $name (sort keys %boxes) {
+			next if (!list_match($name, $ref.$pat));
+			send_out("* LIST () \"/\" ".quote($name)."\r\n");
+			box_status($name, $ret) if (defined($ret));
+		}
+	} elsif ($cmd eq "STATUS") {
+		my $name = get_string($args);
+		return "NO no such mailbox" if (!$boxes{$name});
+		$args =~ /\(([^)]*)\)/;
+		box_status($name, $1);
+	} elsif ($cmd eq "CREATE") {
+		my $name = get_string($args);
+		return "NO mailbox exists" if ($boxes{$name});
+		$boxes{$name} = new_box();
+	} elsif ($cmd eq "SELECT" || $cmd eq "EXAMINE") {
+		my $name = get_string($args);
+		$sel = undef;
+		return "NO [TRYCREATE] no such mailbox" if (!$boxes{$name});
+		$sel = $boxes{$name};
+		send_out("* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n".
+		         "* ".scalar(@{$sel->{msgs}})." EXISTS\r\n".
+		         "* 0 RECENT\r\n".
+		         "* OK [UIDVALIDITY ".$sel->{uidvalidity}."] UIDs valid\r\n".
+		         "* OK [UIDNEXT ".$sel->{uidnext}."] next UID\r\n");
+		send_out("* OK [HIGHESTMODSEQ ".$sel->{modseq}."] mod-sequence\r\n")
+			if (has_cap("CONDSTORE"));
+		return "OK [".($cmd eq "SELECT" ? "READ-WRITE" : "READ-ONLY")."] done";
+	} elsif ($cmd eq "APPEND") {
+		my $name = get_string($parts[0]);
+		return "NO [TRYCREATE] no such mailbox" if (!$boxes{$name});
+		my @uids = append_msgs($boxes{$name}, @parts);
+		return "BAD missing message" if (!@uids);
+		return "OK [APPENDUID ".$boxes{$name}{uidvalidity}." ".
+		       (@uids > 1 ? $uids[0].":".$uids[-1] : $uids[0])."] done"
+			if (has_cap("UIDPLUS"));
+	} elsif ($cmd eq "IDLE") {
+		send_out("+ idling\r\n");
+		read_line();
+	} elsif (!$sel) {
+		return "BAD no mailbox selected";
+	} elsif ($cmd eq "UID FETCH") {
+		my ($set, $items) = split(/ /, $args, 2);
+		fetch($sel, $set, $items);
+	} elsif ($cmd eq "UID SEARCH") {
+		# Only what mbsync asks for: SINCE, optionally with an ESEARCH MIN.
+		my $min = $args =~ s/^RETURN \(MIN\) //i;
+		return "BAD unsupported search" if ($args !~ /^SINCE (\d+)-(\w+)-(\d+)$/i);
+		my %m = (Jan => 0, Feb => 1, Mar => 2, Apr => 3, May => 4, Jun => 5,
+		         Jul => 6, Aug => 7, Sep => 8, Oct => 9, Nov => 10, Dec => 11);
+		require Time::Local;
+		my $since = Time::Local::timegm(0, 0, 0, $1, $m{$2}, $3);
+		my @uids = map { $_->{uid} } grep { $_->{date} >= $since } @{$sel->{msgs}};
+		if (!$min) {
+			send_out("* SEARCH".join("", map { " $_" } @uids)."\r\n");
+		} elsif (@uids) {
+			send_out("* ESEARCH (TAG \"$tag\") UID MIN $uids[0]\r\n");
+		} else {
+			send_out("* ESEARCH (TAG \"$tag\") UID\r\n");
+		}
+	} elsif ($cmd eq "UID STORE") {
+		my ($set, $op, $flags) = split(/ /, $args, 3);
+		$flags =~ s/^\((.*)\)$/$1/;
+		store($sel, $set, $op, $flags);
+	} elsif ($cmd eq "UID COPY") {
+		my ($set, $name) = split(/ /, $args, 2);
+		$name = unquote($name);
+		return "NO [TRYCREATE] no such mailbox" if (!$boxes{$name});
+		append_msgs($boxes{$name}, map { ("(".join(" ", keys %{$_->{flags}}).")", $_->{data}) }
+		                           map { $sel->{msgs}[$_] } find_set($sel, $set));
+	} elsif ($cmd eq "UID EXPUNGE") {
+		expunge($sel, $args, 0);
+	} elsif ($cmd eq "EXPUNGE") {
+		expunge($sel, undef, 0);
+	} elsif ($cmd eq "CLOSE") {
+		expunge($sel, undef, 1);
+		$sel = undef;
+	} else {
+		return "BAD unknown command";
+	}
+	return "OK done";
+}
+
+sub session()
+{
+	%cnt = (commands => 0, roundtrips => 0, bytes_in => 0, bytes_out => 0);
+	($ibuf, $obuf, $sent, $sel, $inflater, $deflater) = ("", "", 0, undef, undef, undef);
+	send_out("* PREAUTH [CAPABILITY ".$opt{caps}."] fake-imapd ready\r\n");
+	eval {
+		while (my @parts = read_command()) {
+			my $first = shift @parts;
+			my ($tag, $cmd, $args) = $first =~ /^(\S+) (\S+) ?(.*)$/s or do {
+				send_out("* BAD malformed command\r\n");
+				next;
+			};
+			$cmd = uc($cmd);
+			if ($cmd eq "UID") {
+				($cmd, $args) = split(/ /, $args, 2);
+				$cmd = "UID ".uc($cmd);
+			}
+			$cnt{commands}++;
+			unshift @parts, $args if (@parts);
+			my $r = handle($tag, $cmd, $args, @parts);
+			send_out($tag." ".$r."\r\n");
+			start_compress() if ($cmd eq "COMPRESS" && $r =~ /^OK/);
+			last if ($cmd eq "LOGOUT");
+		}
+		flush_out();
+	};
+	if (defined($opt{stats}) && open(my $sf, ">>", $opt{stats})) {
+		print $sf join(" ", map { $_."=".$cnt{$_} } sort keys %cnt)."\n";
+		close $sf;
+	}
+}
+
+if (defined($opt{port})) {
+	my $srv = IO::Socket::INET->new(LocalAddr => "127.0.0.1", LocalPort => $opt{port},
+	                                Listen => 5, ReuseAddr => 1)
+		or die "Cannot listen: $!\n";
+	$| = 1;
+	print $srv->sockport()."\n" if (!$opt{port});
+	while (my $conn = $srv->accept()) {
+		$in = $out = $conn;
+		session();
+		close $conn;
+	}
+} else {
+	$in = \*STDIN;
+	$out = \*STDOUT;
+	session();
+}
@@ -0,0 +1,199 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+
+/* Fuzz target for the FETCH response parser. The input is the part of
+ * a response behind "* n FETCH", including any literals. The first byte
+ * selects the size of the chunks the input arrives in and whether BODY[]
+ * goes to a sink, so partial reads are covered as well. A buffered BODY[]
+ * is turned into a placeholder along with the BODYSTRUCTURE.
+ *
+ * With libFuzzer:
+ *   clang -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER -o fuzz_imap_fetch \
+ *         fuzz_imap_fetch.c imap_fetch.c util.c
+ * Otherwise (e.g. with afl-fuzz), it reads the input files given on the
+ * command line, or stdin:
+ *   make fuzz_imap_fetch && ./fuzz_imap_fetch < input
+ */
+
+#include "imap_fetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int DFlags;
+const char *Home;
+
+int LLVMFuzzerTestOneInput( const unsigned char *data, size_t size );
+
+static char *buf;
+static int len, pos, avail, chunk;
+
+static void
+refill( void )
+{
+	avail = len - avail < chunk ? len : avail + chunk;
+}
+
+static char *
+in_read_line( void *aux ATTR_UNUSED )
+{
+	char *s = buf + pos, *p;
+
+	if (!(p = memchr( s, '\n', avail - pos )))
+		return 0;
+	pos = p + 1 - buf;
+	if (p != s && p[-1] == '\r')
+		p--;
+	*p = 0;
+	return s;
+}
+
+static int
+in_read_direct( void *aux ATTR_UNUSED, char **bufp, int l )
+{
+	int n = avail - pos;
+
+	if (n > l)
+		n = l;
+	*bufp = buf + pos;
+	pos += n;
+	return n;
+}
+
+static void
+sink_write( msg_sink_t *sink ATTR_UNUSED, const char *data, int l )
+{
+	/* Make sure the memory is actually valid. */
+	volatile char c;
+
+	if (l)
+		c = data[0] ^ data[l - 1];
+	(void)c;
+}
+
+static msg_sink_t sink = { sink_write };
+
+static msg_sink_t *
+in_body_sink( void *aux ATTR_UNUSED, int uid ATTR_UNUSED, int l ATTR_UNUSED )
+{
+	return &sink;
+}
+
+int
+LLVMFuzzerTestOneInput( const unsigned char *data, size_t size )
+{
+	fetch_parser_t fp;
+	char *s, *ph;
+	int r, phl;
+
+	if (size < 1 || size > 1000000)
+		return 0;
+	chunk = 1 + (data[0] & 0x7f) * (data[0] & 0x7f);
+	len = size - 1;
+	buf = nfmalloc( len + 1 );
+	memcpy( buf, data + 1, len );
+	buf[len] = 0;
+	pos = avail = 0;
+
+	fp.read_line = in_read_line;
+	fp.read_direct = in_read_direct;
+	fp.body_sink = (data[0] & 0x80) ? in_body_sink : 0;
+	fp.aux = 0;
+	while (!(s = in_read_line( 0 ))) {
+		if (avail == len)
+			goto out;
+		refill();
+	}
+	fetch_parser_init( &fp );
+	r = fetch_parse( &fp, s );
+	while (r == FETCH_PARTIAL) {
+		if (avail == len) {
+			/* Connection lost mid-response. */
+			free( fp.body );
+			free( fp.bstruct );
+			goto out;
+		}
+		refill();
+		r = fetch_parse( &fp, 0 );
+	}
+	if (r == FETCH_OK) {
+		if (fp.body && (int)strlen( fp.body ) > fp.body_len)
+			abort();
+		if (fp.bstruct && (int)strlen( fp.bstruct ) >= 65536)
+			abort();
+		if (fp.body) {
+			ph = make_placeholder( fp.body, fp.body_len, fp.bstruct, fp.size, &phl );
+			if ((int)strlen( ph ) != phl)
+				abort();
+			free( ph );
+		}
+		free( fp.body );
+		free( fp.bstruct );
+	} else if (fp.body || fp.bstruct || fp.level) {
+		abort();
+	}
+  out:
+	free( buf );
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static void
+run_file( FILE *f )
+{
+	unsigned char *data = 0;
+	size_t size = 0, a = 0, n;
+
+	do {
+		if (size == a)
+			data = nfrealloc( data, a = a * 2 + 4096 );
+		n = fread( data + size, 1, a - size, f );
+		size += n;
+	} while (n);
+	LLVMFuzzerTestOneInput( data, size );
+	free( data );
+}
+
+int
+main( int argc, char **argv )
+{
+	FILE *f;
+	int i;
+
+	if (argc < 2) {
+		run_file( stdin );
+		return 0;
+	}
+	for (i = 1; i < argc; i++) {
+		if (!(f = fopen( argv[i], "rb" ))) {
+			perror( argv[i] );
+			return 1;
+		}
+		run_file( f );
+		fclose( f );
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,858 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+#include "imap_fetch.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+const char *ImapFlags[NUM_FLAGS] = {
+	"Draft",
+	"Flagged",
+	"Answered",
+	"Seen",
+	"Deleted",
+};
+
+/* What the next value belongs to. */
+enum {
+	FI_NAME, /* nothing - the name of the next item is expected */
+	FI_UID,
+	FI_FLAGS,
+	FI_DATE,
+	FI_SIZE,
+	FI_BODY,
+	FI_HEADER,
+	FI_STRUCT,
+	FI_SKIP /* an item we don't care about */
+};
+
+static const char *ItemNames[] = {
+	0,
+	"UID",
+	"FLAGS",
+	"INTERNALDATE",
+	"RFC822.SIZE",
+	"BODY[]",
+	"BODY[HEADER.FIELDS ...]",
+	"BODYSTRUCTURE",
+};
+
+/* Where the contents of a literal go. */
+enum {
+	FL_SKIP,
+	FL_BODY,
+	FL_SINK,
+	FL_HEADER,
+	FL_STRUCT
+};
+
+/* Pathological BODYSTRUCTUREs are dropped rather than captured. */
+#define MAX_STRUCT 65536
+
+time_t
+parse_imap_date( const char *str )
+{
+	char *end;
+	time_t date;
+	int hours, mins;
+	struct tm datetime;
+
+	memset( &datetime, 0, sizeof(datetime) );
+	if (!(end = strptime( str, "%d-%b-%Y %H:%M:%S ", &datetime )))
+		return -1;
+	if ((date = timegm( &datetime )) == -1)
+		return -1;
+	if (sscanf( end, "%3d%2d", &hours, &mins ) != 2)
+		return -1;
+	return date - (hours * 60 + mins) * 60;
+}
+
+void
+fetch_parser_init( fetch_parser_t *fp )
+{
+	fp->uid = fp->flags = fp->status = fp->size = 0;
+	fp->date = 0;
+	fp->body = 0;
+	fp->body_len = 0;
+	fp->got_body = fp->got_tuid = fp->got_msgid = 0;
+	fp->bstruct = 0;
+	fp->struct_len = fp->struct_size = 0;
+	fp->level = 0;
+	fp->need_bytes = -1;
+	fp->item = FI_NAME;
+	fp->sink = 0;
+}
+
+static int
+item_kind( const char *s, int l )
+{
+	switch (l) {
+	case 3:
+		if (!memcmp( s, "UID", 3 ))
+			return FI_UID;
+		break;
+	case 5:
+		if (!memcmp( s, "FLAGS", 5 ))
+			return FI_FLAGS;
+		break;
+	case 6:
+		if (!memcmp( s, "BODY[]", 6 ))
+			return FI_BODY;
+		break;
+	case 11:
+		if (!memcmp( s, "RFC822.SIZE", 11 ))
+			return FI_SIZE;
+		break;
+	case 12:
+		if (!memcmp( s, "INTERNALDATE", 12 ))
+			return FI_DATE;
+		if (!memcmp( s, "BODY[HEADER]", 12 ))
+			return FI_BODY;
+		break;
+	case 13:
+		if (!memcmp( s, "BODYSTRUCTURE", 13 ))
+			return FI_STRUCT;
+		break;
+	case 18:
+		if (!memcmp( s, "BODY[HEADER.FIELDS", 18 ))
+			return FI_HEADER;
+		break;
+	}
+	return FI_SKIP;
+}
+
+static void
+parse_flag( fetch_parser_t *fp, const char *s, int l )
+{
+	int i;
+
+	if (*s != '\\') /* ignore user-defined flags for now */
+		return;
+	if (equals( s + 1, l - 1, "Recent", 6 )) {
+		fp->status |= M_RECENT;
+		return;
+	}
+	for (i = 0; i < NUM_FLAGS; i++) {
+		if (equals( s + 1, l - 1, ImapFlags[i], strlen( ImapFlags[i] ) )) {
+			fp->flags |= 1 << i;
+			return;
+		}
+	}
+	if (l >= 3 && s[1] == 'X' && s[2] == '-')
+		return; /* ignore system flag extensions */
+	error( "IMAP warning: unknown system flag %.*s\n", l, s );
+}
+
+/* Parse the contents of a FLAGS list; s points behind the opening parenthesis.
+ * Returns the position behind the closing one, or null if the list is bogus. */
+static char *
+parse_flags( fetch_parser_t *fp, char *s )
+{
+	char *p;
+
+	for (;;) {
+		while (isspace( (unsigned char)*s ))
+			s++;
+		if (*s == ')') {
+			fp->status |= M_FLAGS;
+			return s + 1;
+		}
+		if (!*s || *s == '(' || *s == '"' || *s == '{') {
+			error( "IMAP error: unable to parse FLAGS list\n" );
+			return 0;
+		}
+		for (p = s; *s && *s != ')' && !isspace( (unsigned char)*s ); s++) {}
+		parse_flag( fp, p, s - p );
+	}
+}
+
+/* Where the header scan is. */
+enum {
+	HDR_BOL, /* at the start of a line; a blank continues the field */
+	HDR_LINE,
+	HDR_DONE /* behind the terminating empty line */
+};
+
+static void
+got_field( fetch_parser_t *fp, const char *s, int l )
+{
+	int n;
+
+	if (!fp->got_msgid && find_msgid( s, l, fp->msgid ))
+		fp->got_msgid = 1;
+	if (!fp->got_tuid && starts_with( s, l, "X-TUID: ", 8 )) {
+		if ((n = l - 8) > TUIDL)
+			n = TUIDL;
+		memcpy( fp->tuid, s + 8, n );
+		memset( fp->tuid + n, 0, TUIDL - n );
+		fp->got_tuid = 1;
+	}
+}
+
+static void
+header_start( fetch_parser_t *fp )
+{
+	fp->hdrl = 0;
+	fp->hdr_state = HDR_BOL;
+}
+
+/* Scan the header as it streams in, one (possibly folded) field at a time.
+ * Only the start of each field is kept, which is all we need of it. */
+static void
+header_chars( fetch_parser_t *fp, const char *s, int l )
+{
+	const char *e = s + l;
+	char c;
+
+	for (; s < e && fp->hdr_state != HDR_DONE; s++) {
+		if ((c = *s) == '\r')
+			continue;
+		if (fp->hdr_state == HDR_BOL && c != ' ' && c != '\t') {
+			if (fp->hdrl)
+				got_field( fp, fp->hdr, fp->hdrl );
+			fp->hdrl = 0;
+			if (c == '\n') {
+				fp->hdr_state = HDR_DONE;
+				break;
+			}
+		}
+		if (c == '\n') {
+			fp->hdr_state = HDR_BOL;
+		} else {
+			fp->hdr_state = HDR_LINE;
+			if (fp->hdrl < (int)sizeof(fp->hdr))
+				fp->hdr[fp->hdrl++] = c;
+		}
+	}
+}
+
+static void
+header_end( fetch_parser_t *fp )
+{
+	if (fp->hdr_state != HDR_DONE && fp->hdrl)
+		got_field( fp, fp->hdr, fp->hdrl );
+	fp->hdr_state = HDR_DONE;
+}
+
+static void
+struct_put( fetch_parser_t *fp, const char *s, int l )
+{
+	if (fp->struct_len < 0)
+		return;
+	if (fp->struct_len + l >= MAX_STRUCT) {
+		fp->struct_len = -1;
+		return;
+	}
+	if (fp->struct_len + l >= fp->struct_size) {
+		fp->struct_size = fp->struct_len + l + 1024;
+		fp->bstruct = nfrealloc( fp->bstruct, fp->struct_size );
+	}
+	memcpy( fp->bstruct + fp->struct_len, s, l );
+	fp->struct_len += l;
+	fp->bstruct[fp->struct_len] = 0;
+}
+
+/* Append the start of a token to the BODYSTRUCTURE. */
+static void
+struct_token( fetch_parser_t *fp, const char *s, int l )
+{
+	if (fp->struct_len > 0 && fp->bstruct[fp->struct_len - 1] != '(' && *s != ')')
+		struct_put( fp, " ", 1 );
+	struct_put( fp, s, l );
+}
+
+/* Append string contents to the BODYSTRUCTURE, quoting as needed. */
+static void
+struct_chars( fetch_parser_t *fp, const char *s, int l )
+{
+	int i, n;
+
+	for (i = n = 0; i < l; i++) {
+		if (s[i] == '"' || s[i] == '\\') {
+			struct_put( fp, s + n, i - n );
+			struct_put( fp, "\\", 1 );
+			n = i;
+		} else if (s[i] == '\r' || s[i] == '\n') {
+			struct_put( fp, s + n, i - n );
+			struct_put( fp, " ", 1 );
+			n = i + 1;
+		}
+	}
+	struct_put( fp, s + n, l - n );
+}
+
+/* Prepare for the BODY[]. Returns whether it is to be stored in fp->body. */
+static int
+start_body( fetch_parser_t *fp, int len )
+{
+	fp->got_body = 1;
+	fp->body_len = len;
+	free( fp->body ); /* in case of a duplicate */
+	fp->body = 0;
+	if (fp->body_sink && (fp->sink = fp->body_sink( fp->aux, fp->uid, len )))
+		return 0;
+	fp->body = nfmalloc( len + 1 );
+	fp->body[len] = 0;
+	return 1;
+}
+
+/* Apply a value which is an atom or a string. s needs to be NUL-terminated. */
+static void
+got_value( fetch_parser_t *fp, char *s, int l, int nil )
+{
+	switch (fp->item) {
+	case FI_UID:
+		if (nil)
+			goto bad;
+		fp->uid = atoi( s );
+		break;
+	case FI_SIZE:
+		if (nil)
+			goto bad;
+		fp->size = atoi( s );
+		break;
+	case FI_DATE:
+		if (nil)
+			goto bad;
+		if ((fp->date = parse_imap_date( s )) == -1)
+			error( "IMAP error: unable to parse INTERNALDATE format\n" );
+		break;
+	case FI_BODY:
+		if (nil)
+			goto bad;
+		if (start_body( fp, l ))
+			memcpy( fp->body, s, l );
+		else
+			fp->sink->write( fp->sink, s, l );
+		break;
+	case FI_HEADER:
+		if (nil)
+			goto bad;
+		header_start( fp );
+		header_chars( fp, s, l );
+		header_end( fp );
+		break;
+	case FI_FLAGS:
+	  bad:
+		error( "IMAP error: unable to parse %s\n", ItemNames[(int)fp->item] );
+		break;
+	}
+}
+
+/* Work out where the literal of len bytes goes. */
+static int
+start_literal( fetch_parser_t *fp, int len )
+{
+	fp->need_bytes = len;
+	fp->lit = FL_SKIP;
+	if (fp->level > 1) {
+		if (fp->item == FI_STRUCT) {
+			fp->lit = FL_STRUCT;
+			struct_token( fp, "\"", 1 );
+		}
+		return 0;
+	}
+	switch (fp->item) {
+	case FI_NAME:
+		return -1;
+	case FI_BODY:
+		fp->lit = start_body( fp, len ) ? FL_BODY : FL_SINK;
+		break;
+	case FI_HEADER:
+		fp->lit = FL_HEADER;
+		header_start( fp );
+		break;
+	case FI_SKIP:
+		break;
+	default:
+		error( "IMAP error: unable to parse %s\n", ItemNames[(int)fp->item] );
+		break;
+	}
+	fp->item = FI_NAME;
+	return 0;
+}
+
+int
+fetch_parse( fetch_parser_t *fp, char *s )
+{
+	char *p, *d, *buf;
+	long lit;
+	int n, l;
+	char c;
+
+	if (!s) {
+		if (fp->need_bytes >= 0)
+			goto literal;
+		if (!fp->level)
+			goto bogus;
+		goto getline;
+	}
+	for (;;) {
+		while (isspace( (unsigned char)*s ))
+			s++;
+		if (!*s) /* only literals may continue a response on the next line */
+			goto bogus;
+		if (!fp->level) {
+			if (*s != '(')
+				goto bogus;
+			s++;
+			fp->level = 1;
+			continue;
+		}
+		if (*s == ')') {
+			s++;
+			if (fp->level == 1) {
+				if (fp->item != FI_NAME)
+					goto bogus;
+				fp->level = 0;
+				return FETCH_OK;
+			}
+			if (fp->item == FI_STRUCT)
+				struct_token( fp, ")", 1 );
+			if (--fp->level == 1) {
+				if (fp->item == FI_STRUCT && fp->struct_len < 0) {
+					free( fp->bstruct );
+					fp->bstruct = 0;
+				}
+				fp->item = FI_NAME;
+			}
+			continue;
+		}
+		if (*s == '(') {
+			s++;
+			if (fp->level == 1) {
+				if (fp->item == FI_NAME)
+					goto bogus;
+				if (fp->item == FI_FLAGS) {
+					if (!(s = parse_flags( fp, s )))
+						goto bail;
+					fp->item = FI_NAME;
+					continue;
+				}
+				if (fp->item == FI_STRUCT) {
+					free( fp->bstruct ); /* in case of a duplicate */
+					fp->bstruct = 0;
+					fp->struct_len = fp->struct_size = 0;
+				} else {
+					if (fp->item != FI_SKIP)
+						error( "IMAP error: unable to parse %s\n", ItemNames[(int)fp->item] );
+					fp->item = FI_SKIP;
+				}
+			}
+			if (fp->item == FI_STRUCT)
+				struct_token( fp, "(", 1 );
+			fp->level++;
+			continue;
+		}
+		if (*s == '{') {
+			lit = strtol( s + 1, &p, 10 );
+			if (p == s + 1 || lit < 0 || lit >= INT_MAX || *p != '}' || p[1])
+				goto bogus;
+			if (start_literal( fp, (int)lit ) < 0)
+				goto bogus;
+
+		  literal:
+			while (fp->need_bytes > 0 && (n = fp->read_direct( fp->aux, &buf, fp->need_bytes ))) {
+				switch (fp->lit) {
+				case FL_BODY:
+					memcpy( fp->body + fp->body_len - fp->need_bytes, buf, n );
+					break;
+				case FL_SINK:
+					fp->sink->write( fp->sink, buf, n );
+					break;
+				case FL_HEADER:
+					header_chars( fp, buf, n );
+					break;
+				case FL_STRUCT:
+					struct_chars( fp, buf, n );
+					break;
+				}
+				fp->need_bytes -= n;
+			}
+			if (fp->need_bytes > 0)
+				return FETCH_PARTIAL;
+			fp->need_bytes = -1;
+			if (fp->lit == FL_HEADER)
+				header_end( fp );
+			else if (fp->lit == FL_STRUCT)
+				struct_put( fp, "\"", 1 );
+
+		  getline:
+			if (!(s = fp->read_line( fp->aux )))
+				return FETCH_PARTIAL;
+			continue;
+		}
+		if (*s == '"') {
+			s++;
+			p = d = s;
+			while ((c = *s++) != '"') {
+				if (c == '\\')
+					c = *s++;
+				if (!c)
+					goto bogus;
+				*d++ = c;
+			}
+			*d = 0;
+			if (fp->level == 1) {
+				if (fp->item == FI_NAME)
+					goto bogus;
+				got_value( fp, p, d - p, 0 );
+				fp->item = FI_NAME;
+			} else if (fp->item == FI_STRUCT) {
+				struct_token( fp, "\"", 1 );
+				struct_chars( fp, p, d - p );
+				struct_put( fp, "\"", 1 );
+			}
+			continue;
+		}
+		/* atom */
+		for (p = s; *s && *s != ')' && !isspace( (unsigned char)*s ); s++) {}
+		if (fp->level > 1) {
+			if (fp->item == FI_STRUCT)
+				struct_token( fp, p, s - p );
+			continue;
+		}
+		l = s - p;
+		if (fp->item == FI_NAME) {
+			if ((fp->item = item_kind( p, l )) == FI_HEADER) {
+				/* Skip the list of header fields; the value follows the bracket. */
+				while (isspace( (unsigned char)*s ))
+					s++;
+				if (*s != '(' || !(d = strchr( s, ')' )) || d[1] != ']') {
+					error( "IMAP error: unable to parse BODY[HEADER.FIELDS ...]\n" );
+					goto bail;
+				}
+				s = d + 2;
+			}
+			continue;
+		}
+		c = *s;
+		*s = 0;
+		got_value( fp, p, l, equals( p, l, "NIL", 3 ) );
+		*s = c;
+		fp->item = FI_NAME;
+	}
+
+  bogus:
+	error( "IMAP error: bogus FETCH response\n" );
+  bail:
+	free( fp->body );
+	fp->body = 0;
+	free( fp->bstruct );
+	fp->bstruct = 0;
+	fp->level = 0;
+	fp->need_bytes = -1;
+	return FETCH_BAD;
+}
+
+/* Placeholders for messages exceeding MaxSize. */
+
+typedef struct {
+	char *buf;
+	int len, size;
+} obuf_t;
+
+static void
+ob_put( obuf_t *ob, const char *s, int l )
+{
+	if (ob->len + l >= ob->size) {
+		ob->size = ob->len + l + 1024;
+		ob->buf = nfrealloc( ob->buf, ob->size );
+	}
+	memcpy( ob->buf + ob->len, s, l );
+	ob->len += l;
+	ob->buf[ob->len] = 0;
+}
+
+static void ATTR_PRINTFLIKE(2, 3)
+ob_printf( obuf_t *ob, const char *fmt, ... )
+{
+	va_list va;
+	char buf[1000];
+	int l;
+
+	va_start( va, fmt );
+	l = vsnprintf( buf, sizeof(buf), fmt, va );
+	va_end( va );
+	if (l >= (int)sizeof(buf))
+		l = sizeof(buf) - 1;
+	ob_put( ob, buf, l );
+}
+
+/* The fields describing the body, which the placeholder replaces. */
+static int
+is_body_field( const char *s, int l )
+{
+	static const char *fields[] = {
+		"Content-Type:",
+		"Content-Transfer-Encoding:",
+		"Content-Disposition:",
+		"X-TUID:",
+	};
+	unsigned i;
+	int fl;
+
+	for (i = 0; i < as(fields); i++) {
+		fl = strlen( fields[i] );
+		if (l >= fl && !strncasecmp( s, fields[i], fl ))
+			return 1;
+	}
+	return 0;
+}
+
+/* Scanner for the BODYSTRUCTURE as captured by fetch_parse(). */
+
+#define MAX_STRUCT_DEPTH 16
+
+static void
+bs_space( const char **pp )
+{
+	while (**pp == ' ')
+		(*pp)++;
+}
+
+/* Fetch an atom or string into buf (which may be null); NIL yields an empty one.
+ * Returns 0 if there is something else. */
+static int
+bs_string( const char **pp, char *buf, int bsz )
+{
+	const char *p = *pp;
+	int l = 0;
+	char c;
+
+	bs_space( &p );
+	if (*p == '"') {
+		for (p++; (c = *p++) != '"'; ) {
+			if (c == '\\')
+				c = *p++;
+			if (!c)
+				return 0;
+			if (buf && l < bsz - 1)
+				buf[l++] = (unsigned char)c < 0x20 ? '?' : c;
+		}
+	} else if (*p && *p != '(' && *p != ')') {
+		if (!strncmp( p, "NIL", 3 ) && (p[3] == ' ' || p[3] == ')' || !p[3])) {
+			p += 3;
+		} else {
+			for (; *p && *p != ' ' && *p != ')'; p++)
+				if (buf && l < bsz - 1)
+					buf[l++] = *p;
+		}
+	} else {
+		return 0;
+	}
+	if (buf)
+		buf[l] = 0;
+	*pp = p;
+	return 1;
+}
+
+/* Skip one value of any kind. Returns 0 if there is none. */
+static int
+bs_skip( const char **pp )
+{
+	int level = 0;
+
+	do {
+		bs_space( pp );
+		if (**pp == '(') {
+			(*pp)++;
+			level++;
+		} else if (**pp == ')') {
+			if (!level)
+				return 0;
+			(*pp)++;
+			level--;
+		} else if (!bs_string( pp, 0, 0 )) {
+			return 0;
+		}
+	} while (level);
+	return 1;
+}
+
+/* Find the name of the file in a parameter list. */
+static void
+bs_params( const char **pp, char *name, int nsz )
+{
+	char key[20];
+
+	bs_space( pp );
+	if (**pp != '(') {
+		bs_skip( pp );
+		return;
+	}
+	(*pp)++;
+	while (bs_string( pp, key, sizeof(key) )) {
+		if (!strcasecmp( key, "name" ) || !strcasecmp( key, "filename" ))
+			bs_string( pp, name, nsz );
+		else
+			bs_skip( pp );
+	}
+	bs_space( pp );
+	if (**pp == ')')
+		(*pp)++;
+}
+
+static void
+bs_close( const char **pp )
+{
+	bs_space( pp );
+	while (**pp && **pp != ')')
+		if (!bs_skip( pp ))
+			return;
+	if (**pp == ')')
+		(*pp)++;
+}
+
+static void
+bs_line( obuf_t *ob, int depth, const char *type, const char *subtype )
+{
+	char buf[160];
+	int i;
+
+	i = nfsnprintf( buf, sizeof(buf), "%*s%s/%s", 2 + depth * 2, "", type, subtype );
+	while (--i >= 0)
+		buf[i] = tolower( (unsigned char)buf[i] );
+	ob_put( ob, buf, strlen( buf ) );
+}
+
+/* Describe the body starting at *pp, one line per part. Returns 0 if it is bogus. */
+static int
+bs_describe( obuf_t *ob, const char **pp, int depth )
+{
+	const char *p, *sub;
+	int size;
+	char type[32], subtype[64], size_str[16], name[256];
+
+	bs_space( pp );
+	if (**pp != '(' || depth >= MAX_STRUCT_DEPTH)
+		return 0;
+	(*pp)++;
+	bs_space( pp );
+	if (**pp == '(') {
+		/* multipart: the subtype follows the parts */
+		for (p = *pp; bs_space( &p ), *p == '('; )
+			if (!bs_skip( &p ))
+				return 0;
+		if (!bs_string( &p, subtype, sizeof(subtype) ))
+			return 0;
+		bs_line( ob, depth, "multipart", subtype );
+		ob_put( ob, "\r\n", 2 );
+		while (bs_space( pp ), **pp == '(')
+			if (!bs_describe( ob, pp, depth + 1 ))
+				return 0;
+		*pp = p;
+		bs_close( pp );
+		return 1;
+	}
+	name[0] = 0;
+	size_str[0] = 0;
+	sub = 0;
+	if (!bs_string( pp, type, sizeof(type) ) || !bs_string( pp, subtype, sizeof(subtype) ))
+		return 0;
+	bs_params( pp, name, sizeof(name) );
+	if (!bs_skip( pp ) || !bs_skip( pp ) || !bs_skip( pp ) || /* id, description, encoding */
+	    !bs_string( pp, size_str, sizeof(size_str) ))
+		return 0;
+	if (!strcasecmp( type, "message" ) && !strcasecmp( subtype, "rfc822" )) {
+		/* envelope, body, lines */
+		bs_skip( pp );
+		bs_space( pp );
+		sub = *pp;
+		bs_skip( pp );
+		bs_skip( pp );
+	} else if (!strcasecmp( type, "text" )) {
+		bs_skip( pp ); /* lines */
+	}
+	/* extension data: MD5, disposition */
+	if (bs_skip( pp )) {
+		bs_space( pp );
+		if (**pp == '(') {
+			(*pp)++;
+			bs_skip( pp );
+			bs_params( pp, name, sizeof(name) );
+			bs_close( pp );
+		}
+	}
+	bs_close( pp );
+
+	bs_line( ob, depth, type, subtype );
+	if (name[0])
+		ob_printf( ob, " \"%s\"", name );
+	size = atoi( size_str );
+	if (size < 10 * 1024)
+		ob_printf( ob, ", %d bytes\r\n", size );
+	else if (size < 10 * 1024 * 1024)
+		ob_printf( ob, ", %d KiB\r\n", size >> 10 );
+	else
+		ob_printf( ob, ", %d MiB\r\n", size >> 20 );
+	return !sub || bs_describe( ob, &sub, depth + 1 );
+}
+
+char *
+make_placeholder( const char *hdr, int hdrl, const char *bstruct, int size, int *len )
+{
+	obuf_t ob;
+	const char *s, *p, *e = hdr + hdrl;
+	int l, skip = 0;
+
+	ob.buf = 0;
+	ob.len = ob.size = 0;
+	for (s = hdr; s < e; s = p + 1) {
+		if (!(p = memchr( s, '\n', e - s )))
+			p = e;
+		l = p - s;
+		if (l && s[l - 1] == '\r')
+			l--;
+		if (!l)
+			break;
+		if (*s != ' ' && *s != '\t')
+			skip = is_body_field( s, l );
+		if (!skip) {
+			ob_put( &ob, s, l );
+			ob_put( &ob, "\r\n", 2 );
+		}
+	}
+	ob_printf( &ob, "X-Placeholder: %d\r\n"
+	                "Content-Type: text/plain; charset=utf-8\r\n"
+	                "Content-Transfer-Encoding: 8bit\r\n"
+	                "\r\n"
+	                "This is a placeholder for a message of %d bytes, which exceeds MaxSize.\r\n"
+	                "Flag it to have the complete message fetched by the next sync.\r\n",
+	           size, size );
+	if (bstruct) {
+		ob_put( &ob, "\r\nOriginal structure:\r\n", 23 );
+		l = ob.len;
+		if (!bs_describe( &ob, &bstruct, 0 )) {
+			ob.len = l;
+			ob_put( &ob, "  (unknown)\r\n", 13 );
+		}
+	}
+	*len = ob.len;
+	return ob.buf;
+}
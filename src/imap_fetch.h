@@ -0,0 +1,89 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+#ifndef IMAP_FETCH_H
+#define IMAP_FETCH_H
+
+#include "driver.h"
+
+/* Parses the data items of one untagged FETCH response and decodes UID, FLAGS,
+ * RFC822.SIZE, INTERNALDATE, BODY[] (or BODY[HEADER]) and the X-TUID and Message-ID from
+ * BODY[HEADER.FIELDS] on the fly. BODYSTRUCTURE is captured as a string. Nothing is
+ * allocated except the buffers for these two and a BODY[] which does not go to a sink;
+ * other items are skipped.
+ * The parser pulls its input through the callbacks. If they run dry, it
+ * returns FETCH_PARTIAL and is to be called again when more data arrived. */
+
+enum {
+	FETCH_OK,
+	FETCH_PARTIAL,
+	FETCH_BAD
+};
+
+/* IMAP names of the message flags, in the order of F_*. */
+extern const char *ImapFlags[NUM_FLAGS];
+
+typedef struct fetch_parser {
+	/* Return the next line without the line ending, or null if there is none yet.
+	 * The line may be modified, and needs to stay valid only until the next call. */
+	char *(*read_line)( void *aux );
+	/* Return up to len bytes of a literal in *buf, or 0 if there are none yet. */
+	int (*read_direct)( void *aux, char **buf, int len );
+	/* Called when a BODY[] of len bytes starts; uid is zero if it was not seen yet.
+	 * Return a sink for the contents, or null to have them buffered. */
+	msg_sink_t *(*body_sink)( void *aux, int uid, int len );
+	void *aux;
+
+	/* The decoded data items. */
+	int uid, flags, status, size; /* status has M_RECENT and M_FLAGS */
+	time_t date;
+	char *body; /* BODY[] which went to no sink; NUL-terminated, owned by the caller */
+	int body_len;
+	char got_body; /* BODY[] was seen (and possibly went to the sink) */
+	char got_tuid, got_msgid;
+	char tuid[TUIDL];
+	char msgid[MSGIDL];
+	/* BODYSTRUCTURE, with literals turned into quoted strings and the tokens separated
+	 * by single spaces; NUL-terminated, owned by the caller. Null if it was not seen. */
+	char *bstruct;
+
+	/* Internal state. */
+	int level, need_bytes, hdrl;
+	int struct_len, struct_size;
+	char item, lit, hdr_state;
+	msg_sink_t *sink;
+	char hdr[32 + TUIDL + MSGIDL]; /* start of the current header field */
+} fetch_parser_t;
+
+void fetch_parser_init( fetch_parser_t *fp );
+/* Pass the rest of the line after "FETCH" on the first call, and null on
+ * subsequent ones. Anything but FETCH_PARTIAL ends the response, and leaves
+ * fp->level at zero. Errors are reported with error(). */
+int fetch_parse( fetch_parser_t *fp, char *s );
+
+time_t parse_imap_date( const char *str );
+
+/* Make up a placeholder for a message of size bytes from its header (including the
+ * terminating empty line) and its BODYSTRUCTURE as captured by the parser, which
+ * may be null. The result is NUL-terminated and has CRLF line endings. */
+char *make_placeholder( const char *hdr, int hdrl, const char *bstruct, int size, int *len );
+
+#endif
@@ -33,6 +33,9 @@
 
 int DFlags;
 int UseFSync = 1;
+int DetectMoves;
+int MaxParallel = 1;
+int DaemonInterval = 300;
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__) || defined(__CYGWIN__)
 char FieldDelimiter = ';';
 #else
@@ -62,6 +65,9 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 " " EXE " [flags] {{channel[:box,...]|group} ...|-a}\n"
 "  -a, --all		operate on all defined channels\n"
 "  -l, --list		list mailboxes instead of syncing them\n"
+"  -w, --daemon		keep running and sync again on changes\n"
+"      --convert-state={text|binary} FILE...\n"
+"			rewrite sync state files in the given format\n"
 "  -n, --new		propagate new messages\n"
 "  -d, --delete		propagate message deletions\n"
 "  -f, --flags		propagate message flag changes\n"
@@ -71,6 +77,7 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 "  -C, --create		create mailboxes if nonexistent\n"
 "  -X, --expunge		expunge	deleted messages\n"
 "  -c, --config CONFIG	read an alternate config file (default: ~/." EXE "rc)\n"
+"      --stats FILE	append timing and traffic statistics to FILE ('-' is stdout)\n"
 "  -D, --debug		print debugging messages\n"
 "  -V, --verbose		verbose mode (display network traffic)\n"
 "  -q, --quiet		don't display progress info\n"
@@ -86,6 +93,11 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 "  +HAVE_LIBSSL\n"
 #else
 "  -HAVE_LIBSSL\n"
+#endif
+#ifdef HAVE_LIBZ
+"  +HAVE_LIBZ\n"
+#else
+"  -HAVE_LIBZ\n"
 #endif
 	, code ? stderr : stdout );
 	exit( code );
@@ -121,66 +133,192 @@ crashHandler( int n )
 }
 #endif
 
+/* The wildcard part of a pattern is matched by simulating the automaton it
+ * describes, so the time is bounded by the product of the lengths instead
+ * of growing exponentially with the number of wildcards. st has room for a
+ * flag per pattern position, telling whether that much of it matched. */
 static int
-matches( const char *t, const char *p )
+matches( const char *t, int tl, const char *p, int pl, char *st )
 {
+	int i, any;
+	char c;
+
+	memset( st, 0, pl + 1 );
+	st[0] = 1;
 	for (;;) {
-		if (!*p)
-			return !*t;
-		if (*p == '*') {
-			p++;
-			do {
-				if (matches( t, p ))
-					return 1;
-			} while (*t++);
-			return 0;
-		} else if (*p == '%') {
-			p++;
-			do {
-				if (*t == '/')
-					return 0;
-				if (matches( t, p ))
-					return 1;
-			} while (*t++);
-			return 0;
-		} else {
-			if (*p != *t)
-				return 0;
-			p++, t++;
+		/* Wildcards may match nothing. */
+		for (i = 0; i < pl; i++)
+			if (st[i] && (p[i] == '*' || p[i] == '%'))
+				st[i + 1] = 1;
+		if (!tl--)
+			return st[pl];
+		c = *t++;
+		any = 0;
+		st[pl] = 0;
+		/* Downwards, so each state advances at most once. */
+		for (i = pl; --i >= 0; ) {
+			if (!st[i])
+				continue;
+			if (p[i] == '*' || (p[i] == '%' && c != '/')) {
+				any = 1;
+			} else {
+				st[i] = 0;
+				if (p[i] == c)
+					st[i + 1] = any = 1;
+			}
 		}
+		if (!any)
+			return 0;
+	}
+}
+
+typedef struct {
+	const char *str; /* the literal prefix */
+	int pfxl, sfxl; /* lengths of the literal prefix and suffix */
+	int len; /* length of the part in between, which is delimited by wildcards; -1 if none */
+	char not;
+} pattern_t;
+
+static void
+compile_pattern( pattern_t *pat, const char *str )
+{
+	int l, pl, sl;
+
+	if ((pat->not = (*str == '!')))
+		str++;
+	pat->str = str;
+	l = strlen( str );
+	for (pl = 0; pl < l && str[pl] != '*' && str[pl] != '%'; pl++);
+	if (pl == l) {
+		pat->pfxl = l;
+		pat->sfxl = 0;
+		pat->len = -1;
+		return;
 	}
+	for (sl = 0; str[l - sl - 1] != '*' && str[l - sl - 1] != '%'; sl++);
+	pat->pfxl = pl;
+	pat->sfxl = sl;
+	pat->len = l - pl - sl;
+}
+
+static int
+matches_pattern( const char *t, const pattern_t *pat, char *st )
+{
+	int tl = strlen( t );
+
+	if (pat->len < 0)
+		return tl == pat->pfxl && !memcmp( t, pat->str, tl );
+	if (tl < pat->pfxl + pat->sfxl ||
+	    memcmp( t, pat->str, pat->pfxl ) ||
+	    memcmp( t + tl - pat->sfxl, pat->str + pat->pfxl + pat->len, pat->sfxl ))
+		return 0;
+	return matches( t + pat->pfxl, tl - pat->pfxl - pat->sfxl, pat->str + pat->pfxl, pat->len, st );
 }
 
 static string_list_t *
 filter_boxes( string_list_t *boxes, const char *prefix, string_list_t *patterns )
 {
 	string_list_t *nboxes = 0, *cpat;
-	const char *ps;
-	int not, fnot, pfxl;
+	pattern_t *pats;
+	char *st;
+	int i, npats, maxl, fnot, pfxl;
+
+	/* Compile the patterns once, instead of once per box. */
+	for (npats = 0, cpat = patterns; cpat; cpat = cpat->next)
+		npats++;
+	pats = nfmalloc( npats * sizeof(*pats) + 1 );
+	for (maxl = 0, i = 0, cpat = patterns; cpat; i++, cpat = cpat->next) {
+		compile_pattern( &pats[i], cpat->string );
+		if (pats[i].len > maxl)
+			maxl = pats[i].len;
+	}
+	st = nfmalloc( maxl + 1 );
 
 	pfxl = prefix ? strlen( prefix ) : 0;
 	for (; boxes; boxes = boxes->next) {
 		if (!starts_with( boxes->string, -1, prefix, pfxl ))
 			continue;
 		fnot = 1;
-		for (cpat = patterns; cpat; cpat = cpat->next) {
-			ps = cpat->string;
-			if (*ps == '!') {
-				ps++;
-				not = 1;
-			} else
-				not = 0;
-			if (matches( boxes->string + pfxl, ps )) {
-				fnot = not;
+		for (i = 0; i < npats; i++)
+			if (matches_pattern( boxes->string + pfxl, &pats[i], st )) {
+				fnot = pats[i].not;
 				break;
 			}
-		}
 		if (!fnot)
 			add_string_list( &nboxes, boxes->string + pfxl );
 	}
+	free( st );
+	free( pats );
 	return nboxes;
 }
 
+typedef struct {
+	string_list_t *box; /* zero if the slot is free */
+	int taken;
+} box_map_t;
+
+static unsigned
+hash_box( const char *name )
+{
+	unsigned h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+/* Move the boxes which exist on both sides to a separate list. Slave boxes
+ * with equal names end up in the probe sequence in list order, so they are
+ * paired up in the same order as by a linear search. */
+static void
+pair_boxes( string_list_t **mboxes, string_list_t **sboxes, string_list_t **cboxes )
+{
+	string_list_t *mbox, *sbox, **mboxp, **sboxp;
+	box_map_t *boxmap, *bme;
+	unsigned hashsz, idx;
+	int nboxes;
+
+	for (nboxes = 0, sbox = *sboxes; sbox; sbox = sbox->next)
+		nboxes++;
+	hashsz = bucketsForSize( nboxes * 3 );
+	boxmap = nfcalloc( hashsz * sizeof(*boxmap) );
+	for (sbox = *sboxes; sbox; sbox = sbox->next) {
+		idx = hash_box( sbox->string ) % hashsz;
+		while (boxmap[idx].box)
+			if (++idx == hashsz)
+				idx = 0;
+		boxmap[idx].box = sbox;
+	}
+
+	for (mboxp = mboxes; (mbox = *mboxp); ) {
+		idx = hash_box( mbox->string ) % hashsz;
+		for (; (bme = &boxmap[idx])->box; idx = (idx + 1 == hashsz) ? 0 : idx + 1)
+			if (!bme->taken && !strcmp( bme->box->string, mbox->string )) {
+				bme->taken = 1;
+				*mboxp = mbox->next;
+				mbox->next = *cboxes;
+				*cboxes = mbox;
+				goto gotdupe;
+			}
+		mboxp = &mbox->next;
+	  gotdupe: ;
+	}
+
+	for (sboxp = sboxes; (sbox = *sboxp); ) {
+		idx = hash_box( sbox->string ) % hashsz;
+		while (boxmap[idx].box != sbox)
+			if (++idx == hashsz)
+				idx = 0;
+		if (boxmap[idx].taken) {
+			*sboxp = sbox->next;
+			free( sbox );
+		} else {
+			sboxp = &sbox->next;
+		}
+	}
+	free( boxmap );
+}
+
 static void
 merge_actions( channel_conf_t *chan, int ops[], int have, int mask, int def )
 {
@@ -200,16 +338,32 @@ merge_actions( channel_conf_t *chan, int ops[], int have, int mask, int def )
 	}
 }
 
+typedef struct box_job {
+	struct box_job *next;
+	channel_conf_t *chan;
+	const char *names[2];
+	int run;
+	char dyn;
+} box_job_t;
+
 typedef struct {
 	int t[2];
 	channel_conf_t *chan;
 	driver_t *drv[2];
 	store_t *ctx[2];
 	string_list_t *boxes[2], *cboxes, *chanptr;
-	char *names[2];
+	box_job_t *jobs, **jobapp; /* boxes waiting for a worker */
 	char **argv;
 	int oind, ret, multiple, all, list, ops[2], state[2];
-	char done, skip, cben, boxlist;
+	int run, running; /* serial of the current channel; number of workers */
+	int round; /* serial of the full run, to know when to list again */
+	uint64_t round_start; /* for the statistics */
+	char skip, cben, boxlist, waiting, finished;
+	/* daemon mode */
+	struct watch *watches;
+	wakeup_t interval_timer;
+	int oind0, stopping; /* first channel argument; watches still to be stopped */
+	char daemon, in_round, full_round, full_pending, stop_watching;
 } main_vars_t;
 
 #define AUX &mvars->t[t]
@@ -217,11 +371,30 @@ typedef struct {
 	int t = *(int *)aux; \
 	main_vars_t *mvars = (main_vars_t *)(((char *)(&((int *)aux)[-t])) - offsetof(main_vars_t, t));
 
+/* A worker owns one pair of stores and syncs the queued boxes of one
+ * channel through them, one after another. Up to MaxParallel workers
+ * run at once. */
+typedef struct {
+	int t[2];
+	main_vars_t *mvars;
+	channel_conf_t *chan;
+	box_job_t *job;
+	store_t *ctx[2];
+	int run, state[2];
+	char done, skip, cben;
+} worker_vars_t;
+
+#define WVARS(aux) \
+	int t = *(int *)aux; \
+	worker_vars_t *wvars = (worker_vars_t *)(((char *)(&((int *)aux)[-t])) - offsetof(worker_vars_t, t));
+
 #define E_START  0
 #define E_OPEN   1
 #define E_SYNC   2
+#define E_NEXT   3
 
 static void sync_chans( main_vars_t *mvars, int ent );
+static void daemon_interval( void *aux );
 
 int
 main( int argc, char **argv )
@@ -229,7 +402,7 @@ main( int argc, char **argv )
 	main_vars_t mvars[1];
 	group_conf_t *group;
 	char *config = 0, *opt, *ochar;
-	int cops = 0, op, pseudo = 0;
+	int cops = 0, op, pseudo = 0, convert = -1;
 
 	tzset();
 	gethostname( Hostname, sizeof(Hostname) );
@@ -244,6 +417,7 @@ main( int argc, char **argv )
 
 	memset( mvars, 0, sizeof(*mvars) );
 	mvars->t[1] = 1;
+	mvars->jobapp = &mvars->jobs;
 
 	for (mvars->oind = 1, ochar = 0; ; ) {
 		if (!ochar || !*ochar) {
@@ -263,10 +437,26 @@ main( int argc, char **argv )
 					config = argv[mvars->oind++];
 				} else if (starts_with( opt, -1, "config=", 7 ))
 					config = opt + 7;
-				else if (!strcmp( opt, "all" ))
+				else if (!strcmp( opt, "stats" )) {
+					if (mvars->oind >= argc) {
+						error( "--stats requires an argument.\n" );
+						return 1;
+					}
+					if (stats_open( argv[mvars->oind++] ) < 0)
+						return 1;
+				} else if (starts_with( opt, -1, "stats=", 6 )) {
+					if (stats_open( opt + 6 ) < 0)
+						return 1;
+				} else if (!strcmp( opt, "all" ))
 					mvars->all = 1;
 				else if (!strcmp( opt, "list" ))
 					mvars->list = 1;
+				else if (!strcmp( opt, "daemon" ))
+					mvars->daemon = 1;
+				else if (!strcmp( opt, "convert-state=text" ))
+					convert = SYNCSTATE_TEXT;
+				else if (!strcmp( opt, "convert-state=binary" ))
+					convert = SYNCSTATE_BINARY;
 				else if (!strcmp( opt, "help" ))
 					usage( 0 );
 				else if (!strcmp( opt, "version" ))
@@ -364,6 +554,9 @@ main( int argc, char **argv )
 		case 'l':
 			mvars->list = 1;
 			break;
+		case 'w':
+			mvars->daemon = 1;
+			break;
 		case 'c':
 			if (*ochar == 'T') {
 				ochar++;
@@ -474,9 +667,25 @@ main( int argc, char **argv )
 	}
 #endif
 
+	if (convert >= 0) {
+		if (!argv[mvars->oind]) {
+			error( "No sync state file specified.\n" );
+			return 1;
+		}
+		for (; argv[mvars->oind]; mvars->oind++)
+			if (convert_sync_state( argv[mvars->oind], convert ))
+				mvars->ret = 1;
+		return mvars->ret;
+	}
+
 	if (merge_ops( cops, mvars->ops ))
 		return 1;
 
+	if (mvars->daemon && mvars->list) {
+		error( "--daemon and --list are mutually exclusive.\n" );
+		return 1;
+	}
+
 	if (load_config( config, pseudo ))
 		return 1;
 
@@ -501,7 +710,14 @@ main( int argc, char **argv )
 				break;
 			}
 	mvars->argv = argv;
+	mvars->oind0 = mvars->oind;
+	mvars->round = 1;
+	if (mvars->daemon) {
+		init_wakeup( &mvars->interval_timer, daemon_interval, mvars );
+		mvars->in_round = mvars->full_round = 1;
+	}
 	mvars->cben = 1;
+	mvars->round_start = get_usecs();
 	sync_chans( mvars, E_START );
 	main_loop();
 	return mvars->ret;
@@ -513,30 +729,68 @@ main( int argc, char **argv )
 
 static void store_opened( store_t *ctx, void *aux );
 static void store_listed( int sts, void *aux );
-static int sync_listed_boxes( main_vars_t *mvars, string_list_t *mbox );
-static void done_sync_dyn( int sts, void *aux );
-static void done_sync_2_dyn( int sts, void *aux );
-static void done_sync( int sts, void *aux );
+static void add_job( main_vars_t *mvars, const char *names[], int dyn );
+static void queue_listed_box( main_vars_t *mvars, string_list_t *mbox );
+static void start_worker( main_vars_t *mvars, store_t *ctx[] );
+static void daemon_round_done( main_vars_t *mvars );
 
 #define nz(a,b) ((a)?(a):(b))
 
+/* A fresh connection reports how long it took to set it up. */
+static void
+report_connect( channel_conf_t *chan, store_t *ctx, int t )
+{
+	if (!StatsFile || !(ctx->stats.connect_us | ctx->stats.tls_us | ctx->stats.auth_us))
+		return;
+	stats_open_rec( "connect" );
+	stats_str( "channel", chan->name );
+	stats_str( "side", str_ms[t] );
+	stats_str( "store", ctx->conf->name );
+	stats_usecs( "connect", ctx->stats.connect_us );
+	stats_usecs( "tls", ctx->stats.tls_us );
+	stats_usecs( "auth", ctx->stats.auth_us );
+	stats_io( "io", &ctx->stats );
+	stats_close_rec();
+	ctx->stats.connect_us = ctx->stats.tls_us = ctx->stats.auth_us = 0;
+}
+
+static void
+report_run( main_vars_t *mvars )
+{
+	if (!StatsFile)
+		return;
+	stats_open_rec( "run" );
+	stats_str( "status", mvars->ret ? "failed" : "ok" );
+	stats_usecs( "time", get_usecs() - mvars->round_start );
+	stats_close_rec();
+}
+
 static void
 sync_chans( main_vars_t *mvars, int ent )
 {
 	group_conf_t *group;
 	channel_conf_t *chan;
-	string_list_t *mbox, *sbox, **mboxp, **sboxp;
-	char *channame, *boxp, *nboxp;
+	string_list_t *mbox;
+	const char *channame, *boxp, *nboxp;
 	const char *labels[2];
-	int t;
+	int t, chanl;
 
 	if (!mvars->cben)
 		return;
 	switch (ent) {
 	case E_OPEN: goto opened;
-	case E_SYNC: goto syncone;
+	case E_NEXT:
+		if (mvars->finished)
+			goto finish;
+		goto nextchan;
 	}
 	for (;;) {
+	  nextchan:
+		/* Don't list the next channel's boxes before the queue runs dry. */
+		if (mvars->jobs || mvars->running >= MaxParallel) {
+			mvars->waiting = 1;
+			return;
+		}
 		mvars->boxlist = 0;
 		mvars->boxes[M] = mvars->boxes[S] = mvars->cboxes = 0;
 		if (!mvars->all) {
@@ -552,19 +806,22 @@ sync_chans( main_vars_t *mvars, int ent )
 				channame = mvars->argv[mvars->oind];
 			  gotgrp: ;
 			}
+			/* Don't modify the arguments; a daemon parses them again. */
 			if ((boxp = strchr( channame, ':' )))
-				*boxp++ = 0;
+				chanl = boxp++ - channame;
+			else
+				chanl = strlen( channame );
 			for (chan = channels; chan; chan = chan->next)
-				if (!strcmp( chan->name, channame ))
+				if (equals( chan->name, -1, channame, chanl ))
 					goto gotchan;
-			error( "No channel or group named '%s' defined.\n", channame );
+			error( "No channel or group named '%.*s' defined.\n", chanl, channame );
 			mvars->ret = 1;
 			goto gotnone;
 		  gotchan:
 			mvars->chan = chan;
 			if (boxp) {
 				if (!chan->patterns) {
-					error( "Cannot override mailbox in channel '%s' - no Patterns.\n", channame );
+					error( "Cannot override mailbox in channel '%s' - no Patterns.\n", chan->name );
 					mvars->ret = 1;
 					goto gotnone;
 				}
@@ -573,7 +830,7 @@ sync_chans( main_vars_t *mvars, int ent )
 					nboxp = strpbrk( boxp, ",\n" );
 					if (nboxp) {
 						t = nboxp - boxp;
-						*nboxp++ = 0;
+						nboxp++;
 					} else {
 						t = strlen( boxp );
 					}
@@ -591,6 +848,7 @@ sync_chans( main_vars_t *mvars, int ent )
 		merge_actions( mvars->chan, mvars->ops, XOP_HAVE_CREATE, OP_CREATE, 0 );
 		merge_actions( mvars->chan, mvars->ops, XOP_HAVE_EXPUNGE, OP_EXPUNGE, 0 );
 
+		mvars->run++;
 		mvars->state[M] = mvars->state[S] = ST_FRESH;
 		info( "Channel %s\n", mvars->chan->name );
 		mvars->skip = mvars->cben = 0;
@@ -598,12 +856,16 @@ sync_chans( main_vars_t *mvars, int ent )
 			labels[M] = "M: ", labels[S] = "S: ";
 		else
 			labels[M] = labels[S] = "";
-		for (t = 0; t < 2; t++) {
+		for (t = 0; ; t++) {
 			info( "Opening %s %s...\n", str_ms[t], mvars->chan->stores[t]->name );
 			mvars->drv[t] = mvars->chan->stores[t]->driver;
 			mvars->drv[t]->open_store( mvars->chan->stores[t], labels[t], store_opened, AUX );
-			if (mvars->skip)
+			if (t)
+				break;
+			if (mvars->skip) {
+				mvars->state[S] = ST_CLOSED;
 				break;
+			}
 		}
 		mvars->cben = 1;
 	  opened:
@@ -616,57 +878,36 @@ sync_chans( main_vars_t *mvars, int ent )
 			mvars->boxlist = 1;
 			mvars->boxes[M] = filter_boxes( mvars->ctx[M]->boxes, mvars->chan->boxes[M], mvars->chan->patterns );
 			mvars->boxes[S] = filter_boxes( mvars->ctx[S]->boxes, mvars->chan->boxes[S], mvars->chan->patterns );
-			for (mboxp = &mvars->boxes[M]; (mbox = *mboxp); ) {
-				for (sboxp = &mvars->boxes[S]; (sbox = *sboxp); sboxp = &sbox->next)
-					if (!strcmp( sbox->string, mbox->string )) {
-						*sboxp = sbox->next;
-						free( sbox );
-						*mboxp = mbox->next;
-						mbox->next = mvars->cboxes;
-						mvars->cboxes = mbox;
-						goto gotdupe;
-					}
-				mboxp = &mbox->next;
-			  gotdupe: ;
-			}
+			pair_boxes( &mvars->boxes[M], &mvars->boxes[S], &mvars->cboxes );
 		}
 
 		if (mvars->list && mvars->multiple)
 			printf( "%s:\n", mvars->chan->name );
-	  syncml:
-		mvars->done = mvars->cben = 0;
 		if (mvars->boxlist) {
 			while ((mbox = mvars->cboxes)) {
 				mvars->cboxes = mbox->next;
-				if (sync_listed_boxes( mvars, mbox ))
-					goto syncw;
+				queue_listed_box( mvars, mbox );
 			}
 			for (t = 0; t < 2; t++)
 				while ((mbox = mvars->boxes[t])) {
 					mvars->boxes[t] = mbox->next;
-					if ((mvars->chan->ops[1-t] & OP_MASK_TYPE) && (mvars->chan->ops[1-t] & OP_CREATE)) {
-						if (sync_listed_boxes( mvars, mbox ))
-							goto syncw;
-					} else {
+					if ((mvars->chan->ops[1-t] & OP_MASK_TYPE) && (mvars->chan->ops[1-t] & OP_CREATE))
+						queue_listed_box( mvars, mbox );
+					else
 						free( mbox );
-					}
 				}
+		} else if (!mvars->list) {
+			add_job( mvars, mvars->chan->boxes, 0 );
 		} else {
-			if (!mvars->list) {
-				sync_boxes( mvars->ctx, mvars->chan->boxes, mvars->chan, done_sync, mvars );
-				mvars->skip = 1;
-			  syncw:
-				mvars->cben = 1;
-				if (!mvars->done)
-					return;
-			  syncone:
-				if (!mvars->skip)
-					goto syncml;
-			} else
-				printf( "%s <=> %s\n", nz( mvars->chan->boxes[M], "INBOX" ), nz( mvars->chan->boxes[S], "INBOX" ) );
+			printf( "%s <=> %s\n", nz( mvars->chan->boxes[M], "INBOX" ), nz( mvars->chan->boxes[S], "INBOX" ) );
 		}
 
 	  next:
+		if (mvars->jobs && !mvars->skip) {
+			/* The first worker inherits our stores. */
+			mvars->state[M] = mvars->state[S] = ST_CLOSED;
+			start_worker( mvars, mvars->ctx );
+		}
 		for (t = 0; t < 2; t++)
 			if (mvars->state[t] == ST_OPEN) {
 				mvars->drv[t]->disown_store( mvars->ctx[t] );
@@ -676,6 +917,8 @@ sync_chans( main_vars_t *mvars, int ent )
 			mvars->skip = mvars->cben = 1;
 			return;
 		}
+		while (mvars->jobs && mvars->running < MaxParallel)
+			start_worker( mvars, 0 );
 		free_string_list( mvars->cboxes );
 		free_string_list( mvars->boxes[M] );
 		free_string_list( mvars->boxes[S] );
@@ -690,6 +933,20 @@ sync_chans( main_vars_t *mvars, int ent )
 				break;
 		}
 	}
+	mvars->finished = 1;
+  finish:
+	if (mvars->running) {
+		mvars->waiting = 1;
+		return;
+	}
+	report_run( mvars );
+	for (t = 0; t < N_DRIVERS; t++)
+		if (drivers[t]->drop_moved)
+			drivers[t]->drop_moved();
+	if (mvars->daemon) {
+		daemon_round_done( mvars );
+		return;
+	}
 	for (t = 0; t < N_DRIVERS; t++)
 		drivers[t]->cleanup();
 }
@@ -719,7 +976,11 @@ store_opened( store_t *ctx, void *aux )
 		return;
 	}
 	mvars->ctx[t] = ctx;
-	if (!mvars->skip && !mvars->boxlist && mvars->chan->patterns && !ctx->listed) {
+	report_connect( mvars->chan, ctx, t );
+	if (!mvars->skip && !mvars->boxlist && mvars->chan->patterns && ctx->listed != mvars->round) {
+		/* A recycled connection may carry the list of an earlier daemon run. */
+		free_string_list( ctx->boxes );
+		ctx->boxes = 0;
 		for (flags = 0, cpat = mvars->chan->patterns; cpat; cpat = cpat->next) {
 			const char *pat = cpat->string;
 			if (*pat != '!') {
@@ -769,7 +1030,7 @@ store_listed( int sts, void *aux )
 	case DRV_CANCELED:
 		return;
 	case DRV_OK:
-		mvars->ctx[t]->listed = 1;
+		mvars->ctx[t]->listed = mvars->round;
 		if (mvars->ctx[t]->conf->flat_delim) {
 			for (box = &mvars->ctx[t]->boxes; *box; box = &(*box)->next) {
 				string_list_t *nbox;
@@ -794,68 +1055,470 @@ store_listed( int sts, void *aux )
 	sync_chans( mvars, E_OPEN );
 }
 
-static int
-sync_listed_boxes( main_vars_t *mvars, string_list_t *mbox )
-{
-	if (mvars->chan->boxes[M] || mvars->chan->boxes[S]) {
-		const char *mpfx = nz( mvars->chan->boxes[M], "" );
-		const char *spfx = nz( mvars->chan->boxes[S], "" );
-		if (!mvars->list) {
-			nfasprintf( &mvars->names[M], "%s%s", mpfx, mbox->string );
-			nfasprintf( &mvars->names[S], "%s%s", spfx, mbox->string );
-			free( mbox );
-			sync_boxes( mvars->ctx, (const char **)mvars->names, mvars->chan, done_sync_2_dyn, mvars );
-			return 1;
+static void
+add_job( main_vars_t *mvars, const char *names[], int dyn )
+{
+	box_job_t *job;
+
+	job = nfmalloc( sizeof(*job) );
+	job->next = 0;
+	job->chan = mvars->chan;
+	job->names[M] = names[M];
+	job->names[S] = names[S];
+	job->run = mvars->run;
+	job->dyn = dyn;
+	*mvars->jobapp = job;
+	mvars->jobapp = &job->next;
+}
+
+static void
+free_job( box_job_t *job )
+{
+	if (job->dyn) {
+		free( (char *)job->names[M] );
+		free( (char *)job->names[S] );
+	}
+	free( job );
+}
+
+static void
+drop_jobs( main_vars_t *mvars, int run )
+{
+	box_job_t *job, **jobp;
+
+	for (jobp = &mvars->jobs; (job = *jobp); ) {
+		if (job->run == run) {
+			*jobp = job->next;
+			free_job( job );
+		} else {
+			jobp = &job->next;
 		}
+	}
+	mvars->jobapp = jobp;
+}
+
+static void
+queue_listed_box( main_vars_t *mvars, string_list_t *mbox )
+{
+	const char *mpfx = nz( mvars->chan->boxes[M], "" );
+	const char *spfx = nz( mvars->chan->boxes[S], "" );
+	char *names[2];
+
+	if (!mvars->list) {
+		nfasprintf( &names[M], "%s%s", mpfx, mbox->string );
+		nfasprintf( &names[S], "%s%s", spfx, mbox->string );
+		add_job( mvars, (const char **)names, 1 );
+	} else if (mvars->chan->boxes[M] || mvars->chan->boxes[S]) {
 		printf( "%s%s <=> %s%s\n", mpfx, mbox->string, spfx, mbox->string );
 	} else {
-		if (!mvars->list) {
-			mvars->names[M] = mvars->names[S] = mbox->string;
-			sync_boxes( mvars->ctx, (const char **)mvars->names, mvars->chan, done_sync_dyn, mvars );
-			return 1;
-		}
 		puts( mbox->string );
 	}
 	free( mbox );
-	return 0;
 }
 
+static void sync_worker( worker_vars_t *wvars, int ent );
+
 static void
-done_sync_dyn( int sts, void *aux )
+start_worker( main_vars_t *mvars, store_t *ctx[] )
 {
-	main_vars_t *mvars = (main_vars_t *)aux;
+	worker_vars_t *wvars;
 
-	free( ((char *)mvars->names[S]) - offsetof(string_list_t, string) );
-	done_sync( sts, aux );
+	wvars = nfcalloc( sizeof(*wvars) );
+	wvars->t[1] = 1;
+	wvars->mvars = mvars;
+	if (ctx) {
+		wvars->chan = mvars->chan;
+		wvars->run = mvars->run;
+		wvars->ctx[M] = ctx[M];
+		wvars->ctx[S] = ctx[S];
+		wvars->state[M] = wvars->state[S] = ST_OPEN;
+	}
+	wvars->cben = 1;
+	mvars->running++;
+	sync_worker( wvars, E_START );
 }
 
 static void
-done_sync_2_dyn( int sts, void *aux )
+dispatch_jobs( main_vars_t *mvars )
 {
-	main_vars_t *mvars = (main_vars_t *)aux;
+	while (mvars->jobs && mvars->running < MaxParallel)
+		start_worker( mvars, 0 );
+	if (mvars->waiting) {
+		mvars->waiting = 0;
+		sync_chans( mvars, E_NEXT );
+	}
+}
+
+static void worker_opened( store_t *ctx, void *aux );
+static void worker_synced( int sts, void *aux );
+static void note_job( main_vars_t *mvars, box_job_t *job );
 
-	free( mvars->names[M] );
-	free( mvars->names[S] );
-	done_sync( sts, aux );
+static void
+sync_worker( worker_vars_t *wvars, int ent )
+{
+	main_vars_t *mvars = wvars->mvars;
+	box_job_t *job;
+	const char *labels[2];
+	int t;
+
+	if (!wvars->cben)
+		return;
+	switch (ent) {
+	case E_OPEN: goto opened;
+	case E_SYNC: goto synced;
+	}
+	while ((job = mvars->jobs) && (!wvars->chan || job->run == wvars->run)) {
+		if (!(mvars->jobs = job->next))
+			mvars->jobapp = &mvars->jobs;
+		wvars->job = job;
+		if (!wvars->chan) {
+			wvars->chan = job->chan;
+			wvars->run = job->run;
+			if (wvars->chan->stores[M]->driver->flags & wvars->chan->stores[S]->driver->flags & DRV_VERBOSE)
+				labels[M] = "M: ", labels[S] = "S: ";
+			else
+				labels[M] = labels[S] = "";
+			wvars->cben = 0;
+			for (t = 0; ; t++) {
+				info( "Opening %s %s...\n", str_ms[t], wvars->chan->stores[t]->name );
+				wvars->chan->stores[t]->driver->open_store( wvars->chan->stores[t], labels[t], worker_opened, &wvars->t[t] );
+				if (t)
+					break;
+				if (wvars->skip) {
+					wvars->state[S] = ST_CLOSED;
+					break;
+				}
+			}
+			wvars->cben = 1;
+		  opened:
+			if (wvars->skip)
+				break;
+			if (wvars->state[M] != ST_OPEN || wvars->state[S] != ST_OPEN)
+				return;
+		}
+		wvars->done = wvars->cben = 0;
+		sync_boxes( wvars->ctx, wvars->job->names, wvars->chan, worker_synced, wvars );
+		wvars->cben = 1;
+		if (!wvars->done)
+			return;
+	  synced:
+		if (mvars->daemon)
+			note_job( mvars, wvars->job );
+		free_job( wvars->job );
+		wvars->job = 0;
+		if (wvars->skip)
+			break;
+	}
+	if (wvars->job) {
+		free_job( wvars->job );
+		wvars->job = 0;
+	}
+	if (wvars->skip)
+		drop_jobs( mvars, wvars->run );
+	for (t = 0; t < 2; t++)
+		if (wvars->state[t] == ST_OPEN) {
+			wvars->chan->stores[t]->driver->disown_store( wvars->ctx[t] );
+			wvars->state[t] = ST_CLOSED;
+		}
+	if (wvars->chan && (wvars->state[M] != ST_CLOSED || wvars->state[S] != ST_CLOSED))
+		return;
+	free( wvars );
+	mvars->running--;
+	dispatch_jobs( mvars );
 }
 
 static void
-done_sync( int sts, void *aux )
+worker_opened( store_t *ctx, void *aux )
 {
-	main_vars_t *mvars = (main_vars_t *)aux;
+	WVARS(aux)
+
+	if (!ctx) {
+		wvars->mvars->ret = wvars->skip = 1;
+		wvars->state[t] = ST_CLOSED;
+	} else {
+		wvars->ctx[t] = ctx;
+		wvars->state[t] = ST_OPEN;
+		report_connect( wvars->chan, ctx, t );
+	}
+	sync_worker( wvars, E_OPEN );
+}
+
+static void
+worker_synced( int sts, void *aux )
+{
+	worker_vars_t *wvars = (worker_vars_t *)aux;
 
-	mvars->done = 1;
+	wvars->done = 1;
 	if (sts) {
-		mvars->ret = 1;
+		wvars->mvars->ret = 1;
 		if (sts & (SYNC_BAD(M) | SYNC_BAD(S))) {
 			if (sts & SYNC_BAD(M))
-				mvars->state[M] = ST_CLOSED;
+				wvars->state[M] = ST_CLOSED;
 			if (sts & SYNC_BAD(S))
-				mvars->state[S] = ST_CLOSED;
-			mvars->skip = 1;
+				wvars->state[S] = ST_CLOSED;
+			wvars->skip = 1;
 		} else if (sts & SYNC_FAIL_ALL) {
-			mvars->skip = 1;
+			wvars->skip = 1;
+		}
+	}
+	sync_worker( wvars, E_SYNC );
+}
+
+/* In daemon mode, a watch waits for changes to the INBOX of a store which
+ * can be watched, and remembers which boxes were synced against that INBOX.
+ * When it reports a change, all watches are stopped to free the connections,
+ * and only the remembered boxes are synced again. */
+typedef struct watch {
+	struct watch *next;
+	main_vars_t *mvars;
+	store_conf_t *conf;
+	store_t *ctx;
+	box_job_t *jobs;
+	int state;
+	char changed, dead;
+} watch_t;
+
+#define W_IDLE      0
+#define W_OPENING   1
+#define W_WATCHING  2
+
+static int
+same_name( const char *a, const char *b )
+{
+	return a ? b && !strcmp( a, b ) : !b;
+}
+
+static int
+same_job( box_job_t *a, box_job_t *b )
+{
+	return a->chan == b->chan && same_name( a->names[M], b->names[M] ) && same_name( a->names[S], b->names[S] );
+}
+
+static box_job_t *
+copy_job( box_job_t *job )
+{
+	box_job_t *njob;
+
+	njob = nfmalloc( sizeof(*njob) );
+	njob->next = 0;
+	njob->chan = job->chan;
+	njob->names[M] = job->names[M] ? nfstrdup( job->names[M] ) : 0;
+	njob->names[S] = job->names[S] ? nfstrdup( job->names[S] ) : 0;
+	njob->run = job->run;
+	njob->dyn = 1;
+	return njob;
+}
+
+static void
+note_job( main_vars_t *mvars, box_job_t *job )
+{
+	watch_t *w, **wp;
+	box_job_t *wjob;
+	store_conf_t *conf;
+	int t;
+
+	for (t = 0; t < 2; t++) {
+		conf = job->chan->stores[t];
+		if (!conf->driver->idle || !same_name( nz( job->names[t], "INBOX" ), "INBOX" ))
+			continue;
+		for (wp = &mvars->watches; (w = *wp); wp = &w->next)
+			if (w->conf == conf)
+				goto gotwatch;
+		w = nfcalloc( sizeof(*w) );
+		w->mvars = mvars;
+		w->conf = conf;
+		*wp = w;
+	  gotwatch:
+		for (wjob = w->jobs; wjob; wjob = wjob->next)
+			if (same_job( wjob, job ))
+				goto gotjob;
+		wjob = copy_job( job );
+		wjob->next = w->jobs;
+		w->jobs = wjob;
+	  gotjob: ;
+	}
+}
+
+static void
+start_round( main_vars_t *mvars )
+{
+	watch_t *w;
+	box_job_t *wjob, *job;
+
+	mvars->in_round = 1;
+	mvars->round_start = get_usecs();
+	if (mvars->full_pending) {
+		mvars->full_pending = 0;
+		mvars->full_round = 1;
+		for (w = mvars->watches; w; w = w->next)
+			w->changed = 0;
+		mvars->round++;
+		mvars->chan = channels;
+		mvars->chanptr = 0;
+		mvars->oind = mvars->oind0;
+		mvars->finished = 0;
+		sync_chans( mvars, E_START );
+		return;
+	}
+	for (w = mvars->watches; w; w = w->next) {
+		if (!w->changed)
+			continue;
+		w->changed = 0;
+		for (wjob = w->jobs; wjob; wjob = wjob->next) {
+			for (job = mvars->jobs; job; job = job->next)
+				if (same_job( job, wjob ))
+					goto dupe;
+			job = copy_job( wjob );
+			job->run = ++mvars->run;
+			*mvars->jobapp = job;
+			mvars->jobapp = &job->next;
+		  dupe: ;
 		}
 	}
-	sync_chans( mvars, E_SYNC );
+	mvars->finished = mvars->waiting = 1;
+	dispatch_jobs( mvars );
+}
+
+static void
+unref_watches( main_vars_t *mvars )
+{
+	if (!--mvars->stopping) {
+		mvars->stop_watching = 0;
+		start_round( mvars );
+	}
+}
+
+static void
+release_watch( watch_t *w )
+{
+	if (w->ctx) {
+		w->conf->driver->disown_store( w->ctx );
+		w->ctx = 0;
+	}
+	w->state = W_IDLE;
+	if (w->mvars->stop_watching)
+		unref_watches( w->mvars );
+}
+
+static void
+stop_watches( main_vars_t *mvars )
+{
+	watch_t *w;
+
+	if (mvars->in_round || mvars->stop_watching)
+		return; /* the state is evaluated once they are done */
+	mvars->stop_watching = 1;
+	mvars->stopping = 1;
+	for (w = mvars->watches; w; w = w->next) {
+		if (w->state == W_IDLE)
+			continue;
+		mvars->stopping++;
+		/* Opening watches notice stop_watching when they are done. */
+		if (w->state == W_WATCHING)
+			w->conf->driver->cancel( w->ctx, (void (*)( void * ))release_watch, w );
+	}
+	unref_watches( mvars );
+}
+
+static void
+watch_bad( void *aux )
+{
+	watch_t *w = (watch_t *)aux;
+	store_t *ctx = w->ctx;
+
+	w->ctx = 0;
+	w->conf->driver->cancel_store( ctx );
+	release_watch( w );
+}
+
+static void
+watch_idled( int sts, void *aux )
+{
+	watch_t *w = (watch_t *)aux;
+
+	switch (sts) {
+	case DRV_OK:
+		debug( "change reported on %s\n", w->conf->name );
+		w->changed = 1;
+		stop_watches( w->mvars );
+		break;
+	case DRV_BOX_BAD:
+		/* No IDLE support. The periodic runs have to do. */
+		w->dead = 1;
+		if (!w->mvars->stop_watching)
+			release_watch( w );
+		break;
+	}
+}
+
+static void
+watch_selected( int sts, void *aux )
+{
+	watch_t *w = (watch_t *)aux;
+
+	if (w->mvars->stop_watching)
+		return;
+	switch (sts) {
+	case DRV_OK:
+		w->conf->driver->idle( w->ctx, watch_idled, w );
+		break;
+	case DRV_BOX_BAD:
+		w->dead = 1;
+		release_watch( w );
+		break;
+	}
+}
+
+static void
+watch_opened( store_t *ctx, void *aux )
+{
+	watch_t *w = (watch_t *)aux;
+
+	if (!ctx) {
+		release_watch( w );
+		return;
+	}
+	w->ctx = ctx;
+	if (w->mvars->stop_watching) {
+		release_watch( w );
+		return;
+	}
+	w->state = W_WATCHING;
+	set_bad_callback( ctx, watch_bad, w );
+	w->conf->driver->prepare_opts( ctx, 0 );
+	w->conf->driver->select( ctx, "INBOX", 0, watch_selected, w );
+}
+
+static void
+daemon_interval( void *aux )
+{
+	main_vars_t *mvars = (main_vars_t *)aux;
+
+	mvars->full_pending = 1;
+	stop_watches( mvars );
+}
+
+static void
+daemon_round_done( main_vars_t *mvars )
+{
+	watch_t *w;
+
+	mvars->in_round = 0;
+	if (mvars->full_round) {
+		mvars->full_round = 0;
+		if (DaemonInterval)
+			conf_wakeup( &mvars->interval_timer, DaemonInterval * 1000 );
+	}
+	if (mvars->full_pending) {
+		start_round( mvars );
+		return;
+	}
+	for (w = mvars->watches; w; w = w->next) {
+		if (w->dead || w->state != W_IDLE)
+			continue;
+		w->state = W_OPENING;
+		w->conf->driver->open_store( w->conf, "", watch_opened, w );
+		if (mvars->in_round || mvars->stop_watching)
+			break;
+	}
 }
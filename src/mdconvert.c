@@ -23,6 +23,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <stdarg.h>
 #include <dirent.h>
 #include <limits.h>
@@ -75,12 +77,47 @@ nfsnprintf( char *buf, int blen, const char *fmt, ... )
 	return ret;
 }
 
+static void ATTR_NORETURN
+oom( void )
+{
+	fputs( "Fatal: Out of memory\n", stderr );
+	abort();
+}
+
+static void *
+nfrealloc( void *mem, size_t sz )
+{
+	char *ret;
+
+	if (!(ret = realloc( mem, sz )) && sz)
+		oom();
+	return ret;
+}
+
+static char *
+nfstrdup( const char *str )
+{
+	char *ret;
+
+	if (!(ret = strdup( str )))
+		oom();
+	return ret;
+}
+
 static const char *subdirs[] = { "cur", "new" };
 static struct flock lck;
 static DBT key, value;
 
+/* Big enough to hold the UID map of a huge mailbox, so it is written out
+ * in one go when the mailbox is done, rather than page by page. */
+#define DB_CACHE_SIZE (16 * 1024 * 1024)
+
+#define CONV_OK      0
+#define CONV_FAIL    1
+#define CONV_SKIPPED 2  /* not in the source scheme, e.g., already converted */
+
 static int
-convert( const char *box, int altmap )
+convert( const char *box, int altmap, int *nmsgs )
 {
 	DB *db;
 	DIR *d;
@@ -92,9 +129,10 @@ convert( const char *box, int altmap )
 	char buf[_POSIX_PATH_MAX], buf2[_POSIX_PATH_MAX];
 	char umpath[_POSIX_PATH_MAX], uvpath[_POSIX_PATH_MAX], tdpath[_POSIX_PATH_MAX];
 
+	*nmsgs = 0;
 	if (stat( box, &st ) || !S_ISDIR(st.st_mode)) {
 		fprintf( stderr, "'%s' is no Maildir mailbox.\n", box );
-		return 1;
+		return CONV_FAIL;
 	}
 
 	nfsnprintf( umpath, sizeof(umpath), "%s/.isyncuidmap.db", box );
@@ -105,9 +143,11 @@ convert( const char *box, int altmap )
 		spath = umpath, dpath = uvpath, dbpath = umpath;
 	nfsnprintf( tdpath, sizeof(tdpath), "%s.tmp", dpath );
 	if ((sfd = open( spath, O_RDWR )) < 0) {
-		if (errno != ENOENT)
+		if (errno != ENOENT) {
 			sys_error( "Cannot open %s", spath );
-		return 1;
+			return CONV_FAIL;
+		}
+		return CONV_SKIPPED;
 	}
 	if (fcntl( sfd, F_SETLKW, &lck )) {
 		sys_error( "Cannot lock %s", spath );
@@ -121,6 +161,10 @@ convert( const char *box, int altmap )
 		fputs( "Error: db_create() failed\n", stderr );
 		goto tbork;
 	}
+	if ((ret = db->set_cachesize( db, 0, DB_CACHE_SIZE, 1 ))) {
+		db->err( db, ret, "Error: db->set_cachesize()" );
+		goto dbork;
+	}
 	if ((ret = (db->open)( db, 0, dbpath, 0, DB_HASH, altmap ? DB_CREATE|DB_TRUNCATE : 0, 0 ))) {
 		db->err( db, ret, "Error: db->open(%s)", dbpath );
 	  dbork:
@@ -130,7 +174,7 @@ convert( const char *box, int altmap )
 		close( dfd );
 	  sbork:
 		close( sfd );
-		return 1;
+		return CONV_FAIL;
 	}
 	key.data = (void *)"UIDVALIDITY";
 	key.size = 11;
@@ -160,6 +204,7 @@ convert( const char *box, int altmap )
 	}
 
   again:
+	*nmsgs = 0;
 	for (i = 0; i < 2; i++) {
 		bl = nfsnprintf( buf, sizeof(buf), "%s/%s/", box, subdirs[i] );
 		if (!(d = opendir( buf ))) {
@@ -217,7 +262,7 @@ convert( const char *box, int altmap )
 				closedir( d );
 				goto dbork;
 			}
-
+			++*nmsgs;
 		}
 		closedir( d );
 	}
@@ -227,27 +272,164 @@ convert( const char *box, int altmap )
 	if (rename( tdpath, dpath )) {
 		sys_error( "Cannot rename %s to %s", tdpath, dpath );
 		close( sfd );
-		return 1;
+		return CONV_FAIL;
 	}
 	if (unlink( spath ))
 		sys_error( "Cannot remove %s", spath );
 	close( sfd );
-	return 0;
+	return CONV_OK;
+}
+
+static char **boxes;
+static int nboxes, aboxes;
+
+static void
+add_box( const char *path )
+{
+	if (nboxes == aboxes) {
+		aboxes = aboxes * 2 + 100;
+		boxes = nfrealloc( boxes, aboxes * sizeof(*boxes) );
+	}
+	boxes[nboxes++] = nfstrdup( path );
+}
+
+/* Every directory with a cur subdirectory is taken to be a mailbox. Both
+ * Maildir++ style (dotted) and nested subfolders are found this way. */
+static int
+find_boxes( const char *path )
+{
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+	int ret, isbox;
+	char buf[_POSIX_PATH_MAX];
+
+	nfsnprintf( buf, sizeof(buf), "%s/cur", path );
+	if ((isbox = !stat( buf, &st ) && S_ISDIR(st.st_mode)))
+		add_box( path );
+	if (!(d = opendir( path ))) {
+		sys_error( "Cannot list %s", path );
+		return 1;
+	}
+	ret = 0;
+	while ((e = readdir( d ))) {
+		if (!strcmp( e->d_name, "." ) || !strcmp( e->d_name, ".." ))
+			continue;
+		if (isbox && (!strcmp( e->d_name, "cur" ) || !strcmp( e->d_name, "new" ) || !strcmp( e->d_name, "tmp" )))
+			continue;
+		nfsnprintf( buf, sizeof(buf), "%s/%s", path, e->d_name );
+		/* Symlinks are not followed, lest we run in circles. */
+		if (lstat( buf, &st ) || !S_ISDIR(st.st_mode))
+			continue;
+		ret |= find_boxes( buf );
+	}
+	closedir( d );
+	return ret;
+}
+
+static int progress;
+static int counts[3], total_msgs, ndone;
+
+static void
+box_done( int idx, int sts, int nmsgs )
+{
+	counts[sts]++;
+	total_msgs += nmsgs;
+	ndone++;
+	if (progress) {
+		if (sts == CONV_OK)
+			printf( "[%d/%d] %s: %d messages\n", ndone, nboxes, boxes[idx], nmsgs );
+		else if (sts == CONV_SKIPPED)
+			printf( "[%d/%d] %s: skipped\n", ndone, nboxes, boxes[idx] );
+		else
+			printf( "[%d/%d] %s: FAILED\n", ndone, nboxes, boxes[idx] );
+		fflush( stdout );
+	}
+}
+
+typedef struct {
+	int idx, nmsgs;
+} result_t;
+
+/* Each mailbox is converted by a child process of its own. The results come
+ * back through a pipe; they are small enough to be written atomically. */
+static void
+convert_parallel( int altmap, int jobs )
+{
+	pid_t pid, *pids;
+	result_t res;
+	int i, next, running, status, sts, fds[2], *nmsgs;
+
+	if (pipe( fds ) || fcntl( fds[0], F_SETFL, O_NONBLOCK )) {
+		perror( "Cannot create pipe" );
+		exit( 1 );
+	}
+	pids = nfrealloc( 0, nboxes * sizeof(*pids) );
+	nmsgs = nfrealloc( 0, nboxes * sizeof(*nmsgs) );
+	fflush( stdout );
+	for (next = running = 0; next < nboxes || running; ) {
+		if (next < nboxes && running < jobs) {
+			if ((pid = fork()) < 0) {
+				perror( "Cannot fork" );
+				if (!running)
+					exit( 1 );
+			} else if (!pid) {
+				close( fds[0] );
+				res.idx = next;
+				sts = convert( boxes[next], altmap, &res.nmsgs );
+				if (write( fds[1], &res, sizeof(res) ) != sizeof(res))
+					_exit( CONV_FAIL );
+				_exit( sts );
+			} else {
+				pids[next] = pid;
+				nmsgs[next++] = 0;
+				running++;
+				continue;
+			}
+		}
+		if ((pid = wait( &status )) < 0) {
+			perror( "Cannot wait for worker" );
+			exit( 1 );
+		}
+		running--;
+		while (read( fds[0], &res, sizeof(res) ) == sizeof(res))
+			nmsgs[res.idx] = res.nmsgs;
+		for (i = 0; pids[i] != pid; i++) {}
+		sts = (WIFEXITED(status) && WEXITSTATUS(status) <= CONV_SKIPPED) ? WEXITSTATUS(status) : CONV_FAIL;
+		box_done( i, sts, nmsgs[i] );
+	}
+	close( fds[0] );
+	close( fds[1] );
+	free( nmsgs );
+	free( pids );
+}
+
+static double
+get_time( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
 int
 main( int argc, char **argv )
 {
-	int oint, ret, altmap = 0;
+	int oint, ret, i, sts, nmsgs, altmap = 0, recursive = 0, jobs = 1;
+	double start, secs;
+	char *end;
 
 	for (oint = 1; oint < argc; oint++) {
 		if (!strcmp( argv[oint], "-h" ) || !strcmp( argv[oint], "--help" )) {
 			puts(
-"Usage: " EXE " [-a] mailbox...\n"
-"  -a, --alt      convert to alternative (DB based) UID scheme\n"
-"  -n, --native   convert to native (file name based) UID scheme (default)\n"
-"  -h, --help     show this help message\n"
-"  -v, --version  display version"
+"Usage: " EXE " [-a] [-r] [-j jobs] mailbox...\n"
+"  -a, --alt        convert to alternative (DB based) UID scheme\n"
+"  -n, --native     convert to native (file name based) UID scheme (default)\n"
+"  -r, --recursive  convert all mailboxes below the given directories\n"
+"  -j, --jobs N     convert up to N mailboxes in parallel\n"
+"  -h, --help       show this help message\n"
+"  -v, --version    display version"
 			);
 			return 0;
 		} else if (!strcmp( argv[oint], "-v" ) || !strcmp( argv[oint], "--version" )) {
@@ -257,6 +439,13 @@ main( int argc, char **argv )
 			altmap = 1;
 		} else if (!strcmp( argv[oint], "-n" ) || !strcmp( argv[oint], "--native" )) {
 			altmap = 0;
+		} else if (!strcmp( argv[oint], "-r" ) || !strcmp( argv[oint], "--recursive" )) {
+			recursive = 1;
+		} else if (!strcmp( argv[oint], "-j" ) || !strcmp( argv[oint], "--jobs" )) {
+			if (oint + 1 == argc || (jobs = strtol( argv[++oint], &end, 10 )) <= 0 || *end) {
+				fprintf( stderr, "Invalid number of jobs. Try " EXE " -h\n" );
+				return 1;
+			}
 		} else if (!strcmp( argv[oint], "--" )) {
 			oint++;
 			break;
@@ -277,8 +466,36 @@ main( int argc, char **argv )
 	lck.l_type = F_WRLCK;
 #endif
 	ret = 0;
-	for (; oint < argc; oint++)
-		ret |= convert( argv[oint], altmap );
+	if (!recursive) {
+		for (; oint < argc; oint++)
+			add_box( argv[oint] );
+	} else {
+		for (; oint < argc; oint++)
+			ret |= find_boxes( argv[oint] );
+		/* Large trees take a while, so keep the user informed. */
+		progress = 1;
+		printf( "Found %d mailboxes.\n", nboxes );
+	}
+	start = get_time();
+	if (jobs > 1 && nboxes > 1) {
+		convert_parallel( altmap, jobs );
+	} else {
+		for (i = 0; i < nboxes; i++) {
+			sts = convert( boxes[i], altmap, &nmsgs );
+			box_done( i, sts, nmsgs );
+		}
+	}
+	/* Mailboxes named explicitly must be in the source scheme. */
+	if (counts[CONV_FAIL] || (!recursive && counts[CONV_SKIPPED]))
+		ret = 1;
+	if (progress) {
+		secs = get_time() - start;
+		printf( "Converted %d mailboxes (%d skipped, %d failed) with %d messages in %.1f seconds",
+		        counts[CONV_OK], counts[CONV_SKIPPED], counts[CONV_FAIL], total_msgs, secs );
+		if (secs > 0)
+			printf( " (%.0f messages/s)", total_msgs / secs );
+		puts( "." );
+	}
 	return ret;
 }
 
@@ -0,0 +1,126 @@
+#! /usr/bin/perl -w
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Generate a tree of maildirs with synthetic messages, for benchmarking.
+# The first box is called INBOX, the others are box2, box3, ..., possibly
+# nested into each other. As mbsync expects it, the directories of nested
+# boxes are prefixed with a dot. The same arguments yield the same tree.
+
+use strict;
+use Getopt::Long;
+use File::Path;
+
+my %opt = (boxes => 1, depth => 1, messages => 100, size => 4096,
+           seen => 80, flagged => 5, seed => 1);
+
+sub usage()
+{
+	print STDERR <<EOF;
+Usage: $0 [options] DIR
+  --boxes N         number of mailboxes (default $opt{boxes})
+  --depth N         nest the mailboxes up to N levels deep (default $opt{depth})
+  --messages N      messages per mailbox (default $opt{messages})
+  --size BYTES      mean message size (default $opt{size}); the sizes are
+                    spread exponentially, like those of real mail
+  --seen PERCENT    share of read messages (default $opt{seen})
+  --flagged PERCENT share of flagged messages (default $opt{flagged})
+  --seed N          random seed (default $opt{seed})
+EOF
+	exit 1;
+}
+
+GetOptions(\%opt, "boxes=i", "depth=i", "messages=i", "size=i",
+                  "seen=i", "flagged=i", "seed=i") or usage();
+@ARGV == 1 or usage();
+my $dir = $ARGV[0];
+
+srand($opt{seed});
+
+my @words = qw(the of and to in is that for it as was with be by on not he
+               this are or his from at which but have an they you were her
+               she there one all we their can has been if more when will
+               would who so no mailbox server message folder sync state);
+
+sub text($)
+{
+	my ($len) = @_;
+	my $txt = "";
+	my $line = "";
+	while (length($txt) + length($line) < $len) {
+		my $w = $words[int(rand(@words))];
+		if (length($line) + length($w) >= 72) {
+			$txt .= $line."\n";
+			$line = "";
+		}
+		$line .= ($line eq "" ? "" : " ").$w;
+	}
+	return $txt.$line."\n";
+}
+
+my @days = qw(Sun Mon Tue Wed Thu Fri Sat);
+my @months = qw(Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec);
+our $total = 0;
+
+sub mkbox($$)
+{
+	my ($name, $path) = @_;
+
+	for my $sd ("", "/cur", "/new", "/tmp") {
+		-d $path.$sd or mkpath($path.$sd) or die "Cannot create $path$sd.\n";
+	}
+	for my $i (1..$opt{messages}) {
+		# Exponentially distributed, but never smaller than the headers.
+		my $size = int(-log(1 - rand()) * $opt{size});
+		my $stamp = 1000000000 + int(rand(500000000));
+		my @t = gmtime($stamp);
+		my $msg = "From: Sender $i <sender$i\@example.com>\n".
+		          "To: Recipient <rcpt\@example.org>\n".
+		          "Subject: ".$name." message ".$i."\n".
+		          sprintf("Date: %s, %d %s %d %02d:%02d:%02d +0000\n",
+		                  $days[$t[6]], $t[3], $months[$t[4]], $t[5] + 1900, $t[2], $t[1], $t[0]).
+		          "Message-ID: <".$stamp.".".$i."\@bench.example.com>\n".
+		          "\n";
+		$msg .= text($size - length($msg)) if ($size > length($msg));
+		my $flags = "";
+		$flags .= "F" if (rand(100) < $opt{flagged});
+		my $seen = rand(100) < $opt{seen};
+		$flags .= "S" if ($seen);
+		my $fn = $seen || $flags ne "" ?
+			$path."/cur/".$stamp.".".$i."_bench.localhost:2,".$flags :
+			$path."/new/".$stamp.".".$i."_bench.localhost";
+		open(FILE, ">", $fn) or die "Cannot create $fn.\n";
+		print FILE $msg;
+		close FILE;
+		utime($stamp, $stamp, $fn);
+		$total += length($msg);
+	}
+}
+
+my @names = ("INBOX");
+for my $b (2..$opt{boxes}) {
+	my $name = "box".$b;
+	# Put it into a random earlier box which is not nested too deeply yet.
+	my @parents = grep { $_ ne "INBOX" && ($_ =~ tr,/,,) + 1 < $opt{depth} } @names;
+	$name = $parents[int(rand(@parents))]."/".$name
+		if (@parents && rand(2) < 1);
+	push @names, $name;
+}
+for my $name (@names) {
+	(my $path = $name) =~ s,/,/.,g;
+	mkbox($name, $dir."/".$path);
+}
+printf("Created %d boxes with %d messages, %.1f MB.\n",
+       scalar(@names), scalar(@names) * $opt{messages}, $total / 1048576);
@@ -0,0 +1,230 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+#include "msg_cvt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Word-at-a-time scanning, see "Bit Twiddling Hacks". */
+#define ONES (~0UL / 0xff)
+#define HIGHS (ONES << 7)
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+#define CRS (ONES * '\r')
+#define LFS (ONES * '\n')
+
+/* Find the first CR or LF in [p, e), or return e. */
+static const char *
+find_cr_or_lf( const char *p, const char *e )
+{
+	unsigned long w;
+
+	for (; e - p >= (int)sizeof(w); p += sizeof(w)) {
+		memcpy( &w, p, sizeof(w) );
+		if (HAS_ZERO( w ^ CRS ) | HAS_ZERO( w ^ LFS ))
+			break;
+	}
+	for (; p < e; p++)
+		if (*p == '\r' || *p == '\n')
+			break;
+	return p;
+}
+
+static void
+cvt_flush( msg_cvt_t *cvt )
+{
+	if (cvt->obufl) {
+		cvt->out( cvt->aux, cvt->obuf, cvt->obufl );
+		cvt->obufl = 0;
+	}
+}
+
+static void
+cvt_emit( msg_cvt_t *cvt, const char *buf, int len )
+{
+	if (cvt->obufl + len > CVT_BUF_SIZE) {
+		cvt_flush( cvt );
+		if (len >= CVT_BUF_SIZE) {
+			cvt->out( cvt->aux, buf, len );
+			return;
+		}
+	}
+	memcpy( cvt->obuf + cvt->obufl, buf, len );
+	cvt->obufl += len;
+}
+
+static void
+cvt_convert( msg_cvt_t *cvt, const char *buf, int len )
+{
+	const char *p, *e = buf + len;
+
+	if (cvt->tcr == cvt->scr) {
+		cvt_emit( cvt, buf, len );
+	} else if (!cvt->tcr) {
+		/* Strip all CRs. */
+		while ((p = memchr( buf, '\r', e - buf ))) {
+			cvt_emit( cvt, buf, p - buf );
+			buf = p + 1;
+		}
+		cvt_emit( cvt, buf, e - buf );
+	} else {
+		/* Strip stray CRs and precede each LF with a CR. */
+		while ((p = find_cr_or_lf( buf, e )) != e) {
+			cvt_emit( cvt, buf, p - buf );
+			if (*p == '\n')
+				cvt_emit( cvt, "\r\n", 2 );
+			buf = p + 1;
+		}
+		cvt_emit( cvt, buf, e - buf );
+	}
+}
+
+static void
+cvt_emit_tuid( msg_cvt_t *cvt )
+{
+	cvt_emit( cvt, "X-TUID: ", 8 );
+	cvt_emit( cvt, cvt->tuid, TUIDL );
+	if (cvt->tcr && (!cvt->scr || cvt->hcrs))
+		cvt_emit( cvt, "\r\n", 2 );
+	else
+		cvt_emit( cvt, "\n", 1 );
+}
+
+/* Process one complete header line; return 1 once the X-TUID is placed. */
+static int
+cvt_header_line( msg_cvt_t *cvt, const char *buf, int len )
+{
+	const char *p, *e;
+	int lcrs;
+
+	if (starts_with( buf, len, "X-TUID: ", 8 )) {
+		cvt_emit_tuid( cvt );
+		return 1;
+	}
+	for (lcrs = 0, p = buf, e = buf + len; (p = memchr( p, '\r', e - p )); p++)
+		lcrs++;
+	cvt->hcrs += lcrs;
+	if (len - lcrs == 1) {
+		/* Empty line - end of header. */
+		cvt_emit_tuid( cvt );
+		cvt_convert( cvt, buf, len );
+		return 1;
+	}
+	cvt_convert( cvt, buf, len );
+	return 0;
+}
+
+void
+msg_cvt_init( msg_cvt_t *cvt, int scr, int tcr, const char *tuid,
+              void (*out)( void *aux, const char *buf, int len ), void *aux )
+{
+	cvt->out = out;
+	cvt->aux = aux;
+	cvt->tuid = tuid;
+	cvt->line = 0;
+	cvt->linel = cvt->linesz = cvt->obufl = cvt->hcrs = 0;
+	cvt->scr = scr;
+	cvt->tcr = tcr;
+	cvt->inhdr = tuid != 0;
+}
+
+void
+msg_cvt_feed( msg_cvt_t *cvt, const char *buf, int len )
+{
+	const char *nl;
+	int ll;
+
+	while (cvt->inhdr) {
+		if (!(nl = memchr( buf, '\n', len ))) {
+			if (cvt->linel + len > cvt->linesz)
+				cvt->line = nfrealloc( cvt->line, cvt->linesz = cvt->linel + len + 256 );
+			memcpy( cvt->line + cvt->linel, buf, len );
+			cvt->linel += len;
+			return;
+		}
+		ll = nl + 1 - buf;
+		if (cvt->linel) {
+			if (cvt->linel + ll > cvt->linesz)
+				cvt->line = nfrealloc( cvt->line, cvt->linesz = cvt->linel + ll );
+			memcpy( cvt->line + cvt->linel, buf, ll );
+			cvt->inhdr = !cvt_header_line( cvt, cvt->line, cvt->linel + ll );
+			cvt->linel = 0;
+		} else {
+			cvt->inhdr = !cvt_header_line( cvt, buf, ll );
+		}
+		buf += ll;
+		len -= ll;
+	}
+	cvt_convert( cvt, buf, len );
+}
+
+int
+msg_cvt_done( msg_cvt_t *cvt )
+{
+	free( cvt->line );
+	cvt->line = 0;
+	if (cvt->inhdr)
+		return -1;
+	cvt_flush( cvt );
+	return 0;
+}
+
+typedef struct {
+	char *buf;
+	int len, size;
+} cvt_buffer_t;
+
+static void
+cvt_buffer_out( void *aux, const char *buf, int len )
+{
+	cvt_buffer_t *ob = (cvt_buffer_t *)aux;
+
+	if (ob->len + len > ob->size)
+		ob->buf = nfrealloc( ob->buf, ob->size = ob->len + len + ob->size / 2 );
+	memcpy( ob->buf + ob->len, buf, len );
+	ob->len += len;
+}
+
+int
+msg_cvt_buffer( const char *buf, int len, int scr, int tcr, const char *tuid,
+                char **out, int *outl )
+{
+	msg_cvt_t *cvt;
+	cvt_buffer_t ob;
+	int ret;
+
+	/* Enough unless LFs need to be expanded, in which case we need to grow once. */
+	ob.size = len + TUIDL + 16;
+	ob.buf = nfmalloc( ob.size );
+	ob.len = 0;
+	cvt = nfmalloc( sizeof(*cvt) );
+	msg_cvt_init( cvt, scr, tcr, tuid, cvt_buffer_out, &ob );
+	msg_cvt_feed( cvt, buf, len );
+	ret = msg_cvt_done( cvt );
+	free( cvt );
+	if (ret < 0) {
+		free( ob.buf );
+		return -1;
+	}
+	*out = ob.buf;
+	*outl = ob.len;
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+
+#ifndef MSG_CVT_H
+#define MSG_CVT_H
+
+#include "driver.h"
+
+/* Converts a message on its way from one store to another: line endings are
+ * adjusted and the X-TUID header is replaced or inserted. The input may be fed
+ * in arbitrary pieces; each byte is looked at only once. The output is passed
+ * to the callback in pieces of up to CVT_BUF_SIZE bytes (larger ones may be
+ * passed through unbuffered). */
+
+#define CVT_BUF_SIZE 16384
+
+typedef struct {
+	void (*out)( void *aux, const char *buf, int len );
+	void *aux;
+	const char *tuid; /* TUIDL chars; null if the header is to be left alone */
+	char *line; /* incomplete header line */
+	int linel, linesz, obufl, hcrs;
+	char scr, tcr, inhdr;
+	char obuf[CVT_BUF_SIZE];
+} msg_cvt_t;
+
+/* scr and tcr say whether the source and the target use CRLF line endings. */
+void msg_cvt_init( msg_cvt_t *cvt, int scr, int tcr, const char *tuid,
+                   void (*out)( void *aux, const char *buf, int len ), void *aux );
+void msg_cvt_feed( msg_cvt_t *cvt, const char *buf, int len );
+/* Flush the output and free resources. Returns -1 if the header was incomplete. */
+int msg_cvt_done( msg_cvt_t *cvt );
+
+/* Convert a message which is entirely in memory. The result is stored in *out.
+ * Returns -1 (with nothing allocated) if the header was incomplete. */
+int msg_cvt_buffer( const char *buf, int len, int scr, int tcr, const char *tuid,
+                    char **out, int *outl );
+
+#endif
@@ -0,0 +1,383 @@
+#! /usr/bin/perl -w
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Benchmark mbsync against fake-imapd.pl in some standard scenarios, on
+# mailboxes made by mkmaildir.pl, and the scaling of some Maildir-only
+# operations. Usually run via "make bench".
+#
+# The MB/s refer to the bytes on the wire. The syscall counts cover only
+# reads and writes, and like the peak RSS, they come from /proc, so they
+# are not available everywhere.
+
+use strict;
+use Getopt::Long;
+use File::Basename;
+use File::Find;
+use File::Path;
+use File::Spec;
+use Time::HiRes qw(time sleep);
+use POSIX qw(:sys_wait_h);
+
+my %opt = (mbsync => "./mbsync", boxes => 4, depth => 2, messages => 500, size => 8192,
+           latency => 0, bandwidth => 0, tuids => 25000, lists => 2000);
+my @scenarios = ("download", "noop", "flags", "upload", "tuid", "list");
+
+sub usage($)
+{
+	my ($sts) = @_;
+	print { $sts ? \*STDERR : \*STDOUT } <<EOF;
+Usage: $0 [options] [scenario...]
+  --mbsync PATH     the binary to benchmark (default $opt{mbsync})
+  --boxes N, --depth N, --messages N, --size BYTES
+                    the shape of the mailboxes, see mkmaildir.pl
+                    (defaults $opt{boxes}, $opt{depth}, $opt{messages}, $opt{size})
+  --latency MS      round trip time to simulate
+  --bandwidth KB    bandwidth limit in kilobytes per second
+  --caps LIST       capabilities the server announces
+  --tuids N         messages of the interrupted upload (default $opt{tuids})
+  --lists N         boxes of the smaller list (default $opt{lists})
+  --keep            keep the work directory
+  --help            show this help
+Scenarios: @scenarios (default: all)
+  download          initial download of all mailboxes
+  noop              sync without any changes
+  flags             propagate flag changes of 10% of the messages
+  upload            initial upload of all mailboxes
+  tuid              recovery of an interrupted upload from Maildir to Maildir,
+                    with the messages in order and reversed on the slave
+  list              listing of Maildir boxes with long common prefixes,
+                    with N and 4*N boxes
+EOF
+	exit $sts;
+}
+
+GetOptions(\%opt, "mbsync=s", "boxes=i", "depth=i", "messages=i", "size=i",
+                  "latency=f", "bandwidth=f", "caps=s", "tuids=i", "lists=i", "keep", "help") or usage(1);
+usage(0) if ($opt{help});
+my %want = map { ($_, 1) } @ARGV ? @ARGV : @scenarios;
+for (keys %want) {
+	my $s = $_;
+	grep { $_ eq $s } @scenarios or usage(1);
+}
+
+my $srcdir = dirname($0);
+my $mbsync = File::Spec->rel2abs($opt{mbsync});
+-x $mbsync or die "No mbsync binary at $mbsync.\n";
+# Builds without SSL support do not know the SSLType keyword.
+my $ssl = `$mbsync --help` =~ /\+HAVE_LIBSSL/;
+my $work = File::Spec->rel2abs("bench-tmp");
+rmtree($work);
+mkdir($work) or die "Cannot create $work.\n";
+
+sub mkmaildir($)
+{
+	my ($dir) = @_;
+	system("perl", $srcdir."/mkmaildir.pl", "--boxes", $opt{boxes}, "--depth", $opt{depth},
+	       "--messages", $opt{messages}, "--size", $opt{size}, $dir) and
+		die "Cannot generate mailboxes.\n";
+}
+
+my $server;
+END { kill "TERM", $server if ($server); }
+
+sub start_server(@)
+{
+	my @args = @_;
+	push @args, "--latency", $opt{latency} if ($opt{latency});
+	push @args, "--bandwidth", $opt{bandwidth} if ($opt{bandwidth});
+	push @args, "--caps", $opt{caps} if (defined($opt{caps}));
+	unlink $work."/stats";
+	$server = open(SRV, "-|", "perl", $srcdir."/fake-imapd.pl", "--port", "0",
+	                          "--stats", $work."/stats", @args) or
+		die "Cannot start fake-imapd.pl.\n";
+	my $port = <SRV>;
+	defined($port) or die "fake-imapd.pl did not start.\n";
+	chomp $port;
+	return $port;
+}
+
+sub stop_server()
+{
+	kill "TERM", $server;
+	close SRV;
+	$server = undef;
+}
+
+# Without a port, the master is a Maildir.
+sub writecfg($$;$)
+{
+	my ($port, $sync, $pats) = @_;
+	$pats = "*" if (!defined($pats));
+	my $sslcfg = $ssl ? "SSLType None\n" : "";
+	my $remote = defined($port) ? <<EOF : <<EOF;
+IMAPAccount bench
+Host 127.0.0.1
+Port $port
+${sslcfg}Timeout 0
+
+IMAPStore remote
+Account bench
+EOF
+MaildirStore remote
+Path $work/remote/
+Inbox $work/remote/INBOX
+EOF
+	open(FILE, ">", $work."/.mbsyncrc") or die "Cannot create config.\n";
+	print FILE <<EOF;
+$remote
+MaildirStore local
+Path $work/local/
+Inbox $work/local/INBOX
+
+Channel bench
+Master :remote:
+Slave :local:
+Patterns $pats
+Create Both
+SyncState *
+Sync $sync
+EOF
+	close FILE;
+}
+
+sub proc_stats($)
+{
+	my ($pid) = @_;
+	my ($zombie, $rss, $sys);
+	if (open(my $fh, "<", "/proc/$pid/status")) {
+		while (<$fh>) {
+			$zombie = 1 if (/^State:\s+Z/);
+			$rss = $1 if (/^VmHWM:\s+(\d+)/);
+		}
+		close $fh;
+	}
+	if (open(my $fh, "<", "/proc/$pid/io")) {
+		$sys = 0;
+		while (<$fh>) {
+			$sys += $1 if (/^sysc[rw]:\s+(\d+)/);
+		}
+		close $fh;
+	}
+	return ($zombie, $rss, $sys);
+}
+
+# The Maildir driver waits for a second after scanning a directory which
+# was modified just before, so the results would measure mostly that.
+sub age_maildirs()
+{
+	my $then = time() - 60;
+	my @dirs = grep { -d $_ } ($work."/local", $work."/remote");
+	find(sub { utime($then, $then, $_) if (-d $_); }, @dirs) if (@dirs);
+}
+
+# Returns the elapsed time, the peak RSS in KiB and the syscall count.
+sub run_mbsync(@)
+{
+	my @args = @_;
+	my ($rss, $sys) = (undef, undef);
+	age_maildirs();
+	my $start = time();
+	my $pid = fork();
+	defined($pid) or die "Cannot fork.\n";
+	if (!$pid) {
+		open(STDOUT, ">", $work."/mbsync.log");
+		open(STDERR, ">&", \*STDOUT);
+		exec($mbsync, @args, "-c", $work."/.mbsyncrc", "bench") or exit 127;
+	}
+	# The process is not reaped before it is a zombie, so the final
+	# syscall count can be read. The memory is gone by then, though.
+	for (;;) {
+		my ($z, $r, $s) = proc_stats($pid);
+		$rss = $r if (defined($r));
+		$sys = $s if (defined($s));
+		last if ($z || !-e "/proc/$pid");
+		sleep(.002);
+	}
+	waitpid($pid, 0);
+	my $elapsed = time() - $start;
+	if ($?) {
+		print "mbsync failed (exit status ".($? >> 8)."), see $work/mbsync.log:\n";
+		system("tail", "-n", "20", $work."/mbsync.log");
+		exit 1;
+	}
+	return ($elapsed, $rss, $sys);
+}
+
+sub server_stats()
+{
+	# The server logs the session after noticing the disconnect.
+	for (my $i = 0; $i < 500 && !-s $work."/stats"; $i++) {
+		sleep(.01);
+	}
+	my %st = (roundtrips => 0, bytes_in => 0, bytes_out => 0);
+	open(my $fh, "<", $work."/stats") or return %st;
+	while (<$fh>) {
+		for my $kv (split) {
+			my ($k, $v) = split(/=/, $kv);
+			$st{$k} += $v;
+		}
+	}
+	close $fh;
+	unlink $work."/stats";
+	return %st;
+}
+
+sub count_msgs($)
+{
+	my ($dir) = @_;
+	my $n = 0;
+	open(my $fh, "-|", "find", $dir, "-path", "*/cur/*", "-o", "-path", "*/new/*") or return 0;
+	$n++ while (<$fh>);
+	close $fh;
+	return $n;
+}
+
+printf("%-10s %7s %7s %8s %9s %8s %6s %9s %9s\n",
+       "scenario", "msgs", "MB", "time", "msgs/s", "MB/s", "RTs", "syscalls", "peak RSS");
+
+# $name, $count, @mbsync_args
+sub report($$@)
+{
+	my ($name, $msgs, @args) = @_;
+	my ($elapsed, $rss, $sys) = run_mbsync(@args);
+	my %st = $server ? server_stats() : (roundtrips => 0, bytes_in => 0, bytes_out => 0);
+	my $mb = ($st{bytes_in} + $st{bytes_out}) / 1048576;
+	printf("%-10s %7d %7.1f %7.2fs %9.1f %8.2f %6d %9s %9s\n",
+	       $name, $msgs, $mb, $elapsed, $msgs / $elapsed, $mb / $elapsed, $st{roundtrips},
+	       defined($sys) ? $sys : "-", defined($rss) ? sprintf("%.1f MB", $rss / 1024) : "-");
+	return $elapsed;
+}
+
+# Set up a Maildir to Maildir upload which was interrupted after storing
+# the messages on the slave, but before their UIDs were recorded. With
+# $rev, the slave has them in the opposite order.
+sub mktuids($)
+{
+	my ($rev) = @_;
+	my $num = $opt{tuids};
+	for my $bn ("remote", "local") {
+		rmtree($work."/".$bn);
+		my $b = $work."/".$bn."/INBOX";
+		(mkdir($work."/".$bn) and mkdir($b) and mkdir($b."/tmp") and mkdir($b."/new") and mkdir($b."/cur")) or
+			die "Cannot create mailbox $b.\n";
+		open(FILE, ">", $b."/.uidvalidity") or die "Cannot create UID validity for mailbox $b.\n";
+		print FILE "1\n$num\n";
+		close FILE;
+	}
+	my $b = $work."/local/INBOX";
+	open(JFILE, ">", $b."/.mbsyncstate.journal") or die "Cannot create journal.\n";
+	print JFILE "2\n} 1\n";
+	for my $u (1..$num) {
+		my $tuid = sprintf("T%011d", $u);
+		my $su = $rev ? $num + 1 - $u : $u;
+		print JFILE "+ $u -2\n# $u -2 $tuid\n";
+		for my $m ([ "remote", $u, "" ], [ "local", $su, "X-TUID: $tuid\n" ]) {
+			my ($bn, $uid, $hdr) = @$m;
+			open(FILE, ">", $work."/$bn/INBOX/cur/0.1_$uid.bench,U=$uid:2,S") or
+				die "Cannot create message $uid in $bn.\n";
+			print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $u\n$hdr\n";
+			close FILE;
+		}
+	}
+	close JFILE;
+	open(FILE, ">", $b."/.mbsyncstate") or die "Cannot create sync state.\n";
+	print FILE "MasterUidValidity 1\nMaxPulledUid $num\nSlaveUidValidity 1\nMaxExpiredSlaveUid 0\nMaxPushedUid 0\n\n";
+	close FILE;
+	open(FILE, ">", $b."/.mbsyncstate.new") or die "Cannot create new sync state.\n";
+	close FILE;
+}
+
+my $port;
+
+if ($want{download} || $want{noop} || $want{flags}) {
+	mkmaildir($work."/gen");
+	$port = start_server("--import", $work."/gen");
+	writecfg($port, "All");
+	mkdir($work."/local");
+	if ($want{download}) {
+		report("download", count_msgs($work."/gen"));
+	} else {
+		run_mbsync();
+		server_stats();
+	}
+	report("noop", count_msgs($work."/local")) if ($want{noop});
+	if ($want{flags}) {
+		my $n = 0;
+		open(my $fh, "-|", "find", $work."/local", "-path", "*/cur/*") or die "Cannot run find.\n";
+		while (my $fn = <$fh>) {
+			chomp $fn;
+			next if (++$n % 10);
+			my $nfn = $fn =~ /F/ ? $fn =~ s/F//r : $fn."F";
+			$nfn =~ s/,([A-Z]*)$/",".join("", sort split(\/\/, $1))/e;
+			rename($fn, $nfn) or die "Cannot rename $fn.\n";
+		}
+		close $fh;
+		report("flags", int($n / 10));
+	}
+	stop_server();
+}
+
+if ($want{upload}) {
+	rmtree($work."/local");
+	mkmaildir($work."/local");
+	$port = start_server();
+	writecfg($port, "Push");
+	report("upload", count_msgs($work."/local"));
+	stop_server();
+}
+
+# The matching should take about as long either way.
+if ($want{tuid}) {
+	writecfg(undef, "Pull New");
+	mktuids(0);
+	my $tfwd = report("tuid", $opt{tuids});
+	mktuids(1);
+	my $trev = report("tuid-rev", $opt{tuids});
+	printf("reversed TUID matching took %.2f times as long\n", $trev / $tfwd);
+	rmtree($work."/remote");
+}
+
+# Long common prefixes make for slow comparisons, and many dashes for
+# slow backtracking in the last pattern, which never matches. Every fifth
+# box exists on one side only. Listing needs only cur/.
+sub mklists($$)
+{
+	my ($num, $lpfx) = @_;
+	for my $bn ("remote", "local") {
+		rmtree($work."/".$bn);
+		mkdir($work."/".$bn) or die "Cannot create $bn.\n";
+		for my $i (1..$num) {
+			next if ($i % 5 == ($bn eq "remote" ? 1 : 2));
+			my $b = $work."/".$bn."/".$lpfx.$i;
+			(mkdir($b) and mkdir($b."/cur")) or
+				die "Cannot create mailbox $b.\n";
+		}
+	}
+}
+
+# The matching should take linear time.
+if ($want{list}) {
+	my $lpfx = ("shared-projects-archive-" x 5)."box";
+	writecfg(undef, "All", "* !$lpfx%/* $lpfx* !*3 !*-*-*-*-*-*x");
+	mklists($opt{lists}, $lpfx);
+	my $tsmall = report("list", $opt{lists}, "-l");
+	mklists($opt{lists} * 4, $lpfx);
+	my $tlarge = report("list-4x", $opt{lists} * 4, "-l");
+	printf("listing four times as many boxes took %.2f times as long\n", $tlarge / $tsmall);
+	rmtree($work."/remote");
+}
+
+rmtree($work) if (!$opt{keep});
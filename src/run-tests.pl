@@ -17,6 +17,7 @@
 #
 
 use strict;
+use File::Copy;
 use File::Path;
 
 -d "tmp" or mkdir "tmp";
@@ -24,6 +25,11 @@ chdir "tmp" or die "Cannot enter temp direcory.\n";
 
 sub show($$$);
 sub test($$$@);
+sub tuidtest($$$);
+sub listtest($\@\@\@@);
+sub crashtest($$$@);
+sub converttest($$);
+sub testfmt($$$$@);
 
 ################################################################################
 
@@ -224,6 +230,100 @@ my @X51 = (
 );
 test("max messages + expire", \@x50, \@X51, @O51);
 
+# age restriction tests
+
+my @x60 = (
+ [ 0,
+   1, 0, "S", 2, 0, "", 3, 0, "+S", 4, 0, "+" ],
+ [ 0,
+   ],
+ [ 0, 0, 0,
+    ],
+);
+
+my @O61 = ("", "", "MaxAge 30\n");
+#show("60", "61", "61");
+my @X61 = (
+ [ 4,
+   1, 1, "S", 2, 2, "", 3, 3, "S", 4, 4, "" ],
+ [ 2,
+   3, 1, "S", 4, 2, "" ],
+ [ 4, 0, 0,
+   3, 1, "S", 4, 2, "" ],
+);
+test("max age", \@x60, \@X61, @O61);
+
+# The slave's copies of the aged messages are deleted, unless they are flagged.
+my @x62 = (
+ [ 5,
+   1, 1, "S", 2, 2, "FS", 3, 3, "", 4, 4, "+S", 5, 5, "+" ],
+ [ 3,
+   1, 1, "S", 2, 2, "FS", 3, 3, "" ],
+ [ 3, 0, 3,
+   1, 1, "S", 2, 2, "FS", 3, 3, "" ],
+);
+
+my @O63 = ("", "", "MaxAge 30\nPruneAged yes\n");
+#show("62", "63", "63");
+my @X63 = (
+ [ 5,
+   1, 1, "S", 2, 2, "FS", 3, 3, "", 4, 4, "S", 5, 5, "" ],
+ [ 5,
+   1, 1, "ST", 2, 2, "FS", 3, 3, "T", 4, 4, "S", 5, 5, "" ],
+ [ 5, 0, 3,
+   0, 1, "S", 2, 2, "FS", 0, 3, "", 4, 4, "S", 5, 5, "" ],
+);
+test("prune aged", \@x62, \@X63, @O63);
+
+# Recovering from an interrupted bulk upload, whatever order the messages
+# ended up in on the slave. run-bench.pl has the scaling of this.
+tuidtest("TUID matching, in order", 50, 0);
+tuidtest("TUID matching, reversed", 50, 1);
+
+# binary sync state tests
+
+# The state is updated in place, but the run is interrupted before the
+# journal is deleted. The replay must skip the part of the journal which
+# the state file already contains.
+crashtest("binary state update interruption", \@x01, \@X07, @O07);
+
+my $tstate =
+"MasterUidValidity 1234
+SlaveUidValidity 5678
+MaxPulledUid 20
+MaxPushedUid 17
+MasterHighestModSeq 98765432101
+SlaveHighestModSeq 42
+MaxExpiredSlaveUid 3
+
+1 0 X
+2 3 XS
+4 5 PF
+6 7 DFRST
+".
+# The entries always end in a space-separated flag field.
+"8 0 \n".
+"0 9 T\n";
+converttest("sync state conversion", $tstate);
+
+# Matching the mailbox lists against the patterns and against each other.
+# The last matching pattern decides; boxes which exist on one side only
+# are not listed, as nothing would be created. run-bench.pl has the scaling
+# of this.
+my @lboth = ("INBOX", "a", "a/b", "a/b/c", "ab", "x3", "shared");
+my @lmaster = ("monly");
+my @lslave = ("sonly");
+listtest("box list matching", @lboth, @lmaster, @lslave,
+	"*", "INBOX a a/b a/b/c ab shared x3",
+	"%", "INBOX a ab shared x3",
+	"!a %", "INBOX a ab shared x3",
+	"% !a", "INBOX ab shared x3",
+	"* !INBOX", "a a/b a/b/c ab shared x3",
+	"!*3 a/% INBOX", "INBOX a/b",
+	"%/*", "a/b a/b/c",
+	"a* !s*", "a a/b a/b/c ab",
+	"IN*", "INBOX");
+
 
 ################################################################################
 
@@ -243,27 +343,29 @@ sub qm($)
 	return $_;
 }
 
-# $master, $slave, $channel
-sub writecfg($$$)
+# $master, $slave, $channel[, $global]
+sub writecfg($$$;$)
 {
+	my ($mcfg, $scfg, $ccfg, $gcfg) = @_;
 	open(FILE, ">", ".mbsyncrc") or
 		die "Cannot open .mbsyncrc.\n";
 	print FILE
 "FSync no
+".($gcfg // "")."
 
 MaildirStore master
 Path ./
 Inbox ./master
-".shift()."
+".$mcfg."
 MaildirStore slave
 Path ./
 Inbox ./slave
-".shift()."
+".$scfg."
 Channel test
 Master :master:
 Slave :slave:
 SyncState *
-".shift();
+".$ccfg;
 	close FILE;
 }
 
@@ -348,6 +450,46 @@ sub showbox($)
 	print " ],\n";
 }
 
+# $filename, $format
+sub convstate($$)
+{
+	my ($fn, $fmt) = @_;
+	open FILE, "../mbsync --convert-state=$fmt $fn 2>&1 |";
+	my @out = <FILE>;
+	close FILE;
+	return $?, @out;
+}
+
+# $filename
+# Returns the lines of a sync state file; binary ones are read via a
+# converted copy.
+sub readstate($)
+{
+	my ($fn) = @_;
+	my $c;
+
+	open(FILE, "<", $fn) or return;
+	if (!read(FILE, $c, 1) || $c ne "\0") {
+		seek(FILE, 0, 0);
+		chomp(my @ls = <FILE>);
+		close FILE;
+		return \@ls;
+	}
+	close FILE;
+	my $cfn = $fn.".conv";
+	copy($fn, $cfn) or return;
+	my ($xc, @out) = convstate($cfn, "text");
+	if ($xc || !open(FILE, "<", $cfn)) {
+		print STDERR @out;
+		unlink $cfn;
+		return;
+	}
+	chomp(my @ls = <FILE>);
+	close FILE;
+	unlink $cfn;
+	return \@ls;
+}
+
 # $filename
 # Output:
 # [ maxuid[M], smaxxuid, maxuid[S],
@@ -356,12 +498,12 @@ sub showstate($)
 {
 	my ($fn) = @_;
 
-	if (!open(FILE, "<", $fn)) {
+	my $lsr = readstate($fn);
+	if (!$lsr) {
 		print STDERR " Cannot read sync state $fn: $!\n";
 		return;
 	}
-	chomp(my @ls = <FILE>);
-	close FILE;
+	my @ls = @$lsr;
 	my %hdr;
 	OUTER: while (1) {
 		while (@ls) {
@@ -447,7 +589,9 @@ sub mkbox($$@)
 			$uid = "";
 		}
 		my $big = $flg =~ s/\*//;
-		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/0.1_".$num.".local".$uid.":2,".$flg) or
+		# Messages are from the epoch, unless they are marked as recent.
+		my $tm = ($flg =~ s/\+//) ? int(time()) : 0;
+		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/".$tm.".1_".$num.".local".$uid.":2,".$flg) or
 			die "Cannot create message $num in mailbox $bn.\n";
 		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\n\n".(("A"x50)."\n")x($big*30);
 		close FILE;
@@ -513,9 +657,8 @@ sub ckstate($@)
 	$hdr{'MaxPulledUid'} = $mmaxuid;
 	$hdr{'MaxPushedUid'} = $smaxuid;
 	$hdr{'MaxExpiredSlaveUid'} = $smaxxuid if ($smaxxuid ne 0);
-	open(FILE, "<", $fn) or die "Cannot read sync state $fn.\n";
-	chomp(my @ls = <FILE>);
-	close FILE;
+	my $lsr = readstate($fn) or die "Cannot read sync state $fn.\n";
+	my @ls = @$lsr;
 	OUTER: while (1) {
 		while (@ls) {
 			my $l = shift(@ls);
@@ -617,14 +760,33 @@ sub printchan($)
 }
 
 # $title, \@source_state, \@target_state, @channel_configs
+# Runs with either sync state format; the binary one starts out converted.
 sub test($$$@)
 {
 	my ($ttl, $sx, $tx, @sfx) = @_;
 
 	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
-	print "Testing: ".$ttl." ...\n";
+	for my $fmt ("Text", "Binary") {
+		testfmt($ttl, $fmt, $sx, $tx, @sfx);
+	}
+}
+
+# $title, $format, \@source_state, \@target_state, @channel_configs
+sub testfmt($$$$@)
+{
+	my ($ttl, $fmt, $sx, $tx, @sfx) = @_;
+
+	print "Testing: ".$ttl.($fmt eq "Text" ? "" : " ($fmt state)")." ...\n";
 	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
-	&writecfg(@sfx);
+	if ($fmt ne "Text") {
+		my ($xc, @ret) = convstate("slave/.mbsyncstate", lc($fmt));
+		if ($xc) {
+			print "Converting the sync state failed.\n";
+			print @ret;
+			exit 1;
+		}
+	}
+	&writecfg(@sfx, "SyncStateFormat $fmt\n");
 
 	my ($xc, @ret) = runsync("-J");
 	if ($xc) {
@@ -711,3 +873,185 @@ sub test($$$@)
 	rmtree "slave";
 	rmtree "master";
 }
+
+# $title, \@source_state, \@target_state, @channel_configs
+sub crashtest($$$@)
+{
+	my ($ttl, $sx, $tx, @sfx) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	print "Testing: ".$ttl." ...\n";
+	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
+	my ($xc, @ret) = convstate("slave/.mbsyncstate", "binary");
+	if ($xc) {
+		print "Converting the sync state failed.\n";
+		print @ret;
+		exit 1;
+	}
+	&writecfg(@sfx, "SyncStateFormat Binary\n");
+
+	# Keep hard links to the journal and the new state, so they can be
+	# put back after the run to simulate a crash right behind the update.
+	for my $f ("journal", "new") {
+		(open(FILE, ">", "slave/.mbsyncstate.$f") and close(FILE) and
+		 link("slave/.mbsyncstate.$f", "slave/.mbsyncstate.$f.keep")) or
+			die "Cannot create $f sync state.\n";
+	}
+	($xc, @ret) = runsync("");
+	if ($xc || !grep(/^updating sync state in place$/, @ret)) {
+		print "Sync run failed, or did not update the state in place.\n";
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	for my $f ("journal", "new") {
+		rename("slave/.mbsyncstate.$f.keep", "slave/.mbsyncstate.$f") or
+			die "Cannot restore $f sync state.\n";
+	}
+
+	($xc, @ret) = runsync("-0 --no-expunge");
+	if ($xc || !grep(/^  skipping journal up to \d+$/, @ret) || ckchan("slave/.mbsyncstate", $tx)) {
+		print "Journal replay failed.\n";
+		print "Expected result:\n";
+		printchan($tx);
+		print "Actual result:\n";
+		showchan("slave/.mbsyncstate");
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+
+	killcfg();
+	rmtree "slave";
+	rmtree "master";
+}
+
+# $title, $text_state
+sub converttest($$)
+{
+	my ($ttl, $state) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	print "Testing: ".$ttl." ...\n";
+	open(FILE, ">", ".mbsyncstate") or
+		die "Cannot create sync state.\n";
+	print FILE $state;
+	close FILE;
+	for my $fmt ("binary", "text") {
+		my ($xc, @ret) = convstate(".mbsyncstate", $fmt);
+		if ($xc) {
+			print "Converting the sync state to $fmt failed.\n";
+			print @ret;
+			exit 1;
+		}
+		open(FILE, "<", ".mbsyncstate") or
+			die "Cannot read sync state.\n";
+		my $got = do { local $/; <FILE> };
+		close FILE;
+		if ($fmt eq "binary" ? substr($got, 0, 8) ne "\0mbsyncS" : $got ne $state) {
+			print "Converting the sync state to $fmt yielded:\n$got\n";
+			print "Original:\n$state";
+			exit 1;
+		}
+	}
+	unlink ".mbsyncstate";
+}
+
+# $title, $count, $reverse
+sub tuidtest($$$)
+{
+	my ($ttl, $num, $rev) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	print "Testing: ".$ttl." ...\n";
+	&mkbox("master", $num, map { ($_, $_, "") } 1..$num);
+	&mkbox("slave", $num);
+	open(JFILE, ">", "slave/.mbsyncstate.journal") or
+		die "Cannot create journal.\n";
+	print JFILE "2\n} 1\n";
+	for my $u (1..$num) {
+		my $tuid = sprintf("T%011d", $u);
+		my $su = $rev ? $num + 1 - $u : $u;
+		print JFILE "+ $u -2\n# $u -2 $tuid\n";
+		open(FILE, ">", "slave/cur/0.1_$su.local,U=$su:2,S") or
+			die "Cannot create message $su in slave.\n";
+		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $u\nX-TUID: $tuid\n\n";
+		close FILE;
+	}
+	close JFILE;
+	open(FILE, ">", "slave/.mbsyncstate") or
+		die "Cannot create sync state.\n";
+	print FILE "MasterUidValidity 1\nMaxPulledUid $num\nSlaveUidValidity 1\nMaxExpiredSlaveUid 0\nMaxPushedUid 0\n\n";
+	close FILE;
+	open(FILE, ">", "slave/.mbsyncstate.new") or
+		die "Cannot create new sync state.\n";
+	close FILE;
+	&writecfg("", "", "Sync Pull New\n");
+
+	my ($xc, @ret) = runsync("");
+	my $nfound = grep(/-> new UID \d+ (adjacently|after gap|after reset)$/, @ret);
+	my $nadj = grep(/-> new UID \d+ adjacently$/, @ret);
+	my @st = ();
+	if (open(FILE, "<", "slave/.mbsyncstate")) {
+		while (<FILE>) {
+			last if ($_ eq "\n");
+		}
+		@st = <FILE>;
+		close FILE;
+	}
+	my $nok = grep { /^(\d+) (\d+) / && $2 == ($rev ? $num + 1 - $1 : $1) } @st;
+	if ($xc || $nfound != $num || $nadj != ($rev ? 0 : $num - 1) || $nok != $num) {
+		print "Matched $nfound messages ($nadj adjacently), $nok correct state entries; expected $num.\n";
+		print "Debug output:\n";
+		print grep(!/^  /, @ret);
+		exit 1;
+	}
+
+	killcfg();
+	rmtree "slave";
+	rmtree "master";
+}
+
+# $title, \@common_boxes, \@master_boxes, \@slave_boxes, [$patterns, $expected_boxes]...
+sub listtest($\@\@\@@)
+{
+	my ($ttl, $both, $monly, $sonly, @cases) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	print "Testing: ".$ttl." ...\n";
+	for my $bn ("master", "slave") {
+		rmtree($bn);
+		mkdir($bn) or die "Cannot create $bn.\n";
+		for my $box (@$both, @{ $bn eq "master" ? $monly : $sonly }) {
+			# Subfolders live in dot-prefixed directories inside their parent.
+			# Listing needs only cur/.
+			my $b = $bn;
+			for my $c (split(/\//, $box)) {
+				$b .= ($b eq $bn ? "/" : "/.").$c;
+				-d $b or mkdir($b) or die "Cannot create mailbox $b.\n";
+			}
+			-d $b."/cur" or mkdir($b."/cur") or die "Cannot create mailbox $b.\n";
+		}
+	}
+	while (@cases) {
+		my ($pats, $exp) = (shift @cases, shift @cases);
+		open(FILE, ">", ".mbsyncrc") or
+			die "Cannot open .mbsyncrc.\n";
+		print FILE "MaildirStore master\nPath ./master/\nInbox ./master/INBOX\n\n".
+		           "MaildirStore slave\nPath ./slave/\nInbox ./slave/INBOX\n\n".
+		           "Channel test\nMaster :master:\nSlave :slave:\nPatterns $pats\n";
+		close FILE;
+		open(FILE, "../mbsync -q -l -c .mbsyncrc test 2>&1 |");
+		my @out = <FILE>;
+		close FILE;
+		my $got = join(" ", sort map { chomp; $_ } @out);
+		if ($? || $got ne $exp) {
+			print "Patterns: $pats\nExpected boxes: $exp\nListed boxes: $got\n";
+			exit 1;
+		}
+	}
+
+	killcfg();
+	rmtree "slave";
+	rmtree "master";
+}
@@ -32,6 +32,8 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -42,6 +44,9 @@
 # include <openssl/hmac.h>
 # include <openssl/x509v3.h>
 #endif
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 enum {
 	SCK_CONNECTING,
@@ -57,6 +62,18 @@ socket_fail( conn_t *conn )
 	conn->bad_callback( conn->callback_aux );
 }
 
+/* The timeout covers connecting and the TLS handshake, and while the
+ * peer is expected to talk, the time since any data last moved in either
+ * direction - a long upload keeps the connection alive as well. */
+static void
+socket_arm_timeout( conn_t *conn )
+{
+	if (conn->conf->timeout > 0 && (conn->state != SCK_READY || conn->expect_read))
+		conf_wakeup( &conn->fd_timeout, conn->conf->timeout * 1000 );
+	else
+		wipe_wakeup( &conn->fd_timeout );
+}
+
 #ifdef HAVE_LIBSSL
 static int
 ssl_return( const char *func, conn_t *conn, int ret )
@@ -185,6 +202,96 @@ verify_cert_host( const server_conf_t *conf, conn_t *sock )
 	return verify_hostname( cert, conf->host );
 }
 
+/* The last session of each server is remembered, so further connections
+ * can resume it instead of doing a full handshake. It can be also kept in
+ * a file for the benefit of later runs. The session still carries the peer
+ * certificate and its verification result, so the checks above apply as
+ * usual. */
+
+static void
+save_ssl_session( server_conf_t *conf )
+{
+	unsigned char *buf, *p;
+	char *tmp;
+	int fd, len;
+
+	if ((len = i2d_SSL_SESSION( conf->session, 0 )) <= 0)
+		return;
+	p = buf = nfmalloc( len );
+	i2d_SSL_SESSION( conf->session, &p );
+	nfasprintf( &tmp, "%s.new", conf->session_file );
+	unlink( tmp );
+	if ((fd = open( tmp, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0)
+		goto bail;
+	if (write( fd, buf, len ) != len) {
+		close( fd );
+		goto fail;
+	}
+	if (close( fd ) || rename( tmp, conf->session_file ))
+		goto fail;
+  out:
+	free( tmp );
+	free( buf );
+	return;
+
+  fail:
+	unlink( tmp );
+  bail:
+	warn( "Warning: cannot write TLS session file %s: %s\n", tmp, strerror( errno ) );
+	goto out;
+}
+
+static void
+load_ssl_session( server_conf_t *conf )
+{
+	struct stat st;
+	unsigned char *buf;
+	const unsigned char *p;
+	int fd, len;
+
+	conf->session_loaded = 1;
+	if ((fd = open( conf->session_file, O_RDONLY )) < 0) {
+		if (errno != ENOENT)
+			warn( "Warning: cannot read TLS session file %s: %s\n", conf->session_file, strerror( errno ) );
+		return;
+	}
+	if (fstat( fd, &st ) || st.st_size > 0x100000) {
+		close( fd );
+		return;
+	}
+	p = buf = nfmalloc( st.st_size + 1 );
+	len = read( fd, buf, st.st_size );
+	close( fd );
+	if (len != st.st_size || !(conf->session = d2i_SSL_SESSION( 0, &p, len )))
+		warn( "Warning: ignoring unusable TLS session file %s\n", conf->session_file );
+	free( buf );
+}
+
+static void
+forget_ssl_session( server_conf_t *conf )
+{
+	if (conf->session) {
+		SSL_SESSION_free( conf->session );
+		conf->session = 0;
+	}
+	if (conf->session_file)
+		unlink( conf->session_file );
+}
+
+static int
+ssl_new_session( SSL *ssl, SSL_SESSION *sess )
+{
+	conn_t *conn = (conn_t *)SSL_get_app_data( ssl );
+	server_conf_t *conf = (server_conf_t *)conn->conf;
+
+	if (conf->session)
+		SSL_SESSION_free( conf->session );
+	conf->session = sess;
+	if (conf->session_file)
+		save_ssl_session( conf );
+	return 1; /* We took the reference. */
+}
+
 static int
 init_ssl_ctx( const server_conf_t *conf )
 {
@@ -225,6 +332,9 @@ init_ssl_ctx( const server_conf_t *conf )
 
 	SSL_CTX_set_verify( mconf->SSLContext, SSL_VERIFY_NONE, NULL );
 
+	SSL_CTX_set_session_cache_mode( mconf->SSLContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+	SSL_CTX_sess_set_new_cb( mconf->SSLContext, ssl_new_session );
+
 	mconf->ssl_ctx_valid = 1;
 	return 1;
 }
@@ -236,6 +346,7 @@ void
 socket_start_tls( conn_t *conn, void (*cb)( int ok, void *aux ) )
 {
 	static int ssl_inited;
+	server_conf_t *conf = (server_conf_t *)conn->conf;
 
 	conn->callbacks.starttls = cb;
 
@@ -250,10 +361,16 @@ socket_start_tls( conn_t *conn, void (*cb)( int ok, void *aux ) )
 		return;
 	}
 
-	conn->ssl = SSL_new( ((server_conf_t *)conn->conf)->SSLContext );
+	conn->ssl = SSL_new( conf->SSLContext );
 	SSL_set_fd( conn->ssl, conn->fd );
 	SSL_set_mode( conn->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+	SSL_set_app_data( conn->ssl, conn );
+	if (conf->session_file && !conf->session_loaded)
+		load_ssl_session( conf );
+	if (conf->session)
+		SSL_set_session( conn->ssl, conf->session );
 	conn->state = SCK_STARTTLS;
+	socket_arm_timeout( conn );
 	start_tls_p2( conn );
 }
 
@@ -262,8 +379,12 @@ start_tls_p2( conn_t *conn )
 {
 	if (ssl_return( "connect to", conn, SSL_connect( conn->ssl ) ) > 0) {
 		if (verify_cert_host( conn->conf, conn )) {
+			/* Do not resume a session with an unacceptable peer. */
+			forget_ssl_session( (server_conf_t *)conn->conf );
 			start_tls_p3( conn, 0 );
 		} else {
+			if (SSL_session_reused( conn->ssl ))
+				debug( "Resumed TLS session\n" );
 			info( "Connection is now encrypted\n" );
 			start_tls_p3( conn, 1 );
 		}
@@ -273,15 +394,78 @@ start_tls_p2( conn_t *conn )
 static void start_tls_p3( conn_t *conn, int ok )
 {
 	conn->state = SCK_READY;
+	socket_arm_timeout( conn );
 	conn->callbacks.starttls( ok, conn->callback_aux );
 }
 
 #endif /* HAVE_LIBSSL */
 
+#ifdef HAVE_LIBZ
+
+/* Compressed input is read in chunks of this size. */
+#define Z_BUF_SIZE 16384
+
+/* From now on, the data in both directions is deflated, without zlib
+ * headers (RFC 4978). Anything which follows the peer's agreement in the
+ * receive buffer is compressed already. */
+int
+socket_start_deflate( conn_t *conn )
+{
+	conn->in_z = nfcalloc( sizeof(*conn->in_z) );
+	conn->out_z = nfcalloc( sizeof(*conn->out_z) );
+	conn->z_buf = nfmalloc( Z_BUF_SIZE );
+	if (inflateInit2( conn->in_z, -15 ) != Z_OK) {
+		free( conn->in_z );
+		conn->in_z = 0;
+		goto bail;
+	}
+	if (deflateInit2( conn->out_z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK) {
+		free( conn->out_z );
+		conn->out_z = 0;
+		goto bail;
+	}
+	if (conn->bytes) {
+		if (conn->bytes > Z_BUF_SIZE) {
+			error( "Socket error: excess data from %s before compression.\n", conn->name );
+			return -1;
+		}
+		memcpy( conn->z_buf, conn->buf + conn->offset, conn->bytes );
+		conn->in_z->next_in = (Bytef *)conn->z_buf;
+		conn->in_z->avail_in = conn->bytes;
+		conn->offset = conn->bytes = conn->scanoff = 0;
+		fake_fd( conn->fd, POLLIN );
+	}
+	return 0;
+
+  bail:
+	error( "Socket error: cannot set up compression for %s.\n", conn->name );
+	return -1;
+}
+
+static void
+socket_stop_deflate( conn_t *conn )
+{
+	if (conn->in_z) {
+		inflateEnd( conn->in_z );
+		free( conn->in_z );
+		conn->in_z = 0;
+	}
+	if (conn->out_z) {
+		deflateEnd( conn->out_z );
+		free( conn->out_z );
+		conn->out_z = 0;
+	}
+	free( conn->z_buf );
+	conn->z_buf = 0;
+	conn->z_more = conn->z_dirty = 0;
+}
+
+#endif /* HAVE_LIBZ */
+
 static void socket_fd_cb( int, void * );
+static void socket_attempt_cb( int, void * );
 
 static void socket_connect_one( conn_t * );
-static void socket_connect_failed( conn_t * );
 static void socket_connected( conn_t * );
 static void socket_connect_bail( conn_t * );
 
@@ -293,6 +477,81 @@ socket_close_internal( conn_t *sock )
 	sock->fd = -1;
 }
 
+/* The server's addresses are not tried strictly one after another; instead,
+ * the next attempt is started if the previous ones did not succeed within
+ * a short delay, so an address which silently drops the packets does not hold
+ * up the others until the timeout. The first attempt which succeeds wins.
+ * This is "Happy Eyeballs", see RFC 8305. */
+#define CONNECT_ATTEMPT_DELAY 250 /* milliseconds */
+
+struct conn_attempt {
+	struct conn_attempt *next;
+	conn_t *conn;
+	int fd;
+	char *name;
+};
+
+/* The winning attempt's socket and name are taken over by the connection. */
+static void
+drop_attempt( conn_attempt_t *att, int won )
+{
+	conn_attempt_t **attp;
+
+	for (attp = &att->conn->attempts; *attp != att; attp = &(*attp)->next) {}
+	*attp = att->next;
+	del_fd( att->fd );
+	if (!won) {
+		close( att->fd );
+		free( att->name );
+	}
+	free( att );
+}
+
+static void
+fail_attempt( conn_attempt_t *att )
+{
+	sys_error( "Cannot connect to %s", att->name );
+	drop_attempt( att, 0 );
+}
+
+static void
+drop_attempts( conn_t *conn )
+{
+	while (conn->attempts)
+		drop_attempt( conn->attempts, 0 );
+	wipe_wakeup( &conn->attempt_timer );
+}
+
+#ifdef HAVE_IPV6
+/* Make the address families alternate, starting with the preferred one,
+ * so one broken family does not delay the other one (RFC 8305, Section 4). */
+static struct addrinfo *
+interleave_addrs( struct addrinfo *addrs )
+{
+	struct addrinfo *lists[2], **tails[2], *ret, **retp;
+	int i, family = addrs->ai_family;
+
+	tails[0] = &lists[0];
+	tails[1] = &lists[1];
+	for (; addrs; addrs = addrs->ai_next) {
+		i = addrs->ai_family != family;
+		*tails[i] = addrs;
+		tails[i] = &addrs->ai_next;
+	}
+	*tails[0] = *tails[1] = 0;
+	retp = &ret;
+	for (i = 0; lists[0] || lists[1]; i ^= 1) {
+		if (lists[i]) {
+			*retp = lists[i];
+			retp = &lists[i]->ai_next;
+			lists[i] = lists[i]->ai_next;
+		}
+	}
+	*retp = 0;
+	return ret;
+}
+#endif
+
 void
 socket_connect( conn_t *sock, void (*cb)( int ok, void *aux ) )
 {
@@ -340,13 +599,14 @@ socket_connect( conn_t *sock, void (*cb)( int ok, void *aux ) )
 		hints.ai_flags = AI_ADDRCONFIG;
 		infon( "Resolving %s... ", conf->host );
 		if ((gaierr = getaddrinfo( conf->host, NULL, &hints, &sock->addrs ))) {
+			sock->addrs = 0;
 			error( "Error: Cannot resolve server '%s': %s\n", conf->host, gai_strerror( gaierr ) );
 			socket_connect_bail( sock );
 			return;
 		}
 		info( "\vok\n" );
 
-		sock->curr_addr = sock->addrs;
+		sock->curr_addr = sock->addrs = interleave_addrs( sock->addrs );
 #else
 		struct hostent *he;
 
@@ -361,14 +621,19 @@ socket_connect( conn_t *sock, void (*cb)( int ok, void *aux ) )
 
 		sock->curr_addr = he->h_addr_list;
 #endif
+		sock->state = SCK_CONNECTING;
 		socket_connect_one( sock );
 	}
 }
 
+/* Start an attempt to connect to the next address. If there is none left,
+ * give up unless other attempts are still in progress. */
 static void
 socket_connect_one( conn_t *sock )
 {
 	int s;
+	char *name;
+	conn_attempt_t *att;
 #ifdef HAVE_IPV6
 	struct addrinfo *ai;
 #else
@@ -377,82 +642,127 @@ socket_connect_one( conn_t *sock )
 	} ai[1];
 #endif
 
+	wipe_wakeup( &sock->attempt_timer );
+	for (;;) {
 #ifdef HAVE_IPV6
-	if (!(ai = sock->curr_addr)) {
+		if (!(ai = sock->curr_addr)) {
 #else
-	if (!*sock->curr_addr) {
+		if (!*sock->curr_addr) {
 #endif
-		error( "No working address found for %s\n", sock->conf->host );
-		socket_connect_bail( sock );
-		return;
-	}
+			if (!sock->attempts) {
+				error( "No working address found for %s\n", sock->conf->host );
+				socket_connect_bail( sock );
+			}
+			return;
+		}
 
 #ifdef HAVE_IPV6
-	if (ai->ai_family == AF_INET6) {
-		struct sockaddr_in6 *in6 = ((struct sockaddr_in6 *)ai->ai_addr);
-		char sockname[64];
-		in6->sin6_port = htons( sock->conf->port );
-		nfasprintf( &sock->name, "%s ([%s]:%hu)",
-		            sock->conf->host, inet_ntop( AF_INET6, &in6->sin6_addr, sockname, sizeof(sockname) ), sock->conf->port );
-	} else
+		if (ai->ai_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = ((struct sockaddr_in6 *)ai->ai_addr);
+			char sockname[64];
+			in6->sin6_port = htons( sock->conf->port );
+			nfasprintf( &name, "%s ([%s]:%hu)",
+			            sock->conf->host, inet_ntop( AF_INET6, &in6->sin6_addr, sockname, sizeof(sockname) ), sock->conf->port );
+		} else
 #endif
-	{
-		struct sockaddr_in *in = ((struct sockaddr_in *)ai->ai_addr);
+		{
+			struct sockaddr_in *in = ((struct sockaddr_in *)ai->ai_addr);
 #ifndef HAVE_IPV6
-		memset( in, 0, sizeof(*in) );
-		in->sin_family = AF_INET;
-		in->sin_addr.s_addr = *((int *)*sock->curr_addr);
+			memset( in, 0, sizeof(*in) );
+			in->sin_family = AF_INET;
+			in->sin_addr.s_addr = *((int *)*sock->curr_addr);
+#endif
+			in->sin_port = htons( sock->conf->port );
+			nfasprintf( &name, "%s (%s:%hu)",
+			            sock->conf->host, inet_ntoa( in->sin_addr ), sock->conf->port );
+		}
+#ifdef HAVE_IPV6
+		sock->curr_addr = ai->ai_next;
+#else
+		sock->curr_addr++;
 #endif
-		in->sin_port = htons( sock->conf->port );
-		nfasprintf( &sock->name, "%s (%s:%hu)",
-		            sock->conf->host, inet_ntoa( in->sin_addr ), sock->conf->port );
-	}
 
 #ifdef HAVE_IPV6
-	s = socket( ai->ai_family, SOCK_STREAM, 0 );
+		s = socket( ai->ai_family, SOCK_STREAM, 0 );
 #else
-	s = socket( PF_INET, SOCK_STREAM, 0 );
+		s = socket( PF_INET, SOCK_STREAM, 0 );
 #endif
-	if (s < 0) {
-		perror( "socket" );
-		exit( 1 );
-	}
-	sock->fd = s;
-	fcntl( s, F_SETFL, O_NONBLOCK );
-	add_fd( s, socket_fd_cb, sock );
+		if (s < 0) {
+			perror( "socket" );
+			exit( 1 );
+		}
+		fcntl( s, F_SETFL, O_NONBLOCK );
 
-	infon( "Connecting to %s... ", sock->name );
+		infon( "Connecting to %s... ", name );
 #ifdef HAVE_IPV6
-	if (connect( s, ai->ai_addr, ai->ai_addrlen )) {
+		if (!connect( s, ai->ai_addr, ai->ai_addrlen )) {
 #else
-	if (connect( s, ai->ai_addr, sizeof(*ai->ai_addr) )) {
+		if (!connect( s, ai->ai_addr, sizeof(*ai->ai_addr) )) {
 #endif
-		if (errno != EINPROGRESS) {
-			socket_connect_failed( sock );
+			info( "\vok\n" );
+			drop_attempts( sock );
+			sock->fd = s;
+			sock->name = name;
+			add_fd( s, socket_fd_cb, sock );
+			socket_connected( sock );
 			return;
 		}
-		conf_fd( s, 0, POLLOUT );
-		sock->state = SCK_CONNECTING;
+		if (errno != EINPROGRESS) {
+			sys_error( "Cannot connect to %s", name );
+			close( s );
+			free( name );
+			continue;
+		}
 		info( "\v\n" );
+		att = nfmalloc( sizeof(*att) );
+		att->conn = sock;
+		att->fd = s;
+		att->name = name;
+		att->next = sock->attempts;
+		sock->attempts = att;
+		add_fd( s, socket_attempt_cb, att );
+		conf_fd( s, 0, POLLOUT );
+		socket_arm_timeout( sock );
+#ifdef HAVE_IPV6
+		if (sock->curr_addr)
+#else
+		if (*sock->curr_addr)
+#endif
+			conf_wakeup( &sock->attempt_timer, CONNECT_ATTEMPT_DELAY );
 		return;
 	}
-	info( "\vok\n" );
-	socket_connected( sock );
+}
+
+void
+socket_connect_next( void *aux )
+{
+	socket_connect_one( (conn_t *)aux );
 }
 
 static void
-socket_connect_failed( conn_t *conn )
+socket_attempt_cb( int events ATTR_UNUSED, void *aux )
 {
-	sys_error( "Cannot connect to %s", conn->name );
-	socket_close_internal( conn );
-	free( conn->name );
-	conn->name = 0;
-#ifdef HAVE_IPV6
-	conn->curr_addr = conn->curr_addr->ai_next;
-#else
-	conn->curr_addr++;
-#endif
-	socket_connect_one( conn );
+	conn_attempt_t *att = (conn_attempt_t *)aux;
+	conn_t *conn = att->conn;
+	int soerr;
+	socklen_t selen = sizeof(soerr);
+
+	if (getsockopt( att->fd, SOL_SOCKET, SO_ERROR, &soerr, &selen )) {
+		perror( "getsockopt" );
+		exit( 1 );
+	}
+	if ((errno = soerr)) {
+		/* Do not wait for the delay to elapse. */
+		fail_attempt( att );
+		socket_connect_one( conn );
+		return;
+	}
+	conn->fd = att->fd;
+	conn->name = att->name;
+	drop_attempt( att, 1 );
+	drop_attempts( conn );
+	add_fd( conn->fd, socket_fd_cb, conn );
+	socket_connected( conn );
 }
 
 static void
@@ -460,9 +770,11 @@ socket_connected( conn_t *conn )
 {
 #ifdef HAVE_IPV6
 	freeaddrinfo( conn->addrs );
+	conn->addrs = 0;
 #endif
 	conf_fd( conn->fd, 0, POLLIN );
 	conn->state = SCK_READY;
+	socket_arm_timeout( conn );
 	conn->callbacks.connect( 1, conn->callback_aux );
 }
 
@@ -471,7 +783,9 @@ socket_connect_bail( conn_t *conn )
 {
 #ifdef HAVE_IPV6
 	freeaddrinfo( conn->addrs );
+	conn->addrs = 0;
 #endif
+	wipe_wakeup( &conn->fd_timeout );
 	free( conn->name );
 	conn->name = 0;
 	conn->callbacks.connect( 0, conn->callback_aux );
@@ -484,6 +798,15 @@ socket_close( conn_t *sock )
 {
 	if (sock->fd >= 0)
 		socket_close_internal( sock );
+	drop_attempts( sock );
+#ifdef HAVE_IPV6
+	if (sock->addrs) {
+		freeaddrinfo( sock->addrs );
+		sock->addrs = 0;
+	}
+#endif
+	wipe_wakeup( &sock->fd_timeout );
+	sock->expect_read = 0;
 	free( sock->name );
 	sock->name = 0;
 #ifdef HAVE_LIBSSL
@@ -492,27 +815,44 @@ socket_close( conn_t *sock )
 		sock->ssl = 0;
 	}
 #endif
+#ifdef HAVE_LIBZ
+	socket_stop_deflate( sock );
+#endif
+	wipe_wakeup( &sock->write_flush );
 	while (sock->write_buf)
 		dispose_chunk( sock );
+	sock->write_offset = 0;
+	sock->write_cr = 0;
+	sock->unsent = 0;
+	free( sock->buf );
+	sock->buf = 0;
+	sock->bufsz = 0;
+	sock->offset = sock->bytes = sock->scanoff = 0;
+	sock->direct_buf = 0;
 }
 
-static void
-socket_fill( conn_t *sock )
+/* The receive buffer holds at least one complete line, as the parser needs
+ * them contiguously. Whatever the reader did not consume yet (usually a
+ * partial line) is moved to the front when the free tail runs short, and
+ * the buffer grows only when a single line does not fit. */
+#define RECV_BUF_MIN (64 * 1024)
+#define RECV_BUF_MAX (64 * 1024 * 1024)
+
+/* Literals at least this much larger than the buffered data are read
+ * directly into the reader's buffer, see socket_read(). */
+#define DIRECT_READ_MIN 4096
+
+/* Returns the number of bytes read; zero if there was nothing to read,
+ * and -1 on failure. */
+static int
+do_read( conn_t *sock, char *buf, int len )
 {
-	char *buf;
-	int n = sock->offset + sock->bytes;
-	int len = sizeof(sock->buf) - n;
-	if (!len) {
-		error( "Socket error: receive buffer full. Probably protocol error.\n" );
-		socket_fail( sock );
-		return;
-	}
-	assert( sock->fd >= 0 );
-	buf = sock->buf + n;
+	int n;
+
 #ifdef HAVE_LIBSSL
 	if (sock->ssl) {
 		if ((n = ssl_return( "read from", sock, SSL_read( sock->ssl, buf, len ) )) <= 0)
-			return;
+			return n;
 		if (n == len && SSL_pending( sock->ssl ))
 			fake_fd( sock->fd, POLLIN );
 	} else
@@ -521,24 +861,190 @@ socket_fill( conn_t *sock )
 		if ((n = read( sock->fd, buf, len )) < 0) {
 			sys_error( "Socket error: read from %s", sock->name );
 			socket_fail( sock );
-			return;
+			return -1;
 		} else if (!n) {
 			error( "Socket error: read from %s: unexpected EOF\n", sock->name );
 			socket_fail( sock );
-			return;
+			return -1;
+		}
+	}
+	if (sock->stats)
+		sock->stats->bytes_in += n;
+	return n;
+}
+
+#ifdef HAVE_LIBZ
+/* The input may inflate to more than fits into the buffer, so we come back
+ * for the rest before waiting for the socket again. */
+static int
+do_inflate( conn_t *sock, char *buf, int len )
+{
+	z_streamp z = sock->in_z;
+	int n, ret;
+
+	if (!z->avail_in && !sock->z_more) {
+		if ((n = do_read( sock, sock->z_buf, Z_BUF_SIZE )) <= 0)
+			return n;
+		z->next_in = (Bytef *)sock->z_buf;
+		z->avail_in = n;
+	}
+	z->next_out = (Bytef *)buf;
+	z->avail_out = len;
+	ret = inflate( z, Z_SYNC_FLUSH );
+	if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		error( "Socket error: cannot decompress data from %s: %s\n", sock->name,
+		       ret == Z_STREAM_END ? "unexpected end of stream" : z->msg ? z->msg : "corrupted data" );
+		socket_fail( sock );
+		return -1;
+	}
+	sock->z_more = !z->avail_out;
+	if (z->avail_in || sock->z_more)
+		fake_fd( sock->fd, POLLIN );
+	return len - z->avail_out;
+}
+#endif
+
+static void
+socket_fill( conn_t *sock )
+{
+	char *buf;
+	int n, len;
+
+	assert( sock->fd >= 0 );
+	if (sock->direct_buf) {
+		buf = sock->direct_buf + sock->direct_got;
+		len = sock->direct_len - sock->direct_got;
+	} else {
+		n = sock->offset + sock->bytes;
+		len = sock->bufsz - n;
+		if (!len || len < sock->bufsz / 4) {
+			if (sock->offset) {
+				memmove( sock->buf, sock->buf + sock->offset, sock->bytes );
+				sock->offset = 0;
+			} else if (!len) {
+				if (sock->bufsz >= RECV_BUF_MAX) {
+					error( "Socket error: receive buffer full. Probably protocol error.\n" );
+					socket_fail( sock );
+					return;
+				}
+				sock->bufsz = sock->bufsz ? sock->bufsz * 2 : RECV_BUF_MIN;
+				sock->buf = nfrealloc( sock->buf, sock->bufsz );
+			}
+			n = sock->bytes;
+			len = sock->bufsz - n;
 		}
+		buf = sock->buf + n;
 	}
-	sock->bytes += n;
+#ifdef HAVE_LIBZ
+	if (sock->in_z)
+		n = do_inflate( sock, buf, len );
+	else
+#endif
+		n = do_read( sock, buf, len );
+	if (n <= 0)
+		return;
+	if (sock->direct_buf)
+		sock->direct_got += n;
+	else
+		sock->bytes += n;
+	if (sock->expect_read)
+		socket_arm_timeout( sock );
 	sock->read_callback( sock->callback_aux );
 }
 
+void
+socket_expect_read( conn_t *conn, int expect )
+{
+	if (conn->expect_read == expect)
+		return;
+	conn->expect_read = expect;
+	socket_arm_timeout( conn );
+}
+
+/* Whether data which the kernel accepted already drained to the peer since
+ * the last check. Uploads are mostly stuck there rather than in our queue.
+ * Once it is gone, the peer gets another period to process the tail. */
+static int
+socket_draining( conn_t *conn )
+{
+#ifdef TIOCOUTQ
+	int unsent;
+
+	if (!ioctl( conn->fd, TIOCOUTQ, &unsent ) && unsent != conn->unsent) {
+		conn->unsent = unsent;
+		return 1;
+	}
+#else
+	(void)conn;
+#endif
+	return 0;
+}
+
+void
+socket_timed_out( void *aux )
+{
+	conn_t *conn = (conn_t *)aux;
+
+	if (conn->state == SCK_CONNECTING) {
+		/* Give up on all attempts in progress, but not on the remaining addresses. */
+		while (conn->attempts) {
+			errno = ETIMEDOUT;
+			fail_attempt( conn->attempts );
+		}
+		socket_connect_one( conn );
+		return;
+	}
+	if (socket_draining( conn )) {
+		socket_arm_timeout( conn );
+		return;
+	}
+	error( "Socket error on %s: timeout.\n", conn->name );
+#ifdef HAVE_LIBSSL
+	if (conn->state == SCK_STARTTLS) {
+		conn->callbacks.starttls( 0, conn->callback_aux );
+		return;
+	}
+#endif
+	socket_fail( conn );
+}
+
+/* If this returns short, the remainder of buf may be registered to be filled
+ * directly by the next socket_fill(); the caller must then ask for exactly
+ * that remainder. */
 int
 socket_read( conn_t *conn, char *buf, int len )
+{
+	int n;
+
+	if (conn->direct_buf) {
+		assert( buf == conn->direct_buf );
+		n = conn->direct_got;
+		conn->direct_buf = 0;
+	} else {
+		n = conn->bytes;
+		if (n > len)
+			n = len;
+		memcpy( buf, conn->buf + conn->offset, n );
+		if (!(conn->bytes -= n))
+			conn->offset = 0;
+		else
+			conn->offset += n;
+	}
+	if (len - n >= DIRECT_READ_MIN && conn->fd >= 0) {
+		conn->direct_buf = buf + n;
+		conn->direct_len = len - n;
+		conn->direct_got = 0;
+	}
+	return n;
+}
+
+int
+socket_read_direct( conn_t *conn, char **buf, int len )
 {
 	int n = conn->bytes;
 	if (n > len)
 		n = len;
-	memcpy( buf, conn->buf + conn->offset, n );
+	*buf = conn->buf + conn->offset;
 	if (!(conn->bytes -= n))
 		conn->offset = 0;
 	else
@@ -553,13 +1059,8 @@ socket_read_line( conn_t *b )
 	int n;
 
 	s = b->buf + b->offset;
-	p = memchr( s + b->scanoff, '\n', b->bytes - b->scanoff );
-	if (!p) {
+	if (b->scanoff == b->bytes || !(p = memchr( s + b->scanoff, '\n', b->bytes - b->scanoff ))) {
 		b->scanoff = b->bytes;
-		if (b->offset + b->bytes == sizeof(b->buf)) {
-			memmove( b->buf, b->buf + b->offset, b->bytes );
-			b->offset = 0;
-		}
 		return 0;
 	}
 	n = p + 1 - s;
@@ -572,27 +1073,148 @@ socket_read_line( conn_t *b )
 	return s;
 }
 
+/* Small writes are queued and sent out together at the end of the current
+ * event loop iteration. Plain sockets take the whole queue with one writev();
+ * TLS records cover only one chunk each, so small chunks are coalesced. */
+#define WRITE_CHUNK_SIZE 16384
+#if defined(IOV_MAX) && IOV_MAX < 512
+# define WRITE_IOVS IOV_MAX
+#else
+# define WRITE_IOVS 512
+#endif
+
+/* Text with bare LFs is sent as a sequence of pieces: the text up to
+ * the next bare LF, and the CR which is inserted before it. So plain sockets
+ * can gather the pieces right from the text, while TLS records and the
+ * deflater get them copied into a buffer. */
+static const char crlf_cr[] = "\r";
+
 static int
-do_write( conn_t *sock, char *buf, int len )
+crlf_piece( const char *data, int len, int off, int cr, const char **piece )
 {
-	int n;
+	const char *p, *q, *e;
+
+	p = data + off;
+	if (!cr && *p == '\n' && (!off || p[-1] != '\r')) {
+		*piece = crlf_cr;
+		return 1;
+	}
+	e = data + len;
+	for (q = p + 1; (q = memchr( q, '\n', e - q )) && q[-1] == '\r'; q++) {}
+	*piece = p;
+	return (q ? q : e) - p;
+}
+
+/* Advance past n bytes of output. Returns how many of them are left over
+ * once the text is exhausted. */
+static int
+crlf_skip( const char *data, int len, int *off, char *cr, int n )
+{
+	const char *piece;
+	int l;
+
+	while (n && *off < len) {
+		l = crlf_piece( data, len, *off, *cr, &piece );
+		if (piece == crlf_cr) {
+			*cr = 1;
+			n--;
+		} else {
+			if (l > n)
+				l = n;
+			*off += l;
+			*cr = 0;
+			n -= l;
+		}
+	}
+	return n;
+}
+
+static int
+crlf_gather( const char *data, int len, int off, int cr, struct iovec *iov, int maxiov, int *total )
+{
+	const char *piece;
+	int i, l;
+
+	for (i = 0; i < maxiov && off < len; i++) {
+		l = crlf_piece( data, len, off, cr, &piece );
+		iov[i].iov_base = (char *)piece;
+		iov[i].iov_len = l;
+		*total += l;
+		if (piece == crlf_cr) {
+			cr = 1;
+		} else {
+			off += l;
+			cr = 0;
+		}
+	}
+	return i;
+}
+
+static int
+crlf_copy( const char *data, int len, int off, int cr, char *buf, int bufsz )
+{
+	const char *piece;
+	int bufl, l;
+
+	for (bufl = 0; bufl < bufsz && off < len; bufl += l) {
+		l = crlf_piece( data, len, off, cr, &piece );
+		if (l > bufsz - bufl)
+			l = bufsz - bufl;
+		memcpy( buf + bufl, piece, l );
+		if (piece == crlf_cr) {
+			cr = 1;
+		} else {
+			off += l;
+			cr = 0;
+		}
+	}
+	return bufl;
+}
+
+int
+crlf_len( const char *buf, int len )
+{
+	const char *p, *e;
+	int n = len;
+
+	for (p = buf, e = buf + len; (p = memchr( p, '\n', e - p )); p++)
+		if (p == buf || p[-1] != '\r')
+			n++;
+	return n;
+}
+
+static int
+do_write( conn_t *sock, struct iovec *iov, int iovcnt )
+{
+	int n, len, i;
 
 	assert( sock->fd >= 0 );
 #ifdef HAVE_LIBSSL
-	if (sock->ssl)
-		return ssl_return( "write to", sock, SSL_write( sock->ssl, buf, len ) );
+	if (sock->ssl) {
+		n = ssl_return( "write to", sock, SSL_write( sock->ssl, iov[0].iov_base, iov[0].iov_len ) );
+	} else
 #endif
-	n = write( sock->fd, buf, len );
-	if (n < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			sys_error( "Socket error: write to %s", sock->name );
-			socket_fail( sock );
-		} else {
-			n = 0;
+	{
+		for (len = i = 0; i < iovcnt; i++)
+			len += iov[i].iov_len;
+		n = writev( sock->fd, iov, iovcnt );
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				sys_error( "Socket error: write to %s", sock->name );
+				socket_fail( sock );
+			} else {
+				n = 0;
+				conf_fd( sock->fd, POLLIN, POLLOUT );
+			}
+		} else if (n != len) {
 			conf_fd( sock->fd, POLLIN, POLLOUT );
 		}
-	} else if (n != len) {
-		conf_fd( sock->fd, POLLIN, POLLOUT );
+	}
+	if (n > 0) {
+		if (sock->stats)
+			sock->stats->bytes_out += n;
+		if (sock->expect_read)
+			socket_arm_timeout( sock );
 	}
 	return n;
 }
@@ -603,30 +1225,173 @@ dispose_chunk( conn_t *conn )
 	buff_chunk_t *bc = conn->write_buf;
 	if (!(conn->write_buf = bc->next))
 		conn->write_buf_append = &conn->write_buf;
-	if (bc->data != bc->buf)
+	if (bc->data != bc->buf && !bc->crlf)
 		free( bc->data );
 	free( bc );
 }
 
+/* Send as much of the queue as possible, followed by buf if the queue drains.
+ * Returns the number of bytes sent from buf, or -1 on failure. */
 static int
-do_queued_write( conn_t *conn )
+do_flush( conn_t *conn, char *buf, int len )
+{
+	buff_chunk_t *bc;
+	struct iovec iov[WRITE_IOVS];
+	int n, i, maxiov, total, left, bufi, off;
+	char cr;
+#ifdef HAVE_LIBSSL
+	char tbuf[WRITE_CHUNK_SIZE];
+
+	maxiov = conn->ssl ? 1 : WRITE_IOVS;
+#else
+	maxiov = WRITE_IOVS;
+#endif
+	wipe_wakeup( &conn->write_flush );
+	for (;;) {
+		total = 0;
+		for (i = 0, bc = conn->write_buf; bc && i < maxiov; bc = bc->next) {
+			off = (bc == conn->write_buf) ? conn->write_offset : 0;
+			if (!bc->crlf) {
+				iov[i].iov_base = bc->data + off;
+				iov[i].iov_len = bc->len - off;
+				total += iov[i++].iov_len;
+				continue;
+			}
+			cr = (bc == conn->write_buf) ? conn->write_cr : 0;
+#ifdef HAVE_LIBSSL
+			if (conn->ssl) {
+				/* The content is reproduced identically if the write needs to be retried. */
+				iov[0].iov_base = tbuf;
+				iov[0].iov_len = total = crlf_copy( bc->data, bc->len, off, cr, tbuf, sizeof(tbuf) );
+				i = 1;
+				break;
+			}
+#endif
+			i += crlf_gather( bc->data, bc->len, off, cr, iov + i, maxiov - i, &total );
+			break;
+		}
+		bufi = -1;
+		if (!bc && buf && i < maxiov) {
+			bufi = i;
+			iov[i].iov_base = buf;
+			iov[i].iov_len = len;
+			total += len;
+			i++;
+		}
+		if (!i)
+			return 0;
+		if ((n = do_write( conn, iov, i )) < 0)
+			return -1;
+		for (left = n, i = 0; i != bufi && left; i++) {
+			bc = conn->write_buf;
+			if (bc->crlf) {
+				/* This is the last chunk which was gathered. */
+				off = conn->write_offset;
+				cr = conn->write_cr;
+				left = crlf_skip( bc->data, bc->len, &off, &cr, left );
+				if (off < bc->len) {
+					conn->write_offset = off;
+					conn->write_cr = cr;
+					break;
+				}
+			} else {
+				if (left < (int)iov[i].iov_len) {
+					conn->write_offset += left;
+					return 0;
+				}
+				left -= iov[i].iov_len;
+			}
+			conn->write_offset = 0;
+			conn->write_cr = 0;
+			dispose_chunk( conn );
+		}
+		if (i == bufi)
+			return left;
+		if (n != total)
+			return 0;
+	}
+}
+
+/* The last chunk of the queue, if it may be appended to. */
+static buff_chunk_t *
+append_tail( conn_t *conn )
 {
 	buff_chunk_t *bc;
 
 	if (!conn->write_buf)
 		return 0;
+	bc = (buff_chunk_t *)((char *)conn->write_buf_append - offsetof(buff_chunk_t, next));
+	/* The head chunk may be in the middle of a TLS write, so it
+	 * must not change unless nothing was attempted yet. */
+	if (!bc->size || (bc == conn->write_buf && !pending_wakeup( &conn->write_flush )))
+		return 0;
+	return bc;
+}
+
+#ifdef HAVE_LIBZ
+/* The output is appended to the queue as it comes out of the deflater. */
+static int
+do_deflate( conn_t *conn, char *buf, int len, int flush )
+{
+	z_streamp z = conn->out_z;
+	buff_chunk_t *bc;
+	int ret, fresh;
 
-	while ((bc = conn->write_buf)) {
-		int n, len = bc->len - conn->write_offset;
-		if ((n = do_write( conn, bc->data + conn->write_offset, len )) < 0)
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+	do {
+		if ((bc = append_tail( conn )) && bc->len < bc->size) {
+			fresh = 0;
+		} else {
+			bc = nfmalloc( offsetof(buff_chunk_t, buf) + WRITE_CHUNK_SIZE );
+			bc->data = bc->buf;
+			bc->size = WRITE_CHUNK_SIZE;
+			bc->crlf = 0;
+			bc->len = 0;
+			bc->next = 0;
+			fresh = 1;
+		}
+		z->next_out = (Bytef *)bc->buf + bc->len;
+		z->avail_out = bc->size - bc->len;
+		ret = deflate( z, flush );
+		bc->len = bc->size - z->avail_out;
+		if (fresh) {
+			/* The queue must not contain empty chunks. */
+			if (bc->len) {
+				*conn->write_buf_append = bc;
+				conn->write_buf_append = &bc->next;
+			} else {
+				free( bc );
+			}
+		}
+		if (ret == Z_STREAM_ERROR) {
+			error( "Socket error: cannot compress data for %s\n", conn->name );
+			socket_fail( conn );
 			return -1;
-		if (n != len) {
-			conn->write_offset += n;
-			return 0;
 		}
-		conn->write_offset = 0;
-		dispose_chunk( conn );
+	} while (!z->avail_out);
+	return 0;
+}
+#endif
+
+static int
+do_queued_write( conn_t *conn )
+{
+#ifdef HAVE_LIBZ
+	if (conn->z_dirty) {
+		/* Complete the commands for the peer. */
+		conn->z_dirty = 0;
+		if (do_deflate( conn, 0, 0, Z_SYNC_FLUSH ) < 0)
+			return -1;
 	}
+#endif
+	if (!conn->write_buf)
+		return 0;
+
+	if (do_flush( conn, 0, 0 ) < 0)
+		return -1;
+	if (conn->write_buf)
+		return 0;
 #ifdef HAVE_LIBSSL
 	if (conn->ssl && SSL_pending( conn->ssl ))
 		fake_fd( conn->fd, POLLIN );
@@ -634,19 +1399,35 @@ do_queued_write( conn_t *conn )
 	return conn->write_callback( conn->callback_aux );
 }
 
+void
+socket_flush_cb( void *aux )
+{
+	do_queued_write( (conn_t *)aux );
+}
+
 static void
 do_append( conn_t *conn, char *buf, int len, ownership_t takeOwn )
 {
 	buff_chunk_t *bc;
+	int size;
 
+	if (takeOwn == KeepOwn && (bc = append_tail( conn )) && bc->size - bc->len >= len) {
+		memcpy( bc->buf + bc->len, buf, len );
+		bc->len += len;
+		return;
+	}
 	if (takeOwn == GiveOwn) {
 		bc = nfmalloc( offsetof(buff_chunk_t, buf) );
 		bc->data = buf;
+		bc->size = 0;
 	} else {
-		bc = nfmalloc( offsetof(buff_chunk_t, buf) + len );
+		size = len < WRITE_CHUNK_SIZE ? WRITE_CHUNK_SIZE : len;
+		bc = nfmalloc( offsetof(buff_chunk_t, buf) + size );
 		bc->data = bc->buf;
+		bc->size = size;
 		memcpy( bc->data, buf, len );
 	}
+	bc->crlf = 0;
 	bc->len = len;
 	bc->next = 0;
 	*conn->write_buf_append = bc;
@@ -656,19 +1437,86 @@ do_append( conn_t *conn, char *buf, int len, ownership_t takeOwn )
 int
 socket_write( conn_t *conn, char *buf, int len, ownership_t takeOwn )
 {
+	int n;
+
+#ifdef HAVE_LIBZ
+	if (conn->out_z) {
+		/* Everything is queued, so the flush can finish the compressed
+		 * block once per event loop iteration. */
+		if (!socket_congested( conn ))
+			conf_wakeup( &conn->write_flush, 0 );
+		n = do_deflate( conn, buf, len, Z_NO_FLUSH );
+		if (takeOwn)
+			free( buf );
+		if (n < 0)
+			return -1;
+		conn->z_dirty = 1;
+		return len;
+	}
+#endif
+
 	if (conn->write_buf) {
+		if (len < WRITE_CHUNK_SIZE || !pending_wakeup( &conn->write_flush )) {
+			do_append( conn, buf, len, takeOwn );
+			return len;
+		}
+	} else if (len < WRITE_CHUNK_SIZE) {
+		conf_wakeup( &conn->write_flush, 0 );
 		do_append( conn, buf, len, takeOwn );
 		return len;
-	} else {
-		int n = do_write( conn, buf, len );
-		if (n != len && n >= 0) {
-			conn->write_offset = n;
-			do_append( conn, buf, len, takeOwn );
-		} else if (takeOwn) {
+	}
+	/* Big writes go out right away, along with whatever is queued. */
+	if ((n = do_flush( conn, buf, len )) < 0) {
+		if (takeOwn)
 			free( buf );
+		return -1;
+	}
+	if (n != len) {
+		if (!conn->write_buf)
+			conn->write_offset = n;
+		do_append( conn, buf, len, takeOwn );
+	} else if (takeOwn) {
+		free( buf );
+	}
+	return len;
+}
+
+int
+socket_write_crlf( conn_t *conn, const char *buf, int len )
+{
+	buff_chunk_t *bc;
+#ifdef HAVE_LIBZ
+	int off, l;
+	char cr;
+	char tbuf[WRITE_CHUNK_SIZE];
+
+	if (conn->out_z) {
+		if (!socket_congested( conn ))
+			conf_wakeup( &conn->write_flush, 0 );
+		for (off = 0, cr = 0; off < len; ) {
+			l = crlf_copy( buf, len, off, cr, tbuf, sizeof(tbuf) );
+			if (do_deflate( conn, tbuf, l, Z_NO_FLUSH ) < 0)
+				return -1;
+			crlf_skip( buf, len, &off, &cr, l );
 		}
-		return n;
+		conn->z_dirty = 1;
+		return len;
 	}
+#endif
+
+	if (!len)
+		return 0;
+	if (!conn->write_buf)
+		conf_wakeup( &conn->write_flush, 0 );
+	bc = nfmalloc( offsetof(buff_chunk_t, buf) );
+	bc->data = (char *)buf;
+	bc->len = len;
+	bc->size = 0;
+	bc->crlf = 1;
+	bc->next = 0;
+	*conn->write_buf_append = bc;
+	conn->write_buf_append = &bc->next;
+	return len;
 }
 
 static void
@@ -676,7 +1524,7 @@ socket_fd_cb( int events, void *aux )
 {
 	conn_t *conn = (conn_t *)aux;
 
-	if ((events & POLLERR) || conn->state == SCK_CONNECTING) {
+	if (events & POLLERR) {
 		int soerr;
 		socklen_t selen = sizeof(soerr);
 		if (getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &soerr, &selen )) {
@@ -684,13 +1532,6 @@ socket_fd_cb( int events, void *aux )
 			exit( 1 );
 		}
 		errno = soerr;
-		if (conn->state == SCK_CONNECTING) {
-			if (errno)
-				socket_connect_failed( conn );
-			else
-				socket_connected( conn );
-			return;
-		}
 		sys_error( "Socket error from %s", conn->name );
 		socket_fail( conn );
 		return;
@@ -28,6 +28,7 @@
 #ifdef HAVE_LIBSSL
 typedef struct ssl_st SSL;
 typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
 
 enum {
 	SSLv2 = 1,
@@ -42,15 +43,19 @@ typedef struct server_conf {
 	char *tunnel;
 	char *host;
 	int port;
+	int timeout; /* seconds; 0 means none */
 #ifdef HAVE_LIBSSL
 	char *cert_file;
+	char *session_file;
 	char system_certs;
 	char ssl_versions;
 
 	/* these are actually variables and are leaked at the end */
 	char ssl_ctx_valid;
+	char session_loaded;
 	unsigned num_trusted;
 	SSL_CTX *SSLContext;
+	SSL_SESSION *session;
 #endif
 } server_conf_t;
 
@@ -58,23 +63,38 @@ typedef struct buff_chunk {
 	struct buff_chunk *next;
 	char *data;
 	int len;
+	int size; /* capacity of buf; zero if data is owned elsewhere */
+	char crlf; /* data is borrowed text whose bare LFs go out as CRLFs */
 	char buf[1];
 } buff_chunk_t;
 
+typedef struct conn_attempt conn_attempt_t;
+
 typedef struct {
 	/* connection */
 	int fd;
 	int state;
+	int expect_read; /* the peer is supposed to send something */
+	wakeup_t fd_timeout;
 	const server_conf_t *conf; /* needed during connect */
 #ifdef HAVE_IPV6
 	struct addrinfo *addrs, *curr_addr; /* needed during connect */
 #else
 	char **curr_addr; /* needed during connect */
 #endif
+	conn_attempt_t *attempts; /* connects in progress */
+	wakeup_t attempt_timer; /* starts the next one */
 	char *name;
 #ifdef HAVE_LIBSSL
 	SSL *ssl;
 #endif
+#ifdef HAVE_LIBZ
+	struct z_stream_s *in_z, *out_z;
+	char *z_buf; /* compressed data not inflated yet */
+	char z_more; /* the inflater may have more output even without input */
+	char z_dirty; /* data was deflated since the last flush */
+#endif
+	io_stats_t *stats; /* if set, the traffic is counted there */
 
 	void (*bad_callback)( void *aux ); /* async fail while sending or listening */
 	void (*read_callback)( void *aux ); /* data available for reading */
@@ -88,14 +108,25 @@ typedef struct {
 	/* writing */
 	buff_chunk_t *write_buf, **write_buf_append; /* buffer head & tail */
 	int write_offset; /* offset into buffer head */
+	int unsent; /* what the kernel had yet to send at the last timeout */
+	char write_cr; /* the CR to be inserted at write_offset was sent already */
+	wakeup_t write_flush; /* sends the queue at the end of the event loop iteration */
 
 	/* reading */
+	char *buf; /* allocated on first use, grows as needed */
+	int bufsz; /* allocated size of buffer */
 	int offset; /* start of filled bytes in buffer */
 	int bytes; /* number of filled bytes in buffer */
 	int scanoff; /* offset to continue scanning for newline at, relative to 'offset' */
-	char buf[100000];
+	char *direct_buf; /* reader's buffer which is filled without copying */
+	int direct_len; /* number of bytes still wanted there */
+	int direct_got; /* number of bytes read into it so far */
 } conn_t;
 
+void socket_timed_out( void *aux );
+void socket_connect_next( void *aux );
+void socket_flush_cb( void *aux );
+
 /* call this before doing anything with the socket */
 static INLINE void socket_init( conn_t *conn,
                                 const server_conf_t *conf,
@@ -110,16 +141,49 @@ static INLINE void socket_init( conn_t *conn,
 	conn->write_callback = write_callback;
 	conn->callback_aux = aux;
 	conn->fd = -1;
+	conn->expect_read = 0;
+#ifdef HAVE_IPV6
+	conn->addrs = 0;
+#endif
+	conn->attempts = 0;
 	conn->name = 0;
+	conn->stats = 0;
+#ifdef HAVE_LIBZ
+	conn->in_z = conn->out_z = 0;
+	conn->z_buf = 0;
+	conn->z_more = conn->z_dirty = 0;
+#endif
+	conn->unsent = 0;
 	conn->write_buf_append = &conn->write_buf;
+	conn->buf = 0;
+	conn->bufsz = 0;
+	conn->direct_buf = 0;
+	init_wakeup( &conn->fd_timeout, socket_timed_out, conn );
+	init_wakeup( &conn->attempt_timer, socket_connect_next, conn );
+	init_wakeup( &conn->write_flush, socket_flush_cb, conn );
 }
 void socket_connect( conn_t *conn, void (*cb)( int ok, void *aux ) );
 void socket_start_tls(conn_t *conn, void (*cb)( int ok, void *aux ) );
+#ifdef HAVE_LIBZ
+int socket_start_deflate( conn_t *conn ); /* RFC 4978; right after the peer agreed */
+#endif
 void socket_close( conn_t *sock );
-int socket_read( conn_t *sock, char *buf, int len ); /* never waits */
+void socket_expect_read( conn_t *sock, int expect ); /* arms the timeout */
+int socket_read( conn_t *sock, char *buf, int len ); /* never waits; if short, continue at buf + result */
+int socket_read_direct( conn_t *sock, char **buf, int len ); /* ditto; data valid until next read */
 char *socket_read_line( conn_t *sock ); /* don't free return value; never waits */
 typedef enum { KeepOwn = 0, GiveOwn } ownership_t;
 int socket_write( conn_t *sock, char *buf, int len, ownership_t takeOwn );
+/* Queue text whose bare LFs are to be sent as CRLFs, without copying it.
+ * It must stay valid until it is sent or the socket is closed. */
+int socket_write_crlf( conn_t *sock, const char *buf, int len );
+/* The number of bytes socket_write_crlf() would send for the text. */
+int crlf_len( const char *buf, int len );
+/* the kernel does not accept more data currently */
+static INLINE int socket_congested( conn_t *sock )
+{
+	return sock->write_buf && !pending_wakeup( &sock->write_flush );
+}
 
 void cram( const char *challenge, const char *user, const char *pass,
            char **_final, int *_finallen );
@@ -0,0 +1,154 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+#include "common.h"
+
+#include <string.h>
+
+/* The statistics are written as JSON, one record per line, so they can be
+ * appended to and consumed incrementally. */
+
+FILE *StatsFile;
+
+#define MAX_DEPTH 4
+
+static int depth;
+static char need_comma[MAX_DEPTH];
+
+int
+stats_open( const char *path )
+{
+	if (!strcmp( path, "-" )) {
+		StatsFile = stdout;
+	} else if (!(StatsFile = fopen( path, "a" ))) {
+		sys_error( "Error: cannot open statistics file %s", path );
+		return -1;
+	}
+	return 0;
+}
+
+static void
+put_str( const char *str )
+{
+	unsigned char c;
+
+	putc( '"', StatsFile );
+	for (; (c = *str); str++) {
+		if (c == '"' || c == '\\')
+			fprintf( StatsFile, "\\%c", c );
+		else if (c < 0x20)
+			fprintf( StatsFile, "\\u%04x", c );
+		else
+			putc( c, StatsFile );
+	}
+	putc( '"', StatsFile );
+}
+
+static void
+put_key( const char *key )
+{
+	if (need_comma[depth - 1])
+		putc( ',', StatsFile );
+	need_comma[depth - 1] = 1;
+	put_str( key );
+	putc( ':', StatsFile );
+}
+
+void
+stats_open_rec( const char *type )
+{
+	putc( '{', StatsFile );
+	depth = 1;
+	need_comma[0] = 0;
+	stats_str( "type", type );
+}
+
+void
+stats_close_rec( void )
+{
+	fputs( "}\n", StatsFile );
+	fflush( StatsFile );
+	depth = 0;
+}
+
+void
+stats_open_obj( const char *key )
+{
+	put_key( key );
+	putc( '{', StatsFile );
+	need_comma[depth++] = 0;
+}
+
+void
+stats_close_obj( void )
+{
+	putc( '}', StatsFile );
+	depth--;
+}
+
+void
+stats_str( const char *key, const char *val )
+{
+	put_key( key );
+	if (val)
+		put_str( val );
+	else
+		fputs( "null", StatsFile );
+}
+
+void
+stats_int( const char *key, uint64_t val )
+{
+	put_key( key );
+	fprintf( StatsFile, "%" PRIu64, val );
+}
+
+void
+stats_usecs( const char *key, uint64_t usecs )
+{
+	put_key( key );
+	fprintf( StatsFile, "%" PRIu64 ".%06u", usecs / 1000000, (unsigned)(usecs % 1000000) );
+}
+
+void
+stats_io( const char *key, const io_stats_t *io )
+{
+	stats_open_obj( key );
+	stats_int( "bytes_in", io->bytes_in );
+	stats_int( "bytes_out", io->bytes_out );
+	stats_int( "commands", io->commands );
+	stats_int( "round_trips", io->round_trips );
+	stats_int( "fsyncs", io->fsyncs );
+	stats_int( "renames", io->renames );
+	stats_close_obj();
+}
+
+/* The activity between two snapshots of the counters. */
+void
+io_stats_diff( io_stats_t *res, const io_stats_t *now, const io_stats_t *then )
+{
+	res->bytes_in = now->bytes_in - then->bytes_in;
+	res->bytes_out = now->bytes_out - then->bytes_out;
+	res->commands = now->commands - then->commands;
+	res->round_trips = now->round_trips - then->round_trips;
+	res->fsyncs = now->fsyncs - then->fsyncs;
+	res->renames = now->renames - then->renames;
+	res->connect_us = res->tls_us = res->auth_us = 0;
+}
@@ -21,6 +21,7 @@
  */
 
 #include "sync.h"
+#include "msg_cvt.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -33,6 +34,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #if !defined(_POSIX_SYNCHRONIZED_IO) || _POSIX_SYNCHRONIZED_IO <= 0
@@ -99,11 +101,14 @@ make_flags( int flags, char *buf )
 
 
 #define S_DEAD         (1<<0)  /* ephemeral: the entry was killed and should be ignored */
+#define S_DUMMY        (1<<1)  /* the slave message is a placeholder for a too big master message */
 #define S_DEL(ms)      (1<<(2+(ms)))  /* ephemeral: m/s message would be subject to expunge */
 #define S_EXPIRED      (1<<4)  /* the entry is expired (slave message removal confirmed) */
 #define S_EXPIRE       (1<<5)  /* the entry is being expired (slave message removal scheduled) */
 #define S_NEXPIRE      (1<<6)  /* temporary: new expiration state */
 #define S_DELETE       (1<<7)  /* ephemeral: flags propagation is a deletion */
+#define S_UPGRADE      (1<<8)  /* ephemeral: the placeholder is being replaced by the real message */
+#define S_AGED         (1<<9)  /* ephemeral: the master message is older than MaxAge */
 
 #define mvBit(in,ib,ob) ((unsigned char)(((unsigned)in) * (ob) / (ib)))
 
@@ -112,7 +117,8 @@ typedef struct sync_rec {
 	/* string_list_t *keywords; */
 	int uid[2]; /* -2 = pending (use tuid), -1 = skipped (too big), 0 = expired */
 	message_t *msg[2];
-	unsigned char status, flags, aflags[2], dflags[2];
+	unsigned short status;
+	unsigned char flags, aflags[2], dflags[2];
 	char tuid[TUIDL];
 } sync_rec_t;
 
@@ -144,32 +150,72 @@ typedef struct sync_rec {
    impossible cases: both uid[M] & uid[S] 0 or -1, both not scanned
 */
 
+/* The phases overlap, as each side proceeds as soon as it can. */
+enum { PH_SELECT, PH_LOAD, PH_FLAGS, PH_NEW, PH_TRASH, PH_CLOSE, PH_MAX };
+static const char * const phase_names[] = { "select", "load", "flags", "new", "trash", "close" };
+
 typedef struct {
 	int t[2];
 	void (*cb)( int sts, void *aux ), *aux;
 	char *dname, *jname, *nname, *lname, *box_name[2];
+	char *fp[2]; /* the boxes' fingerprints before the sync */
 	FILE *jfp, *nfp;
-	sync_rec_t *srecs, **srecadd;
+	sync_rec_t *srecs, **srecadd; /* allocated from srec_pool */
+	pool_t srec_pool;
 	channel_conf_t *chan;
 	store_t *ctx[2];
 	driver_t *drv[2];
 	const char *orig_name[2];
 	int state[2], ref_count, nsrecs, ret, lfd;
 	int new_total[2], new_done[2];
+	int moved[2]; /* new messages which were adopted rather than copied */
+	int copy_pending[2]; /* copies still to be handed to the target; +1 while issuing them */
 	int flags_total[2], flags_done[2];
 	int trash_total[2], trash_done[2];
 	int maxuid[2]; /* highest UID that was already propagated */
 	int newmaxuid[2]; /* highest UID that is currently being propagated */
 	int uidval[2]; /* UID validity value */
+	uint64_t modseq[2]; /* highest mod-sequence as of the previous sync */
+	int maxkuid[2]; /* highest UID which was already known before this sync */
 	int newuid[2]; /* TUID lookup makes sense only for UIDs >= this */
 	int mmaxxuid; /* highest expired UID on master during new message propagation */
 	int smaxxuid; /* highest expired UID on slave */
+	int maged; /* master messages below this UID are older than MaxAge */
+	/* binary sync state */
+	char *smap; /* the mapped file */
+	size_t smap_len;
+	int sfd; /* the file, opened for in-place updates; -1 if not possible */
+	int snents; /* number of entries in the file; they are at the head of srecs */
+	int sserial; /* serial of the journal which the file includes ... */
+	uint64_t sjlen; /* ... up to this offset */
+	int jserial; /* serial of this run's journal */
+	char *jbuf; /* buffered journal entries ... */
+	int jpending; /* ... amounting to this many bytes */
+	wakeup_t jtimer;
+	/* statistics */
+	uint64_t start_us, phase_start[PH_MAX], phase_end[PH_MAX];
+	io_stats_t io[2]; /* the stores' counters at the start; the difference once a store is gone */
+	char unchanged;
 } sync_vars_t;
 
 static void sync_ref( sync_vars_t *svars ) { ++svars->ref_count; }
 static void sync_deref( sync_vars_t *svars );
 static int check_cancel( sync_vars_t *svars );
 
+static void
+phase_begin( sync_vars_t *svars, int ph )
+{
+	if (!svars->phase_start[ph])
+		svars->phase_start[ph] = get_usecs();
+}
+
+static void
+phase_end( sync_vars_t *svars, int ph )
+{
+	if (svars->phase_start[ph] && !svars->phase_end[ph])
+		svars->phase_end[ph] = get_usecs();
+}
+
 #define AUX &svars->t[t]
 #define INV_AUX &svars->t[1-t]
 #define DECL_SVARS \
@@ -205,96 +251,396 @@ static int check_cancel( sync_vars_t *svars );
 #define ST_SELECTED        (1<<10)
 #define ST_DID_EXPUNGE     (1<<11)
 #define ST_CLOSING         (1<<12)
+#define ST_FINGERPRINTED   (1<<13)
+
+/* Journal entries are collected in a buffer, which is written out after
+ * at most JournalFlush milliseconds, when it fills up, and before any
+ * operation which relies on the entries logged so far. Entries recording
+ * completed operations may get lost in a crash, which is equivalent to
+ * crashing before the operation had completed. The buffer is always
+ * written out at entry boundaries, so an interrupted write cannot leave
+ * a partial entry behind. */
+#define JOURNAL_BUFSIZE 32768
+#define JOURNAL_ENTRY_MAX 128 /* longer than any entry */
 
+int JournalFlush;
+
+static void
+flush_journal( sync_vars_t *svars )
+{
+	wipe_wakeup( &svars->jtimer );
+	if (svars->jpending) {
+		if (fflush( svars->jfp )) {
+			sys_error( "Error: cannot write journal %s", svars->jname );
+			exit( 1 );
+		}
+		svars->jpending = 0;
+	}
+}
+
+static void
+journal_timeout( void *aux )
+{
+	flush_journal( (sync_vars_t *)aux );
+}
+
+static void
+jFprintf( sync_vars_t *svars, const char *msg, ... )
+{
+	int r;
+	va_list va;
+
+	va_start( va, msg );
+	r = vfprintf( svars->jfp, msg, va );
+	va_end( va );
+	if (r < 0) {
+		sys_error( "Error: cannot write journal %s", svars->jname );
+		exit( 1 );
+	}
+	if ((svars->jpending += r) > JOURNAL_BUFSIZE - JOURNAL_ENTRY_MAX)
+		flush_journal( svars );
+	else if (!pending_wakeup( &svars->jtimer ))
+		conf_wakeup( &svars->jtimer, JournalFlush );
+}
+
+
+typedef struct {
+	message_t *msg; /* zero if the slot is free */
+	int pos; /* the message's position in the list */
+} tuid_map_t;
+
+static unsigned
+hash_tuid( const char *tuid )
+{
+	unsigned i, h = 2166136261U;
+
+	for (i = 0; i < TUIDL; i++)
+		h = (h ^ (unsigned char)tuid[i]) * 16777619U;
+	return h;
+}
 
 static void
 match_tuids( sync_vars_t *svars, int t )
 {
 	sync_rec_t *srec;
-	message_t *tmsg, *ntmsg = 0;
+	message_t *tmsg;
+	tuid_map_t *tuidmap, *tme, *first;
 	const char *diag;
-	int num_lost = 0;
+	int num_lost = 0, nmsgs, pos, npos;
+	unsigned hashsz, idx;
+
+	for (srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD) && srec->uid[t] == -2 && srec->tuid[0])
+			goto doit;
+	return;
+  doit:
+	/* Messages with equal TUIDs end up in the probe sequence in list
+	 * order, so the search order of a linear scan can be reproduced. */
+	for (nmsgs = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+		nmsgs++;
+	npos = nmsgs; /* like at the end of the list, so the first search starts from the head */
+	hashsz = bucketsForSize( nmsgs * 3 );
+	tuidmap = nfcalloc( hashsz * sizeof(*tuidmap) );
+	for (pos = 0, tmsg = svars->ctx[t]->msgs; tmsg; pos++, tmsg = tmsg->next) {
+		if ((tmsg->status & M_DEAD) || !tmsg->tuid[0])
+			continue;
+		idx = hash_tuid( tmsg->tuid ) % hashsz;
+		while (tuidmap[idx].msg)
+			if (++idx == hashsz)
+				idx = 0;
+		tuidmap[idx].msg = tmsg;
+		tuidmap[idx].pos = pos;
+	}
 
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
 			continue;
 		if (srec->uid[t] == -2 && srec->tuid[0]) {
 			debug( "  pair(%d,%d): lookup %s, TUID %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], str_ms[t], srec->tuid );
-			for (tmsg = ntmsg; tmsg; tmsg = tmsg->next) {
-				if (tmsg->status & M_DEAD)
+			/* Prefer the first match after the previously found message. */
+			first = 0;
+			idx = hash_tuid( srec->tuid ) % hashsz;
+			for (; (tme = &tuidmap[idx])->msg; idx = (idx + 1 == hashsz) ? 0 : idx + 1) {
+				if (memcmp( tme->msg->tuid, srec->tuid, TUIDL ))
 					continue;
-				if (tmsg->tuid[0] && !memcmp( tmsg->tuid, srec->tuid, TUIDL )) {
-					diag = (tmsg == ntmsg) ? "adjacently" : "after gap";
+				if (tme->pos >= npos)
 					goto mfound;
-				}
+				if (!first)
+					first = tme;
 			}
-			for (tmsg = svars->ctx[t]->msgs; tmsg != ntmsg; tmsg = tmsg->next) {
-				if (tmsg->status & M_DEAD)
-					continue;
-				if (tmsg->tuid[0] && !memcmp( tmsg->tuid, srec->tuid, TUIDL )) {
-					diag = "after reset";
-					goto mfound;
-				}
+			if (first) {
+				tme = first;
+				goto mfound;
 			}
 			debug( "  -> TUID lost\n" );
-			Fprintf( svars->jfp, "& %d %d\n", srec->uid[M], srec->uid[S] );
+			jFprintf( svars, "& %d %d\n", srec->uid[M], srec->uid[S] );
 			srec->flags = 0;
 			srec->tuid[0] = 0;
 			num_lost++;
 			continue;
 		  mfound:
+			tmsg = tme->msg;
+			diag = (tme->pos == npos) ? "adjacently" : (tme->pos > npos) ? "after gap" : "after reset";
 			debug( "  -> new UID %d %s\n", tmsg->uid, diag );
-			Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], tmsg->uid );
+			jFprintf( svars, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], tmsg->uid );
 			tmsg->srec = srec;
 			srec->msg[t] = tmsg;
-			ntmsg = tmsg->next;
+			npos = tme->pos + 1;
 			srec->uid[t] = tmsg->uid;
 			srec->tuid[0] = 0;
 		}
 	}
+	free( tuidmap );
 	if (num_lost)
 		warn( "Warning: lost track of %d %sed message(s)\n", num_lost, str_hl[t] );
 }
 
-
 typedef struct copy_vars {
 	void (*cb)( int sts, int uid, struct copy_vars *vars );
 	void *aux;
 	sync_rec_t *srec; /* also ->tuid */
 	message_t *msg;
 	msg_data_t data;
+	/* streaming; the target message is opened only when the data starts flowing */
+	msg_sink_t sink, *tsink;
+	msg_cvt_t *cvt;
+	int tsts;
 } copy_vars_t;
 
 static void msg_fetched( int sts, void *aux );
+static void msg_stored( int sts, int uid, void *aux );
+static void copy_write( msg_sink_t *sink, const char *buf, int len );
+
+static void
+make_tuid( char *tuid )
+{
+	int i, c;
+
+	for (i = 0; i < TUIDL; i++) {
+		c = arc4_getbyte() & 0x3f;
+		tuid[i] = c < 26 ? c + 'A' : c < 52 ? c + 'a' - 26 : c < 62 ? c + '0' - 52 : c == 62 ? '+' : '/';
+	}
+}
+
+/* Whether too big messages go to the slave as placeholders. This needs
+ * the slave to be able to replace them with the real messages later. */
+static int
+use_placeholders( sync_vars_t *svars )
+{
+	return svars->chan->placeholders && svars->chan->stores[S]->max_size != INT_MAX &&
+	       (svars->drv[M]->flags & DRV_PLACEHOLDER) && (svars->drv[S]->flags & DRV_REPLACE);
+}
+
+/* Whether the message belonging to the entry is to be propagated in
+ * the new messages phase. */
+static int
+copy_pending( sync_rec_t *srec, int t )
+{
+	return srec->tuid[0] || (t == S && (srec->status & S_UPGRADE));
+}
+
+/* Once all messages of a batch are handed to the target, it is told
+ * to commit them, so the driver can send them out together. */
+static void
+copies_begin( sync_vars_t *svars, int t )
+{
+	svars->copy_pending[t]++;
+}
+
+static void
+copies_issued( sync_vars_t *svars, int t )
+{
+	if (!--svars->copy_pending[t] && !check_cancel( svars ))
+		svars->drv[t]->commit( svars->ctx[t] );
+}
+
+/* Whether moves into side t can be detected. The stashed messages are
+ * recognized by their size with CRLF line endings, so the other side
+ * needs to have these as well. */
+static int
+detect_moves( sync_vars_t *svars, int t )
+{
+	return DetectMoves && svars->drv[t]->adopt_msg && (svars->drv[1-t]->flags & DRV_CRLF);
+}
+
+/* The size of the source message as the target's adopt_msg() expects it. */
+static int
+moved_size( message_t *msg )
+{
+	if (!msg->size)
+		return -1;
+	return msg->size - (msg->tuid[0] ? 8 + TUIDL + 2 : 0);
+}
 
 static void
 copy_msg( copy_vars_t *vars )
 {
+	int sts, uid;
 	DECL_INIT_SVARS(vars->aux);
 
-	t ^= 1;
+	copies_begin( svars, t );
+	vars->data.placeholder = 0;
+	vars->data.replace = 0;
+	if (vars->srec && t == S) {
+		if (vars->srec->status & S_UPGRADE) {
+			vars->data.replace = vars->srec->msg[S];
+			make_tuid( vars->srec->tuid );
+		} else if (vars->srec->status & S_DUMMY) {
+			vars->data.placeholder = 1;
+		}
+	}
+	if (vars->srec && !(vars->srec->status & (S_DUMMY|S_UPGRADE)) &&
+	    vars->msg->msgid && svars->drv[t]->adopt_msg &&
+	    (sts = svars->drv[t]->adopt_msg( svars->ctx[t], vars->msg->msgid, moved_size( vars->msg ),
+	                                     vars->msg->flags, &uid )) != DRV_MSG_BAD) {
+		if (sts == DRV_OK)
+			svars->moved[t]++;
+		sync_ref( svars );
+		msg_stored( sts, uid, vars );
+		copies_issued( svars, t );
+		sync_deref( svars );
+		return;
+	}
 	vars->data.flags = vars->msg->flags;
 	vars->data.date = svars->chan->use_internal_date ? -1 : 0;
+	vars->data.sink = 0;
+	vars->data.map = 0;
+	vars->data.map_ok = (svars->drv[t]->flags & DRV_MAPPED) &&
+	                    (svars->drv[t]->flags & DRV_CRLF) && !(svars->drv[1-t]->flags & DRV_CRLF);
+	vars->cvt = 0;
+	if (svars->drv[t]->open_msg) {
+		vars->sink.write = copy_write;
+		vars->data.sink = &vars->sink;
+		vars->tsts = DRV_OK;
+	}
+	t ^= 1;
 	svars->drv[t]->fetch_msg( svars->ctx[t], vars->msg, &vars->data, msg_fetched, vars );
 }
 
-static void msg_stored( int sts, int uid, void *aux );
+static void
+copy_out( void *aux, const char *buf, int len )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
+
+	vars->tsink->write( vars->tsink, buf, len );
+}
+
+static int
+copy_open( copy_vars_t *vars )
+{
+	DECL_INIT_SVARS(vars->aux);
+
+	if ((vars->tsts = svars->drv[t]->open_msg( svars->ctx[t], !vars->srec, &vars->tsink )) != DRV_OK)
+		return -1;
+	vars->cvt = nfmalloc( sizeof(*vars->cvt) );
+	msg_cvt_init( vars->cvt, (svars->drv[1-t]->flags / DRV_CRLF) & 1, (svars->drv[t]->flags / DRV_CRLF) & 1,
+	              vars->srec ? vars->srec->tuid : 0, copy_out, vars );
+	return 0;
+}
+
+/* The sink which is handed to the source driver. The data is converted and
+ * passed on to the target driver's sink. */
+static void
+copy_write( msg_sink_t *sink, const char *buf, int len )
+{
+	copy_vars_t *vars = (copy_vars_t *)((char *)sink - offsetof(copy_vars_t, sink));
+
+	if (!vars->cvt && (vars->tsts != DRV_OK || copy_open( vars ) < 0))
+		return;
+	msg_cvt_feed( vars->cvt, buf, len );
+}
+
+static void
+msg_fetched_sink( int sts, copy_vars_t *vars )
+{
+	DECL_INIT_SVARS(vars->aux);
+
+	if (sts == DRV_OK) {
+		if (check_cancel( svars )) {
+			sts = DRV_CANCELED;
+		} else {
+			vars->msg->flags = vars->data.flags;
+			if (!vars->cvt && (vars->tsts != DRV_OK || copy_open( vars ) < 0)) {
+				msg_stored( vars->tsts, 0, vars );
+				return;
+			}
+			if (msg_cvt_done( vars->cvt ) >= 0) {
+				free( vars->cvt );
+				svars->drv[t]->close_msg( svars->ctx[t], vars->tsink, &vars->data, msg_stored, vars );
+				return;
+			}
+			warn( "Warning: message %d from %s has incomplete header.\n",
+			      vars->msg->uid, str_ms[1-t] );
+			sts = DRV_MSG_BAD;
+		}
+	}
+	if (vars->cvt) {
+		msg_cvt_done( vars->cvt );
+		free( vars->cvt );
+		svars->drv[t]->close_msg( svars->ctx[t], vars->tsink, 0, 0, 0 );
+	}
+	switch (sts) {
+	case DRV_CANCELED:
+		vars->cb( SYNC_CANCELED, 0, vars );
+		break;
+	case DRV_MSG_BAD:
+		vars->cb( SYNC_NOGOOD, 0, vars );
+		break;
+	default:
+		vars->cb( SYNC_FAIL, 0, vars );
+		break;
+	}
+}
+
+/* The length of the header of a mapped message, including the empty line,
+ * if only the header needs converting. Otherwise, -1. */
+static int
+mapped_header_len( msg_map_t *map )
+{
+	const char *p, *e;
+
+	/* The target's CRLF conversion also drops stray CRs, which a mapping cannot do. */
+	if (memchr( map->base, '\r', map->size ))
+		return -1;
+	for (p = map->base, e = p + map->size; (p = memchr( p, '\n', e - p )); p++)
+		if (p == map->base || p[-1] == '\n')
+			return p + 1 - map->base;
+	return -1;
+}
+
+static void msg_fetched_p2( int sts, copy_vars_t *vars );
 
 static void
 msg_fetched( int sts, void *aux )
 {
 	copy_vars_t *vars = (copy_vars_t *)aux;
+	DECL_INIT_SVARS(vars->aux);
+
+	sync_ref( svars );
+	msg_fetched_p2( sts, vars );
+	copies_issued( svars, t );
+	sync_deref( svars );
+}
+
+static void
+msg_fetched_p2( int sts, copy_vars_t *vars )
+{
 	DECL_SVARS;
-	char *fmap, *buf;
-	int i, len, extra, scr, tcr, lcrs, hcrs, bcrs, lines;
-	int start, sbreak = 0, ebreak = 0;
-	char c;
+	msg_map_t *map;
+	char *fmap;
+	int scr, tcr, flen, hdrl;
 
+	if (vars->data.sink) {
+		msg_fetched_sink( sts, vars );
+		return;
+	}
 	switch (sts) {
 	case DRV_OK:
 		INIT_SVARS(vars->aux);
+		map = vars->data.map;
 		if (check_cancel( svars )) {
 			free( vars->data.data );
+			free_msg_map( map );
 			vars->cb( SYNC_CANCELED, 0, vars );
 			return;
 		}
@@ -303,103 +649,37 @@ msg_fetched( int sts, void *aux )
 
 		scr = (svars->drv[1-t]->flags / DRV_CRLF) & 1;
 		tcr = (svars->drv[t]->flags / DRV_CRLF) & 1;
-		if (vars->srec || scr != tcr) {
+		if (map) {
+			/* The body stays in the mapping and is converted while it is sent out;
+			 * only the header is copied. If that does not work out, everything is. */
+			fmap = map->base;
+			if ((hdrl = mapped_header_len( map )) >= 0) {
+				flen = map->off = hdrl;
+			} else {
+				flen = map->size;
+				vars->data.map = 0;
+			}
+		} else {
 			fmap = vars->data.data;
-			len = vars->data.len;
-			extra = lines = hcrs = bcrs = i = 0;
-			if (vars->srec) {
-			  nloop:
-				start = i;
-				lcrs = 0;
-				while (i < len) {
-					c = fmap[i++];
-					if (c == '\r')
-						lcrs++;
-					else if (c == '\n') {
-						if (starts_with( fmap + start, len - start, "X-TUID: ", 8 )) {
-							extra = (sbreak = start) - (ebreak = i);
-							goto oke;
-						}
-						lines++;
-						hcrs += lcrs;
-						if (i - lcrs - 1 == start) {
-							sbreak = ebreak = start;
-							goto oke;
-						}
-						goto nloop;
-					}
-				}
-				/* invalid message */
+			flen = vars->data.len;
+		}
+		if (vars->srec || scr != tcr) {
+			if (msg_cvt_buffer( fmap, flen, scr, tcr, vars->srec ? vars->srec->tuid : 0,
+			                    &vars->data.data, &vars->data.len ) < 0) {
 				warn( "Warning: message %d from %s has incomplete header.\n",
 				      vars->msg->uid, str_ms[1-t] );
-				free( fmap );
+				if (map)
+					free_msg_map( map );
+				else
+					free( fmap );
 				vars->cb( SYNC_NOGOOD, 0, vars );
 				return;
-			  oke:
-				extra += 8 + TUIDL + 1 + (tcr && (!scr || hcrs));
-			}
-			if (tcr != scr) {
-				for (; i < len; i++) {
-					c = fmap[i];
-					if (c == '\r')
-						bcrs++;
-					else if (c == '\n')
-						lines++;
-				}
-				extra -= hcrs + bcrs;
-				if (tcr)
-					extra += lines;
-			}
-
-			vars->data.len = len + extra;
-			buf = vars->data.data = nfmalloc( vars->data.len );
-			i = 0;
-			if (vars->srec) {
-				if (tcr != scr) {
-					if (tcr) {
-						for (; i < sbreak; i++)
-							if ((c = fmap[i]) != '\r') {
-								if (c == '\n')
-									*buf++ = '\r';
-								*buf++ = c;
-							}
-					} else {
-						for (; i < sbreak; i++)
-							if ((c = fmap[i]) != '\r')
-								*buf++ = c;
-					}
-				} else {
-					memcpy( buf, fmap, sbreak );
-					buf += sbreak;
-				}
-
-				memcpy( buf, "X-TUID: ", 8 );
-				buf += 8;
-				memcpy( buf, vars->srec->tuid, TUIDL );
-				buf += TUIDL;
-				if (tcr && (!scr || hcrs))
-					*buf++ = '\r';
-				*buf++ = '\n';
-				i = ebreak;
 			}
-			if (tcr != scr) {
-				if (tcr) {
-					for (; i < len; i++)
-						if ((c = fmap[i]) != '\r') {
-							if (c == '\n')
-								*buf++ = '\r';
-							*buf++ = c;
-						}
-				} else {
-					for (; i < len; i++)
-						if ((c = fmap[i]) != '\r')
-							*buf++ = c;
-				}
-			} else
-				memcpy( buf, fmap + i, len - i );
-
-			free( fmap );
+			if (!map)
+				free( fmap );
 		}
+		if (map && !vars->data.map)
+			free_msg_map( map );
 
 		svars->drv[t]->store_msg( svars->ctx[t], &vars->data, !vars->srec, msg_stored, vars );
 		break;
@@ -513,6 +793,7 @@ store_bad( void *aux )
 {
 	DECL_INIT_SVARS(aux);
 
+	io_stats_diff( &svars->io[t], &svars->ctx[t]->stats, &svars->io[t] );
 	svars->drv[t]->cancel_store( svars->ctx[t] );
 	svars->ret |= SYNC_BAD(t);
 	cancel_sync( svars );
@@ -577,9 +858,359 @@ clean_strdup( const char *s )
 }
 
 
-#define JOURNAL_VERSION "2"
-
-static void box_selected( int sts, void *aux );
+#define JOURNAL_VERSION "2"
+
+/* The binary sync state consists of a header and fixed-size entries in
+ * native byte order, in the same order as the text format's lines.
+ * It is mapped into memory for loading. At the end of a sync, it is updated
+ * in place if the existing entries changed only their flags or died:
+ * dead entries are kept as tombstones until they make up a quarter of the
+ * file, and new entries are appended behind the ones the header counts.
+ * The header is written last; it records which journal the file includes
+ * and how far, so a journal replay after a crash does not apply it twice. */
+
+#define SS_MAGIC "\0mbsyncS"
+#define SS_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nents;
+	int uidval[2], maxuid[2], smaxxuid;
+	int serial; /* serial of the included journal */
+	uint64_t modseq[2];
+	uint64_t jlen; /* length of the included journal prefix; 0 if none */
+} ss_hdr_t;
+
+#define SSE_EXPIRED  1
+#define SSE_DEAD     2
+#define SSE_DUMMY    4
+
+typedef struct {
+	int uid[2];
+	unsigned char flags, status;
+	unsigned char pad[2];
+} ss_ent_t;
+
+int SyncStateFormat;
+
+static int load_state( sync_vars_t *svars );
+
+static void
+Fwrite( FILE *f, const void *buf, size_t len )
+{
+	if (fwrite( buf, 1, len, f ) != len) {
+		sys_error( "Error: cannot write file" );
+		exit( 1 );
+	}
+}
+
+static void
+free_binary_state( sync_vars_t *svars )
+{
+	if (svars->smap) {
+		munmap( svars->smap, svars->smap_len );
+		svars->smap = 0;
+	}
+	if (svars->sfd >= 0) {
+		close( svars->sfd );
+		svars->sfd = -1;
+	}
+}
+
+static int
+load_binary_state( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	ss_hdr_t *hdr;
+	ss_ent_t *ent;
+	struct stat st;
+	int fd, i;
+
+	debug( "reading binary sync state %s ...\n", svars->dname );
+	if ((fd = open( svars->dname, O_RDWR )) >= 0) {
+		svars->sfd = fd;
+	} else if ((fd = open( svars->dname, O_RDONLY )) < 0) {
+		sys_error( "Error: cannot read sync state %s", svars->dname );
+		return -1;
+	}
+	if (fstat( fd, &st )) {
+		sys_error( "Error: cannot read sync state %s", svars->dname );
+		goto bail;
+	}
+	if (st.st_size < (off_t)sizeof(*hdr)) {
+		error( "Error: truncated sync state header in %s\n", svars->dname );
+		goto bail;
+	}
+	if ((svars->smap = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 )) == MAP_FAILED) {
+		svars->smap = 0;
+		sys_error( "Error: cannot map sync state %s", svars->dname );
+		goto bail;
+	}
+	svars->smap_len = st.st_size;
+	if (svars->sfd < 0)
+		close( fd );
+	hdr = (ss_hdr_t *)svars->smap;
+	if (memcmp( hdr->magic, SS_MAGIC, sizeof(hdr->magic) )) {
+		error( "Error: invalid sync state header in %s\n", svars->dname );
+		return -1;
+	}
+	if (hdr->version != SS_VERSION) {
+		error( "Error: incompatible sync state version in %s (got %u, expected %d)\n",
+		       svars->dname, hdr->version, SS_VERSION );
+		return -1;
+	}
+	if (hdr->nents > (st.st_size - sizeof(*hdr)) / sizeof(*ent)) {
+		error( "Error: truncated sync state %s\n", svars->dname );
+		return -1;
+	}
+	svars->uidval[M] = hdr->uidval[M];
+	svars->uidval[S] = hdr->uidval[S];
+	svars->maxuid[M] = hdr->maxuid[M];
+	svars->maxuid[S] = hdr->maxuid[S];
+	svars->smaxxuid = hdr->smaxxuid;
+	svars->modseq[M] = hdr->modseq[M];
+	svars->modseq[S] = hdr->modseq[S];
+	svars->sserial = hdr->serial;
+	svars->sjlen = hdr->jlen;
+	svars->snents = hdr->nents;
+	for (i = 0, ent = (ss_ent_t *)(hdr + 1); i < svars->snents; i++, ent++) {
+		srec = pool_alloc( &svars->srec_pool, sizeof(*srec) );
+		srec->uid[M] = ent->uid[M];
+		srec->uid[S] = ent->uid[S];
+		srec->flags = ent->flags;
+		if (ent->status & SSE_DEAD)
+			srec->status = S_DEAD;
+		else if (ent->status & SSE_EXPIRED)
+			srec->status = S_EXPIRE | S_EXPIRED;
+		else
+			srec->status = 0;
+		if (ent->status & SSE_DUMMY)
+			srec->status |= S_DUMMY;
+		debug( "  entry (%d,%d,%u,%s)\n", srec->uid[M], srec->uid[S], srec->flags,
+		       srec->status & S_DEAD ? "dead" : srec->status & S_EXPIRED ? "X" : "" );
+		srec->msg[M] = srec->msg[S] = 0;
+		srec->tuid[0] = 0;
+		srec->next = 0;
+		*svars->srecadd = srec;
+		svars->srecadd = &srec->next;
+		svars->nsrecs++;
+	}
+	return 0;
+
+  bail:
+	if (svars->sfd < 0)
+		close( fd );
+	return -1;
+}
+
+static void
+make_ent( ss_ent_t *ent, sync_rec_t *srec )
+{
+	memset( ent, 0, sizeof(*ent) );
+	ent->uid[M] = srec->uid[M];
+	ent->uid[S] = srec->uid[S];
+	if (srec->status & S_DEAD) {
+		ent->status = SSE_DEAD;
+	} else {
+		ent->flags = srec->flags;
+		if (srec->status & S_EXPIRED)
+			ent->status = SSE_EXPIRED;
+		if (srec->status & S_DUMMY)
+			ent->status |= SSE_DUMMY;
+	}
+}
+
+static void
+make_hdr( ss_hdr_t *hdr, sync_vars_t *svars, uint64_t modseq[], int nents, uint64_t jlen )
+{
+	memset( hdr, 0, sizeof(*hdr) );
+	memcpy( hdr->magic, SS_MAGIC, sizeof(hdr->magic) );
+	hdr->version = SS_VERSION;
+	hdr->nents = nents;
+	hdr->uidval[M] = svars->uidval[M];
+	hdr->uidval[S] = svars->uidval[S];
+	hdr->maxuid[M] = svars->maxuid[M];
+	hdr->maxuid[S] = svars->maxuid[S];
+	hdr->smaxxuid = svars->smaxxuid;
+	hdr->serial = svars->jserial;
+	hdr->modseq[M] = modseq[M];
+	hdr->modseq[S] = modseq[S];
+	hdr->jlen = jlen;
+}
+
+/* Write the complete state in the given format. */
+static void
+write_state( sync_vars_t *svars, FILE *f, int format, uint64_t modseq[] )
+{
+	sync_rec_t *srec;
+	ss_hdr_t hdr;
+	ss_ent_t ent;
+	int nents;
+	char fbuf[16]; /* enlarge when support for keywords is added */
+
+	if (format == SYNCSTATE_BINARY) {
+		for (nents = 0, srec = svars->srecs; srec; srec = srec->next)
+			if (!(srec->status & S_DEAD))
+				nents++;
+		make_hdr( &hdr, svars, modseq, nents, 0 );
+		Fwrite( f, &hdr, sizeof(hdr) );
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			make_ent( &ent, srec );
+			Fwrite( f, &ent, sizeof(ent) );
+		}
+		return;
+	}
+	Fprintf( f,
+	         "MasterUidValidity %d\nSlaveUidValidity %d\nMaxPulledUid %d\nMaxPushedUid %d\n",
+	         svars->uidval[M], svars->uidval[S], svars->maxuid[M], svars->maxuid[S] );
+	if (modseq[M])
+		Fprintf( f, "MasterHighestModSeq %" PRIu64 "\n", modseq[M] );
+	if (modseq[S])
+		Fprintf( f, "SlaveHighestModSeq %" PRIu64 "\n", modseq[S] );
+	if (svars->smaxxuid)
+		Fprintf( f, "MaxExpiredSlaveUid %d\n", svars->smaxxuid );
+	Fprintf( f, "\n" );
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if (srec->status & S_DEAD)
+			continue;
+		make_flags( srec->flags, fbuf );
+		Fprintf( f, "%d %d %s%s%s\n", srec->uid[M], srec->uid[S],
+		         srec->status & S_EXPIRED ? "X" : "", srec->status & S_DUMMY ? "P" : "", fbuf );
+	}
+}
+
+static int
+pwrite_ents( sync_vars_t *svars, ss_ent_t *ents, int start, int cnt )
+{
+	size_t len = cnt * sizeof(*ents);
+
+	return pwrite( svars->sfd, ents, len, sizeof(ss_hdr_t) + start * sizeof(*ents) ) == (ssize_t)len ? 0 : -1;
+}
+
+/* Update the binary state in place. Returns 1 if this is not possible,
+ * and -1 if it failed half-way; a full rewrite is needed then. */
+static int
+update_state( sync_vars_t *svars, uint64_t modseq[] )
+{
+	sync_rec_t *srec;
+	ss_ent_t *oents, ents[256];
+	ss_hdr_t hdr;
+	struct stat st;
+	int i, ndead, start, cnt, dirty;
+
+	if (!svars->smap || svars->sfd < 0)
+		return 1;
+	oents = (ss_ent_t *)(svars->smap + sizeof(ss_hdr_t));
+	for (i = ndead = 0, srec = svars->srecs; i < svars->snents; i++, srec = srec->next) {
+		if (srec->status & S_DEAD)
+			ndead++;
+		else if (srec->uid[M] != oents[i].uid[M] || srec->uid[S] != oents[i].uid[S])
+			return 1; /* a journal replay could not find the entry any more */
+	}
+	if (ndead > svars->snents / 4) {
+		debug( "compacting sync state\n" );
+		return 1;
+	}
+	debug( "updating sync state in place\n" );
+	for (i = cnt = start = dirty = 0, srec = svars->srecs; srec; srec = srec->next) {
+		if (i >= svars->snents && (srec->status & S_DEAD))
+			continue;
+		make_ent( &ents[cnt], srec );
+		if (i < svars->snents && !memcmp( &ents[cnt], &oents[i], sizeof(ents[cnt]) )) {
+			if (cnt && pwrite_ents( svars, ents, start, cnt ) < 0)
+				goto bail;
+			cnt = 0;
+		} else {
+			dirty = 1;
+			if (!cnt)
+				start = i;
+			if (++cnt == as(ents)) {
+				if (pwrite_ents( svars, ents, start, cnt ) < 0)
+					goto bail;
+				cnt = 0;
+			}
+		}
+		i++;
+	}
+	if (cnt && pwrite_ents( svars, ents, start, cnt ) < 0)
+		goto bail;
+	make_hdr( &hdr, svars, modseq, i, 0 );
+	hdr.serial = ((ss_hdr_t *)svars->smap)->serial;
+	hdr.jlen = ((ss_hdr_t *)svars->smap)->jlen;
+	if (!dirty && !memcmp( &hdr, svars->smap, sizeof(hdr) )) {
+		debug( "sync state is unchanged\n" );
+		return 0;
+	}
+	/* The header must not refer to entries which did not make it to disk. */
+	if (UseFSync && fdatasync( svars->sfd ))
+		goto bail;
+	flush_journal( svars );
+	if (fstat( fileno( svars->jfp ), &st ))
+		goto bail;
+	make_hdr( &hdr, svars, modseq, i, st.st_size );
+	if (pwrite( svars->sfd, &hdr, sizeof(hdr), 0 ) != sizeof(hdr) ||
+	    (UseFSync && fdatasync( svars->sfd )))
+		goto bail;
+	return 0;
+
+  bail:
+	sys_error( "Error: cannot update sync state %s", svars->dname );
+	return -1;
+}
+
+int
+convert_sync_state( const char *path, int format )
+{
+	sync_vars_t svars[1];
+	FILE *nfp;
+	struct stat st;
+	int ret = -1;
+
+	memset( svars, 0, sizeof(*svars) );
+	svars->uidval[M] = svars->uidval[S] = -1;
+	svars->srecadd = &svars->srecs;
+	svars->sfd = -1;
+	svars->dname = (char *)path;
+	nfasprintf( &svars->jname, "%s.journal", path );
+	nfasprintf( &svars->nname, "%s.new", path );
+	if (!stat( svars->jname, &st ) && !stat( svars->nname, &st )) {
+		error( "Error: %s has an unfinished journal; run " EXE " on it first\n", path );
+		goto bail;
+	}
+	if (stat( path, &st )) {
+		sys_error( "Error: cannot read sync state %s", path );
+		goto bail;
+	}
+	if (load_state( svars ) < 0)
+		goto bail;
+	svars->jserial = svars->sserial;
+	if (!(nfp = fopen( svars->nname, "w" ))) {
+		sys_error( "Error: cannot create new sync state %s", svars->nname );
+		goto bail;
+	}
+	write_state( svars, nfp, format, svars->modseq );
+	Fclose( nfp, 1 );
+	if (rename( svars->nname, path )) {
+		sys_error( "Error: cannot commit sync state %s", path );
+		unlink( svars->nname );
+		goto bail;
+	}
+	ret = 0;
+  bail:
+	pool_free( &svars->srec_pool );
+	free_binary_state( svars );
+	free( svars->nname );
+	free( svars->jname );
+	return ret;
+}
+
+
+static void box_fingerprinted( int sts, const char *fp, void *aux );
+static void select_boxes( sync_vars_t *svars );
+static int locate_state( sync_vars_t *svars );
 
 void
 sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
@@ -598,6 +1229,12 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 	svars->chan = chan;
 	svars->uidval[0] = svars->uidval[1] = -1;
 	svars->srecadd = &svars->srecs;
+	svars->sfd = -1;
+	init_wakeup( &svars->jtimer, journal_timeout, svars );
+	svars->start_us = get_usecs();
+	svars->io[M] = ctx[M]->stats;
+	svars->io[S] = ctx[S]->stats;
+	phase_begin( svars, PH_SELECT );
 
 	for (t = 0; t < 2; t++) {
 		svars->orig_name[t] =
@@ -617,53 +1254,147 @@ sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
 	}
 	/* Both boxes must be fully set up at this point, so that error exit paths
 	 * don't run into uninitialized variables. */
+	sync_ref( svars );
+	/* An in-box sync state can be located only once the box is selected. */
+	if (svars->drv[M]->box_fingerprint && svars->drv[S]->box_fingerprint &&
+	    strcmp( chan->sync_state ? chan->sync_state : global_conf.sync_state, "*" )) {
+		if (locate_state( svars ) < 0) {
+			svars->ret = SYNC_FAIL;
+			sync_bail2( svars );
+		} else {
+			for (t = 0; t < 2; t++) {
+				svars->drv[t]->box_fingerprint( ctx[t], svars->box_name[t], box_fingerprinted, AUX );
+				if (check_cancel( svars ))
+					break;
+			}
+		}
+	} else {
+		select_boxes( svars );
+	}
+	sync_deref( svars );
+}
+
+static void box_selected( int sts, void *aux );
+
+static void
+select_boxes( sync_vars_t *svars )
+{
+	int t;
+
 	sync_ref( svars );
 	for (t = 0; t < 2; t++) {
 		info( "Selecting %s %s...\n", str_ms[t], svars->orig_name[t] );
-		svars->drv[t]->select( ctx[t], svars->box_name[t], (chan->ops[t] & OP_CREATE) != 0, box_selected, AUX );
+		svars->drv[t]->select( svars->ctx[t], svars->box_name[t], (svars->chan->ops[t] & OP_CREATE) != 0, box_selected, AUX );
 		if (check_cancel( svars ))
 			break;
 	}
 	sync_deref( svars );
 }
 
-static void load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs );
+/* The fingerprint file records the boxes' fingerprints as of the start of the
+ * last successful sync, along with the configuration it was done with. If
+ * neither changed since, the sync would be a no-op. Our own changes to the
+ * boxes alter their fingerprints, so they are confirmed by one more sync. */
+static char *
+make_fingerprint( sync_vars_t *svars )
+{
+	channel_conf_t *chan = svars->chan;
+	char *fp;
+
+	/* Pruning is due as messages age, so that must not be skipped for more than a day. */
+	nfasprintf( &fp, "%s\n%s\n%d %d %u %d %d %u %u %d %u %d %ld\n", svars->fp[M], svars->fp[S],
+	            chan->ops[M], chan->ops[S], chan->max_messages, chan->expire_unread,
+	            chan->use_internal_date, chan->stores[M]->max_size, chan->stores[S]->max_size,
+	            chan->placeholders, chan->max_age, chan->prune_aged,
+	            (chan->max_age && chan->prune_aged) ? (long)(time( 0 ) / (24 * 60 * 60)) : 0L );
+	return fp;
+}
 
-static void
-box_selected( int sts, void *aux )
+static int
+fingerprint_unchanged( sync_vars_t *svars )
 {
-	DECL_SVARS;
-	sync_rec_t *srec, *nsrec;
-	char *s, *cmname, *csname;
-	store_t *ctx[2];
-	channel_conf_t *chan;
-	FILE *jfp;
-	int opts[2], line, t1, t2, t3;
-	int *mexcs, nmexcs, rmexcs, minwuid;
+	char *fname, *fp;
+	int fd, n, ret = 0;
 	struct stat st;
-	struct flock lck;
-	char fbuf[16]; /* enlarge when support for keywords is added */
-	char buf[128], buf1[64], buf2[64];
+	char buf[1024];
 
-	if (check_ret( sts, aux ))
+	nfasprintf( &fname, "%s.journal", svars->dname );
+	if (!stat( fname, &st )) {
+		/* An interrupted sync needs to be completed. */
+		free( fname );
+		return 0;
+	}
+	free( fname );
+	nfasprintf( &fname, "%s.fingerprint", svars->dname );
+	if ((fd = open( fname, O_RDONLY )) >= 0) {
+		if ((n = read( fd, buf, sizeof(buf) - 1 )) > 0) {
+			buf[n] = 0;
+			fp = make_fingerprint( svars );
+			ret = !strcmp( buf, fp );
+			free( fp );
+		}
+		close( fd );
+	}
+	free( fname );
+	return ret;
+}
+
+static void
+save_fingerprint( sync_vars_t *svars )
+{
+	char *fname, *fp;
+	FILE *f;
+
+	if (svars->ret || !svars->fp[M] || !svars->fp[S])
 		return;
-	INIT_SVARS(aux);
-	ctx[0] = svars->ctx[0];
-	ctx[1] = svars->ctx[1];
-	svars->state[t] |= ST_SELECTED;
-	if (!(svars->state[1-t] & ST_SELECTED))
+	nfasprintf( &fname, "%s.fingerprint", svars->dname );
+	if (!(f = fopen( fname, "w" ))) {
+		sys_error( "Warning: cannot write fingerprint %s", fname );
+	} else {
+		fp = make_fingerprint( svars );
+		fputs( fp, f );
+		free( fp );
+		/* A torn file simply does not match. */
+		if (ferror( f ) | fclose( f )) {
+			sys_error( "Warning: cannot write fingerprint %s", fname );
+			unlink( fname );
+		}
+	}
+	free( fname );
+}
+
+static void
+box_fingerprinted( int sts, const char *fp, void *aux )
+{
+	SVARS_CHECK_RET;
+	svars->fp[t] = fp ? nfstrdup( fp ) : 0;
+	svars->state[t] |= ST_FINGERPRINTED;
+	if (!(svars->state[1-t] & ST_FINGERPRINTED))
 		return;
 
-	chan = svars->chan;
+	if (svars->fp[M] && svars->fp[S] && fingerprint_unchanged( svars )) {
+		info( "Skipping unchanged %s %s and %s %s.\n",
+		      str_ms[M], svars->orig_name[M], str_ms[S], svars->orig_name[S] );
+		svars->unchanged = 1;
+		sync_bail2( svars );
+		return;
+	}
+	select_boxes( svars );
+}
+
+/* Determine the location of the sync state file. */
+static int
+locate_state( sync_vars_t *svars )
+{
+	channel_conf_t *chan = svars->chan;
+	char *s, *cmname, *csname;
+
 	if (!strcmp( chan->sync_state ? chan->sync_state : global_conf.sync_state, "*" )) {
-		if (!ctx[S]->path) {
+		if (!svars->ctx[S]->path) {
 			error( "Error: store '%s' does not support in-box sync state\n", chan->stores[S]->name );
-		  sbail:
-			svars->ret = SYNC_FAIL;
-			sync_bail2( svars );
-			return;
+			return -1;
 		}
-		nfasprintf( &svars->dname, "%s/." EXE "state", ctx[S]->path );
+		nfasprintf( &svars->dname, "%s/." EXE "state", svars->ctx[S]->path );
 	} else {
 		csname = clean_strdup( svars->box_name[S] );
 		if (chan->sync_state)
@@ -678,39 +1409,38 @@ box_selected( int sts, void *aux )
 		free( csname );
 		if (!(s = strrchr( svars->dname, '/' ))) {
 			error( "Error: invalid SyncState location '%s'\n", svars->dname );
-			goto sbail;
+			return -1;
 		}
 		*s = 0;
 		if (mkdir( svars->dname, 0700 ) && errno != EEXIST) {
 			sys_error( "Error: cannot create SyncState directory '%s'", svars->dname );
-			goto sbail;
+			return -1;
 		}
 		*s = '/';
 	}
-	nfasprintf( &svars->jname, "%s.journal", svars->dname );
-	nfasprintf( &svars->nname, "%s.new", svars->dname );
-	nfasprintf( &svars->lname, "%s.lock", svars->dname );
-	memset( &lck, 0, sizeof(lck) );
-#if SEEK_SET != 0
-	lck.l_whence = SEEK_SET;
-#endif
-#if F_WRLCK != 0
-	lck.l_type = F_WRLCK;
-#endif
-	if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
-		sys_error( "Error: cannot create lock file %s", svars->lname );
-		svars->ret = SYNC_FAIL;
-		sync_bail2( svars );
-		return;
-	}
-	if (fcntl( svars->lfd, F_SETLK, &lck )) {
-		error( "Error: channel :%s:%s-:%s:%s is locked\n",
-		         chan->stores[M]->name, svars->orig_name[M], chan->stores[S]->name, svars->orig_name[S] );
-		svars->ret = SYNC_FAIL;
-		sync_bail1( svars );
-		return;
-	}
+	return 0;
+}
+
+static void box_aged( int sts, int uid, void *aux );
+static void load_boxes( sync_vars_t *svars );
+static void load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs );
+
+static int
+load_state( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	char *s;
+	FILE *jfp;
+	int line, t, t1, t2, c;
+	char fbuf[16]; /* enlarge when support for keywords is added */
+	char buf[128], buf1[64], buf2[64];
+
 	if ((jfp = fopen( svars->dname, "r" ))) {
+		if ((c = getc( jfp )) == SS_MAGIC[0]) {
+			fclose( jfp );
+			return load_binary_state( svars );
+		}
+		ungetc( c, jfp );
 		debug( "reading sync state %s ...\n", svars->dname );
 		line = 0;
 		while (fgets( buf, sizeof(buf), jfp )) {
@@ -719,10 +1449,7 @@ box_selected( int sts, void *aux )
 				error( "Error: incomplete sync state header entry at %s:%d\n", svars->dname, line );
 			  jbail:
 				fclose( jfp );
-			  bail:
-				svars->ret = SYNC_FAIL;
-				sync_bail( svars );
-				return;
+				return -1;
 			}
 			if (t == 1)
 				goto gothdr;
@@ -735,6 +1462,9 @@ box_selected( int sts, void *aux )
 				}
 				goto gothdr;
 			}
+			if (sscanf( buf, "MasterHighestModSeq %" SCNu64, &svars->modseq[M] ) == 1 ||
+			    sscanf( buf, "SlaveHighestModSeq %" SCNu64, &svars->modseq[S] ) == 1)
+				continue;
 			if (sscanf( buf, "%63s %d", buf1, &t1 ) != 2) {
 				error( "Error: malformed sync state header entry at %s:%d\n", svars->dname, line );
 				goto jbail;
@@ -768,7 +1498,7 @@ box_selected( int sts, void *aux )
 				error( "Error: invalid sync state entry at %s:%d\n", svars->dname, line );
 				goto jbail;
 			}
-			srec = nfmalloc( sizeof(*srec) );
+			srec = pool_alloc( &svars->srec_pool, sizeof(*srec) );
 			srec->uid[M] = t1;
 			srec->uid[S] = t2;
 			s = fbuf;
@@ -777,6 +1507,10 @@ box_selected( int sts, void *aux )
 				srec->status = S_EXPIRE | S_EXPIRED;
 			} else
 				srec->status = 0;
+			if (*s == 'P') {
+				s++;
+				srec->status |= S_DUMMY;
+			}
 			srec->flags = parse_flags( s );
 			debug( "  entry (%d,%d,%u,%s)\n", srec->uid[M], srec->uid[S], srec->flags, srec->status & S_EXPIRED ? "X" : "" );
 			srec->msg[M] = srec->msg[S] = 0;
@@ -790,9 +1524,77 @@ box_selected( int sts, void *aux )
 	} else {
 		if (errno != ENOENT) {
 			sys_error( "Error: cannot read sync state %s", svars->dname );
-			goto bail;
+			return -1;
 		}
 	}
+	return 0;
+}
+
+static void
+box_selected( int sts, void *aux )
+{
+	DECL_SVARS;
+	sync_rec_t *srec, *nsrec;
+	char *s;
+	store_t *ctx[2];
+	channel_conf_t *chan;
+	FILE *jfp;
+	int opts[2], line, t1, t2, t3;
+	time_t since;
+	struct stat st;
+	struct flock lck;
+	char buf[128];
+
+	if (check_ret( sts, aux ))
+		return;
+	INIT_SVARS(aux);
+	ctx[0] = svars->ctx[0];
+	ctx[1] = svars->ctx[1];
+	svars->state[t] |= ST_SELECTED;
+	if (!(svars->state[1-t] & ST_SELECTED))
+		return;
+	phase_end( svars, PH_SELECT );
+	phase_begin( svars, PH_LOAD );
+
+	chan = svars->chan;
+	if (!svars->dname && locate_state( svars ) < 0) {
+		svars->ret = SYNC_FAIL;
+		sync_bail2( svars );
+		return;
+	}
+	nfasprintf( &svars->jname, "%s.journal", svars->dname );
+	nfasprintf( &svars->nname, "%s.new", svars->dname );
+	nfasprintf( &svars->lname, "%s.lock", svars->dname );
+	memset( &lck, 0, sizeof(lck) );
+#if SEEK_SET != 0
+	lck.l_whence = SEEK_SET;
+#endif
+#if F_WRLCK != 0
+	lck.l_type = F_WRLCK;
+#endif
+	if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
+		sys_error( "Error: cannot create lock file %s", svars->lname );
+		svars->ret = SYNC_FAIL;
+		sync_bail2( svars );
+		return;
+	}
+	if (fcntl( svars->lfd, F_SETLK, &lck )) {
+		error( "Error: channel :%s:%s-:%s:%s is locked\n",
+		         chan->stores[M]->name, svars->orig_name[M], chan->stores[S]->name, svars->orig_name[S] );
+		svars->ret = SYNC_FAIL;
+		sync_bail1( svars );
+		return;
+	}
+	/* Whatever happens now, the fingerprints become stale. */
+	nfasprintf( &s, "%s.fingerprint", svars->dname );
+	unlink( s );
+	free( s );
+	if (load_state( svars ) < 0) {
+	  bail:
+		svars->ret = SYNC_FAIL;
+		sync_bail( svars );
+		return;
+	}
 	svars->newmaxuid[M] = svars->maxuid[M];
 	svars->newmaxuid[S] = svars->maxuid[S];
 	svars->mmaxxuid = INT_MAX;
@@ -807,7 +1609,9 @@ box_selected( int sts, void *aux )
 			if (!equals( buf, t, JOURNAL_VERSION "\n", strlen(JOURNAL_VERSION) + 1 )) {
 				error( "Error: incompatible journal version "
 				                 "(got %.*s, expected " JOURNAL_VERSION ")\n", t - 1, buf );
-				goto jbail;
+			  jbail:
+				fclose( jfp );
+				goto bail;
 			}
 			srec = 0;
 			line = 1;
@@ -819,7 +1623,7 @@ box_selected( int sts, void *aux )
 				}
 				if (buf[0] == '#' ?
 				      (t3 = 0, (sscanf( buf + 2, "%d %d %n", &t1, &t2, &t3 ) < 2) || !t3 || (t - t3 != TUIDL + 3)) :
-				      buf[0] == '(' || buf[0] == ')' || buf[0] == '{' || buf[0] == '}' || buf[0] == '!' ?
+				      buf[0] == '(' || buf[0] == ')' || buf[0] == '{' || buf[0] == '}' || buf[0] == '!' || buf[0] == '=' ?
 				        (sscanf( buf + 2, "%d", &t1 ) != 1) :
 				        buf[0] == '+' || buf[0] == '&' || buf[0] == '-' || buf[0] == '|' || buf[0] == '/' || buf[0] == '\\' ?
 				          (sscanf( buf + 2, "%d %d", &t1, &t2 ) != 2) :
@@ -838,11 +1642,20 @@ box_selected( int sts, void *aux )
 					svars->newuid[S] = t1;
 				else if (buf[0] == '!')
 					svars->smaxxuid = t1;
-				else if (buf[0] == '|') {
+				else if (buf[0] == '=') {
+					if (t1 == svars->sserial && svars->sjlen) {
+						/* The state was updated in place, but the journal was not deleted yet. */
+						debug( "  skipping journal up to %" PRIu64 "\n", svars->sjlen );
+						if (fseek( jfp, (long)svars->sjlen, SEEK_SET )) {
+							sys_error( "Error: cannot seek journal %s", svars->jname );
+							goto jbail;
+						}
+					}
+				} else if (buf[0] == '|') {
 					svars->uidval[M] = t1;
 					svars->uidval[S] = t2;
 				} else if (buf[0] == '+') {
-					srec = nfmalloc( sizeof(*srec) );
+					srec = pool_alloc( &svars->srec_pool, sizeof(*srec) );
 					srec->uid[M] = t1;
 					srec->uid[S] = t2;
 					if (svars->newmaxuid[M] < t1)
@@ -899,6 +1712,13 @@ box_selected( int sts, void *aux )
 						debug( "flags now %d\n", t3 );
 						srec->flags = t3;
 						break;
+					case '^':
+						debug( "placeholder now %d\n", t3 );
+						if (t3)
+							srec->status |= S_DUMMY;
+						else
+							srec->status &= ~S_DUMMY;
+						break;
 					case '~':
 						debug( "expire now %d\n", t3 );
 						if (t3)
@@ -958,9 +1778,13 @@ box_selected( int sts, void *aux )
 		fclose( svars->nfp );
 		goto bail;
 	}
-	setlinebuf( svars->jfp );
+	svars->jbuf = nfmalloc( JOURNAL_BUFSIZE );
+	setvbuf( svars->jfp, svars->jbuf, _IOFBF, JOURNAL_BUFSIZE );
 	if (!line)
-		Fprintf( svars->jfp, JOURNAL_VERSION "\n" );
+		jFprintf( svars, JOURNAL_VERSION "\n" );
+	svars->jserial = svars->sserial + 1;
+	if (SyncStateFormat == SYNCSTATE_BINARY)
+		jFprintf( svars, "= %d\n", svars->jserial );
 
 	opts[M] = opts[S] = 0;
 	for (t = 0; t < 2; t++) {
@@ -980,9 +1804,13 @@ box_selected( int sts, void *aux )
 				opts[1-t] |= OPEN_FLAGS;
 			if (chan->stores[t]->max_size != INT_MAX)
 				opts[1-t] |= OPEN_SIZE;
+			if (detect_moves( svars, t ) && (chan->ops[t] & OP_NEW))
+				opts[1-t] |= OPEN_MSGID|OPEN_SIZE|OPEN_FLAGS;
 		}
 		if (chan->ops[t] & OP_EXPUNGE) {
 			opts[t] |= OPEN_EXPUNGE;
+			if (detect_moves( svars, t ))
+				opts[t] |= OPEN_STASH;
 			if (chan->stores[t]->trash) {
 				if (!chan->stores[t]->trash_only_new)
 					opts[t] |= OPEN_OLD;
@@ -993,6 +1821,13 @@ box_selected( int sts, void *aux )
 	}
 	if ((chan->ops[S] & (OP_NEW|OP_RENEW|OP_FLAGS)) && chan->max_messages)
 		opts[S] |= OPEN_OLD|OPEN_NEW|OPEN_FLAGS;
+	if ((chan->ops[S] & OP_RENEW) && use_placeholders( svars )) {
+		/* Placeholders are upgraded when either side is flagged. */
+		opts[S] |= OPEN_OLD|OPEN_FLAGS;
+		opts[M] |= OPEN_FLAGS;
+	}
+	if (chan->max_age && chan->prune_aged)
+		opts[S] |= OPEN_SETFLAGS|OPEN_OLD|OPEN_FLAGS;
 	if (line)
 		for (srec = svars->srecs; srec; srec = srec->next) {
 			if (srec->status & S_DEAD)
@@ -1009,6 +1844,48 @@ box_selected( int sts, void *aux )
 	svars->drv[M]->prepare_opts( ctx[M], opts[M] );
 	svars->drv[S]->prepare_opts( ctx[S], opts[S] );
 
+	ctx[M]->since = 0;
+	if (chan->max_age && (ctx[M]->opts & (OPEN_OLD|OPEN_NEW))) {
+		since = time( 0 ) - (time_t)chan->max_age * 24 * 60 * 60;
+		if (svars->drv[M]->find_since) {
+			/* Narrow down the master's working set before anything is loaded. */
+			t = M;
+			svars->drv[M]->find_since( ctx[M], since, box_aged, AUX );
+			return;
+		}
+		/* The driver finds the boundary while loading the box. */
+		ctx[M]->since = since;
+	}
+	load_boxes( svars );
+}
+
+static void
+mark_aged( sync_vars_t *svars, int uid )
+{
+	sync_rec_t *srec;
+
+	debug( "master messages below uid %d are older than MaxAge\n", uid );
+	svars->maged = uid;
+	for (srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD) && srec->uid[M] > 0 && srec->uid[M] < uid)
+			srec->status |= S_AGED;
+}
+
+static void
+box_aged( int sts, int uid, void *aux )
+{
+	SVARS_CHECK_RET;
+	mark_aged( svars, uid );
+	load_boxes( svars );
+}
+
+static void
+load_boxes( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	channel_conf_t *chan = svars->chan;
+	int *mexcs, nmexcs, rmexcs, minwuid, t;
+
 	mexcs = 0;
 	nmexcs = rmexcs = 0;
 	if (svars->ctx[M]->opts & OPEN_OLD) {
@@ -1020,7 +1897,7 @@ box_selected( int sts, void *aux )
 			/* First, find out the lower bound for the bulk fetch. */
 			minwuid = INT_MAX;
 			for (srec = svars->srecs; srec; srec = srec->next) {
-				if ((srec->status & S_DEAD) || srec->uid[M] <= 0)
+				if ((srec->status & (S_DEAD|S_AGED)) || srec->uid[M] <= 0)
 					continue;
 				if (srec->status & S_EXPIRED) {
 					if (!srec->uid[S]) {
@@ -1043,7 +1920,7 @@ box_selected( int sts, void *aux )
 			debug( "  min non-orphaned master uid is %d\n", minwuid );
 			/* Next, calculate the exception fetch. */
 			for (srec = svars->srecs; srec; srec = srec->next) {
-				if (srec->status & S_DEAD)
+				if (srec->status & (S_DEAD|S_AGED))
 					continue;
 				if (srec->uid[M] > 0 && srec->uid[S] > 0 && minwuid > srec->uid[M] &&
 				    (!(svars->ctx[M]->opts & OPEN_NEW) || svars->maxuid[M] >= srec->uid[M])) {
@@ -1065,24 +1942,36 @@ box_selected( int sts, void *aux )
 	} else {
 		minwuid = INT_MAX;
 	}
+	if (minwuid < svars->maged)
+		minwuid = svars->maged;
 	sync_ref( svars );
 	load_box( svars, M, minwuid, mexcs, nmexcs );
 	if (!check_cancel( svars ))
-		load_box( svars, S, (ctx[S]->opts & OPEN_OLD) ? 1 : INT_MAX, 0, 0 );
+		load_box( svars, S, (svars->ctx[S]->opts & OPEN_OLD) ? 1 : INT_MAX, 0, 0 );
 	sync_deref( svars );
 }
 
 static void box_loaded( int sts, void *aux );
 
+static int
+known_compare( const void *a, const void *b )
+{
+	return ((const known_msg_t *)a)->uid - ((const known_msg_t *)b)->uid;
+}
+
 static void
 load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs )
 {
 	sync_rec_t *srec;
-	int maxwuid;
+	known_msg_t *known;
+	int maxwuid, nknown, rmexcs;
 
 	if (svars->ctx[t]->opts & OPEN_NEW) {
 		if (minwuid > svars->maxuid[t] + 1)
 			minwuid = svars->maxuid[t] + 1;
+		/* New messages which are too old are not wanted, either. */
+		if (t == M && minwuid < svars->maged)
+			minwuid = svars->maged;
 		maxwuid = INT_MAX;
 	} else if (svars->ctx[t]->opts & OPEN_OLD) {
 		maxwuid = 0;
@@ -1091,6 +1980,41 @@ load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs )
 				maxwuid = srec->uid[t];
 	} else
 		maxwuid = 0;
+	svars->ctx[t]->minnewuid = svars->maxuid[t] + 1;
+	svars->maxkuid[t] = 0;
+	for (srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD) && srec->uid[t] > svars->maxkuid[t])
+			svars->maxkuid[t] = srec->uid[t];
+	if (svars->modseq[t] && svars->ctx[t]->highestmodseq >= svars->modseq[t] &&
+	    (svars->ctx[t]->opts & OPEN_OLD) && !svars->chan->max_messages) {
+		/* Messages which still need to be propagated are fetched in full,
+		 * the driver may skip all other unchanged ones. */
+		known = nfmalloc( (svars->nsrecs + 1) * sizeof(*known) );
+		nknown = rmexcs = 0;
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if ((srec->status & S_DEAD) || srec->uid[t] <= 0 || (t == M && (srec->status & S_AGED)))
+				continue;
+			if (srec->uid[1-t] < 0) {
+				if (nmexcs == rmexcs) {
+					rmexcs = rmexcs * 2 + 100;
+					mexcs = nfrealloc( mexcs, rmexcs * sizeof(int) );
+				}
+				mexcs[nmexcs++] = srec->uid[t];
+			} else {
+				known[nknown].uid = srec->uid[t];
+				known[nknown].flags = srec->flags;
+				nknown++;
+			}
+		}
+		qsort( known, nknown, sizeof(*known), known_compare );
+		debug( "%s: %d known messages, changes since modseq %" PRIu64 " suffice\n",
+		       str_ms[t], nknown, svars->modseq[t] );
+		svars->ctx[t]->changedsince = svars->modseq[t];
+		svars->ctx[t]->known = known;
+		svars->ctx[t]->nknown = nknown;
+	} else {
+		svars->ctx[t]->changedsince = 0;
+	}
 	info( "Loading %s...\n", str_ms[t] );
 	debug( maxwuid == INT_MAX ? "loading %s [%d,inf]\n" : "loading %s [%d,%d]\n", str_ms[t], minwuid, maxwuid );
 	svars->drv[t]->load( svars->ctx[t], minwuid, maxwuid, svars->newuid[t], mexcs, nmexcs, box_loaded, AUX );
@@ -1123,8 +2047,8 @@ box_loaded( int sts, void *aux )
 	message_t *tmsg;
 	copy_vars_t *cv;
 	flag_vars_t *fv;
-	int uid, no[2], del[2], alive, todel, t1, t2;
-	int sflags, nflags, aflags, dflags, nex;
+	int uid, no[2], del[2], alive, todel, dummy;
+	int sflags, nflags, aflags, dflags, nex, nmsgs;
 	unsigned hashsz, idx;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 
@@ -1133,6 +2057,8 @@ box_loaded( int sts, void *aux )
 	INIT_SVARS(aux);
 	svars->state[t] |= ST_LOADED;
 	info( "%s: %d messages, %d recent\n", str_ms[t], svars->ctx[t]->count, svars->ctx[t]->recent );
+	if (t == M && svars->ctx[M]->since)
+		mark_aged( svars, svars->ctx[M]->sinceuid );
 
 	if (svars->state[t] & ST_FIND_OLD) {
 		debug( "matching previously copied messages on %s\n", str_ms[t] );
@@ -1181,11 +2107,12 @@ box_loaded( int sts, void *aux )
 
 	if (!(svars->state[1-t] & ST_LOADED))
 		return;
+	phase_end( svars, PH_LOAD );
 
 	if (svars->uidval[M] < 0 || svars->uidval[S] < 0) {
 		svars->uidval[M] = svars->ctx[M]->uidvalidity;
 		svars->uidval[S] = svars->ctx[S]->uidvalidity;
-		Fprintf( svars->jfp, "| %d %d\n", svars->uidval[M], svars->uidval[S] );
+		jFprintf( svars, "| %d %d\n", svars->uidval[M], svars->uidval[S] );
 	}
 
 	info( "Synchronizing...\n" );
@@ -1195,19 +2122,30 @@ box_loaded( int sts, void *aux )
 		if (srec->status & S_DEAD)
 			continue;
 		debug( "pair (%d,%d)\n", srec->uid[M], srec->uid[S] );
+		srec->aflags[M] = srec->dflags[M] = srec->aflags[S] = srec->dflags[S] = 0;
+		if (srec->status & S_AGED) {
+			/* The master message was not loaded, so there is nothing to compare. */
+			if (svars->chan->prune_aged && srec->msg[S] && !(srec->msg[S]->flags & (F_FLAGGED|F_DELETED))) {
+				debug( "  aged, pruning slave\n" );
+				srec->aflags[S] = F_DELETED;
+				srec->status |= S_DELETE;
+			} else {
+				debug( "  aged\n" );
+			}
+			continue;
+		}
 		no[M] = !srec->msg[M] && (svars->ctx[M]->opts & OPEN_OLD);
 		no[S] = !srec->msg[S] && (svars->ctx[S]->opts & OPEN_OLD);
 		if (no[M] && no[S]) {
 			debug( "  vanished\n" );
 			/* d.1) d.5) d.6) d.10) d.11) */
 			srec->status = S_DEAD;
-			Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+			jFprintf( svars, "- %d %d\n", srec->uid[M], srec->uid[S] );
 		} else {
 			del[M] = no[M] && (srec->uid[M] > 0);
 			del[S] = no[S] && (srec->uid[S] > 0);
 
 			for (t = 0; t < 2; t++) {
-				srec->aflags[t] = srec->dflags[t] = 0;
 				if (srec->msg[t] && (srec->msg[t]->flags & F_DELETED))
 					srec->status |= S_DEL(t);
 				/* excludes (push) c.3) d.2) d.3) d.4) / (pull) b.3) d.7) d.8) d.9) */
@@ -1219,7 +2157,7 @@ box_loaded( int sts, void *aux )
 					if ((t == M) && (srec->status & (S_EXPIRE|S_EXPIRED))) {
 						/* Don't propagate deletion resulting from expiration. */
 						debug( "  slave expired, orphaning master\n" );
-						Fprintf( svars->jfp, "> %d %d 0\n", srec->uid[M], srec->uid[S] );
+						jFprintf( svars, "> %d %d 0\n", srec->uid[M], srec->uid[S] );
 						srec->uid[S] = 0;
 					} else {
 						if (srec->msg[t] && (srec->msg[t]->status & M_FLAGS) && srec->msg[t]->flags != srec->flags)
@@ -1284,7 +2222,7 @@ box_loaded( int sts, void *aux )
 					if (srec) {
 						debug( "  -> pair(%d,%d) exists\n", srec->uid[M], srec->uid[S] );
 					} else {
-						srec = nfmalloc( sizeof(*srec) );
+						srec = pool_alloc( &svars->srec_pool, sizeof(*srec) );
 						srec->next = 0;
 						*svars->srecadd = srec;
 						svars->srecadd = &srec->next;
@@ -1299,7 +2237,7 @@ box_loaded( int sts, void *aux )
 						tmsg->srec = srec;
 						if (svars->newmaxuid[1-t] < tmsg->uid)
 							svars->newmaxuid[1-t] = tmsg->uid;
-						Fprintf( svars->jfp, "+ %d %d\n", srec->uid[M], srec->uid[S] );
+						jFprintf( svars, "+ %d %d\n", srec->uid[M], srec->uid[S] );
 						debug( "  -> pair(%d,%d) created\n", srec->uid[M], srec->uid[S] );
 					}
 					if (svars->maxuid[1-t] < tmsg->uid) {
@@ -1308,17 +2246,21 @@ box_loaded( int sts, void *aux )
 						 * logged before the propagation of messages with lower UIDs completes. */
 						svars->maxuid[1-t] = tmsg->uid;
 					}
-					if ((tmsg->flags & F_FLAGGED) || tmsg->size <= svars->chan->stores[t]->max_size) {
+					dummy = !(tmsg->flags & F_FLAGGED) && tmsg->size > svars->chan->stores[t]->max_size;
+					if (!dummy || (t == S && use_placeholders( svars ))) {
 						if (tmsg->flags) {
 							srec->flags = tmsg->flags;
-							Fprintf( svars->jfp, "* %d %d %u\n", srec->uid[M], srec->uid[S], srec->flags );
+							jFprintf( svars, "* %d %d %u\n", srec->uid[M], srec->uid[S], srec->flags );
 							debug( "  -> updated flags to %u\n", tmsg->flags );
 						}
-						for (t1 = 0; t1 < TUIDL; t1++) {
-							t2 = arc4_getbyte() & 0x3f;
-							srec->tuid[t1] = t2 < 26 ? t2 + 'A' : t2 < 52 ? t2 + 'a' - 26 : t2 < 62 ? t2 + '0' - 52 : t2 == 62 ? '+' : '/';
+						if (dummy != !!(srec->status & S_DUMMY)) {
+							srec->status ^= S_DUMMY;
+							jFprintf( svars, "^ %d %d %d\n", srec->uid[M], srec->uid[S], dummy );
 						}
-						Fprintf( svars->jfp, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
+						if (dummy)
+							debug( "  -> too big - %sing placeholder\n", str_hl[t] );
+						make_tuid( srec->tuid );
+						jFprintf( svars, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
 						debug( "  -> %sing message, TUID %." stringify(TUIDL) "s\n", str_hl[t], srec->tuid );
 					} else {
 						if (srec->uid[t] == -1) {
@@ -1329,6 +2271,12 @@ box_loaded( int sts, void *aux )
 						}
 					}
 				}
+			} else if (t == S && srec && (srec->status & S_DUMMY) && (svars->chan->ops[S] & OP_RENEW) &&
+			           srec->msg[S] && !(srec->msg[S]->status & M_DEAD) &&
+			           ((tmsg->flags | srec->msg[S]->flags) & (F_FLAGGED|F_DELETED)) == F_FLAGGED) {
+				debug( "flagged placeholder for message %d on %s\n", tmsg->uid, str_ms[1-t] );
+				debug( "  -> upgrading\n" );
+				srec->status |= S_UPGRADE;
 			}
 		}
 	}
@@ -1421,7 +2369,7 @@ box_loaded( int sts, void *aux )
 					/* The record needs a state change ... */
 					if (nex != ((srec->status / S_EXPIRE) & 1)) {
 						/* ... and we need to start a transaction. */
-						Fprintf( svars->jfp, "~ %d %d %d\n", srec->uid[M], srec->uid[S], nex );
+						jFprintf( svars, "~ %d %d %d\n", srec->uid[M], srec->uid[S], nex );
 						debug( "  pair(%d,%d): %d (pre)\n", srec->uid[M], srec->uid[S], nex );
 						srec->status = (srec->status & ~S_EXPIRE) | (nex * S_EXPIRE);
 					} else {
@@ -1434,7 +2382,7 @@ box_loaded( int sts, void *aux )
 				}
 			} else {
 				if (srec->status & S_NEXPIRE) {
-					Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+					jFprintf( svars, "- %d %d\n", srec->uid[M], srec->uid[S] );
 					debug( "  pair(%d,%d): 1 (abort)\n", srec->uid[M], srec->uid[S] );
 					srec->msg[M]->srec = 0;
 					srec->status = S_DEAD;
@@ -1445,7 +2393,11 @@ box_loaded( int sts, void *aux )
 
 	sync_ref( svars );
 
+	/* Expiration transactions must be logged before the flags are set. */
+	flush_journal( svars );
+
 	debug( "synchronizing flags\n" );
+	phase_begin( svars, PH_FLAGS );
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if ((srec->status & S_DEAD) || srec->uid[M] <= 0 || srec->uid[S] <= 0)
 			continue;
@@ -1504,12 +2456,22 @@ box_loaded( int sts, void *aux )
 	}
 
 	debug( "propagating new messages\n" );
+	phase_begin( svars, PH_NEW );
+	flush_journal( svars );
 	if (UseFSync)
 		fdatasync( fileno( svars->jfp ) );
 	for (t = 0; t < 2; t++) {
-		Fprintf( svars->jfp, "%c %d\n", "{}"[t], svars->ctx[t]->uidnext );
+		jFprintf( svars, "%c %d\n", "{}"[t], svars->ctx[t]->uidnext );
+		if (svars->drv[t]->reserve_uids) {
+			for (nmsgs = 0, tmsg = svars->ctx[1-t]->msgs; tmsg; tmsg = tmsg->next)
+				if ((srec = tmsg->srec) && copy_pending( srec, t ))
+					nmsgs++;
+			if (nmsgs > 1 && check_ret( svars->drv[t]->reserve_uids( svars->ctx[t], nmsgs ), AUX ))
+				goto out;
+		}
+		copies_begin( svars, t );
 		for (tmsg = svars->ctx[1-t]->msgs; tmsg; tmsg = tmsg->next) {
-			if ((srec = tmsg->srec) && srec->tuid[0]) {
+			if ((srec = tmsg->srec) && copy_pending( srec, t )) {
 				svars->new_total[t]++;
 				stats( svars );
 				cv = nfmalloc( sizeof(*cv) );
@@ -1522,6 +2484,9 @@ box_loaded( int sts, void *aux )
 					goto out;
 			}
 		}
+		copies_issued( svars, t );
+		if (check_cancel( svars ))
+			goto out;
 		svars->state[t] |= ST_SENT_NEW;
 		msgs_copied( svars, t );
 		if (check_cancel( svars ))
@@ -1538,14 +2503,27 @@ msg_copied( int sts, int uid, copy_vars_t *vars )
 	SVARS_CHECK_CANCEL_RET;
 	switch (sts) {
 	case SYNC_OK:
+		if (vars->data.replace) {
+			debug( "  -> upgraded placeholder (%d,%d)\n", vars->srec->uid[M], vars->srec->uid[S] );
+			vars->srec->status &= ~(S_DUMMY|S_UPGRADE);
+			vars->srec->tuid[0] = 0;
+			jFprintf( svars, "^ %d %d 0\n", vars->srec->uid[M], vars->srec->uid[S] );
+			break;
+		}
 		if (uid < 0)
 			svars->state[t] |= ST_FIND_NEW;
 		msg_copied_p2( svars, vars->srec, t, uid );
 		break;
 	case SYNC_NOGOOD:
+		if (vars->data.replace) {
+			/* The placeholder stays. */
+			vars->srec->status &= ~S_UPGRADE;
+			vars->srec->tuid[0] = 0;
+			break;
+		}
 		debug( "  -> killing (%d,%d)\n", vars->srec->uid[M], vars->srec->uid[S] );
 		vars->srec->status = S_DEAD;
-		Fprintf( svars->jfp, "- %d %d\n", vars->srec->uid[M], vars->srec->uid[S] );
+		jFprintf( svars, "- %d %d\n", vars->srec->uid[M], vars->srec->uid[S] );
 		break;
 	default:
 		cancel_sync( svars );
@@ -1570,7 +2548,7 @@ msg_copied_p2( sync_vars_t *svars, sync_rec_t *srec, int t, int uid )
 	 * - -1 when not actually storing a message */
 	if (srec->uid[t] != uid) {
 		debug( "  -> new UID %d on %s\n", uid, str_ms[t] );
-		Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], uid );
+		jFprintf( svars, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], uid );
 		srec->uid[t] = uid;
 		srec->tuid[0] = 0;
 	}
@@ -1581,7 +2559,7 @@ msg_copied_p2( sync_vars_t *svars, sync_rec_t *srec, int t, int uid )
 		svars->mmaxxuid = INT_MAX;
 		if (svars->smaxxuid < srec->uid[S] - 1) {
 			svars->smaxxuid = srec->uid[S] - 1;
-			Fprintf( svars->jfp, "! %d\n", svars->smaxxuid );
+			jFprintf( svars, "! %d\n", svars->smaxxuid );
 		}
 	}
 }
@@ -1598,7 +2576,7 @@ msgs_copied( sync_vars_t *svars, int t )
 
 	sync_ref( svars );
 
-	Fprintf( svars->jfp, "%c %d\n", ")("[t], svars->maxuid[1-t] );
+	jFprintf( svars, "%c %d\n", ")("[t], svars->maxuid[1-t] );
 	sync_close( svars, 1-t );
 	if (check_cancel( svars ))
 		goto out;
@@ -1634,6 +2612,8 @@ static void
 msgs_new_done( sync_vars_t *svars, int t )
 {
 	svars->state[t] |= ST_FOUND_NEW;
+	if (svars->state[1-t] & ST_FOUND_NEW)
+		phase_end( svars, PH_NEW );
 	sync_close( svars, t );
 }
 
@@ -1661,25 +2641,25 @@ flags_set_p2( sync_vars_t *svars, sync_rec_t *srec, int t )
 {
 	if (srec->status & S_DELETE) {
 		debug( "  pair(%d,%d): resetting %s UID\n", srec->uid[M], srec->uid[S], str_ms[1-t] );
-		Fprintf( svars->jfp, "%c %d %d 0\n", "><"[t], srec->uid[M], srec->uid[S] );
+		jFprintf( svars, "%c %d %d 0\n", "><"[t], srec->uid[M], srec->uid[S] );
 		srec->uid[1-t] = 0;
 	} else {
 		int nflags = (srec->flags | srec->aflags[t]) & ~srec->dflags[t];
 		if (srec->flags != nflags) {
 			debug( "  pair(%d,%d): updating flags (%u -> %u; %sed)\n", srec->uid[M], srec->uid[S], srec->flags, nflags, str_hl[t] );
 			srec->flags = nflags;
-			Fprintf( svars->jfp, "* %d %d %u\n", srec->uid[M], srec->uid[S], nflags );
+			jFprintf( svars, "* %d %d %u\n", srec->uid[M], srec->uid[S], nflags );
 		}
 		if (t == S) {
 			int nex = (srec->status / S_NEXPIRE) & 1;
 			if (nex != ((srec->status / S_EXPIRED) & 1)) {
 				if (nex && (svars->smaxxuid < srec->uid[S]))
 					svars->smaxxuid = srec->uid[S];
-				Fprintf( svars->jfp, "/ %d %d\n", srec->uid[M], srec->uid[S] );
+				jFprintf( svars, "/ %d %d\n", srec->uid[M], srec->uid[S] );
 				debug( "  pair(%d,%d): expired %d (commit)\n", srec->uid[M], srec->uid[S], nex );
 				srec->status = (srec->status & ~S_EXPIRED) | (nex * S_EXPIRED);
 			} else if (nex != ((srec->status / S_EXPIRE) & 1)) {
-				Fprintf( svars->jfp, "\\ %d %d\n", srec->uid[M], srec->uid[S] );
+				jFprintf( svars, "\\ %d %d\n", srec->uid[M], srec->uid[S] );
 				debug( "  pair(%d,%d): expire %d (cancel)\n", srec->uid[M], srec->uid[S], nex );
 				srec->status = (srec->status & ~S_EXPIRE) | (nex * S_EXPIRE);
 			}
@@ -1698,12 +2678,16 @@ msgs_flags_set( sync_vars_t *svars, int t )
 
 	if (!(svars->state[t] & ST_SENT_FLAGS) || svars->flags_done[t] < svars->flags_total[t])
 		return;
+	if ((svars->state[1-t] & ST_SENT_FLAGS) && svars->flags_done[1-t] >= svars->flags_total[1-t])
+		phase_end( svars, PH_FLAGS );
 
 	sync_ref( svars );
 
 	if ((svars->chan->ops[t] & OP_EXPUNGE) &&
 	    (svars->ctx[t]->conf->trash || (svars->ctx[1-t]->conf->trash && svars->ctx[1-t]->conf->trash_remote_new))) {
 		debug( "trashing in %s\n", str_ms[t] );
+		phase_begin( svars, PH_TRASH );
+		copies_begin( svars, 1-t );
 		for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
 			if ((tmsg->flags & F_DELETED) && (t == M || !tmsg->srec || !(tmsg->srec->status & (S_EXPIRE|S_EXPIRED)))) {
 				if (svars->ctx[t]->conf->trash) {
@@ -1736,6 +2720,9 @@ msgs_flags_set( sync_vars_t *svars, int t )
 						debug( "%s: not remote trashing message %d - not new\n", str_ms[t], tmsg->uid );
 				}
 			}
+		copies_issued( svars, 1-t );
+		if (check_cancel( svars ))
+			goto out;
 	}
 	svars->state[t] |= ST_SENT_TRASH;
 	sync_close( svars, t );
@@ -1782,9 +2769,33 @@ msg_rtrashed( int sts, int uid ATTR_UNUSED, copy_vars_t *vars )
 static void box_closed( int sts, void *aux );
 static void box_closed_p2( sync_vars_t *svars, int t );
 
+/* Determine the mod-sequence from which the next sync can proceed incrementally. */
+static uint64_t
+get_modseq( sync_vars_t *svars, int t )
+{
+	sync_rec_t *srec;
+
+	if (!svars->ctx[t]->highestmodseq)
+		return 0;
+	if (svars->chan->max_messages || (~svars->ctx[t]->opts & (OPEN_OLD|OPEN_FLAGS))) {
+		/* We did not look at everything, so nothing was consumed. */
+		return svars->modseq[t];
+	}
+	for (srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD) && srec->uid[t] > 0 && srec->uid[t] <= svars->maxkuid[t] && !srec->msg[t]) {
+			/* An incremental load would not report the message as gone again. */
+			debug( "%s: message %d is gone, but still has a sync record\n", str_ms[t], srec->uid[t] );
+			return 0;
+		}
+	return svars->ctx[t]->highestmodseq;
+}
+
 static void
 sync_close( sync_vars_t *svars, int t )
 {
+	if ((svars->state[t] & svars->state[1-t] & ST_SENT_TRASH) &&
+	    svars->trash_done[t] >= svars->trash_total[t] && svars->trash_done[1-t] >= svars->trash_total[1-t])
+		phase_end( svars, PH_TRASH );
 	if ((~svars->state[t] & (ST_FOUND_NEW|ST_SENT_TRASH)) || svars->trash_done[t] < svars->trash_total[t] ||
 	    !(svars->state[1-t] & ST_SENT_NEW) || svars->new_done[1-t] < svars->new_total[1-t])
 		return;
@@ -1792,9 +2803,11 @@ sync_close( sync_vars_t *svars, int t )
 	if (svars->state[t] & ST_CLOSING)
 		return;
 	svars->state[t] |= ST_CLOSING;
+	phase_begin( svars, PH_CLOSE );
 
 	if ((svars->chan->ops[t] & OP_EXPUNGE) /*&& !(svars->state[t] & ST_TRASH_BAD)*/) {
 		debug( "expunging %s\n", str_ms[t] );
+		flush_journal( svars );
 		svars->drv[t]->close( svars->ctx[t], box_closed, AUX );
 	} else {
 		box_closed_p2( svars, t );
@@ -1813,12 +2826,13 @@ static void
 box_closed_p2( sync_vars_t *svars, int t )
 {
 	sync_rec_t *srec;
+	uint64_t modseq[2];
 	int minwuid;
-	char fbuf[16]; /* enlarge when support for keywords is added */
 
 	svars->state[t] |= ST_CLOSED;
 	if (!(svars->state[1-t] & ST_CLOSED))
 		return;
+	phase_end( svars, PH_CLOSE );
 
 	if (((svars->state[M] | svars->state[S]) & ST_DID_EXPUNGE) || svars->chan->max_messages) {
 		debug( "purging obsolete entries\n" );
@@ -1845,33 +2859,37 @@ box_closed_p2( sync_vars_t *svars, int t )
 				    ((srec->status & S_EXPIRED) && svars->maxuid[M] >= srec->uid[M] && minwuid > srec->uid[M])) {
 					debug( "  -> killing (%d,%d)\n", srec->uid[M], srec->uid[S] );
 					srec->status = S_DEAD;
-					Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+					jFprintf( svars, "- %d %d\n", srec->uid[M], srec->uid[S] );
 				} else if (srec->uid[S] > 0) {
 					debug( "  -> orphaning (%d,[%d])\n", srec->uid[M], srec->uid[S] );
-					Fprintf( svars->jfp, "> %d %d 0\n", srec->uid[M], srec->uid[S] );
+					jFprintf( svars, "> %d %d 0\n", srec->uid[M], srec->uid[S] );
 					srec->uid[S] = 0;
 				}
 			} else if (srec->uid[M] > 0 && ((srec->status & S_DEL(M)) && (svars->state[M] & ST_DID_EXPUNGE))) {
 				debug( "  -> orphaning ([%d],%d)\n", srec->uid[M], srec->uid[S] );
-				Fprintf( svars->jfp, "< %d %d 0\n", srec->uid[M], srec->uid[S] );
+				jFprintf( svars, "< %d %d 0\n", srec->uid[M], srec->uid[S] );
 				srec->uid[M] = 0;
 			}
 		}
 	}
 
-	Fprintf( svars->nfp,
-	         "MasterUidValidity %d\nSlaveUidValidity %d\nMaxPulledUid %d\nMaxPushedUid %d\n",
-	         svars->uidval[M], svars->uidval[S], svars->maxuid[M], svars->maxuid[S] );
-	if (svars->smaxxuid)
-		Fprintf( svars->nfp, "MaxExpiredSlaveUid %d\n", svars->smaxxuid );
-	Fprintf( svars->nfp, "\n" );
-	for (srec = svars->srecs; srec; srec = srec->next) {
-		if (srec->status & S_DEAD)
-			continue;
-		make_flags( srec->flags, fbuf );
-		Fprintf( svars->nfp, "%d %d %s%s\n", srec->uid[M], srec->uid[S],
-		         srec->status & S_EXPIRED ? "X" : "", fbuf );
+	modseq[M] = get_modseq( svars, M );
+	modseq[S] = get_modseq( svars, S );
+	if (SyncStateFormat == SYNCSTATE_BINARY && !(DFlags & KEEPJOURNAL) &&
+	    !update_state( svars, modseq )) {
+		Fclose( svars->nfp, 0 );
+		Fclose( svars->jfp, 0 );
+		/* order is important! */
+		if (unlink( svars->nname ))
+			warn( "Warning: cannot commit sync state %s\n", svars->dname );
+		else if (unlink( svars->jname ))
+			warn( "Warning: cannot delete journal %s\n", svars->jname );
+		else
+			save_fingerprint( svars );
+		sync_bail( svars );
+		return;
 	}
+	write_state( svars, svars->nfp, SyncStateFormat, modseq );
 
 	Fclose( svars->nfp, 1 );
 	Fclose( svars->jfp, 0 );
@@ -1881,6 +2899,8 @@ box_closed_p2( sync_vars_t *svars, int t )
 			warn( "Warning: cannot commit sync state %s\n", svars->dname );
 		else if (unlink( svars->jname ))
 			warn( "Warning: cannot delete journal %s\n", svars->jname );
+		else
+			save_fingerprint( svars );
 	}
 
 	sync_bail( svars );
@@ -1889,12 +2909,8 @@ box_closed_p2( sync_vars_t *svars, int t )
 static void
 sync_bail( sync_vars_t *svars )
 {
-	sync_rec_t *srec, *nsrec;
-
-	for (srec = svars->srecs; srec; srec = nsrec) {
-		nsrec = srec->next;
-		free( srec );
-	}
+	pool_free( &svars->srec_pool );
+	free_binary_state( svars );
 	unlink( svars->lname );
 	sync_bail1( svars );
 }
@@ -1913,6 +2929,8 @@ sync_bail2( sync_vars_t *svars )
 	free( svars->nname );
 	free( svars->jname );
 	free( svars->dname );
+	wipe_wakeup( &svars->jtimer );
+	free( svars->jbuf );
 	flushn();
 	sync_bail3( svars );
 }
@@ -1922,9 +2940,43 @@ sync_bail3( sync_vars_t *svars )
 {
 	free( svars->box_name[M] );
 	free( svars->box_name[S] );
+	free( svars->fp[M] );
+	free( svars->fp[S] );
 	sync_deref( svars );
 }
 
+static void
+report_box( sync_vars_t *svars )
+{
+	int t, ph;
+
+	stats_open_rec( "box" );
+	stats_str( "channel", svars->chan->name );
+	stats_str( "status", svars->ret ? "failed" : svars->unchanged ? "unchanged" : "ok" );
+	stats_usecs( "time", get_usecs() - svars->start_us );
+	stats_open_obj( "phases" );
+	for (ph = 0; ph < PH_MAX; ph++)
+		if (svars->phase_end[ph])
+			stats_usecs( phase_names[ph], svars->phase_end[ph] - svars->phase_start[ph] );
+	stats_close_obj();
+	for (t = 0; t < 2; t++) {
+		stats_open_obj( str_ms[t] );
+		stats_str( "box", svars->orig_name[t] );
+		if (!(svars->ret & SYNC_BAD(t))) {
+			if (svars->state[t] & ST_LOADED)
+				stats_int( "messages", svars->ctx[t]->count );
+			io_stats_diff( &svars->io[t], &svars->ctx[t]->stats, &svars->io[t] );
+		}
+		stats_int( "new", svars->new_done[t] );
+		stats_int( "moved", svars->moved[t] );
+		stats_int( "flags", svars->flags_done[t] );
+		stats_int( "trash", svars->trash_done[t] );
+		stats_io( "io", &svars->io[t] );
+		stats_close_obj();
+	}
+	stats_close_rec();
+}
+
 static void
 sync_deref( sync_vars_t *svars )
 {
@@ -1932,6 +2984,8 @@ sync_deref( sync_vars_t *svars )
 		void (*cb)( int sts, void *aux ) = svars->cb;
 		void *aux = svars->aux;
 		int ret = svars->ret;
+		if (StatsFile)
+			report_box( svars );
 		free( svars );
 		cb( ret, aux );
 	}
@@ -51,8 +51,11 @@ typedef struct channel_conf {
 	string_list_t *patterns;
 	int ops[2];
 	unsigned max_messages; /* for slave only */
+	unsigned max_age; /* in days; for master only */
 	signed char expire_unread;
 	char use_internal_date;
+	char placeholders;
+	char prune_aged;
 } channel_conf_t;
 
 typedef struct group_conf {
@@ -74,6 +77,15 @@ extern const char *str_ms[2], *str_hl[2];
 #define SYNC_NOGOOD   16 /* internal */
 #define SYNC_CANCELED 32 /* internal */
 
+#define SYNCSTATE_TEXT    0
+#define SYNCSTATE_BINARY  1
+
+extern int SyncStateFormat;
+extern int JournalFlush; /* milliseconds */
+
+/* Rewrite a sync state file in the given format. */
+int convert_sync_state( const char *path, int format );
+
 /* All passed pointers must stay alive until cb is called. */
 void sync_boxes( store_t *ctx[], const char *names[], channel_conf_t *chan,
                  void (*cb)( int sts, void *aux ), void *aux );
@@ -23,11 +23,14 @@
 #include "common.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <pwd.h>
+#include <ctype.h>
 
 static int need_nl;
 
@@ -232,6 +235,34 @@ equals( const char *str, int strl, const char *cmp, int cmpl )
 	return (strl == cmpl) && !memcmp( str, cmp, cmpl );
 }
 
+/* Find the Message-ID in a message header with LF or CRLF line endings, which
+ * may be followed by the body. It is stored in buf, which holds MSGIDL chars.
+ * Returns whether a usable one was found. */
+int
+find_msgid( const char *hdr, int len, char *buf )
+{
+	const char *s = hdr, *e = hdr + len, *p;
+
+	while (s < e && *s != '\n' && (*s != '\r' || s + 1 >= e || s[1] != '\n')) {
+		if (e - s > 11 && !strncasecmp( s, "Message-ID:", 11 )) {
+			/* The field body may be folded. */
+			for (s += 11; s < e && isspace( (unsigned char)*s ); s++) {}
+			if (s == e || *s != '<')
+				return 0;
+			for (p = s + 1; p < e && *p != '>' && !isspace( (unsigned char)*p ); p++) {}
+			if (p == e || *p != '>' || p + 1 - s >= MSGIDL)
+				return 0;
+			memcpy( buf, s, p + 1 - s );
+			buf[p + 1 - s] = 0;
+			return 1;
+		}
+		if (!(p = memchr( s, '\n', e - s )))
+			break;
+		s = p + 1;
+	}
+	return 0;
+}
+
 #ifndef HAVE_TIMEGM
 /*
    Converts struct tm to time_t, assuming the data in tm is UTC rather
@@ -354,6 +385,60 @@ nfrealloc( void *mem, size_t sz )
 	return ret;
 }
 
+/* Chunks grow geometrically, so a big mailbox needs only a few of them. */
+#define POOL_MIN_CHUNK 4096
+#define POOL_MAX_CHUNK (1024 * 1024)
+
+typedef union {
+	void *p;
+	double d;
+	uint64_t u;
+} pool_align_t;
+
+struct pool_chunk {
+	pool_chunk_t *next;
+	pool_align_t data[1];
+};
+
+void *
+pool_alloc( pool_t *pool, size_t sz )
+{
+	pool_chunk_t *chunk;
+	char *ret;
+	size_t csz;
+
+	sz = (sz + sizeof(pool_align_t) - 1) / sizeof(pool_align_t) * sizeof(pool_align_t);
+	if (sz > pool->left) {
+		csz = pool->size ? pool->size * 2 : POOL_MIN_CHUNK;
+		if (csz > POOL_MAX_CHUNK)
+			csz = POOL_MAX_CHUNK;
+		pool->size = csz;
+		if (csz < sz)
+			csz = sz;
+		chunk = nfmalloc( offsetof(pool_chunk_t, data) + csz );
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		pool->ptr = (char *)chunk->data;
+		pool->left = csz;
+	}
+	ret = pool->ptr;
+	pool->ptr += sz;
+	pool->left -= sz;
+	return ret;
+}
+
+void
+pool_free( pool_t *pool )
+{
+	pool_chunk_t *chunk, *nchunk;
+
+	for (chunk = pool->chunks; chunk; chunk = nchunk) {
+		nchunk = chunk->next;
+		free( chunk );
+	}
+	memset( pool, 0, sizeof(*pool) );
+}
+
 char *
 nfstrdup( const char *str )
 {
@@ -584,84 +669,311 @@ bucketsForSize( int size )
 	}
 }
 
-#ifdef HAVE_SYS_POLL_H
-static struct pollfd *pollfds;
-#else
+/* The event loop. Registered fds are kept in a table indexed by the fd
+ * itself, so (re-)configuring them is O(1). The actual waiting is done by
+ * epoll() if available, and by poll() or select() otherwise. Events are
+ * collected before any callback is invoked, so callbacks may freely add and
+ * remove fds - a removed fd just doesn't see its pending events. */
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#elif !defined(HAVE_SYS_POLL_H)
 # ifdef HAVE_SYS_SELECT_H
 #  include <sys/select.h>
 # endif
-# define pollfds fdparms
+struct pollfd {
+	int fd;
+	short events, revents;
+};
 #endif
-static struct {
+#ifdef HAVE_CLOCK_GETTIME
+# include <time.h>
+#else
+# include <sys/time.h>
+#endif
+
+typedef struct {
 	void (*cb)( int what, void *aux );
 	void *aux;
-#ifndef HAVE_SYS_POLL_H
-	int fd, events;
+	int slot; /* index into pollfds (0 with epoll), or -1 if not registered */
+	int events, faked, revents;
+	int queued; /* listed in readyfds */
+} fd_ent_t;
+
+static fd_ent_t *fdents;
+static int nfdents, nfds;
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+static struct epoll_event *epevs;
+static int repevs;
+#else
+static struct pollfd *pollfds;
+static int rpollfds;
 #endif
-	int faked;
-} *fdparms;
-static int npolls, rpolls, changed;
+static int *readyfds, nreadyfds, rreadyfds;
+static int *fakedfds, nfakedfds, rfakedfds;
 
-static int
-find_fd( int fd )
+static fd_ent_t *
+get_fd_ent( int fd )
 {
-	int n;
+	assert( fd >= 0 && fd < nfdents && fdents[fd].slot >= 0 );
+	return &fdents[fd];
+}
+
+static void
+push_fd( int **arr, int *num, int *rnum, int fd )
+{
+	if (*num == *rnum) {
+		*rnum = *rnum * 2 + 16;
+		*arr = nfrealloc( *arr, *rnum * sizeof(int) );
+	}
+	(*arr)[(*num)++] = fd;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void
+epoll_init( void )
+{
+	if (epfd >= 0)
+		return;
+	if ((epfd = epoll_create( 16 )) < 0) {
+		perror( "epoll_create() failed" );
+		abort();
+	}
+	fcntl( epfd, F_SETFD, FD_CLOEXEC );
+}
 
-	for (n = 0; n < npolls; n++)
-		if (pollfds[n].fd == fd)
-			return n;
-	return -1;
+static void
+epoll_update( int op, int fd, int events )
+{
+	struct epoll_event ev;
+
+	memset( &ev, 0, sizeof(ev) );
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl( epfd, op, fd, &ev )) {
+		perror( "epoll_ctl() failed in event loop" );
+		abort();
+	}
 }
+#endif
 
 void
 add_fd( int fd, void (*cb)( int events, void *aux ), void *aux )
 {
+	fd_ent_t *ent;
 	int n;
 
-	assert( find_fd( fd ) < 0 );
-	n = npolls++;
-	if (rpolls < npolls) {
-		rpolls = npolls;
-#ifdef HAVE_SYS_POLL_H
-		pollfds = nfrealloc(pollfds, npolls * sizeof(*pollfds));
-#endif
-		fdparms = nfrealloc(fdparms, npolls * sizeof(*fdparms));
+	assert( fd >= 0 );
+	if (fd >= nfdents) {
+		n = nfdents;
+		nfdents = fd * 2 + 16;
+		fdents = nfrealloc( fdents, nfdents * sizeof(*fdents) );
+		for (; n < nfdents; n++) {
+			fdents[n].slot = -1;
+			fdents[n].queued = 0;
+		}
 	}
-	pollfds[n].fd = fd;
-	pollfds[n].events = 0; /* POLLERR & POLLHUP implicit */
-	fdparms[n].faked = 0;
-	fdparms[n].cb = cb;
-	fdparms[n].aux = aux;
-	changed = 1;
+	ent = &fdents[fd];
+	assert( ent->slot < 0 );
+	ent->cb = cb;
+	ent->aux = aux;
+	ent->events = 0; /* POLLERR & POLLHUP implicit */
+	ent->faked = 0;
+	ent->revents = 0;
+	ent->queued = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_init();
+	epoll_update( EPOLL_CTL_ADD, fd, 0 );
+	ent->slot = 0;
+	nfds++;
+#else
+	if (nfds == rpollfds) {
+		rpollfds = rpollfds * 2 + 16;
+		pollfds = nfrealloc( pollfds, rpollfds * sizeof(*pollfds) );
+	}
+	ent->slot = nfds++;
+	pollfds[ent->slot].fd = fd;
+	pollfds[ent->slot].events = 0;
+#endif
 }
 
 void
 conf_fd( int fd, int and_events, int or_events )
 {
-	int n = find_fd( fd );
-	assert( n >= 0 );
-	pollfds[n].events = (pollfds[n].events & and_events) | or_events;
+	fd_ent_t *ent = get_fd_ent( fd );
+	int events = (ent->events & and_events) | or_events;
+
+	if (events == ent->events)
+		return;
+	ent->events = events;
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_update( EPOLL_CTL_MOD, fd, events );
+#else
+	pollfds[ent->slot].events = events;
+#endif
 }
 
 void
 fake_fd( int fd, int events )
 {
-	int n = find_fd( fd );
-	assert( n >= 0 );
-	fdparms[n].faked |= events;
+	fd_ent_t *ent = get_fd_ent( fd );
+
+	if (!ent->faked)
+		push_fd( &fakedfds, &nfakedfds, &rfakedfds, fd );
+	ent->faked |= events;
 }
 
 void
 del_fd( int fd )
 {
-	int n = find_fd( fd );
-	assert( n >= 0 );
-	npolls--;
-#ifdef HAVE_SYS_POLL_H
-	memmove(pollfds + n, pollfds + n + 1, (npolls - n) * sizeof(*pollfds));
+	fd_ent_t *ent = get_fd_ent( fd );
+
+#ifdef HAVE_SYS_EPOLL_H
+	/* The fd may be closed already, in which case it is gone anyway. */
+	epoll_ctl( epfd, EPOLL_CTL_DEL, fd, 0 );
+#else
+	/* Fill the gap with the last entry. */
+	if (ent->slot != --nfds) {
+		pollfds[ent->slot] = pollfds[nfds];
+		fdents[pollfds[ent->slot].fd].slot = ent->slot;
+	}
+#endif
+	ent->slot = -1;
+	ent->queued = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	nfds--;
+#endif
+}
+
+/* Timers are kept in a hashed wheel: each timer hangs off the slot its
+ * expiry tick falls into, so arming and disarming them is O(1). Timers
+ * which are due only in a later revolution stay in the slot until then. */
+
+#define WHEEL_TICK 10 /* milliseconds */
+#define WHEEL_SLOTS 256
+
+static list_head_t wheel[WHEEL_SLOTS];
+static uint64_t wheel_tick; /* the first tick which may hold due timers */
+static int nwakeups;
+
+uint64_t
+get_usecs( void )
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 #endif
-	memmove(fdparms + n, fdparms + n + 1, (npolls - n) * sizeof(*fdparms));
-	changed = 1;
+}
+
+static uint64_t
+get_now( void )
+{
+	return get_usecs() / 1000;
+}
+
+void
+init_wakeup( wakeup_t *tmr, void (*cb)( void * ), void *aux )
+{
+	tmr->cb = cb;
+	tmr->aux = aux;
+	tmr->links.next = tmr->links.prev = 0;
+}
+
+void
+wipe_wakeup( wakeup_t *tmr )
+{
+	if (tmr->links.next) {
+		tmr->links.prev->next = tmr->links.next;
+		tmr->links.next->prev = tmr->links.prev;
+		tmr->links.next = tmr->links.prev = 0;
+		nwakeups--;
+	}
+}
+
+void
+conf_wakeup( wakeup_t *tmr, int timeout )
+{
+	list_head_t *head;
+
+	wipe_wakeup( tmr );
+	if (timeout < 0)
+		return;
+	if (!nwakeups)
+		wheel_tick = get_now() / WHEEL_TICK;
+	tmr->expiry = get_now() + timeout;
+	/* Never file a timer into a tick which was processed already. */
+	head = &wheel[(tmr->expiry / WHEEL_TICK < wheel_tick ? wheel_tick : tmr->expiry / WHEEL_TICK) % WHEEL_SLOTS];
+	if (!head->next)
+		head->next = head->prev = head;
+	tmr->links.next = head;
+	tmr->links.prev = head->prev;
+	head->prev->next = &tmr->links;
+	head->prev = &tmr->links;
+	nwakeups++;
+}
+
+/* Return the number of milliseconds until the next timer is due, or -1. */
+static int
+next_wakeup( void )
+{
+	list_head_t *head, *lnk;
+	uint64_t now, tick, end, min;
+	int i;
+
+	if (!nwakeups)
+		return -1;
+	now = get_now();
+	end = (wheel_tick + WHEEL_SLOTS) * WHEEL_TICK;
+	min = end;
+	for (i = 0, tick = wheel_tick; i < WHEEL_SLOTS; i++, tick++) {
+		head = &wheel[tick % WHEEL_SLOTS];
+		if (head->next)
+			for (lnk = head->next; lnk != head; lnk = lnk->next)
+				if (((wakeup_t *)lnk)->expiry < min)
+					min = ((wakeup_t *)lnk)->expiry;
+		if (min < end)
+			break;
+	}
+	/* If nothing is due within a full revolution, just wake up after it. */
+	return min <= now ? 0 : (int)(min - now);
+}
+
+static void
+run_wakeups( void )
+{
+	list_head_t *head, *lnk;
+	wakeup_t *tmr;
+	uint64_t now, tick;
+	int i;
+
+	if (!nwakeups)
+		return;
+	now = get_now();
+	for (i = 0, tick = wheel_tick; tick <= now / WHEEL_TICK && i < WHEEL_SLOTS; i++, tick++) {
+		head = &wheel[tick % WHEEL_SLOTS];
+		if (!head->next)
+			continue;
+	  again:
+		for (lnk = head->next; lnk != head; lnk = lnk->next) {
+			tmr = (wakeup_t *)lnk;
+			if (tmr->expiry <= now) {
+				wipe_wakeup( tmr );
+				tmr->cb( tmr->aux );
+				/* The callback may have touched arbitrary timers. */
+				goto again;
+			}
+		}
+	}
+	/* The current tick may still hold timers which are due later. */
+	wheel_tick = now / WHEEL_TICK;
 }
 
 #define shifted_bit(in, from, to) \
@@ -669,82 +981,129 @@ del_fd( int fd )
 		/ (from > to ? from / to : 1) \
 		* (to > from ? to / from : 1))
 
+static void
+mark_ready( int fd, int events )
+{
+	fd_ent_t *ent = &fdents[fd];
+
+	ent->revents |= events;
+	if (!ent->queued) {
+		ent->queued = 1;
+		push_fd( &readyfds, &nreadyfds, &rreadyfds, fd );
+	}
+}
+
 static void
 event_wait( void )
 {
-	int m, n;
+	fd_ent_t *ent;
+	int m, n, timeout;
+#ifdef HAVE_SYS_EPOLL_H
+	int nev;
+#elif !defined(HAVE_SYS_POLL_H)
+	struct timeval tv;
+	fd_set rfds, wfds, efds;
+	int fd;
+#endif
 
-#ifdef HAVE_SYS_POLL_H
-	int timeout = -1;
-	for (n = 0; n < npolls; n++)
-		if (fdparms[n].faked) {
-			timeout = 0;
-			break;
+	timeout = nfakedfds ? 0 : next_wakeup();
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_init();
+	if (repevs <= nfds) {
+		repevs = nfds * 2 + 1;
+		epevs = nfrealloc( epevs, repevs * sizeof(*epevs) );
+	}
+	if ((nev = epoll_wait( epfd, epevs, repevs, timeout )) < 0) {
+		if (errno != EINTR) {
+			perror( "epoll_wait() failed in event loop" );
+			abort();
 		}
-	if (poll( pollfds, npolls, timeout ) < 0) {
-		perror( "poll() failed in event loop" );
-		abort();
+		nev = 0;
 	}
-	for (n = 0; n < npolls; n++)
-		if ((m = pollfds[n].revents | fdparms[n].faked)) {
-			assert( !(m & POLLNVAL) );
-			fdparms[n].faked = 0;
-			fdparms[n].cb( m | shifted_bit( m, POLLHUP, POLLIN ), fdparms[n].aux );
-			if (changed) {
-				changed = 0;
-				break;
-			}
+	for (n = 0; n < nev; n++) {
+		m = epevs[n].events;
+		mark_ready( epevs[n].data.fd,
+		            ((m & EPOLLIN) ? POLLIN : 0) | ((m & EPOLLOUT) ? POLLOUT : 0) |
+		            ((m & EPOLLERR) ? POLLERR : 0) | ((m & EPOLLHUP) ? POLLIN : 0) );
+	}
+#elif defined(HAVE_SYS_POLL_H)
+	if (poll( pollfds, nfds, timeout ) < 0) {
+		if (errno != EINTR) {
+			perror( "poll() failed in event loop" );
+			abort();
 		}
+	} else {
+		for (n = 0; n < nfds; n++)
+			if ((m = pollfds[n].revents)) {
+				assert( !(m & POLLNVAL) );
+				mark_ready( pollfds[n].fd, m | shifted_bit( m, POLLHUP, POLLIN ) );
+			}
+	}
 #else
-	struct timeval *timeout = 0;
-	static struct timeval null_tv;
-	fd_set rfds, wfds, efds;
-	int fd;
-
 	FD_ZERO( &rfds );
 	FD_ZERO( &wfds );
 	FD_ZERO( &efds );
 	m = -1;
-	for (n = 0; n < npolls; n++) {
-		if (fdparms[n].faked)
-			timeout = &null_tv;
-		fd = fdparms[n].fd;
-		if (fdparms[n].events & POLLIN)
+	for (n = 0; n < nfds; n++) {
+		fd = pollfds[n].fd;
+		if (pollfds[n].events & POLLIN)
 			FD_SET( fd, &rfds );
-		if (fdparms[n].events & POLLOUT)
+		if (pollfds[n].events & POLLOUT)
 			FD_SET( fd, &wfds );
 		FD_SET( fd, &efds );
 		if (fd > m)
 			m = fd;
 	}
-	if (select( m + 1, &rfds, &wfds, &efds, timeout ) < 0) {
-		perror( "select() failed in event loop" );
-		abort();
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = timeout % 1000 * 1000;
 	}
-	for (n = 0; n < npolls; n++) {
-		fd = fdparms[n].fd;
-		m = fdparms[n].faked;
-		if (FD_ISSET( fd, &rfds ))
-			m |= POLLIN;
-		if (FD_ISSET( fd, &wfds ))
-			m |= POLLOUT;
-		if (FD_ISSET( fd, &efds ))
-			m |= POLLERR;
-		if (m) {
-			fdparms[n].faked = 0;
-			fdparms[n].cb( m, fdparms[n].aux );
-			if (changed) {
-				changed = 0;
-				break;
-			}
+	if (select( m + 1, &rfds, &wfds, &efds, timeout >= 0 ? &tv : 0 ) < 0) {
+		if (errno != EINTR) {
+			perror( "select() failed in event loop" );
+			abort();
+		}
+	} else {
+		for (n = 0; n < nfds; n++) {
+			fd = pollfds[n].fd;
+			m = 0;
+			if (FD_ISSET( fd, &rfds ))
+				m |= POLLIN;
+			if (FD_ISSET( fd, &wfds ))
+				m |= POLLOUT;
+			if (FD_ISSET( fd, &efds ))
+				m |= POLLERR;
+			if (m)
+				mark_ready( fd, m );
 		}
 	}
 #endif
+	for (n = 0; n < nfakedfds; n++) {
+		ent = &fdents[fakedfds[n]];
+		if (ent->slot >= 0 && ent->faked) {
+			mark_ready( fakedfds[n], ent->faked );
+			ent->faked = 0;
+		}
+	}
+	nfakedfds = 0;
+
+	for (n = 0; n < nreadyfds; n++) {
+		ent = &fdents[readyfds[n]];
+		if (!ent->queued)
+			continue; /* removed in the meantime */
+		ent->queued = 0;
+		m = ent->revents;
+		ent->revents = 0;
+		ent->cb( m, ent->aux );
+	}
+	nreadyfds = 0;
+
+	run_wakeups();
 }
 
 void
 main_loop( void )
 {
-	while (npolls)
+	while (nfds || nwakeups)
 		event_wait();
 }